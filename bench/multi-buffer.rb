@@ -0,0 +1,41 @@
+# Compares idigest_many of XXH32 and XXH64 at each SIMD level against a native
+# loop hashing one message at a time (idigest_seeds_many with a single seed).
+#
+# Usage: ruby bench/multi-buffer.rb [message_count] [rounds]
+
+require 'benchmark'
+$LOAD_PATH.unshift(File.join(__dir__, '..', 'lib'))
+require 'digest/xxhash'
+
+MESSAGE_COUNT = (ARGV[0] || 2_000).to_i
+ROUNDS = (ARGV[1] || 20).to_i
+LEVELS = [:scalar, :avx2, :avx512]
+SUPPORTED_LEVELS = LEVELS.first(LEVELS.index(Digest::XXHash.simd_level) + 1)
+
+[Digest::XXH32, Digest::XXH64].each do |klass|
+  [[64, 256], [256, 1024], [1024, 4096], [4096, 16384]].each do |min, max|
+    random = Random.new(0)
+    messages = Array.new(MESSAGE_COUNT) { random.bytes(random.rand(min..max)) }
+    bytes = messages.inject(0) { |sum, message| sum + message.bytesize } * ROUNDS
+
+    cases = { "per-message native loop" => [:scalar, proc{ klass.idigest_seeds_many(messages, [0], packed: true) }] }
+
+    SUPPORTED_LEVELS.each do |level|
+      cases["idigest_many (#{level})"] = [level, proc{ klass.idigest_many(messages, packed: true) }]
+    end
+
+    results = cases.map do |name, (level, block)|
+      Digest::XXHash.simd_level = level
+      block.call
+      [name, Benchmark.realtime { ROUNDS.times(&block) }]
+    end
+
+    Digest::XXHash.simd_level = :avx512
+    base = results.first[1]
+    puts "#{klass}, #{min}-#{max} byte messages:"
+
+    results.each do |name, elapsed|
+      printf("  %-26s %8.2f GB/s  (%.2fx)\n", name, bytes / elapsed / 1e9, base / elapsed)
+    end
+  end
+end
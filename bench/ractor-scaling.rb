@@ -0,0 +1,42 @@
+# Measures how hashing throughput scales when the work is spread across
+# Ractors.  Each Ractor hashes the same number of bytes, so on a machine with
+# enough cores, the total throughput should grow close to linearly with the
+# number of Ractors.
+#
+# Usage: ruby bench/ractor-scaling.rb [max_ractors] [mib_per_ractor]
+
+require 'etc'
+$LOAD_PATH.unshift(File.join(__dir__, '..', 'lib'))
+require 'digest/xxhash'
+
+Warning[:experimental] = false if Warning.respond_to?(:[]=)
+
+MAX_RACTORS = (ARGV[0] || Etc.nprocessors).to_i
+MIB_PER_RACTOR = (ARGV[1] || 256).to_i
+CHUNK = Ractor.make_shareable(("\x00".."\xff").to_a.join * 4096)
+SECRET = Digest::XXH3_64bits.generate_secret("ractor-scaling")
+
+def run(count)
+  started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+  ractors = count.times.map do |i|
+    Ractor.new(i, MIB_PER_RACTOR * 1024 * 1024 / CHUNK.bytesize) do |seed, rounds|
+      hashers = [Digest::XXH64.new(seed), Digest::XXH3_64bits.new.reset_with_secret(SECRET)]
+      rounds.times { hashers.each { |h| h.update(CHUNK) } }
+      hashers.map(&:hexdigest)
+    end
+  end
+
+  ractors.each(&:take)
+  Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+end
+
+run(1)
+base = nil
+
+1.upto(MAX_RACTORS) do |count|
+  elapsed = run(count)
+  throughput = count * MIB_PER_RACTOR * 2 / elapsed
+  base ||= throughput
+  printf("%2d ractor(s): %8.1f MiB/s  (%.2fx)\n", count, throughput, throughput / base)
+end
@@ -0,0 +1,32 @@
+# Compares ways of hashing many short keys with XXH3_64bits: one Ruby call per
+# key, a native loop hashing one key at a time (idigest_seeds_many with a
+# single seed), and idigest_many, which interleaves groups of keys.
+#
+# Usage: ruby bench/short-keys.rb [key_count] [rounds]
+
+require 'benchmark'
+$LOAD_PATH.unshift(File.join(__dir__, '..', 'lib'))
+require 'digest/xxhash'
+
+KEY_COUNT = (ARGV[0] || 100_000).to_i
+ROUNDS = (ARGV[1] || 20).to_i
+
+[[8, 16], [17, 32], [33, 64]].each do |min, max|
+  keys = Array.new(KEY_COUNT) { |i| ("key:%d:" % i).ljust(min + i % (max - min + 1), "x") }
+
+  results = {
+    "idigest per key" => proc{ keys.each { |key| Digest::XXH3_64bits.idigest(key) } },
+    "per-key native loop" => proc{ Digest::XXH3_64bits.idigest_seeds_many(keys, [0], packed: true) },
+    "idigest_many" => proc{ Digest::XXH3_64bits.idigest_many(keys, packed: true) }
+  }.map do |name, block|
+    block.call
+    [name, Benchmark.realtime { ROUNDS.times(&block) }]
+  end
+
+  base = results.first[1]
+  puts "#{min}-#{max} byte keys:"
+
+  results.each do |name, elapsed|
+    printf("  %-20s %8.1f Mkeys/s  (%.2fx)\n", name, KEY_COUNT * ROUNDS / elapsed / 1e6, base / elapsed)
+  end
+end
@@ -26,8 +26,49 @@
 #include <ruby.h>
 #include <ruby/digest.h>
 
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#	include <ruby/thread.h>
+#endif
+
+#ifdef HAVE_RUBY_IO_BUFFER_H
+#	include <ruby/io/buffer.h>
+#endif
+
+#ifdef HAVE_RB_MEMORY_VIEW_GET
+#	include <ruby/memory_view.h>
+#endif
+
+#ifdef HAVE_PTHREAD_CREATE
+#	include <pthread.h>
+#	include <unistd.h>
+#endif
+
+#if defined(HAVE_MMAP) || defined(HAVE_PREAD) || defined(HAVE_FDOPENDIR)
+#	include <ruby/io.h>
+#	include <fcntl.h>
+#	include <sys/stat.h>
+#	include <unistd.h>
+#endif
+
+#if defined(HAVE_MMAP) || defined(HAVE_IO_URING)
+#	include <sys/mman.h>
+#endif
+
+#if defined(HAVE_FDOPENDIR) && defined(HAVE_FNMATCH)
+#	include <dirent.h>
+#	include <fnmatch.h>
+#endif
+
+#ifdef HAVE_IO_URING
+#	include <linux/io_uring.h>
+#	include <poll.h>
+#	include <sys/eventfd.h>
+#	include <sys/syscall.h>
+#endif
+
 #define XXH_INLINE_ALL
 #include "xxhash.h"
+#include "multibuf.h"
 #include "utils.h"
 
 #define _DIGEST_API_VERSION_IS_SUPPORTED(version) (version == 3)
@@ -52,20 +93,160 @@
 #define _XXH3_128BITS_BLOCK_SIZE 16
 #define _XXH3_128BITS_DEFAULT_SEED 0
 
+/*
+ * Inputs at least this long are hashed with the GVL released.
+ */
+#define _NOGVL_MIN_LENGTH (1024 * 1024)
+
+/*
+ * Interrupts are checked every time this much data is hashed with the GVL
+ * released.
+ */
+#define _NOGVL_CHUNK_SIZE (1024 * 1024)
+
+/*
+ * Default number of bytes processed between calls to a progress callback.
+ */
+#define _PROGRESS_INTERVAL (64 * 1024 * 1024)
+
+/*
+ * Digest::XXHash::Multi feeds data to each state this many bytes at a time,
+ * so the data is still in the cache when the next state reads it.
+ */
+#define _MULTI_SLICE_SIZE (32 * 1024)
+
+/*
+ * Size of reads done by Digest::XXHash::Multi#update_io.
+ */
+#define _READ_CHUNK_SIZE (1024 * 1024)
+
+/*
+ * Size and alignment of the buffers read ahead by #file, and their default
+ * number
+ */
+#define _PIPELINE_BUFFER_SIZE (1024 * 1024)
+#define _PIPELINE_ALIGNMENT 4096
+#define _PIPELINE_DEFAULT_DEPTH 4
+
+/*
+ * Number of buffers whose cached pages are looked up ahead of the reads when
+ * the page cache is bypassed without O_DIRECT
+ */
+#define _PIPELINE_CHECK_AHEAD 16
+
+/*
+ * Size of the stack buffer where data is lowercased when hashing with
+ * 'casefold' enabled.
+ */
+#define _CASEFOLD_BUFFER_SIZE 4096
+
+/*
+ * Default chunk size and version of the tree mode of XXH3_128bits.tree_digest
+ */
+#define _TREE_DEFAULT_CHUNK_SIZE (1024 * 1024)
+#define _TREE_VERSION 1
+
+/*
+ * Maximum number of threads used by the tree-hashing methods
+ */
+#define _TREE_MAX_THREADS 64
+
+/*
+ * Default chunk size, version and header size of Merkle manifests
+ */
+#define _MERKLE_DEFAULT_CHUNK_SIZE (1024 * 1024)
+#define _MERKLE_VERSION 1
+#define _MERKLE_HEADER_SIZE 32
+
+/*
+ * Default chunk size of XXH3_64bits.chunk_digests, and version and header
+ * size of its manifests
+ */
+#define _CHUNK_DIGESTS_DEFAULT_CHUNK_SIZE (1024 * 1024)
+#define _CHUNK_MANIFEST_VERSION 1
+#define _CHUNK_MANIFEST_HEADER_SIZE 32
+
+/*
+ * Default concurrency, read size and engines of XXH3_128bits.files
+ */
+#define _FILES_DEFAULT_CONCURRENCY 64
+#define _FILES_BUFFER_SIZE (64 * 1024)
+#define _FILES_ENGINE_AUTO 0
+#define _FILES_ENGINE_IO_URING 1
+#define _FILES_ENGINE_THREADS 2
+
+/*
+ * Default chunk sizes of Digest::XXHash::Chunker
+ */
+#define _CHUNKER_DEFAULT_MIN (2 * 1024)
+#define _CHUNKER_DEFAULT_AVG (8 * 1024)
+#define _CHUNKER_DEFAULT_MAX (64 * 1024)
+
+/*
+ * Default block size, version, header size and entry size of rsync
+ * signatures
+ */
+#define _RSYNC_DEFAULT_BLOCK_SIZE 2048
+#define _RSYNC_VERSION 1
+#define _RSYNC_HEADER_SIZE 32
+#define _RSYNC_ENTRY_SIZE 12
+
 #if 0
 #	define _DEBUG(...) fprintf(stderr, __VA_ARGS__)
 #else
 #	define _DEBUG(...) (void)0;
 #endif
 
+static ID _id_Ractor;
+static ID _id_aggregate;
+static ID _id_avg;
+static ID _id_avx2;
+static ID _id_avx512;
+static ID _id_binread;
+static ID _id_block;
+static ID _id_bypass;
+static ID _id_cache;
+static ID _id_call;
+static ID _id_casefold;
+static ID _id_chomp;
+static ID _id_chunk;
+static ID _id_chunk_size;
+static ID _id_close;
+static ID _id_concurrency;
+static ID _id_current;
 static ID _id_digest;
+static ID _id_embed;
+static ID _id_engine;
+static ID _id_exclude;
 static ID _id_finish;
+static ID _id_follow_symlinks;
 static ID _id_hexdigest;
 static ID _id_idigest;
 static ID _id_ifinish;
+static ID _id_io_uring;
+static ID _id_length;
+static ID _id_main;
+static ID _id_max;
+static ID _id_min;
 static ID _id_new;
+static ID _id_offset;
+static ID _id_offsets;
+static ID _id_packed;
+static ID _id_progress;
+static ID _id_progress_interval;
+static ID _id_read;
+static ID _id_read_ahead;
+static ID _id_reference;
 static ID _id_reset;
+static ID _id_root;
+static ID _id_scalar;
+static ID _id_secret;
+static ID _id_seed;
+static ID _id_separator;
+static ID _id_stride;
+static ID _id_threads;
 static ID _id_update;
+static ID _id_width;
 
 static VALUE _Digest;
 static VALUE _Digest_Class;
@@ -74,6 +255,16 @@ static VALUE _Digest_XXH32;
 static VALUE _Digest_XXH64;
 static VALUE _Digest_XXH3_64bits;
 static VALUE _Digest_XXH3_128bits;
+static VALUE _Digest_XXHash_Prefix;
+static VALUE _Digest_XXHash_Streams;
+static VALUE _Digest_XXHash_Multi;
+static VALUE _Digest_XXHash_Merkle;
+static VALUE _Digest_XXHash_Chunker;
+static VALUE _Digest_XXHash_Rsync;
+static VALUE _Digest_XXH32_Streams;
+static VALUE _Digest_XXH64_Streams;
+static VALUE _Digest_XXH3_64bits_Streams;
+static VALUE _Digest_XXH3_128bits_Streams;
 
 #define _RSTRING_PTR_U(x) ((unsigned char *)RSTRING_PTR(x))
 #define _TWICE(x) (x * 2)
@@ -81,11 +272,46 @@ static VALUE _Digest_XXH3_128bits;
 static void _xxh32_free_state(void *);
 static void _xxh64_free_state(void *);
 static void _xxh3_free_state(void *);
+static size_t _xxh3_memsize(const void *);
+static struct _xxh3_data *_xxh3_wake(struct _xxh3_data *);
+static void _prefix_free(void *);
+static void _streams_free(void *);
+static size_t _streams_memsize(const void *);
+static void _multi_free(void *);
+static size_t _multi_memsize(const void *);
 
 /*
  * Data types
  */
 
+/*
+ * +busy+ is set while an update is using the state with the GVL released.
+ */
+struct _xxh32_data {
+	XXH32_state_t *state_p;
+	int busy;
+};
+
+struct _xxh64_data {
+	XXH64_state_t *state_p;
+	int busy;
+};
+
+/*
+ * XXH3 states only keep a reference to a custom secret, so a private copy of
+ * it is kept along with the state.  This way the secret string can be
+ * modified, garbage-collected, or shared between Ractors without affecting
+ * the state.
+ */
+struct _xxh3_data {
+	XXH3_state_t *state_p;
+	unsigned char *secret;
+	size_t secret_size;
+	struct _xxh3_packed *packed;
+	int auto_hibernate;
+	int busy;
+};
+
 static const rb_data_type_t _xxh32_state_data_type = {
 	"xxh32_state_data",
 	{ 0, _xxh32_free_state, 0, }, 0, 0,
@@ -100,13 +326,43 @@ static const rb_data_type_t _xxh64_state_data_type = {
 
 static const rb_data_type_t _xxh3_64bits_state_data_type = {
 	"xxh3_64bits_state_data",
-	{ 0, _xxh3_free_state, 0, }, 0, 0,
+	{ 0, _xxh3_free_state, _xxh3_memsize, }, 0, 0,
 	RUBY_TYPED_FREE_IMMEDIATELY|RUBY_TYPED_WB_PROTECTED
 };
 
 static const rb_data_type_t _xxh3_128bits_state_data_type = {
 	"xxh3_128bits_state_data",
-	{ 0, _xxh3_free_state, 0, }, 0, 0,
+	{ 0, _xxh3_free_state, _xxh3_memsize, }, 0, 0,
+	RUBY_TYPED_FREE_IMMEDIATELY|RUBY_TYPED_WB_PROTECTED
+};
+
+#ifdef RUBY_TYPED_FROZEN_SHAREABLE
+#	define _TYPED_FROZEN_SHAREABLE RUBY_TYPED_FROZEN_SHAREABLE
+#else
+#	define _TYPED_FROZEN_SHAREABLE 0
+#endif
+
+static const rb_data_type_t _prefix_data_type = {
+	"xxhash_prefix_data",
+	{ 0, _prefix_free, 0, }, 0, 0,
+	RUBY_TYPED_FREE_IMMEDIATELY|RUBY_TYPED_WB_PROTECTED|_TYPED_FROZEN_SHAREABLE
+};
+
+static const rb_data_type_t _multi_data_type = {
+	"xxhash_multi_data",
+	{ 0, _multi_free, _multi_memsize, }, 0, 0,
+	RUBY_TYPED_FREE_IMMEDIATELY|RUBY_TYPED_WB_PROTECTED
+};
+
+static const rb_data_type_t _chunker_data_type = {
+	"xxhash_chunker_data",
+	{ 0, RUBY_TYPED_DEFAULT_FREE, 0, }, 0, 0,
+	RUBY_TYPED_FREE_IMMEDIATELY|RUBY_TYPED_WB_PROTECTED|_TYPED_FROZEN_SHAREABLE
+};
+
+static const rb_data_type_t _streams_data_type = {
+	"xxhash_streams_data",
+	{ 0, _streams_free, _streams_memsize, }, 0, 0,
 	RUBY_TYPED_FREE_IMMEDIATELY|RUBY_TYPED_WB_PROTECTED
 };
 
@@ -114,32 +370,68 @@ static const rb_data_type_t _xxh3_128bits_state_data_type = {
  * Common functions
  */
 
+static struct _xxh32_data *_get_data_xxh32(VALUE self)
+{
+	struct _xxh32_data *data_p;
+	TypedData_Get_Struct(self, struct _xxh32_data, &_xxh32_state_data_type, data_p);
+	return data_p;
+}
+
 static XXH32_state_t *_get_state_xxh32(VALUE self)
 {
-	XXH32_state_t *state_p;
-	TypedData_Get_Struct(self, XXH32_state_t, &_xxh32_state_data_type, state_p);
-	return state_p;
+	return _get_data_xxh32(self)->state_p;
+}
+
+static struct _xxh64_data *_get_data_xxh64(VALUE self)
+{
+	struct _xxh64_data *data_p;
+	TypedData_Get_Struct(self, struct _xxh64_data, &_xxh64_state_data_type, data_p);
+	return data_p;
 }
 
 static XXH64_state_t *_get_state_xxh64(VALUE self)
 {
-	XXH64_state_t *state_p;
-	TypedData_Get_Struct(self, XXH64_state_t, &_xxh64_state_data_type, state_p);
-	return state_p;
+	return _get_data_xxh64(self)->state_p;
+}
+
+static struct _xxh3_data *_get_raw_data_xxh3_64bits(VALUE self)
+{
+	struct _xxh3_data *data_p;
+	TypedData_Get_Struct(self, struct _xxh3_data, &_xxh3_64bits_state_data_type, data_p);
+	return data_p;
+}
+
+/*
+ * Also re-expands the state if it's hibernated.
+ */
+static struct _xxh3_data *_get_data_xxh3_64bits(VALUE self)
+{
+	return _xxh3_wake(_get_raw_data_xxh3_64bits(self));
+}
+
+static struct _xxh3_data *_get_raw_data_xxh3_128bits(VALUE self)
+{
+	struct _xxh3_data *data_p;
+	TypedData_Get_Struct(self, struct _xxh3_data, &_xxh3_128bits_state_data_type, data_p);
+	return data_p;
+}
+
+/*
+ * Also re-expands the state if it's hibernated.
+ */
+static struct _xxh3_data *_get_data_xxh3_128bits(VALUE self)
+{
+	return _xxh3_wake(_get_raw_data_xxh3_128bits(self));
 }
 
 static XXH3_state_t *_get_state_xxh3_64bits(VALUE self)
 {
-	XXH3_state_t *state_p;
-	TypedData_Get_Struct(self, XXH3_state_t, &_xxh3_64bits_state_data_type, state_p);
-	return state_p;
+	return _get_data_xxh3_64bits(self)->state_p;
 }
 
 static XXH3_state_t *_get_state_xxh3_128bits(VALUE self)
 {
-	XXH3_state_t *state_p;
-	TypedData_Get_Struct(self, XXH3_state_t, &_xxh3_128bits_state_data_type, state_p);
-	return state_p;
+	return _get_data_xxh3_128bits(self)->state_p;
 }
 
 static void _xxh32_reset(XXH32_state_t *state_p, XXH32_hash_t seed)
@@ -154,449 +446,8146 @@ static void _xxh64_reset(XXH64_state_t *state_p, XXH64_hash_t seed)
 		rb_raise(rb_eRuntimeError, "Failed to reset state.");
 }
 
-static void _xxh3_64bits_reset(XXH3_state_t *state_p, XXH64_hash_t seed)
+static void _xxh3_free_secret(struct _xxh3_data *data_p)
 {
-	if (XXH3_64bits_reset_withSeed(state_p, seed) != XXH_OK)
-		rb_raise(rb_eRuntimeError, "Failed to reset state.");
+	xfree(data_p->secret);
+	data_p->secret = NULL;
+	data_p->secret_size = 0;
 }
 
-static void _xxh3_128bits_reset(XXH3_state_t *state_p, XXH64_hash_t seed)
+/*
+ * Raises if an update is using the state with the GVL released, since the
+ * state would otherwise be changed or freed under it.
+ */
+static void _check_idle(int busy)
 {
-	if (XXH3_128bits_reset_withSeed(state_p, seed) != XXH_OK)
-		rb_raise(rb_eRuntimeError, "Failed to reset state.");
+	if (busy)
+		rb_raise(rb_eRuntimeError, "State is being updated.");
 }
 
-static void _xxh32_free_state(void* state)
+/*
+ * Also guards the secret, which the state points to.
+ */
+static void _xxh3_check_idle(const struct _xxh3_data *data_p)
 {
-	XXH32_freeState((XXH32_state_t *)state);
+	_check_idle(data_p->busy);
 }
 
-static void _xxh64_free_state(void* state)
+static void _xxh3_64bits_reset(struct _xxh3_data *data_p, XXH64_hash_t seed)
 {
-	XXH64_freeState((XXH64_state_t *)state);
-}
+	_xxh3_check_idle(data_p);
 
-static void _xxh3_free_state(void* state)
-{
-	XXH3_freeState((XXH3_state_t *)state);
-}
+	if (XXH3_64bits_reset_withSeed(data_p->state_p, seed) != XXH_OK)
+		rb_raise(rb_eRuntimeError, "Failed to reset state.");
 
-static VALUE _hex_encode_str(VALUE str)
-{
-	int len = RSTRING_LEN(str);
-	VALUE hex = rb_usascii_str_new(0, _TWICE(len));
-	hex_encode_str_implied(_RSTRING_PTR_U(str), len, _RSTRING_PTR_U(hex));
-	return hex;
+	_xxh3_free_secret(data_p);
 }
 
-/*
- * Document-class: Digest::XXHash
- *
- * This is the base class of Digest::XXH32, Digest::XXH64,
- * Digest::XXH3_64bits, and Digest::XXH3_128bits.
- */
-
-static VALUE _Digest_XXHash_internal_allocate(VALUE klass)
+static void _xxh3_128bits_reset(struct _xxh3_data *data_p, XXH64_hash_t seed)
 {
-	if (klass == _Digest_XXHash)
-		rb_raise(rb_eRuntimeError, "Digest::XXHash is an incomplete class and cannot be "
-				"instantiated.");
+	_xxh3_check_idle(data_p);
 
-	rb_raise(rb_eNotImpError, "Allocator function not implemented.");
+	if (XXH3_128bits_reset_withSeed(data_p->state_p, seed) != XXH_OK)
+		rb_raise(rb_eRuntimeError, "Failed to reset state.");
+
+	_xxh3_free_secret(data_p);
 }
 
 /*
- * call-seq:
- *     new -> instance
- *     new(seed) -> instance
- *
- * Returns a new hash instance.
- *
- * If seed is provided, the state is reset with its value, otherwise the default
- * seed (0) is used.
- *
- * +seed+ can be in the form of a string, a hex string, or a number.
+ * Copies the secret to the state's private buffer.  The state would then
+ * need to be reset with the buffer.
  */
-static VALUE _Digest_XXHash_initialize(int argc, VALUE* argv, VALUE self)
+static const unsigned char *_xxh3_copy_secret_bytes(struct _xxh3_data *data_p,
+		const void *secret, size_t size)
 {
-	if (argc > 0)
-		rb_funcallv(self, _id_reset, argc, argv);
+	if (data_p->secret_size != size) {
+		data_p->secret = xrealloc(data_p->secret, size);
+		data_p->secret_size = size;
+	}
 
-	return self;
+	memcpy(data_p->secret, secret, size);
+	return data_p->secret;
 }
 
-/* :nodoc: */
-static VALUE _Digest_XXHash_ifinish(VALUE self)
+static const unsigned char *_xxh3_copy_secret(struct _xxh3_data *data_p, VALUE secret)
 {
-	rb_raise(rb_eNotImpError, "Method not implemented.");
+	return _xxh3_copy_secret_bytes(data_p, RSTRING_PTR(secret), RSTRING_LEN(secret));
 }
 
-static VALUE _do_digest(int argc, VALUE* argv, VALUE self, ID finish_method_id)
+/*
+ * Copies the state and the secret of +src_p+ to +dest_p+.
+ */
+static void _xxh3_copy_data(struct _xxh3_data *dest_p, const struct _xxh3_data *src_p)
 {
-	VALUE str, seed, result;
-	int argc2 = argc > 0 ? rb_scan_args(argc, argv, "02", &str, &seed) : 0;
+	if (dest_p == src_p)
+		return;
 
-	if (argc2 > 0) {
-		if (TYPE(str) != T_STRING)
-			rb_raise(rb_eTypeError, "Argument type not string.");
+	_xxh3_check_idle(dest_p);
+	XXH3_copyState(dest_p->state_p, src_p->state_p);
 
-		if (argc2 > 1)
-			rb_funcall(self, _id_reset, 1, seed);
-		else
-			rb_funcall(self, _id_reset, 0);
+	if (src_p->secret != NULL) {
+		if (dest_p->secret_size != src_p->secret_size) {
+			dest_p->secret = xrealloc(dest_p->secret, src_p->secret_size);
+			dest_p->secret_size = src_p->secret_size;
+		}
 
-		rb_funcall(self, _id_update, 1, str);
-	}
+		memcpy(dest_p->secret, src_p->secret, src_p->secret_size);
 
-	result = rb_funcall(self, finish_method_id, 0);
+		if (src_p->state_p->extSecret == src_p->secret)
+			dest_p->state_p->extSecret = dest_p->secret;
+	} else {
+		_xxh3_free_secret(dest_p);
+	}
+}
 
-	if (argc2 > 0)
-		rb_funcall(self, _id_reset, 0);
+static struct _xxh3_data *_xxh3_create_data(void)
+{
+	struct _xxh3_data *data_p = ALLOC(struct _xxh3_data);
+	data_p->secret = NULL;
+	data_p->secret_size = 0;
+	data_p->packed = NULL;
+	data_p->auto_hibernate = 0;
+	data_p->busy = 0;
+
+	if ((data_p->state_p = XXH3_createState()) == NULL) {
+		xfree(data_p);
+		rb_raise(rb_eNoMemError, "Failed to allocate state.");
+	}
 
-	return result;
+	return data_p;
 }
 
 /*
- * call-seq:
- *     digest -> str
- *     digest(str, seed = 0) -> str
- *
- * Returns digest value in string form.
- *
- * If no argument is provided, the current digest value is returned, and no
- * reset happens.
- *
- * If a string argument is provided, the string's digest value is calculated
- * with +seed+, and is used as the return value.  The instance's state is reset
- * to default afterwards.
- *
- * Providing an argument means that previous initializations done with custom
- * seeds or secrets, and previous calculations done with #update would be
- * discarded, so be careful with its use.
+ * Hibernation
  *
- * +seed+ can be in the form of a string, a hex string, or a number.
+ * An idle XXH3 state can be packed into a minimal form holding only the
+ * accumulators, the used part of the buffer, and the counters.  The full
+ * state is freed, and gets re-created the next time the instance is used.
+ * The seed's secret is regenerated, and a custom secret is still kept in the
+ * private copy.
  */
-static VALUE _Digest_XXHash_digest(int argc, VALUE* argv, VALUE self)
+
+enum {
+	_PACKED_SECRET_DEFAULT,
+	_PACKED_SECRET_SEED,
+	_PACKED_SECRET_CUSTOM
+};
+
+struct _xxh3_packed {
+	XXH64_hash_t acc[8];
+	XXH64_hash_t total_len;
+	XXH64_hash_t seed;
+	XXH32_hash_t stripes_so_far;
+	unsigned short buffered_size;
+	unsigned char catch_up_size;
+	unsigned char secret_kind;
+	unsigned char bytes[1]; /* buffered data followed by the catch-up bytes */
+};
+
+static void _xxh3_hibernate(struct _xxh3_data *data_p)
 {
-	return _do_digest(argc, argv, self, _id_finish);
+	const XXH3_state_t *state_p = data_p->state_p;
+	struct _xxh3_packed *packed_p;
+	size_t catch_up_size;
+
+	if (state_p == NULL)
+		return;
+
+	_xxh3_check_idle(data_p);
+	catch_up_size = state_p->totalLen > XXH3_MIDSIZE_MAX && state_p->bufferedSize < XXH_STRIPE_LEN ?
+			XXH_STRIPE_LEN - state_p->bufferedSize : 0;
+	packed_p = xmalloc(offsetof(struct _xxh3_packed, bytes) + state_p->bufferedSize + catch_up_size);
+	memcpy(packed_p->acc, state_p->acc, sizeof packed_p->acc);
+	packed_p->total_len = state_p->totalLen;
+	packed_p->seed = state_p->seed;
+	packed_p->stripes_so_far = (XXH32_hash_t)state_p->nbStripesSoFar;
+	packed_p->buffered_size = (unsigned short)state_p->bufferedSize;
+	packed_p->catch_up_size = (unsigned char)catch_up_size;
+
+	if (state_p->extSecret == NULL)
+		packed_p->secret_kind = _PACKED_SECRET_SEED;
+	else if (state_p->extSecret == XXH3_kSecret)
+		packed_p->secret_kind = _PACKED_SECRET_DEFAULT;
+	else
+		packed_p->secret_kind = _PACKED_SECRET_CUSTOM;
+
+	memcpy(packed_p->bytes, state_p->buffer, state_p->bufferedSize);
+	memcpy(packed_p->bytes + state_p->bufferedSize,
+			state_p->buffer + sizeof state_p->buffer - catch_up_size, catch_up_size);
+
+	XXH3_freeState(data_p->state_p);
+	data_p->state_p = NULL;
+	data_p->packed = packed_p;
 }
 
-/*
- * call-seq:
- *     hexdigest -> hex_str
- *     hexdigest(str) -> hex_str
- *     hexdigest(str, seed) -> hex_str
- *
- * Same as #digest but returns the digest value in hex form.
- */
-static VALUE _Digest_XXHash_hexdigest(int argc, VALUE* argv, VALUE self)
+static struct _xxh3_data *_xxh3_wake(struct _xxh3_data *data_p)
 {
-	return _hex_encode_str(_do_digest(argc, argv, self, _id_finish));
+	const struct _xxh3_packed *packed_p = data_p->packed;
+	XXH3_state_t *state_p;
+
+	if (packed_p == NULL)
+		return data_p;
+
+	if ((state_p = XXH3_createState()) == NULL)
+		rb_raise(rb_eNoMemError, "Failed to allocate state.");
+
+	switch (packed_p->secret_kind) {
+	case _PACKED_SECRET_SEED:
+		XXH3_64bits_reset_withSeed(state_p, packed_p->seed);
+		break;
+	case _PACKED_SECRET_CUSTOM:
+		XXH3_64bits_reset_withSecret(state_p, data_p->secret, data_p->secret_size);
+		break;
+	default:
+		XXH3_64bits_reset(state_p);
+	}
+
+	memcpy(state_p->acc, packed_p->acc, sizeof packed_p->acc);
+	state_p->totalLen = packed_p->total_len;
+	state_p->nbStripesSoFar = packed_p->stripes_so_far;
+	state_p->bufferedSize = packed_p->buffered_size;
+	memcpy(state_p->buffer, packed_p->bytes, packed_p->buffered_size);
+	memcpy(state_p->buffer + sizeof state_p->buffer - packed_p->catch_up_size,
+			packed_p->bytes + packed_p->buffered_size, packed_p->catch_up_size);
+
+	data_p->state_p = state_p;
+	data_p->packed = NULL;
+	xfree((void *)packed_p);
+	return data_p;
 }
 
-/*
- * call-seq:
- *     idigest -> num
- *     idigest(str) -> num
- *     idigest(str, seed) -> num
- *
- * Same as #digest but returns the digest value in numerical form.
- */
-static VALUE _Digest_XXHash_idigest(int argc, VALUE* argv, VALUE self)
+static size_t _xxh3_memsize(const void *data)
 {
-	return _do_digest(argc, argv, self, _id_ifinish);
+	const struct _xxh3_data *data_p = (const struct _xxh3_data *)data;
+	size_t size = sizeof *data_p + data_p->secret_size;
+
+	if (data_p->state_p != NULL)
+		size += sizeof(XXH3_state_t);
+
+	if (data_p->packed != NULL)
+		size += offsetof(struct _xxh3_packed, bytes) + data_p->packed->buffered_size +
+				data_p->packed->catch_up_size;
+
+	return size;
 }
 
-/*
- * call-seq: idigest!
- *
- * Returns current digest value and resets state to default form.
- */
-static VALUE _Digest_XXHash_idigest_bang(VALUE self)
+static void _xxh32_free_state(void* data)
 {
-	VALUE result;
-	result = rb_funcall(self, _id_ifinish, 0);
-	rb_funcall(self, _id_reset, 0);
-	return result;
+	struct _xxh32_data *data_p = (struct _xxh32_data *)data;
+	XXH32_freeState(data_p->state_p);
+	xfree(data_p);
 }
 
-/*
- * call-seq: initialize_copy(orig) -> self
- *
- * This method is called when instances are cloned.  It is responsible for
- * replicating internal data.
- */
-static VALUE _Digest_XXHash_initialize_copy(VALUE self, VALUE orig)
+static void _xxh64_free_state(void* data)
 {
-	rb_raise(rb_eNotImpError, "initialize_copy method not implemented.");
+	struct _xxh64_data *data_p = (struct _xxh64_data *)data;
+	XXH64_freeState(data_p->state_p);
+	xfree(data_p);
 }
 
-/*
- * call-seq: inspect -> str
- *
+static void _xxh3_free_state(void* data)
+{
+	struct _xxh3_data *data_p = (struct _xxh3_data *)data;
+	XXH3_freeState(data_p->state_p);
+	xfree(data_p->secret);
+	xfree(data_p->packed);
+	xfree(data_p);
+}
+
+static VALUE _hex_encode_str(VALUE str)
+{
+	int len = RSTRING_LEN(str);
+	VALUE hex = rb_usascii_str_new(0, _TWICE(len));
+	hex_encode_str_implied(_RSTRING_PTR_U(str), len, _RSTRING_PTR_U(hex));
+	return hex;
+}
+
+static VALUE _xxh128_hash_to_num(XXH128_hash_t hash)
+{
+	if (! XXH_CPU_LITTLE_ENDIAN) {
+		#define _SWAP_WORDS(x) ((x << 32) & 0xffffffff00000000ULL) | \
+			((x >> 32) & 0x000000000ffffffffULL)
+		hash.low64 = _SWAP_WORDS(hash.low64);
+		hash.high64 = _SWAP_WORDS(hash.high64);
+	}
+
+	return rb_integer_unpack(&hash, 4, sizeof(XXH32_hash_t), 0, INTEGER_PACK_LSWORD_FIRST|
+			INTEGER_PACK_NATIVE_BYTE_ORDER);
+}
+
+/*
+ * Generates a frozen custom secret string from arbitrary seed material.
+ */
+static VALUE _generate_secret(int argc, VALUE* argv)
+{
+	VALUE seed, size_arg, secret;
+	size_t size = XXH3_SECRET_DEFAULT_SIZE;
+
+	rb_scan_args(argc, argv, "11", &seed, &size_arg);
+
+	if (TYPE(seed) != T_STRING)
+		rb_raise(rb_eArgError, "Argument 'seed' needs to be a string.");
+
+	if (! NIL_P(size_arg)) {
+		size = NUM2SIZET(size_arg);
+
+		if (size < XXH3_SECRET_SIZE_MIN)
+			rb_raise(rb_eArgError, "Secret needs to be at least %d bytes in length.",
+					XXH3_SECRET_SIZE_MIN);
+	}
+
+	secret = rb_str_new(0, size);
+
+	if (XXH3_generateSecret(RSTRING_PTR(secret), size, RSTRING_PTR(seed),
+			RSTRING_LEN(seed)) != XXH_OK)
+		rb_raise(rb_eRuntimeError, "Failed to generate secret.");
+
+	return rb_obj_freeze(secret);
+}
+
+static VALUE _funcall_with_opts(VALUE recv, ID mid, int argc, VALUE *argv, VALUE opts)
+{
+	VALUE args[3];
+
+	if (NIL_P(opts))
+		return rb_funcallv(recv, mid, argc, argv);
+
+	MEMCPY(args, argv, VALUE, argc);
+	args[argc] = opts;
+
+	#ifdef RB_PASS_KEYWORDS
+	return rb_funcallv_kw(recv, mid, argc + 1, args, RB_PASS_KEYWORDS);
+	#else
+	return rb_funcallv(recv, mid, argc + 1, args);
+	#endif
+}
+
+/*
+ * Input functions
+ */
+
+struct _input {
+	const void *ptr;
+	size_t len;
+	VALUE holder;
+	int nogvl;
+	int unlock_buffer;
+	int release_view;
+	#ifdef HAVE_RB_MEMORY_VIEW_GET
+	rb_memory_view_t view;
+	#endif
+};
+
+static int _is_input(VALUE data)
+{
+	if (TYPE(data) == T_STRING)
+		return 1;
+
+	#ifdef HAVE_RUBY_IO_BUFFER_H
+	if (rb_obj_is_kind_of(data, rb_cIOBuffer))
+		return 1;
+	#endif
+
+	#ifdef HAVE_RB_MEMORY_VIEW_GET
+	if (rb_memory_view_available_p(data))
+		return 1;
+	#endif
+
+	return 0;
+}
+
+static void _check_input(VALUE data)
+{
+	if (! _is_input(data)) {
+		#if defined(HAVE_RB_MEMORY_VIEW_GET)
+		rb_raise(rb_eTypeError, "Argument type not string, IO::Buffer, or an object "
+				"exporting a memory view.");
+		#elif defined(HAVE_RUBY_IO_BUFFER_H)
+		rb_raise(rb_eTypeError, "Argument type not string or IO::Buffer.");
+		#else
+		rb_raise(rb_eTypeError, "Argument type not string.");
+		#endif
+	}
+}
+
+static long _get_range_arg(VALUE value)
+{
+	long n;
+
+	if (value == Qundef || NIL_P(value))
+		return -1;
+
+	n = NUM2LONG(value);
+
+	if (n < 0)
+		rb_raise(rb_eArgError, "Offset and length can't be negative.");
+
+	return n;
+}
+
+/*
+ * Returns an error message if the range doesn't fit in +size+, or NULL.
+ */
+static const char *_get_input_range(size_t size, long offset, long length, size_t *start_p,
+		size_t *length_p)
+{
+	*start_p = 0;
+
+	if (offset >= 0) {
+		if ((size_t)offset > size)
+			return "Offset is out of range.";
+
+		*start_p = offset;
+	}
+
+	*length_p = size - *start_p;
+
+	if (length >= 0) {
+		if ((size_t)length > *length_p)
+			return "Length is out of range.";
+
+		*length_p = length;
+	}
+
+	return NULL;
+}
+
+/*
+ * Resolves the memory of a string, an IO::Buffer, or an object exporting a
+ * contiguous memory view.
+ *
+ * If the selected range is long enough to be hashed with the GVL released,
+ * the memory is pinned first.  Strings are pinned by keeping a frozen shared
+ * copy so that modifications to the original go to a new buffer, and IO
+ * buffers are locked, unless they are already, so that they can't be
+ * resized or freed.  Memory views stay valid until they are released.
+ */
+static void _acquire_input(struct _input *input, VALUE data, VALUE offset_arg, VALUE length_arg)
+{
+	long offset = _get_range_arg(offset_arg), length = _get_range_arg(length_arg);
+	const char *error;
+	size_t start, len;
+
+	input->holder = data;
+	input->nogvl = 0;
+	input->unlock_buffer = 0;
+	input->release_view = 0;
+
+	if (TYPE(data) == T_STRING) {
+		if ((error = _get_input_range(RSTRING_LEN(data), offset, length, &start, &len)))
+			rb_raise(rb_eArgError, "%s", error);
+
+		#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+		if (len >= _NOGVL_MIN_LENGTH) {
+			input->holder = rb_str_new_frozen(data);
+			input->nogvl = 1;
+		}
+		#endif
+
+		input->ptr = RSTRING_PTR(input->holder) + start;
+		input->len = len;
+		return;
+	}
+
+	#ifdef HAVE_RUBY_IO_BUFFER_H
+	if (rb_obj_is_kind_of(data, rb_cIOBuffer)) {
+		#ifdef HAVE_RB_IO_BUFFER_GET_BYTES
+		void *base;
+		size_t size;
+		enum rb_io_buffer_flags flags = rb_io_buffer_get_bytes(data, &base, &size);
+		#else
+		const void *base;
+		size_t size;
+		rb_io_buffer_get_immutable(data, &base, &size);
+		#endif
+
+		if ((error = _get_input_range(size, offset, length, &start, &len)))
+			rb_raise(rb_eArgError, "%s", error);
+		input->ptr = (const char *)base + start;
+		input->len = len;
+
+		#if defined(HAVE_RB_IO_BUFFER_GET_BYTES) && defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+		if (len >= _NOGVL_MIN_LENGTH) {
+			if (! (flags & RB_IO_BUFFER_LOCKED)) {
+				rb_io_buffer_lock(data);
+				input->unlock_buffer = 1;
+			}
+
+			input->nogvl = 1;
+		}
+		#endif
+
+		return;
+	}
+	#endif
+
+	#ifdef HAVE_RB_MEMORY_VIEW_GET
+	if (rb_memory_view_available_p(data)) {
+		if (! rb_memory_view_get(data, &input->view, RUBY_MEMORY_VIEW_SIMPLE))
+			rb_raise(rb_eArgError, "Unable to get memory view of object.");
+
+		/* A view without strides is always contiguous. */
+		if (input->view.strides != NULL && ! rb_memory_view_is_contiguous(&input->view)) {
+			rb_memory_view_release(&input->view);
+			rb_raise(rb_eArgError, "Memory view of object is not contiguous.");
+		}
+
+		if ((error = _get_input_range(input->view.byte_size, offset, length, &start, &len))) {
+			rb_memory_view_release(&input->view);
+			rb_raise(rb_eArgError, "%s", error);
+		}
+
+		input->release_view = 1;
+		input->ptr = (const char *)input->view.data + start;
+		input->len = len;
+
+		#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+		input->nogvl = len >= _NOGVL_MIN_LENGTH;
+		#endif
+
+		return;
+	}
+	#endif
+
+	_check_input(data);
+}
+
+/*
+ * Pins the memory of +input+ whatever its length, for when Ruby code runs
+ * while it's being hashed, like a progress callback that could modify the
+ * data.  Without rb_io_buffer_get_bytes to tell if an IO buffer is locked,
+ * its range is copied instead.
+ */
+static void _pin_input(struct _input *input)
+{
+	size_t start;
+	#ifdef HAVE_RB_IO_BUFFER_GET_BYTES
+	void *base;
+	size_t size;
+	#endif
+
+	if (TYPE(input->holder) == T_STRING) {
+		start = (const char *)input->ptr - RSTRING_PTR(input->holder);
+		input->holder = rb_str_new_frozen(input->holder);
+		input->ptr = RSTRING_PTR(input->holder) + start;
+		return;
+	}
+
+	#ifdef HAVE_RUBY_IO_BUFFER_H
+	if (rb_obj_is_kind_of(input->holder, rb_cIOBuffer) && ! input->unlock_buffer) {
+		#ifdef HAVE_RB_IO_BUFFER_GET_BYTES
+		if (! (rb_io_buffer_get_bytes(input->holder, &base, &size) & RB_IO_BUFFER_LOCKED)) {
+			rb_io_buffer_lock(input->holder);
+			input->unlock_buffer = 1;
+		}
+		#else
+		input->holder = rb_obj_freeze(rb_str_new(input->ptr, input->len));
+		input->ptr = RSTRING_PTR(input->holder);
+		#endif
+	}
+	#endif
+}
+
+static int _input_needs_release(struct _input *input)
+{
+	return input->unlock_buffer || input->release_view;
+}
+
+static void _release_input(struct _input *input)
+{
+	#ifdef HAVE_RUBY_IO_BUFFER_H
+	if (input->unlock_buffer) {
+		input->unlock_buffer = 0;
+		rb_io_buffer_unlock(input->holder);
+	}
+	#endif
+
+	#ifdef HAVE_RB_MEMORY_VIEW_GET
+	if (input->release_view) {
+		input->release_view = 0;
+		rb_memory_view_release(&input->view);
+	}
+	#endif
+}
+
+/*
+ * Reads up to _READ_CHUNK_SIZE bytes from +io+ with read_args as the
+ * arguments to +read+, and appends them to the buffer at *buf_p, which holds
+ * *len_p bytes and is grown as needed.  Returns 0 at the end of the stream.
+ *
+ * The string returned by +read+ is used, since readers may return a new one
+ * instead of filling the buffer argument.
+ */
+static int _read_more(VALUE io, VALUE *read_args, unsigned char **buf_p, size_t *capa_p,
+		size_t *len_p)
+{
+	VALUE ret;
+	size_t n;
+
+	if (NIL_P(ret = rb_funcallv(io, _id_read, 2, read_args)))
+		return 0;
+
+	StringValue(ret);
+	n = RSTRING_LEN(ret);
+
+	if (*len_p + n > *capa_p) {
+		size_t capa = *capa_p == 0 ? _READ_CHUNK_SIZE : *capa_p;
+		unsigned char *buf;
+
+		while (capa < *len_p + n)
+			capa *= 2;
+
+		if ((buf = realloc(*buf_p, capa)) == NULL)
+			rb_raise(rb_eNoMemError, "Failed to allocate memory for read buffer.");
+
+		*buf_p = buf;
+		*capa_p = capa;
+	}
+
+	memcpy(*buf_p + *len_p, RSTRING_PTR(ret), n);
+	*len_p += n;
+	RB_GC_GUARD(ret);
+	return 1;
+}
+
+/*
+ * Update functions
+ */
+
+typedef XXH_errorcode (*_update_func_t)(void *, const void *, size_t);
+
+struct _update_args {
+	_update_func_t func;
+	void *state_p;
+	struct _input input;
+	size_t done;
+	size_t stop;
+	volatile int interrupted;
+	VALUE progress;
+	size_t progress_interval;
+	int casefold;
+	XXH_errorcode result;
+};
+
+static XXH_errorcode _xxh32_update_func(void *state_p, const void *input, size_t len)
+{
+	return XXH32_update((XXH32_state_t *)state_p, input, len);
+}
+
+static XXH_errorcode _xxh64_update_func(void *state_p, const void *input, size_t len)
+{
+	return XXH64_update((XXH64_state_t *)state_p, input, len);
+}
+
+static XXH_errorcode _xxh3_64bits_update_func(void *state_p, const void *input, size_t len)
+{
+	return XXH3_64bits_update((XXH3_state_t *)state_p, input, len);
+}
+
+static XXH_errorcode _xxh3_128bits_update_func(void *state_p, const void *input, size_t len)
+{
+	return XXH3_128bits_update((XXH3_state_t *)state_p, input, len);
+}
+
+/*
+ * Lowercases ASCII letters in +src+.  The loop is kept free of branches so
+ * that compilers can vectorize it.
+ */
+static void _ascii_downcase(const unsigned char *src, unsigned char *dest, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+		dest[i] = src[i] | ((unsigned char)(src[i] - 'A') < 26) << 5;
+}
+
+/*
+ * Feeds lowercased data to the state through a buffer in the stack.
+ */
+static XXH_errorcode _update_casefold(_update_func_t func, void *state_p, const void *input,
+		size_t len)
+{
+	unsigned char buf[_CASEFOLD_BUFFER_SIZE];
+	const unsigned char *p = (const unsigned char *)input;
+	XXH_errorcode result = XXH_OK;
+	size_t n;
+
+	for (; len > 0 && result == XXH_OK; p += n, len -= n) {
+		n = len < sizeof buf ? len : sizeof buf;
+		_ascii_downcase(p, buf, n);
+		result = func(state_p, buf, n);
+	}
+
+	return result;
+}
+
+/*
+ * Feeds data to the state up to args->stop, one chunk at a time, so that a
+ * request to interrupt can be honored without waiting for the whole data to
+ * be processed.
+ */
+static void *_update_state_func(void *ptr)
+{
+	struct _update_args *args = ptr;
+	const char *data = args->input.ptr;
+	size_t len;
+
+	while (args->done < args->stop && ! args->interrupted) {
+		len = args->stop - args->done;
+
+		if (len > _NOGVL_CHUNK_SIZE)
+			len = _NOGVL_CHUNK_SIZE;
+
+		if (args->casefold)
+			args->result = _update_casefold(args->func, args->state_p, data + args->done, len);
+		else
+			args->result = args->func(args->state_p, data + args->done, len);
+
+		if (args->result != XXH_OK)
+			break;
+
+		args->done += len;
+	}
+
+	return NULL;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void _update_state_ubf(void *ptr)
+{
+	((struct _update_args *)ptr)->interrupted = 1;
+}
+#endif
+
+static VALUE _update_state_body(VALUE ptr)
+{
+	struct _update_args *args = (struct _update_args *)ptr;
+
+	while (args->done < args->input.len && args->result == XXH_OK) {
+		args->stop = args->input.len;
+
+		if (! NIL_P(args->progress) && args->input.len - args->done > args->progress_interval)
+			args->stop = args->done + args->progress_interval;
+
+		#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+		if (args->input.nogvl) {
+			/*
+			 * Pending interrupts are handled once the GVL is reacquired.
+			 * Hashing resumes if they don't raise an exception.
+			 */
+			args->interrupted = 0;
+			rb_thread_call_without_gvl(_update_state_func, args, _update_state_ubf, args);
+		} else {
+			_update_state_func(args);
+		}
+		#else
+		_update_state_func(args);
+		#endif
+
+		if (! NIL_P(args->progress) && args->done == args->stop)
+			rb_funcall(args->progress, _id_call, 2, SIZET2NUM(args->done),
+					SIZET2NUM(args->input.len));
+	}
+
+	if (! NIL_P(args->progress) && args->input.len == 0)
+		rb_funcall(args->progress, _id_call, 2, SIZET2NUM(0), SIZET2NUM(0));
+
+	return Qnil;
+}
+
+static VALUE _update_state_ensure(VALUE ptr)
+{
+	_release_input(&((struct _update_args *)ptr)->input);
+	return Qnil;
+}
+
+/*
+ * Parses the arguments of #update and feeds the specified data to the state.
+ */
+static void _update_state(int argc, VALUE *argv, void *state_p, _update_func_t func)
+{
+	ID keywords[5];
+	VALUE data, opts, values[5];
+	struct _update_args args;
+
+	keywords[0] = _id_offset;
+	keywords[1] = _id_length;
+	keywords[2] = _id_progress;
+	keywords[3] = _id_progress_interval;
+	keywords[4] = _id_casefold;
+
+	rb_scan_args(argc, argv, "1:", &data, &opts);
+	values[0] = values[1] = values[2] = values[3] = values[4] = Qundef;
+
+	if (! NIL_P(opts))
+		rb_get_kwargs(opts, keywords, 0, 5, values);
+
+	args.func = func;
+	args.state_p = state_p;
+	args.done = 0;
+	args.interrupted = 0;
+	args.progress = values[2] == Qundef ? Qnil : values[2];
+	args.progress_interval = _PROGRESS_INTERVAL;
+	args.casefold = values[4] != Qundef && RTEST(values[4]);
+	args.result = XXH_OK;
+
+	if (! NIL_P(args.progress) && ! rb_respond_to(args.progress, _id_call))
+		rb_raise(rb_eTypeError, "Progress callback needs to respond to 'call'.");
+
+	if (values[3] != Qundef && ! NIL_P(values[3])) {
+		args.progress_interval = NUM2SIZET(values[3]);
+
+		if (args.progress_interval == 0)
+			rb_raise(rb_eArgError, "Progress interval needs to be greater than 0.");
+	}
+
+	_acquire_input(&args.input, data, values[0], values[1]);
+
+	if (! NIL_P(args.progress))
+		_pin_input(&args.input);
+
+	if (_input_needs_release(&args.input))
+		rb_ensure(_update_state_body, (VALUE)&args, _update_state_ensure, (VALUE)&args);
+	else
+		_update_state_body((VALUE)&args);
+
+	RB_GC_GUARD(args.input.holder);
+
+	if (args.result != XXH_OK)
+		rb_raise(rb_eRuntimeError, "Failed to update state.");
+}
+
+/*
+ * File pipeline
+ *
+ * Used by #file.  A reader thread fills a ring of page-aligned buffers ahead
+ * of the hasher, so waiting for the disk overlaps with hashing.  The ring's
+ * tail is only advanced by the reader and its head only by the hasher; the
+ * mutex is only taken to sleep when the ring is empty or full, and to wake
+ * the other side.
+ *
+ * With 'cache: :bypass', the file is opened with O_DIRECT, which the aligned
+ * buffers allow.  If the file system rejects it, on open or on a read, the
+ * reader falls back to buffered reads and drops the pages it has read from
+ * the page cache with posix_fadvise.  Pages that were cached before the
+ * reader got near them are kept, so that the cached data of other processes
+ * stays.  They're found with mincore on a mapping of each buffer's range,
+ * well ahead of the reads, since kernel read-ahead caches pages a little past
+ * them.  If that fails, nothing is dropped.
+ */
+
+#if defined(HAVE_PREAD) || defined(HAVE_IO_URING)
+/*
+ * Returns 0 if +fd+ is a regular file, or an errno value.  Directories give
+ * EISDIR and anything else EINVAL.
+ */
+static int _check_regular_fd(int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) < 0)
+		return errno;
+
+	return S_ISREG(st.st_mode) ? 0 : S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+}
+#endif
+
+#if defined(HAVE_PTHREAD_CREATE) && defined(HAVE_PREAD)
+struct _open_args {
+	const char *path;
+	int flags;
+	int fd;
+	int error;
+};
+
+static void *_open_func(void *ptr)
+{
+	struct _open_args *args = ptr;
+
+	if ((args->fd = open(args->path, args->flags | O_CLOEXEC | O_NONBLOCK)) < 0)
+		args->error = errno;
+
+	return NULL;
+}
+
+/*
+ * Opens +path+ for reading with the GVL released, so that a slow file system
+ * doesn't hold up other threads, and without blocking on FIFOs.  The thread
+ * is woken with a signal when interrupted, and the open retried once the
+ * interrupts are handled.  Returns the descriptor, or -1 with errno set.
+ */
+static int _open_file(VALUE path, int flags)
+{
+	struct _open_args args;
+
+	/* Other threads can change the string while the GVL is released. */
+	path = rb_str_new_frozen(path);
+	args.path = StringValueCStr(path);
+	args.flags = flags;
+
+	do {
+		args.fd = -1;
+		args.error = EINTR;
+
+		#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+		/* Unlike rb_thread_call_without_gvl, this never raises with the file open. */
+		rb_thread_call_without_gvl2(_open_func, &args, RUBY_UBF_IO, NULL);
+		#else
+		_open_func(&args);
+		#endif
+
+		if (args.fd < 0 && args.error == EINTR)
+			rb_thread_check_ints();
+	} while (args.fd < 0 && args.error == EINTR);
+
+	RB_GC_GUARD(path);
+
+	if (args.fd < 0) {
+		errno = args.error;
+		return -1;
+	}
+
+	rb_update_max_fd(args.fd);
+	return args.fd;
+}
+
+struct _pipeline {
+	_update_func_t func;
+	void *state_p;
+	int fd;
+	int direct;
+	int dontneed;
+	#ifdef HAVE_POSIX_FADVISE
+	unsigned long long checked;
+	size_t page_size;
+	int cached_known[_PIPELINE_CHECK_AHEAD];
+	unsigned char cached[_PIPELINE_CHECK_AHEAD][_PIPELINE_BUFFER_SIZE / _PIPELINE_ALIGNMENT];
+	#endif
+	unsigned char *bufs;
+	size_t *lens;
+	unsigned depth;
+	unsigned head;
+	unsigned tail;
+	int eof;
+	int stop;
+	int done;
+	int error;
+	volatile int interrupted;
+	XXH_errorcode result;
+	int started;
+	pthread_t reader;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+static void _pipeline_wake(struct _pipeline *p)
+{
+	pthread_mutex_lock(&p->mutex);
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->mutex);
+}
+
+#ifdef O_DIRECT
+/*
+ * Switches the file to buffered reads.  Returns 0, or -1 if it can't be.
+ */
+static int _pipeline_stop_direct(struct _pipeline *p)
+{
+	int flags;
+
+	if ((flags = fcntl(p->fd, F_GETFL)) < 0 || fcntl(p->fd, F_SETFL, flags & ~O_DIRECT) < 0)
+		return -1;
+
+	p->direct = 0;
+	p->dontneed = 1;
+	return 0;
+}
+#endif
+
+#ifdef HAVE_POSIX_FADVISE
+/*
+ * Records which pages of the range of the +n+-th buffer are in the page
+ * cache.
+ */
+static void _pipeline_check_cache(struct _pipeline *p, unsigned long long n)
+{
+	int *known = &p->cached_known[n % _PIPELINE_CHECK_AHEAD];
+	#if defined(HAVE_MMAP) && defined(HAVE_MINCORE)
+	long page_size = sysconf(_SC_PAGESIZE);
+	void *addr;
+	#endif
+
+	*known = 0;
+
+	#if defined(HAVE_MMAP) && defined(HAVE_MINCORE)
+	if (page_size < _PIPELINE_ALIGNMENT || _PIPELINE_BUFFER_SIZE % page_size != 0)
+		return;
+
+	/* The mapping is never touched, so it reads nothing into the cache. */
+	if ((addr = mmap(NULL, _PIPELINE_BUFFER_SIZE, PROT_READ, MAP_SHARED, p->fd,
+			(off_t)(n * _PIPELINE_BUFFER_SIZE))) == MAP_FAILED)
+		return;
+
+	*known = mincore(addr, _PIPELINE_BUFFER_SIZE,
+			(void *)p->cached[n % _PIPELINE_CHECK_AHEAD]) == 0;
+	p->page_size = page_size;
+	munmap(addr, _PIPELINE_BUFFER_SIZE);
+	#endif
+}
+
+/*
+ * Looks up the cached pages of the buffers from the +n+-th one to
+ * _PIPELINE_CHECK_AHEAD - 1 past it that haven't been yet.
+ */
+static void _pipeline_check_ahead(struct _pipeline *p, unsigned long long n)
+{
+	if (p->checked < n)
+		p->checked = n;
+
+	while (p->checked < n + _PIPELINE_CHECK_AHEAD)
+		_pipeline_check_cache(p, p->checked++);
+}
+
+/*
+ * Drops the pages from +start+ to +end+ within the range of the +n+-th
+ * buffer that weren't cached when it was looked up.
+ */
+static void _pipeline_drop_cache(struct _pipeline *p, unsigned long long n, size_t start,
+		size_t end)
+{
+	const unsigned char *cached = p->cached[n % _PIPELINE_CHECK_AHEAD];
+	size_t i, j, last;
+
+	if (! p->cached_known[n % _PIPELINE_CHECK_AHEAD])
+		return;
+
+	last = (end + p->page_size - 1) / p->page_size;
+
+	for (i = start / p->page_size; i < last; i = j + 1) {
+		for (j = i; j < last && ! (cached[j] & 1); ++j);
+
+		if (j > i)
+			posix_fadvise(p->fd, (off_t)(n * _PIPELINE_BUFFER_SIZE + i * p->page_size),
+					(off_t)((j - i) * p->page_size), POSIX_FADV_DONTNEED);
+	}
+}
+#endif
+
+static int _pipeline_full(struct _pipeline *p, unsigned tail)
+{
+	return tail - __atomic_load_n(&p->head, __ATOMIC_ACQUIRE) == p->depth &&
+			! __atomic_load_n(&p->stop, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Fills each free buffer completely unless the end of the file is reached.
+ * The tail is published before eof, so the hasher sees the last buffer once
+ * it sees eof.
+ */
+static void *_pipeline_reader_func(void *ptr)
+{
+	struct _pipeline *p = ptr;
+	unsigned char *buf;
+	unsigned tail = 0;
+	unsigned long long offset = 0;
+	size_t len, buffered;
+	ssize_t n;
+	int error = 0;
+
+	for (;;) {
+		if (_pipeline_full(p, tail)) {
+			pthread_mutex_lock(&p->mutex);
+
+			while (_pipeline_full(p, tail))
+				pthread_cond_wait(&p->cond, &p->mutex);
+
+			pthread_mutex_unlock(&p->mutex);
+		}
+
+		if (__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE))
+			break;
+
+		buf = p->bufs + (size_t)(tail % p->depth) * _PIPELINE_BUFFER_SIZE;
+		buffered = 0;
+
+		#ifdef HAVE_POSIX_FADVISE
+		if (p->dontneed)
+			_pipeline_check_ahead(p, offset / _PIPELINE_BUFFER_SIZE);
+		#endif
+
+		for (len = 0; len < _PIPELINE_BUFFER_SIZE; len += n) {
+			if ((n = read(p->fd, buf + len, _PIPELINE_BUFFER_SIZE - len)) < 0) {
+				if (errno == EINTR) {
+					n = 0;
+					continue;
+				}
+
+				#ifdef O_DIRECT
+				if (errno == EINVAL && p->direct && _pipeline_stop_direct(p) == 0) {
+					#ifdef HAVE_POSIX_FADVISE
+					_pipeline_check_ahead(p, offset / _PIPELINE_BUFFER_SIZE);
+					#endif
+					buffered = len;
+					n = 0;
+					continue;
+				}
+				#endif
+
+				error = errno;
+				break;
+			}
+
+			if (n == 0)
+				break;
+		}
+
+		#ifdef HAVE_POSIX_FADVISE
+		/* Only the part read after leaving O_DIRECT went through the cache. */
+		if (p->dontneed && len > buffered)
+			_pipeline_drop_cache(p, offset / _PIPELINE_BUFFER_SIZE, buffered, len);
+		#endif
+
+		offset += len;
+
+		p->lens[tail % p->depth] = len;
+		__atomic_store_n(&p->tail, ++tail, __ATOMIC_RELEASE);
+
+		if (len < _PIPELINE_BUFFER_SIZE) {
+			p->error = error;
+			__atomic_store_n(&p->eof, 1, __ATOMIC_RELEASE);
+		}
+
+		_pipeline_wake(p);
+
+		if (len < _PIPELINE_BUFFER_SIZE)
+			break;
+	}
+
+	return NULL;
+}
+
+static int _pipeline_empty(struct _pipeline *p)
+{
+	return ! __atomic_load_n(&p->eof, __ATOMIC_ACQUIRE) &&
+			__atomic_load_n(&p->tail, __ATOMIC_ACQUIRE) == p->head && ! p->interrupted;
+}
+
+/*
+ * Hashes the buffers as they're filled until the reader reaches the end of
+ * the file, or the thread is interrupted.
+ */
+static void *_pipeline_hash_func(void *ptr)
+{
+	struct _pipeline *p = ptr;
+	unsigned char *buf;
+	unsigned tail;
+	int eof;
+
+	while (! p->interrupted) {
+		eof = __atomic_load_n(&p->eof, __ATOMIC_ACQUIRE);
+		tail = __atomic_load_n(&p->tail, __ATOMIC_ACQUIRE);
+
+		if (tail == p->head) {
+			if (eof) {
+				p->done = 1;
+				break;
+			}
+
+			pthread_mutex_lock(&p->mutex);
+
+			while (_pipeline_empty(p))
+				pthread_cond_wait(&p->cond, &p->mutex);
+
+			pthread_mutex_unlock(&p->mutex);
+			continue;
+		}
+
+		buf = p->bufs + (size_t)(p->head % p->depth) * _PIPELINE_BUFFER_SIZE;
+
+		if ((p->result = p->func(p->state_p, buf, p->lens[p->head % p->depth])) != XXH_OK) {
+			p->done = 1;
+			break;
+		}
+
+		__atomic_store_n(&p->head, p->head + 1, __ATOMIC_RELEASE);
+		_pipeline_wake(p);
+	}
+
+	return NULL;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void _pipeline_ubf(void *ptr)
+{
+	struct _pipeline *p = ptr;
+
+	pthread_mutex_lock(&p->mutex);
+	p->interrupted = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->mutex);
+}
+#endif
+
+static VALUE _pipeline_body(VALUE ptr)
+{
+	struct _pipeline *p = (struct _pipeline *)ptr;
+	int error;
+
+	if ((error = pthread_create(&p->reader, NULL, _pipeline_reader_func, p)) != 0)
+		rb_syserr_fail(error, "pthread_create");
+
+	p->started = 1;
+
+	do {
+		p->interrupted = 0;
+
+		#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+		rb_thread_call_without_gvl(_pipeline_hash_func, p, _pipeline_ubf, p);
+		#else
+		_pipeline_hash_func(p);
+		#endif
+	} while (! p->done);
+
+	return Qnil;
+}
+
+static VALUE _pipeline_ensure(VALUE ptr)
+{
+	struct _pipeline *p = (struct _pipeline *)ptr;
+
+	if (p->started) {
+		pthread_mutex_lock(&p->mutex);
+		__atomic_store_n(&p->stop, 1, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->mutex);
+		pthread_join(p->reader, NULL);
+	}
+
+	pthread_mutex_destroy(&p->mutex);
+	pthread_cond_destroy(&p->cond);
+	close(p->fd);
+	return Qnil;
+}
+
+/*
+ * Feeds the file at +path+ to the state through a pipeline of +depth+
+ * buffers, bypassing the page cache if +bypass+ is nonzero.
+ */
+static void _update_file_pipelined(VALUE path, void *state_p, _update_func_t func, unsigned depth,
+		int bypass)
+{
+	VALUE bufs_tmp = 0;
+	struct _pipeline p;
+	unsigned char *block;
+	int error;
+
+	memset(&p, 0, sizeof(p));
+	p.func = func;
+	p.state_p = state_p;
+	p.depth = depth;
+	p.result = XXH_OK;
+
+	block = ALLOCV(bufs_tmp, (size_t)depth * (_PIPELINE_BUFFER_SIZE + sizeof(size_t)) +
+			_PIPELINE_ALIGNMENT);
+	p.bufs = (unsigned char *)(((uintptr_t)block + _PIPELINE_ALIGNMENT - 1) &
+			~(uintptr_t)(_PIPELINE_ALIGNMENT - 1));
+	p.lens = (size_t *)(p.bufs + (size_t)depth * _PIPELINE_BUFFER_SIZE);
+
+	p.fd = -1;
+
+	#ifdef O_DIRECT
+	if (bypass && (p.fd = _open_file(path, O_RDONLY | O_DIRECT)) >= 0)
+		p.direct = 1;
+	#endif
+
+	if (p.fd < 0) {
+		if ((p.fd = _open_file(path, O_RDONLY)) < 0) {
+			ALLOCV_END(bufs_tmp);
+			rb_sys_fail_str(path);
+		}
+
+		p.dontneed = bypass;
+	}
+
+	if ((error = _check_regular_fd(p.fd)) != 0) {
+		close(p.fd);
+		ALLOCV_END(bufs_tmp);
+		rb_syserr_fail_str(error, path);
+	}
+
+	pthread_mutex_init(&p.mutex, NULL);
+	pthread_cond_init(&p.cond, NULL);
+	rb_ensure(_pipeline_body, (VALUE)&p, _pipeline_ensure, (VALUE)&p);
+	ALLOCV_END(bufs_tmp);
+
+	if (p.result != XXH_OK)
+		rb_raise(rb_eRuntimeError, "Failed to update state.");
+
+	if (p.error != 0)
+		rb_syserr_fail_str(p.error, path);
+}
+#else
+struct _update_io_args {
+	VALUE io;
+	void *state_p;
+	_update_func_t func;
+};
+
+static VALUE _update_io_body(VALUE ptr)
+{
+	struct _update_io_args *args = (struct _update_io_args *)ptr;
+	VALUE read_args[2], ret;
+
+	read_args[0] = INT2FIX(_READ_CHUNK_SIZE);
+	read_args[1] = rb_str_buf_new(_READ_CHUNK_SIZE);
+
+	while (! NIL_P(ret = rb_funcallv(args->io, _id_read, 2, read_args))) {
+		StringValue(ret);
+
+		if (args->func(args->state_p, RSTRING_PTR(ret), RSTRING_LEN(ret)) != XXH_OK)
+			rb_raise(rb_eRuntimeError, "Failed to update state.");
+
+		RB_GC_GUARD(ret);
+	}
+
+	return Qnil;
+}
+
+static VALUE _update_io_ensure(VALUE io)
+{
+	return rb_funcall(io, _id_close, 0);
+}
+#endif
+
+/*
+ * Parses the arguments of #file and feeds the file to the state.
+ */
+static void _update_file(int argc, VALUE *argv, void *state_p, _update_func_t func)
+{
+	ID keywords[2];
+	VALUE path, opts, values[2];
+	int depth = _PIPELINE_DEFAULT_DEPTH, bypass = 0;
+	#if ! defined(HAVE_PTHREAD_CREATE) || ! defined(HAVE_PREAD)
+	struct _update_io_args args;
+	#endif
+
+	keywords[0] = _id_read_ahead;
+	keywords[1] = _id_cache;
+
+	rb_scan_args(argc, argv, "1:", &path, &opts);
+	values[0] = values[1] = Qundef;
+
+	if (! NIL_P(opts))
+		rb_get_kwargs(opts, keywords, 0, 2, values);
+
+	if (values[0] != Qundef && ! NIL_P(values[0]) && (depth = NUM2INT(values[0])) <= 0)
+		rb_raise(rb_eArgError, "Read-ahead depth needs to be greater than 0.");
+
+	if (values[1] == ID2SYM(_id_bypass))
+		bypass = 1;
+	else if (values[1] != Qundef && ! NIL_P(values[1]))
+		rb_raise(rb_eArgError, "Invalid cache mode.");
+
+	FilePathValue(path);
+
+	#if defined(HAVE_PTHREAD_CREATE) && defined(HAVE_PREAD)
+	_update_file_pipelined(path, state_p, func, depth, bypass);
+	#else
+	(void)depth;
+	(void)bypass;
+	args.io = rb_file_open_str(path, "rb");
+	args.state_p = state_p;
+	args.func = func;
+	rb_ensure(_update_io_body, (VALUE)&args, _update_io_ensure, args.io);
+	#endif
+}
+
+struct _busy_update_args {
+	void (*update)(int, VALUE *, void *, _update_func_t);
+	int *busy_p;
+	int argc;
+	VALUE *argv;
+	void *state_p;
+	_update_func_t func;
+};
+
+static VALUE _busy_update_body(VALUE ptr)
+{
+	struct _busy_update_args *args = (struct _busy_update_args *)ptr;
+	args->update(args->argc, args->argv, args->state_p, args->func);
+	return Qnil;
+}
+
+static VALUE _busy_update_ensure(VALUE ptr)
+{
+	*((struct _busy_update_args *)ptr)->busy_p = 0;
+	return Qnil;
+}
+
+/*
+ * Runs +update+ on +state_p+ with *busy_p set, so that methods changing or
+ * freeing the state raise instead while the GVL is released.
+ */
+static void _busy_update(int *busy_p, void (*update)(int, VALUE *, void *, _update_func_t),
+		int argc, VALUE *argv, void *state_p, _update_func_t func)
+{
+	struct _busy_update_args args;
+
+	_check_idle(*busy_p);
+	args.update = update;
+	args.busy_p = busy_p;
+	args.argc = argc;
+	args.argv = argv;
+	args.state_p = state_p;
+	args.func = func;
+	*busy_p = 1;
+	rb_ensure(_busy_update_body, (VALUE)&args, _busy_update_ensure, (VALUE)&args);
+}
+
+/*
+ * Runs +update+ on an XXH3 state, then hibernates it if needed.
+ */
+static void _xxh3_update(struct _xxh3_data *data_p, void (*update)(int, VALUE *, void *, _update_func_t),
+		int argc, VALUE *argv, _update_func_t func)
+{
+	_busy_update(&data_p->busy, update, argc, argv, data_p->state_p, func);
+
+	if (data_p->auto_hibernate)
+		_xxh3_hibernate(data_p);
+}
+
+/*
+ * Algorithms
+ *
+ * These describe each algorithm's state so that functions working with any
+ * of them, like Digest::XXHash::Prefix, can be shared.
+ */
+
+union _any_state {
+	XXH32_state_t xxh32;
+	XXH64_state_t xxh64;
+	XXH3_state_t xxh3;
+};
+
+struct _algo {
+	const char *name;
+	size_t state_size;
+	size_t digest_size;
+	void *(*create_state)(void);
+	void (*free_state)(void *);
+	XXH_errorcode (*reset)(void *, XXH64_hash_t);
+	_update_func_t update;
+	void (*finish)(void *, unsigned char *);
+	VALUE (*ifinish)(void *);
+	void (*oneshot)(const void *, size_t, XXH64_hash_t, unsigned char *);
+};
+
+static void *_xxh32_create_state_func(void)
+{
+	return XXH32_createState();
+}
+
+static void *_xxh64_create_state_func(void)
+{
+	return XXH64_createState();
+}
+
+static void *_xxh3_create_state_func(void)
+{
+	return XXH3_createState();
+}
+
+static void _xxh32_free_state_func(void *state_p)
+{
+	XXH32_freeState((XXH32_state_t *)state_p);
+}
+
+static void _xxh64_free_state_func(void *state_p)
+{
+	XXH64_freeState((XXH64_state_t *)state_p);
+}
+
+static void _xxh3_free_state_func(void *state_p)
+{
+	XXH3_freeState((XXH3_state_t *)state_p);
+}
+
+static XXH_errorcode _xxh32_reset_func(void *state_p, XXH64_hash_t seed)
+{
+	return XXH32_reset((XXH32_state_t *)state_p, (XXH32_hash_t)seed);
+}
+
+static XXH_errorcode _xxh64_reset_func(void *state_p, XXH64_hash_t seed)
+{
+	return XXH64_reset((XXH64_state_t *)state_p, seed);
+}
+
+static XXH_errorcode _xxh3_64bits_reset_func(void *state_p, XXH64_hash_t seed)
+{
+	return XXH3_64bits_reset_withSeed((XXH3_state_t *)state_p, seed);
+}
+
+static XXH_errorcode _xxh3_128bits_reset_func(void *state_p, XXH64_hash_t seed)
+{
+	return XXH3_128bits_reset_withSeed((XXH3_state_t *)state_p, seed);
+}
+
+static void _xxh32_finish_func(void *state_p, unsigned char *digest)
+{
+	XXH32_canonicalFromHash((XXH32_canonical_t *)digest, XXH32_digest((XXH32_state_t *)state_p));
+}
+
+static void _xxh64_finish_func(void *state_p, unsigned char *digest)
+{
+	XXH64_canonicalFromHash((XXH64_canonical_t *)digest, XXH64_digest((XXH64_state_t *)state_p));
+}
+
+static void _xxh3_64bits_finish_func(void *state_p, unsigned char *digest)
+{
+	XXH64_canonicalFromHash((XXH64_canonical_t *)digest,
+			XXH3_64bits_digest((XXH3_state_t *)state_p));
+}
+
+static void _xxh3_128bits_finish_func(void *state_p, unsigned char *digest)
+{
+	XXH128_canonicalFromHash((XXH128_canonical_t *)digest,
+			XXH3_128bits_digest((XXH3_state_t *)state_p));
+}
+
+static VALUE _xxh32_ifinish_func(void *state_p)
+{
+	return ULONG2NUM(XXH32_digest((XXH32_state_t *)state_p));
+}
+
+static VALUE _xxh64_ifinish_func(void *state_p)
+{
+	return ULL2NUM(XXH64_digest((XXH64_state_t *)state_p));
+}
+
+static VALUE _xxh3_64bits_ifinish_func(void *state_p)
+{
+	return ULL2NUM(XXH3_64bits_digest((XXH3_state_t *)state_p));
+}
+
+static VALUE _xxh3_128bits_ifinish_func(void *state_p)
+{
+	return _xxh128_hash_to_num(XXH3_128bits_digest((XXH3_state_t *)state_p));
+}
+
+static void _xxh32_oneshot_func(const void *input, size_t len, XXH64_hash_t seed,
+		unsigned char *digest)
+{
+	XXH32_canonicalFromHash((XXH32_canonical_t *)digest,
+			XXH32(input, len, (XXH32_hash_t)seed));
+}
+
+static void _xxh64_oneshot_func(const void *input, size_t len, XXH64_hash_t seed,
+		unsigned char *digest)
+{
+	XXH64_canonicalFromHash((XXH64_canonical_t *)digest, XXH64(input, len, seed));
+}
+
+static void _xxh3_64bits_oneshot_func(const void *input, size_t len, XXH64_hash_t seed,
+		unsigned char *digest)
+{
+	XXH64_canonicalFromHash((XXH64_canonical_t *)digest, XXH3_64bits_withSeed(input, len, seed));
+}
+
+static void _xxh3_128bits_oneshot_func(const void *input, size_t len, XXH64_hash_t seed,
+		unsigned char *digest)
+{
+	XXH128_canonicalFromHash((XXH128_canonical_t *)digest,
+			XXH3_128bits_withSeed(input, len, seed));
+}
+
+static const struct _algo _xxh32_algo = {
+	"xxh32", sizeof(XXH32_state_t), _XXH32_DIGEST_SIZE,
+	_xxh32_create_state_func, _xxh32_free_state_func, _xxh32_reset_func,
+	_xxh32_update_func, _xxh32_finish_func, _xxh32_ifinish_func,
+	_xxh32_oneshot_func
+};
+
+static const struct _algo _xxh64_algo = {
+	"xxh64", sizeof(XXH64_state_t), _XXH64_DIGEST_SIZE,
+	_xxh64_create_state_func, _xxh64_free_state_func, _xxh64_reset_func,
+	_xxh64_update_func, _xxh64_finish_func, _xxh64_ifinish_func,
+	_xxh64_oneshot_func
+};
+
+static const struct _algo _xxh3_64bits_algo = {
+	"xxh3_64bits", sizeof(XXH3_state_t), _XXH3_64BITS_DIGEST_SIZE,
+	_xxh3_create_state_func, _xxh3_free_state_func, _xxh3_64bits_reset_func,
+	_xxh3_64bits_update_func, _xxh3_64bits_finish_func, _xxh3_64bits_ifinish_func,
+	_xxh3_64bits_oneshot_func
+};
+
+static const struct _algo _xxh3_128bits_algo = {
+	"xxh3_128bits", sizeof(XXH3_state_t), _XXH3_128BITS_DIGEST_SIZE,
+	_xxh3_create_state_func, _xxh3_free_state_func, _xxh3_128bits_reset_func,
+	_xxh3_128bits_update_func, _xxh3_128bits_finish_func, _xxh3_128bits_ifinish_func,
+	_xxh3_128bits_oneshot_func
+};
+
+/*
+ * Converts a canonical digest to a number.
+ */
+static VALUE _digest_to_num(const struct _algo *algo, const unsigned char *digest)
+{
+	switch (algo->digest_size) {
+	case 4:
+		return ULONG2NUM(XXH_readBE32(digest));
+	case 8:
+		return ULL2NUM(XXH_readBE64(digest));
+	default:
+		return _xxh128_hash_to_num(XXH128_hashFromCanonical((const XXH128_canonical_t *)digest));
+	}
+}
+
+/*
+ * Document-class: Digest::XXHash::Prefix
+ *
+ * A frozen snapshot of a hash state, created with #freeze_prefix.
+ *
+ * It's meant for hashing many messages that begin with the same data.  Each
+ * suffix is hashed from a copy of the captured state made in the stack, so no
+ * hash instance is created per message, and the prefix isn't hashed again.
+ *
+ *     prefix = Digest::XXH3_64bits.new(seed).update(namespace).freeze_prefix
+ *     prefix.idigest_suffix(id) == Digest::XXH3_64bits.idigest(namespace + id, seed)
+ *     => true
+ *
+ * Prefixes are immutable, so they can also be shared between Ractors.
+ */
+
+struct _prefix {
+	const struct _algo *algo;
+	void *state_p;
+	unsigned char *secret;
+};
+
+static void _prefix_free(void *ptr)
+{
+	struct _prefix *prefix_p = (struct _prefix *)ptr;
+
+	if (prefix_p->state_p != NULL)
+		prefix_p->algo->free_state(prefix_p->state_p);
+
+	xfree(prefix_p->secret);
+	xfree(prefix_p);
+}
+
+static struct _prefix *_get_prefix(VALUE self)
+{
+	struct _prefix *prefix_p;
+	TypedData_Get_Struct(self, struct _prefix, &_prefix_data_type, prefix_p);
+	return prefix_p;
+}
+
+/*
+ * Creates a prefix object from a copy of a state.  +secret+ is the private
+ * copy of the custom secret of an XXH3 state, which is copied as well.
+ */
+static VALUE _new_prefix(const struct _algo *algo, const void *state_p,
+		const unsigned char *secret, size_t secret_size)
+{
+	struct _prefix *prefix_p;
+	VALUE prefix = TypedData_Make_Struct(_Digest_XXHash_Prefix, struct _prefix,
+			&_prefix_data_type, prefix_p);
+
+	prefix_p->algo = algo;
+
+	if ((prefix_p->state_p = algo->create_state()) == NULL)
+		rb_raise(rb_eNoMemError, "Failed to allocate state.");
+
+	memcpy(prefix_p->state_p, state_p, algo->state_size);
+
+	if (secret != NULL && ((const XXH3_state_t *)state_p)->extSecret == secret) {
+		prefix_p->secret = ALLOC_N(unsigned char, secret_size);
+		memcpy(prefix_p->secret, secret, secret_size);
+		((XXH3_state_t *)prefix_p->state_p)->extSecret = prefix_p->secret;
+	}
+
+	return rb_obj_freeze(prefix);
+}
+
+/*
+ * Hashes +str+ from a copy of the prefix's state stored in +state_p+.
+ */
+static void _prefix_hash_suffix(struct _prefix *prefix_p, VALUE str, union _any_state *state_p)
+{
+	memcpy(state_p, prefix_p->state_p, prefix_p->algo->state_size);
+
+	if (prefix_p->algo->update(state_p, RSTRING_PTR(str), RSTRING_LEN(str)) != XXH_OK)
+		rb_raise(rb_eRuntimeError, "Failed to update state.");
+}
+
+static void _check_suffixes(VALUE suffixes)
+{
+	long i;
+
+	Check_Type(suffixes, T_ARRAY);
+
+	for (i = 0; i < RARRAY_LEN(suffixes); ++i) {
+		if (TYPE(RARRAY_AREF(suffixes, i)) != T_STRING)
+			rb_raise(rb_eTypeError, "Suffixes need to be strings.");
+	}
+}
+
+/*
+ * call-seq: digest_suffix(str) -> str
+ *
+ * Returns the digest of the prefix followed by +str+.
+ */
+static VALUE _Digest_XXHash_Prefix_digest_suffix(VALUE self, VALUE str)
+{
+	struct _prefix *prefix_p = _get_prefix(self);
+	union _any_state state;
+	VALUE digest;
+
+	StringValue(str);
+	_prefix_hash_suffix(prefix_p, str, &state);
+	digest = rb_usascii_str_new(0, prefix_p->algo->digest_size);
+	prefix_p->algo->finish(&state, _RSTRING_PTR_U(digest));
+	return digest;
+}
+
+/*
+ * call-seq: hexdigest_suffix(str) -> hex_str
+ *
+ * Same as #digest_suffix but returns the digest value in hex form.
+ */
+static VALUE _Digest_XXHash_Prefix_hexdigest_suffix(VALUE self, VALUE str)
+{
+	return _hex_encode_str(_Digest_XXHash_Prefix_digest_suffix(self, str));
+}
+
+/*
+ * call-seq: idigest_suffix(str) -> num
+ *
+ * Same as #digest_suffix but returns the digest value in numerical form.
+ *
+ * This doesn't allocate any object unless the number is too large to be a
+ * Fixnum.
+ */
+static VALUE _Digest_XXHash_Prefix_idigest_suffix(VALUE self, VALUE str)
+{
+	struct _prefix *prefix_p = _get_prefix(self);
+	union _any_state state;
+
+	StringValue(str);
+	_prefix_hash_suffix(prefix_p, str, &state);
+	return prefix_p->algo->ifinish(&state);
+}
+
+/*
+ * call-seq: digest_suffixes(array) -> str
+ *
+ * Returns the digests of the prefix followed by each string in +array+,
+ * packed into a single string.
+ *
+ * Each digest is #digest_length bytes long, and is in the same form as the
+ * one returned by #digest_suffix.
+ */
+static VALUE _Digest_XXHash_Prefix_digest_suffixes(VALUE self, VALUE suffixes)
+{
+	struct _prefix *prefix_p = _get_prefix(self);
+	size_t digest_size = prefix_p->algo->digest_size;
+	union _any_state state;
+	unsigned char *out;
+	VALUE digests;
+	long i, n;
+
+	_check_suffixes(suffixes);
+	n = RARRAY_LEN(suffixes);
+	digests = rb_usascii_str_new(0, n * digest_size);
+	out = _RSTRING_PTR_U(digests);
+
+	for (i = 0; i < n; ++i) {
+		_prefix_hash_suffix(prefix_p, RARRAY_AREF(suffixes, i), &state);
+		prefix_p->algo->finish(&state, out + i * digest_size);
+	}
+
+	return digests;
+}
+
+/*
+ * call-seq: idigest_suffixes(array) -> array
+ *
+ * Same as #digest_suffixes but returns the digest values as an array of
+ * numbers.
+ */
+static VALUE _Digest_XXHash_Prefix_idigest_suffixes(VALUE self, VALUE suffixes)
+{
+	struct _prefix *prefix_p = _get_prefix(self);
+	union _any_state state;
+	VALUE result;
+	long i, n;
+
+	_check_suffixes(suffixes);
+	n = RARRAY_LEN(suffixes);
+	result = rb_ary_new_capa(n);
+
+	for (i = 0; i < n; ++i) {
+		_prefix_hash_suffix(prefix_p, RARRAY_AREF(suffixes, i), &state);
+		rb_ary_push(result, prefix_p->algo->ifinish(&state));
+	}
+
+	return result;
+}
+
+/*
+ * call-seq: digest_length -> int
+ *
+ * Returns the length of the digests in bytes.
+ */
+static VALUE _Digest_XXHash_Prefix_digest_length(VALUE self)
+{
+	return INT2FIX(_get_prefix(self)->algo->digest_size);
+}
+
+/*
+ * Document-class: Digest::XXHash::Streams
+ *
+ * Keeps many independent hash states of one algorithm in a single
+ * contiguous array, like one per partition or per shard.
+ *
+ *     streams = Digest::XXH64::Streams.new(64, seed: 1234)
+ *     streams.update(partition, message)
+ *     streams.digests # => packed digests of all streams
+ *
+ * The states are aligned to cache lines, and no object or separate
+ * allocation is needed per stream.
+ *
+ * Use Digest::XXH32::Streams, Digest::XXH64::Streams,
+ * Digest::XXH3_64bits::Streams, or Digest::XXH3_128bits::Streams.
+ */
+
+#define _CACHE_LINE_SIZE 64
+
+struct _streams {
+	const struct _algo *algo;
+	void *block;
+	unsigned char *states;
+	size_t count;
+	size_t stride;
+	XXH64_hash_t seed;
+	int busy;
+};
+
+static void _streams_free(void *ptr)
+{
+	struct _streams *streams_p = (struct _streams *)ptr;
+	xfree(streams_p->block);
+	xfree(streams_p);
+}
+
+static size_t _streams_memsize(const void *ptr)
+{
+	const struct _streams *streams_p = (const struct _streams *)ptr;
+	size_t size = sizeof *streams_p;
+
+	if (streams_p->block != NULL)
+		size += streams_p->count * streams_p->stride + _CACHE_LINE_SIZE - 1;
+
+	return size;
+}
+
+static struct _streams *_get_streams(VALUE self)
+{
+	struct _streams *streams_p;
+	TypedData_Get_Struct(self, struct _streams, &_streams_data_type, streams_p);
+
+	if (streams_p->block == NULL)
+		rb_raise(rb_eRuntimeError, "Streams object is not initialized.");
+
+	return streams_p;
+}
+
+static VALUE _streams_allocate(VALUE klass, const struct _algo *algo)
+{
+	struct _streams *streams_p;
+	VALUE streams = TypedData_Make_Struct(klass, struct _streams, &_streams_data_type, streams_p);
+	streams_p->algo = algo;
+	return streams;
+}
+
+static void *_get_stream(struct _streams *streams_p, size_t i)
+{
+	return streams_p->states + i * streams_p->stride;
+}
+
+static size_t _get_stream_index(struct _streams *streams_p, VALUE index)
+{
+	long i = NUM2LONG(index);
+
+	if (i < 0)
+		i += streams_p->count;
+
+	if (i < 0 || (size_t)i >= streams_p->count)
+		rb_raise(rb_eIndexError, "Stream index %ld is out of range.", NUM2LONG(index));
+
+	return (size_t)i;
+}
+
+static void _reset_stream(struct _streams *streams_p, size_t i)
+{
+	if (streams_p->algo->reset(_get_stream(streams_p, i), streams_p->seed) != XXH_OK)
+		rb_raise(rb_eRuntimeError, "Failed to reset state.");
+}
+
+static VALUE _Digest_XXHash_Streams_internal_allocate(VALUE klass)
+{
+	rb_raise(rb_eRuntimeError, "Digest::XXHash::Streams is an incomplete class and cannot be "
+			"instantiated.");
+}
+
+static VALUE _Digest_XXH32_Streams_internal_allocate(VALUE klass)
+{
+	return _streams_allocate(klass, &_xxh32_algo);
+}
+
+static VALUE _Digest_XXH64_Streams_internal_allocate(VALUE klass)
+{
+	return _streams_allocate(klass, &_xxh64_algo);
+}
+
+static VALUE _Digest_XXH3_64bits_Streams_internal_allocate(VALUE klass)
+{
+	return _streams_allocate(klass, &_xxh3_64bits_algo);
+}
+
+static VALUE _Digest_XXH3_128bits_Streams_internal_allocate(VALUE klass)
+{
+	return _streams_allocate(klass, &_xxh3_128bits_algo);
+}
+
+/*
+ * call-seq: new(count, seed: 0) -> streams
+ *
+ * Returns a new object holding +count+ streams, each reset with +seed+.
+ *
+ * +seed+ needs to be a number.  For XXH32 streams it needs to fit in 32 bits.
+ */
+static VALUE _Digest_XXHash_Streams_initialize(int argc, VALUE* argv, VALUE self)
+{
+	ID keywords[1];
+	VALUE count_arg, opts, seed = Qundef;
+	struct _streams *streams_p;
+	long count;
+	size_t i;
+
+	keywords[0] = _id_seed;
+	rb_scan_args(argc, argv, "1:", &count_arg, &opts);
+
+	if (! NIL_P(opts))
+		rb_get_kwargs(opts, keywords, 0, 1, &seed);
+
+	if ((count = NUM2LONG(count_arg)) <= 0)
+		rb_raise(rb_eArgError, "Number of streams needs to be greater than 0.");
+
+	TypedData_Get_Struct(self, struct _streams, &_streams_data_type, streams_p);
+
+	if (streams_p->block != NULL)
+		rb_raise(rb_eRuntimeError, "Streams object is already initialized.");
+
+	if (seed == Qundef)
+		streams_p->seed = 0;
+	else if (streams_p->algo == &_xxh32_algo)
+		streams_p->seed = NUM2UINT(seed);
+	else
+		streams_p->seed = NUM2ULL(seed);
+	streams_p->stride = (streams_p->algo->state_size + _CACHE_LINE_SIZE - 1) &
+			~(size_t)(_CACHE_LINE_SIZE - 1);
+
+	if ((size_t)count > (SIZE_MAX - _CACHE_LINE_SIZE) / streams_p->stride)
+		rb_raise(rb_eArgError, "Number of streams is too large.");
+
+	streams_p->block = xcalloc(1, count * streams_p->stride + _CACHE_LINE_SIZE - 1);
+	streams_p->states = (unsigned char *)(((uintptr_t)streams_p->block + _CACHE_LINE_SIZE - 1) &
+			~(uintptr_t)(_CACHE_LINE_SIZE - 1));
+	streams_p->count = count;
+
+	for (i = 0; i < streams_p->count; ++i)
+		_reset_stream(streams_p, i);
+
+	return self;
+}
+
+/*
+ * call-seq:
+ *     update(index, str) -> self
+ *     update(index, str_or_buffer, offset: 0, length: nil) -> self
+ *
+ * Updates the stream at +index+.  Accepts the same kinds of data and options
+ * as Digest::XXH64#update.
+ */
+static VALUE _Digest_XXHash_Streams_update(int argc, VALUE* argv, VALUE self)
+{
+	struct _streams *streams_p = _get_streams(self);
+	size_t i;
+
+	rb_check_arity(argc, 2, 3);
+	i = _get_stream_index(streams_p, argv[0]);
+	_busy_update(&streams_p->busy, _update_state, argc - 1, argv + 1, _get_stream(streams_p, i),
+			streams_p->algo->update);
+	return self;
+}
+
+/*
+ * call-seq: update_batch(indices, strings) -> self
+ *
+ * Updates the stream at each index in +indices+ with the string at the same
+ * position in +strings+, in a single call.
+ *
+ * All indices and strings are checked first, so no stream is updated if any
+ * of them is invalid.
+ */
+static VALUE _Digest_XXHash_Streams_update_batch(VALUE self, VALUE indices, VALUE strings)
+{
+	struct _streams *streams_p = _get_streams(self);
+	VALUE tmp;
+	size_t *index_p;
+	long i, n;
+
+	Check_Type(indices, T_ARRAY);
+	Check_Type(strings, T_ARRAY);
+
+	if ((n = RARRAY_LEN(indices)) != RARRAY_LEN(strings))
+		rb_raise(rb_eArgError, "Number of indices and strings don't match.");
+
+	/* Index conversions can run Ruby code, so work on private copies. */
+	indices = rb_ary_subseq(indices, 0, n);
+	strings = rb_ary_subseq(strings, 0, n);
+	index_p = ALLOCV_N(size_t, tmp, n);
+
+	for (i = 0; i < n; ++i) {
+		if (TYPE(RARRAY_AREF(strings, i)) != T_STRING) {
+			ALLOCV_END(tmp);
+			rb_raise(rb_eTypeError, "Batch data needs to be strings.");
+		}
+	}
+
+	for (i = 0; i < n; ++i)
+		index_p[i] = _get_stream_index(streams_p, RARRAY_AREF(indices, i));
+
+	if (streams_p->busy) {
+		ALLOCV_END(tmp);
+		_check_idle(streams_p->busy);
+	}
+
+	for (i = 0; i < n; ++i) {
+		VALUE str = RARRAY_AREF(strings, i);
+
+		if (streams_p->algo->update(_get_stream(streams_p, index_p[i]), RSTRING_PTR(str),
+				RSTRING_LEN(str)) != XXH_OK) {
+			ALLOCV_END(tmp);
+			rb_raise(rb_eRuntimeError, "Failed to update state.");
+		}
+	}
+
+	ALLOCV_END(tmp);
+	return self;
+}
+
+/*
+ * call-seq: reset(index = nil) -> self
+ *
+ * Resets the stream at +index+, or all streams if +index+ isn't given.
+ */
+static VALUE _Digest_XXHash_Streams_reset(int argc, VALUE* argv, VALUE self)
+{
+	struct _streams *streams_p = _get_streams(self);
+	VALUE index;
+	size_t i;
+
+	if (rb_scan_args(argc, argv, "01", &index) > 0 && ! NIL_P(index)) {
+		i = _get_stream_index(streams_p, index);
+		_check_idle(streams_p->busy);
+		_reset_stream(streams_p, i);
+	} else {
+		_check_idle(streams_p->busy);
+
+		for (i = 0; i < streams_p->count; ++i)
+			_reset_stream(streams_p, i);
+	}
+
+	return self;
+}
+
+/*
+ * call-seq: digest(index) -> str
+ *
+ * Returns the current digest of the stream at +index+.
+ */
+static VALUE _Digest_XXHash_Streams_digest(VALUE self, VALUE index)
+{
+	struct _streams *streams_p = _get_streams(self);
+	VALUE digest = rb_usascii_str_new(0, streams_p->algo->digest_size);
+	streams_p->algo->finish(_get_stream(streams_p, _get_stream_index(streams_p, index)),
+			_RSTRING_PTR_U(digest));
+	return digest;
+}
+
+/*
+ * call-seq: hexdigest(index) -> hex_str
+ *
+ * Same as #digest but returns the digest in hex form.
+ */
+static VALUE _Digest_XXHash_Streams_hexdigest(VALUE self, VALUE index)
+{
+	return _hex_encode_str(_Digest_XXHash_Streams_digest(self, index));
+}
+
+/*
+ * call-seq: idigest(index) -> num
+ *
+ * Same as #digest but returns the digest in numerical form.
+ */
+static VALUE _Digest_XXHash_Streams_idigest(VALUE self, VALUE index)
+{
+	struct _streams *streams_p = _get_streams(self);
+	return streams_p->algo->ifinish(_get_stream(streams_p, _get_stream_index(streams_p, index)));
+}
+
+/*
+ * call-seq: digests -> str
+ *
+ * Returns the current digests of all streams packed into a single string.
+ * Each digest is #digest_length bytes long.
+ */
+static VALUE _Digest_XXHash_Streams_digests(VALUE self)
+{
+	struct _streams *streams_p = _get_streams(self);
+	size_t digest_size = streams_p->algo->digest_size, i;
+	VALUE digests = rb_usascii_str_new(0, streams_p->count * digest_size);
+	unsigned char *out = _RSTRING_PTR_U(digests);
+
+	for (i = 0; i < streams_p->count; ++i)
+		streams_p->algo->finish(_get_stream(streams_p, i), out + i * digest_size);
+
+	return digests;
+}
+
+/*
+ * call-seq: idigests -> array
+ *
+ * Returns the current digests of all streams as an array of numbers.
+ */
+static VALUE _Digest_XXHash_Streams_idigests(VALUE self)
+{
+	struct _streams *streams_p = _get_streams(self);
+	VALUE result = rb_ary_new_capa(streams_p->count);
+	size_t i;
+
+	for (i = 0; i < streams_p->count; ++i)
+		rb_ary_push(result, streams_p->algo->ifinish(_get_stream(streams_p, i)));
+
+	return result;
+}
+
+/*
+ * call-seq: size -> int
+ *
+ * Returns the number of streams.
+ */
+static VALUE _Digest_XXHash_Streams_size(VALUE self)
+{
+	return SIZET2NUM(_get_streams(self)->count);
+}
+
+/*
+ * call-seq: digest_length -> int
+ *
+ * Returns the length of each digest in bytes.
+ */
+static VALUE _Digest_XXHash_Streams_digest_length(VALUE self)
+{
+	struct _streams *streams_p;
+	TypedData_Get_Struct(self, struct _streams, &_streams_data_type, streams_p);
+	return INT2FIX(streams_p->algo->digest_size);
+}
+
+/*
+ * Document-class: Digest::XXHash::Multi
+ *
+ * Hashes data with several algorithms in a single pass.
+ *
+ *     multi = Digest::XXHash::Multi.new(:xxh32, :xxh64, :xxh3_128)
+ *     multi.file("blob.bin").hexdigests
+ *     # => {:xxh32=>"...", :xxh64=>"...", :xxh3_128=>"..."}
+ *
+ * Data is fed to all states a slice at a time while it's still in the cache,
+ * so it's only read once from memory or from a file.
+ *
+ * Algorithms are specified with :xxh32, :xxh64, :xxh3_64bits (or :xxh3_64),
+ * and :xxh3_128bits (or :xxh3_128).  The digests are returned in a hash
+ * keyed with the same names.
+ */
+
+#define _MULTI_MAX_ALGOS 4
+
+struct _multi {
+	int count;
+	XXH64_hash_t seed;
+	ID names[_MULTI_MAX_ALGOS];
+	const struct _algo *algos[_MULTI_MAX_ALGOS];
+	void *states[_MULTI_MAX_ALGOS];
+	int busy;
+};
+
+static void _multi_free(void *ptr)
+{
+	struct _multi *multi_p = (struct _multi *)ptr;
+	int i;
+
+	for (i = 0; i < multi_p->count; ++i)
+		multi_p->algos[i]->free_state(multi_p->states[i]);
+
+	xfree(multi_p);
+}
+
+static size_t _multi_memsize(const void *ptr)
+{
+	const struct _multi *multi_p = (const struct _multi *)ptr;
+	size_t size = sizeof *multi_p;
+	int i;
+
+	for (i = 0; i < multi_p->count; ++i)
+		size += multi_p->algos[i]->state_size;
+
+	return size;
+}
+
+static struct _multi *_get_multi(VALUE self)
+{
+	struct _multi *multi_p;
+	TypedData_Get_Struct(self, struct _multi, &_multi_data_type, multi_p);
+
+	if (multi_p->count == 0)
+		rb_raise(rb_eRuntimeError, "Multi object is not initialized.");
+
+	return multi_p;
+}
+
+static const struct _algo *_get_algo_by_name(VALUE name)
+{
+	static const struct {
+		const char *name;
+		const struct _algo *algo;
+	} algos[] = {
+		{ "xxh32", &_xxh32_algo },
+		{ "xxh64", &_xxh64_algo },
+		{ "xxh3_64bits", &_xxh3_64bits_algo },
+		{ "xxh3_64", &_xxh3_64bits_algo },
+		{ "xxh3_128bits", &_xxh3_128bits_algo },
+		{ "xxh3_128", &_xxh3_128bits_algo }
+	};
+	const char *str;
+	size_t i;
+
+	if (! SYMBOL_P(name))
+		rb_raise(rb_eTypeError, "Algorithm names need to be symbols.");
+
+	str = rb_id2name(SYM2ID(name));
+
+	for (i = 0; i < sizeof algos / sizeof algos[0]; ++i) {
+		if (strcmp(str, algos[i].name) == 0)
+			return algos[i].algo;
+	}
+
+	rb_raise(rb_eArgError, "Unknown algorithm: %s", str);
+}
+
+static void _reset_multi(struct _multi *multi_p)
+{
+	int i;
+
+	for (i = 0; i < multi_p->count; ++i) {
+		if (multi_p->algos[i]->reset(multi_p->states[i], multi_p->seed) != XXH_OK)
+			rb_raise(rb_eRuntimeError, "Failed to reset state.");
+	}
+}
+
+static XXH_errorcode _multi_update_func(void *ptr, const void *input, size_t len)
+{
+	struct _multi *multi_p = (struct _multi *)ptr;
+	const char *p = (const char *)input;
+	size_t slice;
+	int i;
+
+	for (; len > 0; p += slice, len -= slice) {
+		slice = len < _MULTI_SLICE_SIZE ? len : _MULTI_SLICE_SIZE;
+
+		for (i = 0; i < multi_p->count; ++i) {
+			if (multi_p->algos[i]->update(multi_p->states[i], p, slice) != XXH_OK)
+				return XXH_ERROR;
+		}
+	}
+
+	return XXH_OK;
+}
+
+static VALUE _Digest_XXHash_Multi_internal_allocate(VALUE klass)
+{
+	struct _multi *multi_p;
+	return TypedData_Make_Struct(klass, struct _multi, &_multi_data_type, multi_p);
+}
+
+/*
+ * call-seq: new(*algorithms, seed: 0) -> multi
+ *
+ * Returns a new object hashing with each of +algorithms+.  +seed+ is used
+ * with all of them, and needs to be a number.  With :xxh32, it needs to fit
+ * in 32 bits.
+ */
+static VALUE _Digest_XXHash_Multi_initialize(int argc, VALUE* argv, VALUE self)
+{
+	ID keywords[1];
+	VALUE names, opts, seed = Qundef;
+	struct _multi *multi_p;
+	long i, j;
+
+	keywords[0] = _id_seed;
+	rb_scan_args(argc, argv, "*:", &names, &opts);
+
+	if (! NIL_P(opts))
+		rb_get_kwargs(opts, keywords, 0, 1, &seed);
+
+	if (RARRAY_LEN(names) == 0 || RARRAY_LEN(names) > _MULTI_MAX_ALGOS)
+		rb_raise(rb_eArgError, "Between 1 and %d algorithms need to be specified.",
+				_MULTI_MAX_ALGOS);
+
+	TypedData_Get_Struct(self, struct _multi, &_multi_data_type, multi_p);
+
+	if (multi_p->count != 0)
+		rb_raise(rb_eRuntimeError, "Multi object is already initialized.");
+
+	for (i = 0; i < RARRAY_LEN(names); ++i) {
+		const struct _algo *algo = _get_algo_by_name(RARRAY_AREF(names, i));
+
+		for (j = 0; j < i; ++j) {
+			if (multi_p->algos[j] == algo)
+				rb_raise(rb_eArgError, "Algorithm specified more than once: %s", algo->name);
+		}
+
+		multi_p->algos[i] = algo;
+	}
+
+	multi_p->seed = seed == Qundef ? 0 : NUM2ULL(seed);
+
+	/* Raises RangeError for seeds XXH32 would truncate. */
+	for (i = 0; i < RARRAY_LEN(names) && seed != Qundef; ++i) {
+		if (multi_p->algos[i] == &_xxh32_algo)
+			(void)NUM2UINT(seed);
+	}
+
+	for (i = 0; i < RARRAY_LEN(names); ++i) {
+		if ((multi_p->states[i] = multi_p->algos[i]->create_state()) == NULL)
+			rb_raise(rb_eNoMemError, "Failed to allocate state.");
+
+		multi_p->names[i] = SYM2ID(RARRAY_AREF(names, i));
+		multi_p->count = (int)i + 1;
+	}
+
+	_reset_multi(multi_p);
+	return self;
+}
+
+/*
+ * call-seq:
+ *     update(str) -> self
+ *     update(str_or_buffer, offset: 0, length: nil) -> self
+ *     update(str_or_buffer, progress: callable, progress_interval: 64 MiB) -> self
+ *
+ * Updates all states with the data.  Accepts the same kinds of data and
+ * options as Digest::XXH64#update.
+ */
+static VALUE _Digest_XXHash_Multi_update(int argc, VALUE* argv, VALUE self)
+{
+	struct _multi *multi_p = _get_multi(self);
+	_busy_update(&multi_p->busy, _update_state, argc, argv, multi_p, _multi_update_func);
+	return self;
+}
+
+/*
+ * call-seq: update_io(io) -> self
+ *
+ * Reads +io+ until its end and updates all states with the data.
+ */
+static VALUE _Digest_XXHash_Multi_update_io(VALUE self, VALUE io)
+{
+	struct _multi *multi_p = _get_multi(self);
+	VALUE read_args[2], ret;
+
+	_check_idle(multi_p->busy);
+	read_args[0] = INT2FIX(_READ_CHUNK_SIZE);
+	read_args[1] = rb_str_buf_new(_READ_CHUNK_SIZE);
+
+	/* Readers may return a new string instead of filling the buffer. */
+	while (! NIL_P(ret = rb_funcallv(io, _id_read, 2, read_args))) {
+		StringValue(ret);
+
+		if (_multi_update_func(multi_p, RSTRING_PTR(ret), RSTRING_LEN(ret)) != XXH_OK)
+			rb_raise(rb_eRuntimeError, "Failed to update state.");
+	}
+
+	return self;
+}
+
+/*
+ * call-seq: file(path, read_ahead: 4, cache: nil) -> self
+ *
+ * Reads the file at +path+ and updates all states with its contents.
+ * Accepts the same options as Digest::XXH64#file.
+ */
+static VALUE _Digest_XXHash_Multi_file(int argc, VALUE* argv, VALUE self)
+{
+	struct _multi *multi_p = _get_multi(self);
+	_busy_update(&multi_p->busy, _update_file, argc, argv, multi_p, _multi_update_func);
+	return self;
+}
+
+/*
+ * call-seq: reset -> self
+ *
+ * Resets all states.
+ */
+static VALUE _Digest_XXHash_Multi_reset(VALUE self)
+{
+	struct _multi *multi_p = _get_multi(self);
+	_check_idle(multi_p->busy);
+	_reset_multi(multi_p);
+	return self;
+}
+
+/*
+ * call-seq: digests -> hash
+ *
+ * Returns the current digests in a hash keyed with the algorithms' names.
+ */
+static VALUE _Digest_XXHash_Multi_digests(VALUE self)
+{
+	struct _multi *multi_p = _get_multi(self);
+	VALUE result = rb_hash_new();
+	int i;
+
+	for (i = 0; i < multi_p->count; ++i) {
+		VALUE digest = rb_usascii_str_new(0, multi_p->algos[i]->digest_size);
+		multi_p->algos[i]->finish(multi_p->states[i], _RSTRING_PTR_U(digest));
+		rb_hash_aset(result, ID2SYM(multi_p->names[i]), digest);
+	}
+
+	return result;
+}
+
+/*
+ * call-seq: hexdigests -> hash
+ *
+ * Same as #digests but returns the digests in hex form.
+ */
+static VALUE _Digest_XXHash_Multi_hexdigests(VALUE self)
+{
+	struct _multi *multi_p = _get_multi(self);
+	VALUE result = rb_hash_new();
+	int i;
+
+	for (i = 0; i < multi_p->count; ++i) {
+		VALUE digest = rb_usascii_str_new(0, multi_p->algos[i]->digest_size);
+		multi_p->algos[i]->finish(multi_p->states[i], _RSTRING_PTR_U(digest));
+		rb_hash_aset(result, ID2SYM(multi_p->names[i]), _hex_encode_str(digest));
+	}
+
+	return result;
+}
+
+/*
+ * call-seq: idigests -> hash
+ *
+ * Same as #digests but returns the digests in numerical form.
+ */
+static VALUE _Digest_XXHash_Multi_idigests(VALUE self)
+{
+	struct _multi *multi_p = _get_multi(self);
+	VALUE result = rb_hash_new();
+	int i;
+
+	for (i = 0; i < multi_p->count; ++i)
+		rb_hash_aset(result, ID2SYM(multi_p->names[i]),
+				multi_p->algos[i]->ifinish(multi_p->states[i]));
+
+	return result;
+}
+
+/*
+ * Multiple seeds
+ *
+ * Used by idigest_seeds and idigest_seeds_many, which compute the digests of
+ * the same data with many seeds in one call, like the k hashes needed by a
+ * Bloom filter or MinHash.
+ */
+
+/*
+ * Computes XXH3_64bits with each seed for an input of at most 16 bytes.
+ * The input is loaded and the length dispatched only once, and each seed then
+ * only costs the final mixing of the short-input paths of XXH3.
+ */
+static void _xxh3_64bits_short_seeds(const unsigned char *input, size_t len,
+		const XXH64_hash_t *seeds, size_t count, unsigned char *out)
+{
+	const unsigned char *secret = XXH3_kSecret;
+	XXH64_hash_t hash;
+	size_t i;
+
+	if (len > 8) {
+		XXH64_hash_t input_lo = XXH_readLE64(input);
+		XXH64_hash_t input_hi = XXH_readLE64(input + len - 8);
+		XXH64_hash_t secret1 = XXH_readLE64(secret + 24) ^ XXH_readLE64(secret + 32);
+		XXH64_hash_t secret2 = XXH_readLE64(secret + 40) ^ XXH_readLE64(secret + 48);
+
+		for (i = 0; i < count; ++i) {
+			XXH64_hash_t lo = input_lo ^ (secret1 + seeds[i]);
+			XXH64_hash_t hi = input_hi ^ (secret2 - seeds[i]);
+			hash = XXH3_avalanche(len + XXH_swap64(lo) + hi + XXH3_mul128_fold64(lo, hi));
+			XXH64_canonicalFromHash((XXH64_canonical_t *)(out + i * 8), hash);
+		}
+	} else if (len >= 4) {
+		XXH64_hash_t input64 = XXH_readLE32(input + len - 4) +
+				((XXH64_hash_t)XXH_readLE32(input) << 32);
+		XXH64_hash_t secret64 = XXH_readLE64(secret + 8) ^ XXH_readLE64(secret + 16);
+
+		for (i = 0; i < count; ++i) {
+			XXH64_hash_t seed = seeds[i] ^ ((XXH64_hash_t)XXH_swap32((XXH32_hash_t)seeds[i]) << 32);
+			hash = XXH3_rrmxmx(input64 ^ (secret64 - seed), len);
+			XXH64_canonicalFromHash((XXH64_canonical_t *)(out + i * 8), hash);
+		}
+	} else if (len > 0) {
+		XXH64_hash_t combined = ((XXH32_hash_t)input[0] << 16) |
+				((XXH32_hash_t)input[len >> 1] << 24) | input[len - 1] | ((XXH32_hash_t)len << 8);
+		XXH64_hash_t secret64 = XXH_readLE32(secret) ^ XXH_readLE32(secret + 4);
+
+		for (i = 0; i < count; ++i) {
+			hash = XXH64_avalanche(combined ^ (secret64 + seeds[i]));
+			XXH64_canonicalFromHash((XXH64_canonical_t *)(out + i * 8), hash);
+		}
+	} else {
+		XXH64_hash_t secret64 = XXH_readLE64(secret + 56) ^ XXH_readLE64(secret + 64);
+
+		for (i = 0; i < count; ++i) {
+			hash = XXH64_avalanche(seeds[i] ^ secret64);
+			XXH64_canonicalFromHash((XXH64_canonical_t *)(out + i * 8), hash);
+		}
+	}
+}
+
+static void _hash_with_seeds(const struct _algo *algo, const void *input, size_t len,
+		const XXH64_hash_t *seeds, size_t count, unsigned char *out)
+{
+	size_t i;
+
+	if (algo == &_xxh3_64bits_algo && len <= 16) {
+		_xxh3_64bits_short_seeds((const unsigned char *)input, len, seeds, count, out);
+		return;
+	}
+
+	for (i = 0; i < count; ++i)
+		algo->oneshot(input, len, seeds[i], out + i * algo->digest_size);
+}
+
+/*
+ * Converts packed digests to an array of numbers.
+ */
+static VALUE _digests_to_ary(const struct _algo *algo, const unsigned char *digests, size_t count)
+{
+	VALUE result = rb_ary_new_capa(count);
+	size_t i;
+
+	for (i = 0; i < count; ++i)
+		rb_ary_push(result, _digest_to_num(algo, digests + i * algo->digest_size));
+
+	return result;
+}
+
+static int _get_packed_opt(VALUE opts)
+{
+	ID keywords[1];
+	VALUE packed = Qundef;
+
+	keywords[0] = _id_packed;
+
+	if (! NIL_P(opts))
+		rb_get_kwargs(opts, keywords, 0, 1, &packed);
+
+	return packed != Qundef && RTEST(packed);
+}
+
+/*
+ * Converts the first +count+ seeds in +seeds_arg+, which should be a private
+ * copy since conversions can run Ruby code.  XXH32 seeds need to fit in 32
+ * bits.
+ */
+static void _get_seeds(const struct _algo *algo, VALUE seeds_arg, size_t count,
+		XXH64_hash_t *seeds)
+{
+	size_t i;
+
+	for (i = 0; i < count; ++i) {
+		if (algo == &_xxh32_algo)
+			seeds[i] = NUM2UINT(RARRAY_AREF(seeds_arg, i));
+		else
+			seeds[i] = NUM2ULL(RARRAY_AREF(seeds_arg, i));
+	}
+}
+
+static VALUE _idigest_seeds(int argc, VALUE *argv, const struct _algo *algo)
+{
+	VALUE str, seeds_arg, opts, tmp = 0, result;
+	XXH64_hash_t *seeds;
+	size_t count;
+
+	rb_scan_args(argc, argv, "2:", &str, &seeds_arg, &opts);
+	StringValue(str);
+	Check_Type(seeds_arg, T_ARRAY);
+	count = RARRAY_LEN(seeds_arg);
+	seeds_arg = rb_ary_subseq(seeds_arg, 0, count);
+	seeds = ALLOCV_N(XXH64_hash_t, tmp, count);
+	_get_seeds(algo, seeds_arg, count, seeds);
+	result = rb_usascii_str_new(0, count * algo->digest_size);
+	_hash_with_seeds(algo, RSTRING_PTR(str), RSTRING_LEN(str), seeds, count, _RSTRING_PTR_U(result));
+	ALLOCV_END(tmp);
+
+	if (! _get_packed_opt(opts))
+		result = _digests_to_ary(algo, _RSTRING_PTR_U(result), count);
+
+	return result;
+}
+
+static VALUE _idigest_seeds_many(int argc, VALUE *argv, const struct _algo *algo)
+{
+	VALUE strings, seeds_arg, opts, tmp = 0, result;
+	size_t count, row_size;
+	XXH64_hash_t *seeds;
+	unsigned char *out;
+	long i, n;
+
+	rb_scan_args(argc, argv, "2:", &strings, &seeds_arg, &opts);
+	Check_Type(strings, T_ARRAY);
+	Check_Type(seeds_arg, T_ARRAY);
+
+	/* Seed conversions can run Ruby code, so work on private copies. */
+	n = RARRAY_LEN(strings);
+	strings = rb_ary_subseq(strings, 0, n);
+	count = RARRAY_LEN(seeds_arg);
+	seeds_arg = rb_ary_subseq(seeds_arg, 0, count);
+	seeds = ALLOCV_N(XXH64_hash_t, tmp, count);
+	_get_seeds(algo, seeds_arg, count, seeds);
+
+	for (i = 0; i < n; ++i) {
+		if (TYPE(RARRAY_AREF(strings, i)) != T_STRING) {
+			ALLOCV_END(tmp);
+			rb_raise(rb_eTypeError, "Batch data needs to be strings.");
+		}
+	}
+
+	row_size = count * algo->digest_size;
+	result = rb_usascii_str_new(0, n * row_size);
+	out = _RSTRING_PTR_U(result);
+
+	for (i = 0; i < n; ++i) {
+		VALUE str = RARRAY_AREF(strings, i);
+		_hash_with_seeds(algo, RSTRING_PTR(str), RSTRING_LEN(str), seeds, count, out + i * row_size);
+	}
+
+	ALLOCV_END(tmp);
+
+	if (! _get_packed_opt(opts)) {
+		VALUE rows = rb_ary_new_capa(n);
+
+		for (i = 0; i < n; ++i)
+			rb_ary_push(rows, _digests_to_ary(algo, out + i * row_size, count));
+
+		RB_GC_GUARD(result);
+		return rows;
+	}
+
+	return result;
+}
+
+/*
+ * Batches
+ *
+ * Used by idigest_many to hash many independent strings in one call.
+ *
+ * XXH3 spends little time on each short key, and most of it waiting on the
+ * dependency chain of a single key.  Keys of 9 to 64 bytes are therefore
+ * hashed _BATCH_LANES at a time with their steps interleaved, so the work of
+ * one key can proceed while another waits, and the data of the next group
+ * is prefetched in the meantime.
+ */
+
+#define _BATCH_LANES 4
+
+/*
+ * Hashes _BATCH_LANES keys of 9 to 16 bytes.
+ */
+static void _xxh3_64bits_lanes_9to16(const unsigned char *const *ptrs, const size_t *lens,
+		XXH64_hash_t seed, XXH64_hash_t *hashes)
+{
+	const unsigned char *secret = XXH3_kSecret;
+	XXH64_hash_t bitflip1 = (XXH_readLE64(secret + 24) ^ XXH_readLE64(secret + 32)) + seed;
+	XXH64_hash_t bitflip2 = (XXH_readLE64(secret + 40) ^ XXH_readLE64(secret + 48)) - seed;
+	XXH64_hash_t lo[_BATCH_LANES], hi[_BATCH_LANES];
+	int l;
+
+	for (l = 0; l < _BATCH_LANES; ++l) {
+		lo[l] = XXH_readLE64(ptrs[l]) ^ bitflip1;
+		hi[l] = XXH_readLE64(ptrs[l] + lens[l] - 8) ^ bitflip2;
+	}
+
+	for (l = 0; l < _BATCH_LANES; ++l)
+		hashes[l] = XXH3_avalanche(lens[l] + XXH_swap64(lo[l]) + hi[l] +
+				XXH3_mul128_fold64(lo[l], hi[l]));
+}
+
+/*
+ * Hashes _BATCH_LANES keys of 17 to 64 bytes.
+ */
+static void _xxh3_64bits_lanes_17to64(const unsigned char *const *ptrs, const size_t *lens,
+		XXH64_hash_t seed, XXH64_hash_t *hashes)
+{
+	const unsigned char *secret = XXH3_kSecret;
+	XXH64_hash_t acc[_BATCH_LANES];
+	int l;
+
+	for (l = 0; l < _BATCH_LANES; ++l)
+		acc[l] = lens[l] * XXH_PRIME64_1 + XXH3_mix16B(ptrs[l], secret, seed) +
+				XXH3_mix16B(ptrs[l] + lens[l] - 16, secret + 16, seed);
+
+	for (l = 0; l < _BATCH_LANES; ++l) {
+		if (lens[l] > 32)
+			acc[l] += XXH3_mix16B(ptrs[l] + 16, secret + 32, seed) +
+					XXH3_mix16B(ptrs[l] + lens[l] - 32, secret + 48, seed);
+	}
+
+	for (l = 0; l < _BATCH_LANES; ++l)
+		hashes[l] = XXH3_avalanche(acc[l]);
+}
+
+static void _xxh3_64bits_batch(const unsigned char *const *ptrs, const size_t *lens, size_t count,
+		XXH64_hash_t seed, unsigned char *out)
+{
+	XXH64_hash_t hashes[_BATCH_LANES];
+	size_t i, j, min, max;
+	int l;
+
+	for (i = 0; i + _BATCH_LANES <= count; i += _BATCH_LANES) {
+		for (j = i + _BATCH_LANES; j < i + 2 * _BATCH_LANES && j < count; ++j)
+			XXH_PREFETCH(ptrs[j]);
+
+		min = max = lens[i];
+
+		for (l = 1; l < _BATCH_LANES; ++l) {
+			if (lens[i + l] < min)
+				min = lens[i + l];
+			else if (lens[i + l] > max)
+				max = lens[i + l];
+		}
+
+		if (min > 16 && max <= 64) {
+			_xxh3_64bits_lanes_17to64(ptrs + i, lens + i, seed, hashes);
+		} else if (min > 8 && max <= 16) {
+			_xxh3_64bits_lanes_9to16(ptrs + i, lens + i, seed, hashes);
+		} else {
+			for (l = 0; l < _BATCH_LANES; ++l)
+				hashes[l] = XXH3_64bits_withSeed(ptrs[i + l], lens[i + l], seed);
+		}
+
+		for (l = 0; l < _BATCH_LANES; ++l)
+			XXH64_canonicalFromHash((XXH64_canonical_t *)(out + (i + l) * 8), hashes[l]);
+	}
+
+	for (; i < count; ++i)
+		XXH64_canonicalFromHash((XXH64_canonical_t *)(out + i * 8),
+				XXH3_64bits_withSeed(ptrs[i], lens[i], seed));
+}
+
+/*
+ * Hashes each input with +seed+ and stores the digests in +out+.
+ */
+static void _hash_batch(const struct _algo *algo, const unsigned char *const *ptrs,
+		const size_t *lens, size_t count, XXH64_hash_t seed, unsigned char *out)
+{
+	size_t i;
+
+	if (algo == &_xxh3_64bits_algo) {
+		_xxh3_64bits_batch(ptrs, lens, count, seed, out);
+		return;
+	} else if (algo == &_xxh32_algo) {
+		multibuf_xxh32(ptrs, lens, count, (XXH32_hash_t)seed, out);
+		return;
+	} else if (algo == &_xxh64_algo) {
+		multibuf_xxh64(ptrs, lens, count, seed, out);
+		return;
+	}
+
+	for (i = 0; i < count; ++i)
+		algo->oneshot(ptrs[i], lens[i], seed, out + i * algo->digest_size);
+}
+
+static VALUE _idigest_many(int argc, VALUE *argv, const struct _algo *algo)
+{
+	VALUE strings, seed, opts, ptrs_tmp = 0, lens_tmp = 0, result;
+	const unsigned char **ptrs;
+	XXH64_hash_t seed_value;
+	size_t *lens;
+	long i, n;
+
+	rb_scan_args(argc, argv, "11:", &strings, &seed, &opts);
+	Check_Type(strings, T_ARRAY);
+
+	if (NIL_P(seed))
+		seed_value = 0;
+	else if (algo == &_xxh32_algo)
+		seed_value = NUM2UINT(seed);
+	else
+		seed_value = NUM2ULL(seed);
+
+	/*
+	 * Everything that can allocate or run Ruby code is done before the
+	 * string pointers are collected, so GC compaction can't move the strings
+	 * before they are hashed.
+	 */
+	n = RARRAY_LEN(strings);
+	result = rb_usascii_str_new(0, n * algo->digest_size);
+	ptrs = ALLOCV_N(const unsigned char *, ptrs_tmp, n);
+	lens = ALLOCV_N(size_t, lens_tmp, n);
+
+	for (i = 0; i < n; ++i) {
+		VALUE str = RARRAY_AREF(strings, i);
+
+		if (TYPE(str) != T_STRING)
+			rb_raise(rb_eTypeError, "Batch data needs to be strings.");
+
+		ptrs[i] = _RSTRING_PTR_U(str);
+		lens[i] = RSTRING_LEN(str);
+	}
+
+	_hash_batch(algo, ptrs, lens, n, seed_value, _RSTRING_PTR_U(result));
+	ALLOCV_END(ptrs_tmp);
+	ALLOCV_END(lens_tmp);
+	RB_GC_GUARD(strings);
+
+	if (! _get_packed_opt(opts))
+		result = _digests_to_ary(algo, _RSTRING_PTR_U(result), n);
+
+	return result;
+}
+
+/*
+ * Strided records
+ *
+ * Used by XXH3_64bits.hash_strided to hash fixed-width records packed in a
+ * single buffer, like a column of keys from a database driver.
+ *
+ * Every record has the same length, so the length dispatch of XXH3 is done
+ * once and each record goes straight to the short-input path matching it.
+ * These paths rely on 64x64-bit multiplies, which vectors of this width don't
+ * do any faster than the scalar units, so the loop is kept simple instead and
+ * independent records are left for the CPU to overlap.
+ */
+
+struct _strided_args {
+	const unsigned char *base;
+	size_t width;
+	size_t stride;
+	size_t count;
+	size_t done;
+	XXH64_hash_t seed;
+	unsigned char *out;
+	volatile int interrupted;
+};
+
+static void _xxh3_64bits_strided(const unsigned char *base, size_t width, size_t stride,
+		size_t count, XXH64_hash_t seed, unsigned char *out)
+{
+	size_t i;
+
+	#define _HASH_RECORDS(expr) \
+		for (i = 0; i < count; ++i, base += stride) \
+			XXH64_canonicalFromHash((XXH64_canonical_t *)(out + i * 8), expr)
+
+	if (width >= 1 && width <= 3)
+		_HASH_RECORDS(XXH3_len_1to3_64b(base, width, XXH3_kSecret, seed));
+	else if (width >= 4 && width <= 8)
+		_HASH_RECORDS(XXH3_len_4to8_64b(base, width, XXH3_kSecret, seed));
+	else if (width >= 9 && width <= 16)
+		_HASH_RECORDS(XXH3_len_9to16_64b(base, width, XXH3_kSecret, seed));
+	else if (width >= 17 && width <= 128)
+		_HASH_RECORDS(XXH3_len_17to128_64b(base, width, XXH3_kSecret, sizeof XXH3_kSecret, seed));
+	else
+		_HASH_RECORDS(XXH3_64bits_withSeed(base, width, seed));
+
+	#undef _HASH_RECORDS
+}
+
+/*
+ * Hashes records until all are done or an interrupt is requested, about
+ * _NOGVL_CHUNK_SIZE bytes of input at a time.
+ */
+static void *_strided_func(void *ptr)
+{
+	struct _strided_args *args = ptr;
+	size_t step = _NOGVL_CHUNK_SIZE / args->stride + 1, n;
+
+	while (args->done < args->count && ! args->interrupted) {
+		n = args->count - args->done < step ? args->count - args->done : step;
+		_xxh3_64bits_strided(args->base + args->done * args->stride, args->width, args->stride, n,
+				args->seed, args->out + args->done * 8);
+		args->done += n;
+	}
+
+	return NULL;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void _strided_ubf(void *ptr)
+{
+	((struct _strided_args *)ptr)->interrupted = 1;
+}
+#endif
+
+struct _strided_body_args {
+	struct _input input;
+	struct _strided_args strided;
+	VALUE result;
+};
+
+static VALUE _strided_body(VALUE ptr)
+{
+	struct _strided_body_args *args = (struct _strided_body_args *)ptr;
+
+	/* Allocated here so that the input is released if this raises */
+	args->result = rb_usascii_str_new(0, args->strided.count * 8);
+	args->strided.out = _RSTRING_PTR_U(args->result);
+
+	while (args->strided.done < args->strided.count) {
+		#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+		if (args->input.nogvl) {
+			args->strided.interrupted = 0;
+			rb_thread_call_without_gvl(_strided_func, &args->strided, _strided_ubf,
+					&args->strided);
+		} else {
+			_strided_func(&args->strided);
+		}
+		#else
+		_strided_func(&args->strided);
+		#endif
+	}
+
+	return Qnil;
+}
+
+static VALUE _strided_ensure(VALUE ptr)
+{
+	_release_input(&((struct _strided_body_args *)ptr)->input);
+	return Qnil;
+}
+
+/*
+ * Integers
+ *
+ * Used by XXH3_64bits.hash_int and its relatives to hash integers without
+ * packing each of them into a string first.  An integer is hashed as the 8
+ * bytes of its value in little-endian order, which always takes the 4 to 8
+ * byte path of XXH3.
+ */
+
+static XXH64_hash_t _xxh3_64bits_hash_u64(XXH64_hash_t value, XXH64_hash_t seed)
+{
+	unsigned char buf[8];
+	XXH_writeLE64(buf, value);
+	return XXH3_len_4to8_64b(buf, sizeof buf, XXH3_kSecret, seed);
+}
+
+static XXH64_hash_t _int_to_u64(VALUE num)
+{
+	if (! RB_INTEGER_TYPE_P(num))
+		rb_raise(rb_eTypeError, "Value needs to be an integer.");
+
+	return NUM2ULL(num);
+}
+
+static VALUE _hashes_to_result(VALUE packed_hashes, long count, VALUE opts)
+{
+	if (_get_packed_opt(opts))
+		return packed_hashes;
+
+	return _digests_to_ary(&_xxh3_64bits_algo, _RSTRING_PTR_U(packed_hashes), count);
+}
+
+/*
+ * Lines
+ *
+ * Used by XXH3_64bits.line_digests to hash each line of a string or an IO
+ * where it lies.  Separators are found with memchr, which C libraries
+ * implement with vector instructions.  Results are collected in buffers
+ * from malloc so that lines can be scanned with the GVL released.
+ */
+
+struct _lines {
+	const unsigned char *sep;
+	size_t sep_len;
+	int chomp;
+	int want_offsets;
+	unsigned char *digests;
+	unsigned char *offsets;
+	size_t count;
+	size_t capa;
+	size_t searched;
+	int no_memory;
+	volatile int interrupted;
+};
+
+static int _lines_add(struct _lines *lines, const unsigned char *line, size_t len,
+		XXH64_hash_t offset)
+{
+	if (lines->count == lines->capa) {
+		size_t capa = lines->capa == 0 ? 1024 : lines->capa * 2;
+		unsigned char *p;
+
+		if ((p = realloc(lines->digests, capa * 8)) == NULL)
+			return 0;
+
+		lines->digests = p;
+
+		if (lines->want_offsets) {
+			if ((p = realloc(lines->offsets, capa * 8)) == NULL)
+				return 0;
+
+			lines->offsets = p;
+		}
+
+		lines->capa = capa;
+	}
+
+	XXH64_canonicalFromHash((XXH64_canonical_t *)(lines->digests + lines->count * 8),
+			XXH3_64bits(line, len));
+
+	if (lines->want_offsets)
+		XXH_writeLE64(lines->offsets + lines->count * 8, offset);
+
+	++lines->count;
+	return 1;
+}
+
+/*
+ * Hashes the lines in +data+ that end with a separator, and the remaining
+ * data as the last line if +final+ is set.  +offset+ is the position of
+ * +data+ in the whole input.  Returns the number of bytes consumed, which
+ * is less than +len+ if scanning got interrupted or if the remaining data
+ * doesn't end with a separator yet.
+ */
+static size_t _lines_scan(struct _lines *lines, const unsigned char *data, size_t len,
+		size_t offset, int final)
+{
+	const unsigned char *p = data, *end = data + len, *q;
+	size_t line_len;
+
+	while (p < end && ! lines->interrupted) {
+		for (q = p + lines->searched; (q = memchr(q, lines->sep[0], end - q)); ++q) {
+			if ((size_t)(end - q) < lines->sep_len) {
+				q = NULL;
+				break;
+			}
+
+			if (memcmp(q, lines->sep, lines->sep_len) == 0)
+				break;
+		}
+
+		if (q == NULL) {
+			if (! final) {
+				line_len = end - p;
+				lines->searched = line_len < lines->sep_len ? 0 : line_len - lines->sep_len + 1;
+				break;
+			}
+
+			q = end;
+			line_len = end - p;
+		} else if (! lines->chomp) {
+			line_len = q - p + lines->sep_len;
+		} else {
+			line_len = q - p;
+
+			/* Like String#each_line, chomping a newline also removes a carriage return. */
+			if (lines->sep_len == 1 && lines->sep[0] == '\n' && line_len > 0 && q[-1] == '\r')
+				--line_len;
+		}
+
+		if (! _lines_add(lines, p, line_len, offset + (p - data))) {
+			lines->no_memory = 1;
+			break;
+		}
+
+		lines->searched = 0;
+		p = q == end ? end : q + lines->sep_len;
+	}
+
+	return p - data;
+}
+
+struct _lines_args {
+	struct _lines lines;
+	struct _input input;
+	const unsigned char *data;
+	size_t len;
+	size_t offset;
+	int final;
+	size_t done;
+	unsigned char *buf;
+	size_t buf_capa;
+	VALUE result;
+};
+
+static void *_lines_func(void *ptr)
+{
+	struct _lines_args *args = ptr;
+	args->done += _lines_scan(&args->lines, args->data + args->done, args->len - args->done,
+			args->offset + args->done, args->final);
+	return NULL;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void _lines_ubf(void *ptr)
+{
+	((struct _lines_args *)ptr)->lines.interrupted = 1;
+}
+#endif
+
+/*
+ * Scans +len+ bytes of +data+ and returns the number of bytes consumed.
+ * Pending interrupts are handled once the GVL is reacquired, and scanning
+ * resumes if they don't raise an exception.
+ */
+static size_t _lines_process(struct _lines_args *args, const unsigned char *data, size_t len,
+		size_t offset, int final, int nogvl)
+{
+	args->data = data;
+	args->len = len;
+	args->offset = offset;
+	args->final = final;
+	args->done = 0;
+
+	do {
+		args->lines.interrupted = 0;
+
+		#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+		if (nogvl)
+			rb_thread_call_without_gvl(_lines_func, args, _lines_ubf, args);
+		else
+			_lines_func(args);
+		#else
+		_lines_func(args);
+		#endif
+
+		if (args->lines.no_memory)
+			rb_raise(rb_eNoMemError, "Failed to allocate memory for line digests.");
+	} while (args->lines.interrupted);
+
+	return args->done;
+}
+
+static void _lines_set_result(struct _lines_args *args)
+{
+	struct _lines *lines = &args->lines;
+	VALUE digests = rb_usascii_str_new((const char *)lines->digests, lines->count * 8);
+
+	if (lines->want_offsets)
+		args->result = rb_assoc_new(digests,
+				rb_usascii_str_new((const char *)lines->offsets, lines->count * 8));
+	else
+		args->result = digests;
+}
+
+static VALUE _lines_str_body(VALUE ptr)
+{
+	struct _lines_args *args = (struct _lines_args *)ptr;
+	_lines_process(args, args->input.ptr, args->input.len, 0, 1, args->input.nogvl);
+	_lines_set_result(args);
+	return Qnil;
+}
+
+/*
+ * Reads +io+ in chunks into args->buf.  A line not ending within a chunk is
+ * moved to the front of the buffer and completed with the following chunks.
+ */
+static VALUE _lines_io_body(VALUE ptr)
+{
+	struct _lines_args *args = (struct _lines_args *)ptr;
+	VALUE read_args[2];
+	size_t len = 0, offset = 0, done;
+
+	read_args[0] = INT2FIX(_READ_CHUNK_SIZE);
+	read_args[1] = rb_str_buf_new(_READ_CHUNK_SIZE);
+
+	while (_read_more(args->input.holder, read_args, &args->buf, &args->buf_capa, &len)) {
+		done = _lines_process(args, args->buf, len, offset, 0, len >= _NOGVL_MIN_LENGTH);
+
+		if (done > 0) {
+			memmove(args->buf, args->buf + done, len - done);
+			len -= done;
+			offset += done;
+		}
+	}
+
+	if (len > 0)
+		_lines_process(args, args->buf, len, offset, 1, len >= _NOGVL_MIN_LENGTH);
+
+	_lines_set_result(args);
+	return Qnil;
+}
+
+static VALUE _lines_ensure(VALUE ptr)
+{
+	struct _lines_args *args = (struct _lines_args *)ptr;
+
+	_release_input(&args->input);
+	free(args->lines.digests);
+	free(args->lines.offsets);
+	free(args->buf);
+	args->lines.digests = args->lines.offsets = args->buf = NULL;
+	return Qnil;
+}
+
+/*
+ * Tree digests
+ *
+ * Used by XXH3_128bits.tree_digest to hash a buffer with several threads.
+ * The buffer is split into chunks, which are hashed in parallel, and the
+ * root digest is computed from their digests.  Each thread takes every
+ * n-th chunk, so no locking is needed, and the digests don't depend on which
+ * thread computed them.  Other users replace the function hashing a chunk,
+ * for example to read it from a file first.  With 'dynamic' set, threads
+ * claim chunks from a shared counter instead, which suits chunks of uneven
+ * cost like whole files.
+ */
+
+struct _tree;
+
+/*
+ * Hashes the +i+-th chunk of +tree+ and returns 0, or an errno value.  +buf+
+ * is a buffer of tree->buf_size bytes private to the worker.
+ */
+typedef int (*_tree_chunk_func_t)(struct _tree *tree, size_t i, unsigned char *buf);
+
+struct _tree_worker {
+	struct _tree *tree;
+	int index;
+};
+
+struct _tree {
+	const unsigned char *data;
+	size_t len;
+	size_t chunk_size;
+	size_t count;
+	unsigned char *leaves;
+	unsigned char *done;
+	int threads;
+	_tree_chunk_func_t chunk_func;
+	size_t buf_size;
+	int dynamic;
+	size_t next;
+	int fd;
+	int error;
+	volatile int interrupted;
+	#ifdef HAVE_PTHREAD_CREATE
+	pthread_t *ids;
+	#endif
+	struct _tree_worker *workers;
+};
+
+static size_t _tree_chunk_length(const struct _tree *tree, size_t i)
+{
+	size_t start = i * tree->chunk_size;
+	return tree->len - start < tree->chunk_size ? tree->len - start : tree->chunk_size;
+}
+
+static int _tree_hash_chunk(struct _tree *tree, size_t i, unsigned char *buf)
+{
+	XXH128_canonicalFromHash((XXH128_canonical_t *)(tree->leaves + i * 16),
+			XXH3_128bits(tree->data + i * tree->chunk_size, _tree_chunk_length(tree, i)));
+	return 0;
+}
+
+static void _tree_run_worker(struct _tree *tree, int index)
+{
+	unsigned char *buf = NULL;
+	size_t i;
+	int error;
+
+	if (tree->buf_size > 0 && (buf = malloc(tree->buf_size)) == NULL) {
+		tree->error = ENOMEM;
+		return;
+	}
+
+	for (i = tree->dynamic ? __atomic_fetch_add(&tree->next, 1, __ATOMIC_RELAXED) : (size_t)index;
+			i < tree->count && ! tree->interrupted && ! tree->error;
+			i = tree->dynamic ? __atomic_fetch_add(&tree->next, 1, __ATOMIC_RELAXED) : i + tree->threads) {
+		if (tree->done[i])
+			continue;
+
+		if ((error = tree->chunk_func(tree, i, buf)) != 0) {
+			tree->error = error;
+			break;
+		}
+
+		tree->done[i] = 1;
+	}
+
+	free(buf);
+}
+
+#ifdef HAVE_PTHREAD_CREATE
+static void *_tree_thread_func(void *ptr)
+{
+	struct _tree_worker *worker = ptr;
+	_tree_run_worker(worker->tree, worker->index);
+	return NULL;
+}
+#endif
+
+/*
+ * Runs the workers, with the calling thread acting as the first one.  The
+ * work of threads that fail to start is done by the calling thread.
+ */
+static void *_tree_func(void *ptr)
+{
+	struct _tree *tree = ptr;
+	int i;
+
+	#ifdef HAVE_PTHREAD_CREATE
+	for (i = 1; i < tree->threads; ++i) {
+		tree->workers[i].tree = tree;
+		tree->workers[i].index = i;
+
+		if (pthread_create(&tree->ids[i], NULL, _tree_thread_func, &tree->workers[i]) != 0)
+			tree->workers[i].tree = NULL;
+	}
+
+	_tree_run_worker(tree, 0);
+
+	for (i = 1; i < tree->threads; ++i) {
+		if (tree->workers[i].tree != NULL)
+			pthread_join(tree->ids[i], NULL);
+		else
+			_tree_run_worker(tree, i);
+	}
+	#else
+	for (i = 0; i < tree->threads; ++i)
+		_tree_run_worker(tree, i);
+	#endif
+
+	return NULL;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void _tree_ubf(void *ptr)
+{
+	((struct _tree *)ptr)->interrupted = 1;
+}
+#endif
+
+struct _tree_body_args {
+	struct _input input;
+	struct _tree tree;
+	unsigned char *digest;
+};
+
+static void _run_tree(struct _tree *tree, int nogvl)
+{
+	do {
+		tree->interrupted = 0;
+		tree->next = 0;
+
+		#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+		if (nogvl)
+			rb_thread_call_without_gvl(_tree_func, tree, _tree_ubf, tree);
+		else
+			_tree_func(tree);
+		#else
+		_tree_func(tree);
+		#endif
+	} while (tree->interrupted && ! tree->error);
+}
+
+static VALUE _tree_ensure(VALUE ptr)
+{
+	_release_input(&((struct _tree_body_args *)ptr)->input);
+	return Qnil;
+}
+
+static int _default_thread_count(void)
+{
+	#if defined(HAVE_PTHREAD_CREATE) && defined(_SC_NPROCESSORS_ONLN)
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n > 0)
+		return n > _TREE_MAX_THREADS ? _TREE_MAX_THREADS : (int)n;
+	#endif
+
+	return 1;
+}
+
+static int _get_threads_opt(VALUE value)
+{
+	int threads;
+
+	if (value == Qundef || NIL_P(value))
+		return _default_thread_count();
+
+	if ((threads = NUM2INT(value)) <= 0)
+		rb_raise(rb_eArgError, "Number of threads needs to be greater than 0.");
+
+	return threads > _TREE_MAX_THREADS ? _TREE_MAX_THREADS : threads;
+}
+
+/*
+ * Prepares +tree+ for hashing +count+ chunks of +data+ with at most +threads+
+ * threads.  The buffers need to be allocated by the caller afterwards.
+ */
+static void _init_tree(struct _tree *tree, const void *data, size_t len, size_t chunk_size,
+		size_t count, int threads)
+{
+	tree->data = data;
+	tree->len = len;
+	tree->chunk_size = chunk_size;
+	tree->count = count;
+	tree->threads = count == 0 ? 1 : (size_t)threads > count ? (int)count : threads;
+	tree->chunk_func = _tree_hash_chunk;
+	tree->buf_size = 0;
+	tree->dynamic = 0;
+	tree->next = 0;
+	tree->fd = -1;
+	tree->error = 0;
+}
+
+/*
+ * Returns the size of the buffer needed by _set_tree_work.
+ */
+static size_t _tree_work_size(const struct _tree *tree)
+{
+	size_t size = tree->threads * sizeof(struct _tree_worker) + tree->count;
+
+	#ifdef HAVE_PTHREAD_CREATE
+	size += tree->threads * sizeof(pthread_t);
+	#endif
+
+	return size;
+}
+
+/*
+ * Lays out the workers, the thread IDs and the completion flags of +tree+
+ * in +buf+.
+ */
+static void _set_tree_work(struct _tree *tree, void *buf)
+{
+	unsigned char *p = buf;
+
+	tree->workers = (struct _tree_worker *)p;
+	p += tree->threads * sizeof(struct _tree_worker);
+	#ifdef HAVE_PTHREAD_CREATE
+	tree->ids = (pthread_t *)p;
+	p += tree->threads * sizeof(pthread_t);
+	#endif
+	tree->done = p;
+	memset(tree->done, 0, tree->count);
+}
+
+/*
+ * Computes the root digest from the header and the chunk digests.
+ */
+static void _tree_root(const struct _tree *tree, unsigned char *digest)
+{
+	unsigned char header[24] = { 'X', 'X', 'H', 'T', _TREE_VERSION };
+	XXH3_state_t state;
+
+	XXH_writeLE64(header + 8, tree->chunk_size);
+	XXH_writeLE64(header + 16, tree->len);
+	XXH3_128bits_reset(&state);
+	XXH3_128bits_update(&state, header, sizeof header);
+	XXH3_128bits_update(&state, tree->leaves, tree->count * 16);
+	XXH128_canonicalFromHash((XXH128_canonical_t *)digest, XXH3_128bits_digest(&state));
+}
+
+/*
+ * Allocates the buffers of args->tree, which may be large, here so that the
+ * input is released if that fails, and stores the root digest in
+ * args->digest.
+ */
+static VALUE _tree_body(VALUE ptr)
+{
+	struct _tree_body_args *args = (struct _tree_body_args *)ptr;
+	VALUE leaves_tmp = 0, work_tmp = 0;
+
+	args->tree.leaves = ALLOCV_N(unsigned char, leaves_tmp, args->tree.count * 16);
+	_set_tree_work(&args->tree, ALLOCV(work_tmp, _tree_work_size(&args->tree)));
+	_run_tree(&args->tree, args->input.nogvl);
+	_tree_root(&args->tree, args->digest);
+	ALLOCV_END(leaves_tmp);
+	ALLOCV_END(work_tmp);
+	return Qnil;
+}
+
+/*
+ * Merkle manifests
+ *
+ * A manifest consists of a 32-byte header followed by the nodes of the tree,
+ * one level after another, starting with the chunk digests and ending with
+ * the root.  The header consists of "XXHM", the version number as a byte,
+ * three zero bytes, and the chunk size, the file size and the number of
+ * chunks as 64-bit little-endian integers.
+ *
+ * A chunk's node is its XXH3_128bits digest.  Every other node is the
+ * XXH3_128bits digest of a 0x01 byte followed by its two children, except
+ * that the last node of a level with an odd number of nodes is carried to
+ * the next level as is.  An empty file is treated as one empty chunk.
+ */
+
+struct _mapped_file {
+	const unsigned char *ptr;
+	size_t len;
+	VALUE holder;
+	int mapped;
+};
+
+struct _merkle_manifest {
+	const unsigned char *nodes;
+	size_t chunk_size;
+	size_t file_size;
+	size_t count;
+};
+
+struct _merkle_args {
+	struct _mapped_file file;
+	struct _tree tree;
+	VALUE (*body)(struct _merkle_args *);
+};
+
+struct _merkle_build_args {
+	struct _merkle_args merkle;
+	long chunk_size;
+	int threads;
+};
+
+struct _merkle_verify_args {
+	struct _merkle_args merkle;
+	const struct _merkle_manifest *m;
+	size_t first, last, start, end;
+	int threads;
+};
+
+/*
+ * Maps the file at +path+ to memory, or reads it whole if mmap isn't
+ * available.
+ */
+static void _map_file(struct _mapped_file *file, VALUE path)
+{
+	#ifdef HAVE_MMAP
+	struct stat st;
+	void *ptr;
+	int fd, error;
+	#endif
+
+	file->ptr = NULL;
+	file->len = 0;
+	file->holder = Qnil;
+	file->mapped = 0;
+
+	#ifdef HAVE_MMAP
+	if ((fd = rb_cloexec_open(StringValueCStr(path), O_RDONLY, 0)) < 0)
+		rb_sys_fail_str(path);
+
+	rb_update_max_fd(fd);
+
+	if (fstat(fd, &st) < 0) {
+		error = errno;
+		close(fd);
+		errno = error;
+		rb_sys_fail_str(path);
+	}
+
+	if (! S_ISREG(st.st_mode) || (unsigned long long)st.st_size > SIZE_MAX) {
+		close(fd);
+		rb_raise(rb_eArgError, "Not a regular file or too large to be mapped: %"PRIsVALUE, path);
+	}
+
+	if (st.st_size > 0) {
+		if ((ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+			error = errno;
+			close(fd);
+			errno = error;
+			rb_sys_fail_str(path);
+		}
+
+		file->ptr = ptr;
+		file->len = st.st_size;
+		file->mapped = 1;
+	}
+
+	close(fd);
+	#else
+	file->holder = rb_funcall(rb_cFile, _id_binread, 1, path);
+	file->ptr = _RSTRING_PTR_U(file->holder);
+	file->len = RSTRING_LEN(file->holder);
+	#endif
+}
+
+static void _unmap_file(struct _mapped_file *file)
+{
+	#ifdef HAVE_MMAP
+	if (file->mapped) {
+		file->mapped = 0;
+		munmap((void *)file->ptr, file->len);
+	}
+	#endif
+}
+
+static VALUE _merkle_body(VALUE ptr)
+{
+	struct _merkle_args *args = (struct _merkle_args *)ptr;
+	return args->body(args);
+}
+
+static VALUE _merkle_ensure(VALUE ptr)
+{
+	_unmap_file(&((struct _merkle_args *)ptr)->file);
+	return Qnil;
+}
+
+/*
+ * Runs +body+ with the file mapped by _map_file, and unmaps it afterwards
+ * even if +body+ raises.  Buffers are allocated in +body+, so a failed
+ * allocation can't leak the mapping.
+ */
+static VALUE _with_mapped_file(struct _merkle_args *args, VALUE (*body)(struct _merkle_args *))
+{
+	VALUE result;
+
+	args->body = body;
+
+	if (args->file.mapped)
+		result = rb_ensure(_merkle_body, (VALUE)args, _merkle_ensure, (VALUE)args);
+	else
+		result = body(args);
+
+	RB_GC_GUARD(args->file.holder);
+	return result;
+}
+
+/*
+ * Hashes the chunks described by +args->tree+ in the mapped file.
+ */
+static void _hash_merkle_chunks(struct _merkle_args *args)
+{
+	_run_tree(&args->tree, args->file.mapped || args->file.len >= _NOGVL_MIN_LENGTH);
+}
+
+static size_t _merkle_node_count(size_t count)
+{
+	size_t total = count;
+
+	while (count > 1) {
+		count = (count + 1) / 2;
+		total += count;
+	}
+
+	return total;
+}
+
+/*
+ * Computes the node of the +i+-th pair of nodes in +level+, which has +n+
+ * nodes.
+ */
+static void _merkle_parent(const unsigned char *level, size_t n, size_t i, unsigned char *node)
+{
+	unsigned char buf[33];
+
+	if (i * 2 + 1 == n) {
+		memcpy(node, level + i * 32, 16);
+		return;
+	}
+
+	buf[0] = 1;
+	memcpy(buf + 1, level + i * 32, 32);
+	XXH128_canonicalFromHash((XXH128_canonical_t *)node, XXH3_128bits(buf, sizeof buf));
+}
+
+/*
+ * Computes the levels above the +count+ chunk digests in +nodes+.
+ */
+static void _build_merkle_levels(unsigned char *nodes, size_t count)
+{
+	unsigned char *level = nodes;
+	size_t i, n = count;
+
+	while (n > 1) {
+		for (i = 0; i < (n + 1) / 2; ++i)
+			_merkle_parent(level, n, i, level + (n + i) * 16);
+
+		level += n * 16;
+		n = (n + 1) / 2;
+	}
+}
+
+static void _parse_merkle_manifest(VALUE manifest, struct _merkle_manifest *m)
+{
+	const unsigned char *p = _RSTRING_PTR_U(manifest);
+	size_t len = RSTRING_LEN(manifest);
+	unsigned long long chunk_size, file_size, count;
+
+	if (len < _MERKLE_HEADER_SIZE || memcmp(p, "XXHM", 4) != 0)
+		rb_raise(rb_eArgError, "Invalid manifest.");
+
+	if (p[4] != _MERKLE_VERSION)
+		rb_raise(rb_eArgError, "Unsupported manifest version.");
+
+	chunk_size = XXH_readLE64(p + 8);
+	file_size = XXH_readLE64(p + 16);
+	count = XXH_readLE64(p + 24);
+
+	if (chunk_size == 0 || count > len / 16 || count != (file_size == 0 ? 1 :
+			file_size / chunk_size + (file_size % chunk_size != 0)) ||
+			len != _MERKLE_HEADER_SIZE + _merkle_node_count(count) * 16)
+		rb_raise(rb_eArgError, "Invalid manifest.");
+
+	m->nodes = p + _MERKLE_HEADER_SIZE;
+	m->chunk_size = chunk_size;
+	m->file_size = file_size;
+	m->count = count;
+}
+
+/*
+ * Builds the manifest of the mapped file.
+ */
+static VALUE _merkle_build_body(struct _merkle_args *args)
+{
+	struct _merkle_build_args *build = (struct _merkle_build_args *)args;
+	VALUE nodes_tmp = 0, work_tmp = 0, result;
+	unsigned char *nodes, *p;
+	size_t count, node_count;
+
+	count = args->file.len == 0 ? 1 : args->file.len / build->chunk_size +
+			(args->file.len % build->chunk_size != 0);
+	node_count = _merkle_node_count(count);
+	_init_tree(&args->tree, args->file.ptr, args->file.len, build->chunk_size, count, build->threads);
+	nodes = ALLOCV_N(unsigned char, nodes_tmp, node_count * 16);
+	args->tree.leaves = nodes;
+	_set_tree_work(&args->tree, ALLOCV(work_tmp, _tree_work_size(&args->tree)));
+	_hash_merkle_chunks(args);
+	_build_merkle_levels(nodes, count);
+
+	result = rb_str_new(0, _MERKLE_HEADER_SIZE + node_count * 16);
+	p = _RSTRING_PTR_U(result);
+	memcpy(p, "XXHM", 4);
+	p[4] = _MERKLE_VERSION;
+	p[5] = p[6] = p[7] = 0;
+	XXH_writeLE64(p + 8, build->chunk_size);
+	XXH_writeLE64(p + 16, args->file.len);
+	XXH_writeLE64(p + 24, count);
+	memcpy(p + _MERKLE_HEADER_SIZE, nodes, node_count * 16);
+	ALLOCV_END(nodes_tmp);
+	ALLOCV_END(work_tmp);
+	return result;
+}
+
+/*
+ * Hashes the chunks touched by the range being verified and compares them
+ * with the leaves in the manifest.
+ */
+static VALUE _merkle_verify_body(struct _merkle_args *args)
+{
+	struct _merkle_verify_args *verify = (struct _merkle_verify_args *)args;
+	VALUE leaves_tmp = 0, work_tmp = 0;
+	int ok;
+
+	if (args->file.len < verify->end)
+		return Qfalse;
+
+	_init_tree(&args->tree, args->file.ptr + verify->start, verify->end - verify->start,
+			verify->m->chunk_size, verify->last - verify->first + 1, verify->threads);
+	args->tree.leaves = ALLOCV_N(unsigned char, leaves_tmp, args->tree.count * 16);
+	_set_tree_work(&args->tree, ALLOCV(work_tmp, _tree_work_size(&args->tree)));
+	_hash_merkle_chunks(args);
+	ok = memcmp(args->tree.leaves, verify->m->nodes + verify->first * 16, args->tree.count * 16) == 0;
+	ALLOCV_END(leaves_tmp);
+	ALLOCV_END(work_tmp);
+	return ok ? Qtrue : Qfalse;
+}
+
+/*
+ * File chunk digests
+ *
+ * Used by XXH3_64bits.chunk_digests and XXH3_64bits.verify_chunks.  Each
+ * worker reads its chunks with pread into a buffer of its own, so the file
+ * is read in parallel without mapping it or sharing a file position.
+ *
+ * A manifest consists of a 32-byte header followed by the 8-byte digest of
+ * each chunk, in the same form as the ones returned by XXH3_64bits.digest.
+ * The header consists of "XXHC", the version number as a byte, three zero
+ * bytes, and the chunk size, the file size and the number of chunks as
+ * 64-bit little-endian integers.
+ */
+
+#ifdef HAVE_PREAD
+static int _tree_pread_chunk(struct _tree *tree, size_t i, unsigned char *buf)
+{
+	size_t len = _tree_chunk_length(tree, i), done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		if ((n = pread(tree->fd, buf + done, len - done, (off_t)(i * tree->chunk_size + done))) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return errno;
+		}
+
+		if (n == 0)
+			break;
+
+		done += n;
+	}
+
+	XXH64_canonicalFromHash((XXH64_canonical_t *)(tree->leaves + i * 8), XXH3_64bits(buf, done));
+	return 0;
+}
+#endif
+
+/*
+ * Returns a manifest holding the digests computed in +tree+.
+ */
+static VALUE _new_chunk_manifest(const struct _tree *tree)
+{
+	VALUE manifest = rb_str_new(0, _CHUNK_MANIFEST_HEADER_SIZE + tree->count * 8);
+	unsigned char *p = _RSTRING_PTR_U(manifest);
+
+	memcpy(p, "XXHC", 4);
+	p[4] = _CHUNK_MANIFEST_VERSION;
+	p[5] = p[6] = p[7] = 0;
+	XXH_writeLE64(p + 8, tree->chunk_size);
+	XXH_writeLE64(p + 16, tree->len);
+	XXH_writeLE64(p + 24, tree->count);
+	memcpy(p + _CHUNK_MANIFEST_HEADER_SIZE, tree->leaves, tree->count * 8);
+	return manifest;
+}
+
+/*
+ * Hashes the chunks described by +tree+ and returns their manifest.
+ */
+static VALUE _hash_file_chunks(struct _tree *tree, VALUE path, int nogvl)
+{
+	VALUE leaves_tmp = 0, work_tmp = 0, result;
+
+	tree->leaves = ALLOCV_N(unsigned char, leaves_tmp, tree->count * 8);
+	_set_tree_work(tree, ALLOCV(work_tmp, _tree_work_size(tree)));
+	_run_tree(tree, nogvl);
+
+	if (tree->error != 0) {
+		ALLOCV_END(leaves_tmp);
+		ALLOCV_END(work_tmp);
+		rb_syserr_fail_str(tree->error, path);
+	}
+
+	result = _new_chunk_manifest(tree);
+	ALLOCV_END(leaves_tmp);
+	ALLOCV_END(work_tmp);
+	return result;
+}
+
+#ifdef HAVE_PREAD
+struct _file_chunks_args {
+	struct _tree tree;
+	VALUE path;
+	long chunk_size;
+	int threads;
+	int fd;
+};
+
+/*
+ * Opens the file and hashes its chunks.  Everything after the file is
+ * opened runs here, so the descriptor is closed by the ensure function even
+ * if an allocation fails.
+ */
+static VALUE _file_chunks_body(VALUE ptr)
+{
+	struct _file_chunks_args *args = (struct _file_chunks_args *)ptr;
+	struct stat st;
+	size_t count;
+
+	if ((args->fd = rb_cloexec_open(StringValueCStr(args->path), O_RDONLY, 0)) < 0)
+		rb_sys_fail_str(args->path);
+
+	rb_update_max_fd(args->fd);
+
+	if (fstat(args->fd, &st) < 0)
+		rb_sys_fail_str(args->path);
+
+	if (! S_ISREG(st.st_mode) || (unsigned long long)st.st_size > SIZE_MAX)
+		rb_raise(rb_eArgError, "Not a regular file or too large: %"PRIsVALUE, args->path);
+
+	count = st.st_size / args->chunk_size + (st.st_size % args->chunk_size != 0);
+	_init_tree(&args->tree, NULL, st.st_size, args->chunk_size, count, args->threads);
+	args->tree.chunk_func = _tree_pread_chunk;
+	args->tree.buf_size = (size_t)args->chunk_size < args->tree.len ? (size_t)args->chunk_size :
+			args->tree.len;
+	args->tree.fd = args->fd;
+	return _hash_file_chunks(&args->tree, args->path, 1);
+}
+
+static VALUE _file_chunks_ensure(VALUE ptr)
+{
+	struct _file_chunks_args *args = (struct _file_chunks_args *)ptr;
+
+	if (args->fd >= 0) {
+		close(args->fd);
+		args->fd = -1;
+	}
+
+	return Qnil;
+}
+#else
+static int _tree_hash_chunk_64(struct _tree *tree, size_t i, unsigned char *buf)
+{
+	XXH64_canonicalFromHash((XXH64_canonical_t *)(tree->leaves + i * 8),
+			XXH3_64bits(tree->data + i * tree->chunk_size, _tree_chunk_length(tree, i)));
+	return 0;
+}
+
+struct _file_chunks_args {
+	struct _merkle_args merkle;
+	VALUE path;
+	long chunk_size;
+	int threads;
+};
+
+static VALUE _file_chunks_mapped_body(struct _merkle_args *merkle)
+{
+	struct _file_chunks_args *args = (struct _file_chunks_args *)merkle;
+	size_t count = merkle->file.len / args->chunk_size + (merkle->file.len % args->chunk_size != 0);
+
+	_init_tree(&merkle->tree, merkle->file.ptr, merkle->file.len, args->chunk_size, count,
+			args->threads);
+	merkle->tree.chunk_func = _tree_hash_chunk_64;
+	return _hash_file_chunks(&merkle->tree, args->path,
+			merkle->file.mapped || merkle->file.len >= _NOGVL_MIN_LENGTH);
+}
+#endif
+
+/*
+ * Returns the manifest of the chunks of the file at +path+.
+ */
+static VALUE _file_chunk_digests(VALUE path, long chunk_size, int threads)
+{
+	struct _file_chunks_args args;
+
+	args.path = path;
+	args.chunk_size = chunk_size;
+	args.threads = threads;
+
+	#ifdef HAVE_PREAD
+	args.fd = -1;
+	return rb_ensure(_file_chunks_body, (VALUE)&args, _file_chunks_ensure, (VALUE)&args);
+	#else
+	_map_file(&args.merkle.file, path);
+	return _with_mapped_file(&args.merkle, _file_chunks_mapped_body);
+	#endif
+}
+
+/*
+ * Checks the header of a manifest returned by chunk_digests.
+ */
+static void _parse_chunk_manifest(VALUE manifest, long *chunk_size_p, size_t *count_p)
+{
+	const unsigned char *p = _RSTRING_PTR_U(manifest);
+	size_t len = RSTRING_LEN(manifest);
+	unsigned long long chunk_size, file_size, count;
+
+	if (len < _CHUNK_MANIFEST_HEADER_SIZE || memcmp(p, "XXHC", 4) != 0)
+		rb_raise(rb_eArgError, "Invalid manifest.");
+
+	if (p[4] != _CHUNK_MANIFEST_VERSION)
+		rb_raise(rb_eArgError, "Unsupported manifest version.");
+
+	chunk_size = XXH_readLE64(p + 8);
+	file_size = XXH_readLE64(p + 16);
+	count = XXH_readLE64(p + 24);
+
+	if (chunk_size == 0 || chunk_size > LONG_MAX ||
+			count != file_size / chunk_size + (file_size % chunk_size != 0) ||
+			count != (len - _CHUNK_MANIFEST_HEADER_SIZE) / 8 ||
+			(len - _CHUNK_MANIFEST_HEADER_SIZE) % 8 != 0)
+		rb_raise(rb_eArgError, "Invalid manifest.");
+
+	*chunk_size_p = (long)chunk_size;
+	*count_p = count;
+}
+
+/*
+ * Reads the chunk_size: and threads: options of chunk_digests.
+ */
+static void _get_file_chunks_opts(VALUE opts, long *chunk_size_p, int *threads_p)
+{
+	ID keywords[2];
+	VALUE values[2];
+
+	keywords[0] = _id_chunk_size;
+	keywords[1] = _id_threads;
+	values[0] = values[1] = Qundef;
+
+	if (! NIL_P(opts))
+		rb_get_kwargs(opts, keywords, 0, 2, values);
+
+	*chunk_size_p = _CHUNK_DIGESTS_DEFAULT_CHUNK_SIZE;
+
+	if (values[0] != Qundef && ! NIL_P(values[0]) && (*chunk_size_p = NUM2LONG(values[0])) <= 0)
+		rb_raise(rb_eArgError, "Chunk size needs to be greater than 0.");
+
+	*threads_p = _get_threads_opt(values[1]);
+}
+
+/*
+ * Batch file hashing
+ *
+ * Used by XXH3_128bits.files.  With io_uring, one thread keeps a slot for
+ * each of up to 'concurrency' files and drives it through openat, reads and
+ * close as its completions arrive, so the system calls of many small files
+ * are in flight together instead of being made one after another.  Without
+ * it, each of 'concurrency' tree workers opens and reads its files with pread.
+ *
+ * Files are opened without blocking and anything other than a regular file is
+ * rejected, since FIFOs and devices can block a read that can't be
+ * interrupted.  Reads fill the slot buffer and a file ends at the first read
+ * that returns nothing, as short reads are common on procfs, NFS and FUSE.  A
+ * file that fits in the buffer is hashed in one shot.
+ *
+ * The io_uring thread also keeps a poll request on an eventfd in flight, which
+ * the unblocking function writes to when the thread is interrupted, so that
+ * a thread waiting for completions wakes up.
+ */
+
+struct _files {
+	struct _tree tree;
+	const char **paths;
+	int *errors;
+	#ifdef HAVE_IO_URING
+	struct _uring *ring;
+	struct _files_slot *slots;
+	int *free_slots;
+	int free_count;
+	size_t next;
+	int wake_fd;
+	int wake_armed;
+	#endif
+};
+
+#if defined(HAVE_PREAD) || defined(HAVE_IO_URING)
+static size_t _files_slot_buf_size(void)
+{
+	return _FILES_BUFFER_SIZE + sizeof(XXH3_state_t) + 64;
+}
+
+static XXH3_state_t *_files_slot_state(unsigned char *buf)
+{
+	return (XXH3_state_t *)(((uintptr_t)buf + _FILES_BUFFER_SIZE + 63) & ~(uintptr_t)63);
+}
+
+/*
+ * Hashes the +n+ bytes read into the slot buffer after the first +offset+
+ * ones, at buf + offset % _FILES_BUFFER_SIZE.  Returns 1 and stores the digest
+ * when +n+ is 0.
+ */
+static int _files_update(XXH3_state_t *state, const unsigned char *buf, size_t n,
+		unsigned long long offset, unsigned char *digest)
+{
+	size_t fill = (size_t)(offset % _FILES_BUFFER_SIZE);
+	XXH128_hash_t hash;
+
+	if (n > 0) {
+		if (fill + n < _FILES_BUFFER_SIZE)
+			return 0;
+
+		if (offset + n == _FILES_BUFFER_SIZE)
+			XXH3_128bits_reset(state);
+
+		XXH3_128bits_update(state, buf, _FILES_BUFFER_SIZE);
+		return 0;
+	}
+
+	if (offset < _FILES_BUFFER_SIZE) {
+		hash = XXH3_128bits(buf, fill);
+	} else {
+		XXH3_128bits_update(state, buf, fill);
+		hash = XXH3_128bits_digest(state);
+	}
+
+	XXH128_canonicalFromHash((XXH128_canonical_t *)digest, hash);
+	return 1;
+}
+
+/*
+ * Returns where the next read into the slot buffer goes after +offset+ bytes,
+ * and stores how much it can take in *len_p.
+ */
+static unsigned char *_files_read_ptr(unsigned char *buf, unsigned long long offset, size_t *len_p)
+{
+	size_t fill = (size_t)(offset % _FILES_BUFFER_SIZE);
+
+	*len_p = _FILES_BUFFER_SIZE - fill;
+	return buf + fill;
+}
+#endif
+
+#ifdef HAVE_PREAD
+static int _files_hash_file(struct _tree *tree, size_t i, unsigned char *buf)
+{
+	struct _files *files = (struct _files *)tree;
+	XXH3_state_t *state = _files_slot_state(buf);
+	unsigned long long offset = 0;
+	unsigned char *ptr;
+	size_t len;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(files->paths[i], O_RDONLY | O_CLOEXEC | O_NONBLOCK)) < 0) {
+		files->errors[i] = errno;
+		return 0;
+	}
+
+	if ((files->errors[i] = _check_regular_fd(fd)) != 0) {
+		close(fd);
+		return 0;
+	}
+
+	for (;;) {
+		ptr = _files_read_ptr(buf, offset, &len);
+
+		if ((n = pread(fd, ptr, len, (off_t)offset)) < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+
+			files->errors[i] = errno;
+			break;
+		}
+
+		if (_files_update(state, buf, n, offset, tree->leaves + i * 16))
+			break;
+
+		offset += n;
+	}
+
+	close(fd);
+	return 0;
+}
+
+#endif
+
+#ifdef HAVE_IO_URING
+struct _uring {
+	int fd;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	struct io_uring_cqe *cqes;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	unsigned entries;
+	unsigned pending;
+	unsigned inflight;
+};
+
+enum {
+	_FILES_SLOT_OPEN,
+	_FILES_SLOT_READ,
+	_FILES_SLOT_CLOSE
+};
+
+/*
+ * User data of the poll request on files->wake_fd
+ */
+#define _FILES_WAKE_DATA (~0ULL)
+
+struct _files_slot {
+	size_t index;
+	int stage;
+	int fd;
+	unsigned long long offset;
+	unsigned char *buf;
+};
+
+/*
+ * Creates a ring with at least +entries+ entries.  Returns 0, or -1 if
+ * io_uring is unavailable or lacks the needed operations.
+ */
+static int _uring_init(struct _uring *ring, unsigned entries)
+{
+	struct io_uring_params p;
+	unsigned char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	memset(ring, 0, sizeof(*ring));
+	p.flags = IORING_SETUP_CLAMP;
+
+	if ((ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p)) < 0)
+		return -1;
+
+	/* OPENAT, READ and CLOSE predate IORING_FEAT_FAST_POLL. */
+	if (! (p.features & IORING_FEAT_FAST_POLL))
+		goto fail;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+
+		ring->cq_ring_size = 0;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->fd, IORING_OFF_SQ_RING);
+
+	if (ring->sq_ring == MAP_FAILED)
+		goto fail;
+
+	if (ring->cq_ring_size == 0) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+
+		if (ring->cq_ring == MAP_FAILED)
+			goto fail_sq;
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->fd, IORING_OFF_SQES);
+
+	if (ring->sqes == MAP_FAILED)
+		goto fail_cq;
+
+	sq = ring->sq_ring;
+	cq = ring->cq_ring;
+	ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	ring->entries = p.sq_entries;
+	return 0;
+
+fail_cq:
+	if (ring->cq_ring_size != 0)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+fail_sq:
+	munmap(ring->sq_ring, ring->sq_ring_size);
+fail:
+	close(ring->fd);
+	ring->fd = -1;
+	return -1;
+}
+
+static void _uring_destroy(struct _uring *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+
+	if (ring->cq_ring_size != 0)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+/*
+ * Queues a request.  The ring never fills up since each slot has at most one
+ * request in flight, and there's an entry left for the poll on the eventfd.
+ */
+static void _uring_push(struct _uring *ring, int opcode, int fd, const void *addr, unsigned len,
+		unsigned long long offset, unsigned long long user_data)
+{
+	unsigned tail = *ring->sq_tail;
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)addr;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+
+	if (opcode == IORING_OP_OPENAT)
+		sqe->open_flags = O_RDONLY | O_CLOEXEC | O_NONBLOCK;
+	else if (opcode == IORING_OP_POLL_ADD)
+		sqe->poll_events = POLLIN;
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++ring->pending;
+	++ring->inflight;
+}
+
+/*
+ * Submits the queued requests and waits for at least one completion.
+ * Returns 0, or an errno value.
+ */
+static int _uring_submit_and_wait(struct _uring *ring)
+{
+	long n;
+
+	if ((n = syscall(__NR_io_uring_enter, ring->fd, ring->pending, 1, IORING_ENTER_GETEVENTS,
+			NULL, 0)) < 0)
+		return errno == EINTR ? 0 : errno;
+
+	ring->pending -= n;
+	return 0;
+}
+
+static void _files_push_read(struct _files *files, struct _files_slot *slot)
+{
+	unsigned char *ptr;
+	size_t len;
+
+	ptr = _files_read_ptr(slot->buf, slot->offset, &len);
+	_uring_push(files->ring, IORING_OP_READ, slot->fd, ptr, (unsigned)len, slot->offset,
+			slot - files->slots);
+}
+
+static void _files_push_close(struct _files *files, struct _files_slot *slot)
+{
+	slot->stage = _FILES_SLOT_CLOSE;
+	_uring_push(files->ring, IORING_OP_CLOSE, slot->fd, NULL, 0, 0, slot - files->slots);
+}
+
+/*
+ * Advances +slot+ to its next request after one completed with +res+.
+ */
+static void _files_complete(struct _files *files, struct _files_slot *slot, int res)
+{
+	switch (slot->stage) {
+	case _FILES_SLOT_OPEN:
+		if (res < 0) {
+			files->errors[slot->index] = -res;
+			files->free_slots[files->free_count++] = slot - files->slots;
+			break;
+		}
+
+		slot->stage = _FILES_SLOT_READ;
+		slot->fd = res;
+		slot->offset = 0;
+
+		if ((files->errors[slot->index] = _check_regular_fd(slot->fd)) != 0)
+			_files_push_close(files, slot);
+		else
+			_files_push_read(files, slot);
+
+		break;
+	case _FILES_SLOT_READ:
+		if (res == -EINTR || res == -EAGAIN) {
+			_files_push_read(files, slot);
+		} else if (res < 0) {
+			files->errors[slot->index] = -res;
+			_files_push_close(files, slot);
+		} else if (_files_update(_files_slot_state(slot->buf), slot->buf, res, slot->offset,
+				files->tree.leaves + slot->index * 16)) {
+			_files_push_close(files, slot);
+		} else {
+			slot->offset += res;
+			_files_push_read(files, slot);
+		}
+
+		break;
+	default:
+		files->tree.done[slot->index] = 1;
+		files->free_slots[files->free_count++] = slot - files->slots;
+	}
+}
+
+/*
+ * Keeps the free slots opening the next files and handles completions until
+ * all files are hashed, or the thread is interrupted.
+ */
+static void *_files_uring_func(void *ptr)
+{
+	struct _files *files = ptr;
+	struct _uring *ring = files->ring;
+	struct io_uring_cqe *cqe;
+	struct _files_slot *slot;
+	unsigned head, tail;
+	uint64_t value;
+	int error;
+
+	/*
+	 * The poll request isn't counted as in flight, since it's left to be
+	 * canceled when the ring is destroyed.
+	 */
+	if (! files->wake_armed) {
+		while (read(files->wake_fd, &value, sizeof value) > 0);
+		_uring_push(ring, IORING_OP_POLL_ADD, files->wake_fd, NULL, 0, 0, _FILES_WAKE_DATA);
+		--ring->inflight;
+		files->wake_armed = 1;
+	}
+
+	while (! files->tree.interrupted) {
+		while (files->free_count > 0 && files->next < files->tree.count) {
+			slot = &files->slots[files->free_slots[--files->free_count]];
+			slot->index = files->next++;
+			slot->stage = _FILES_SLOT_OPEN;
+			_uring_push(ring, IORING_OP_OPENAT, AT_FDCWD, files->paths[slot->index], 0, 0,
+					slot - files->slots);
+		}
+
+		if (ring->inflight == 0)
+			break;
+
+		if ((error = _uring_submit_and_wait(ring)) != 0) {
+			files->tree.error = error;
+			break;
+		}
+
+		head = *ring->cq_head;
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; ++head) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+
+			if (cqe->user_data == _FILES_WAKE_DATA) {
+				files->wake_armed = 0;
+			} else {
+				--ring->inflight;
+				_files_complete(files, &files->slots[cqe->user_data], cqe->res);
+			}
+		}
+
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void _files_uring_ubf(void *ptr)
+{
+	struct _files *files = ptr;
+	uint64_t value = 1;
+
+	files->tree.interrupted = 1;
+
+	/* Only fails if the counter is about to overflow, which wakes it anyway */
+	if (write(files->wake_fd, &value, sizeof value) < 0)
+		return;
+}
+#endif
+
+static VALUE _files_uring_body(VALUE ptr)
+{
+	struct _files *files = (struct _files *)ptr;
+
+	do {
+		files->tree.interrupted = 0;
+
+		#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+		rb_thread_call_without_gvl(_files_uring_func, files, _files_uring_ubf, files);
+		#else
+		_files_uring_func(files);
+		#endif
+	} while (files->tree.interrupted && ! files->tree.error);
+
+	return Qnil;
+}
+
+/*
+ * Waits for the requests still in flight after an error or an exception,
+ * closing the files they leave open, and destroys the ring.
+ */
+static VALUE _files_uring_ensure(VALUE ptr)
+{
+	struct _files *files = (struct _files *)ptr;
+	struct _uring *ring = files->ring;
+	struct io_uring_cqe *cqe;
+	struct _files_slot *slot;
+	unsigned head, tail;
+
+	while (ring->inflight > 0 && _uring_submit_and_wait(ring) == 0) {
+		head = *ring->cq_head;
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; ++head) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+
+			if (cqe->user_data == _FILES_WAKE_DATA)
+				continue;
+
+			slot = &files->slots[cqe->user_data];
+			--ring->inflight;
+
+			if (slot->stage == _FILES_SLOT_OPEN && cqe->res >= 0)
+				close(cqe->res);
+			else if (slot->stage == _FILES_SLOT_READ)
+				close(slot->fd);
+		}
+
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	_uring_destroy(ring);
+	close(files->wake_fd);
+	return Qnil;
+}
+
+/*
+ * Hashes the files with io_uring.  Returns 0, or -1 if it's unavailable.
+ */
+static int _files_hash_with_uring(struct _files *files, int concurrency)
+{
+	VALUE slots_tmp = 0, bufs_tmp = 0;
+	struct _uring ring;
+	unsigned char *bufs;
+	int i;
+
+	if ((files->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+		return -1;
+
+	if (_uring_init(&ring, concurrency + 1) < 0) {
+		close(files->wake_fd);
+		return -1;
+	}
+
+	if ((unsigned)concurrency > ring.entries - 1)
+		concurrency = ring.entries - 1;
+
+	files->ring = &ring;
+	files->slots = ALLOCV(slots_tmp, concurrency * (sizeof(struct _files_slot) + sizeof(int)));
+	files->free_slots = (int *)(files->slots + concurrency);
+	files->free_count = concurrency;
+	files->next = 0;
+	files->wake_armed = 0;
+	bufs = ALLOCV(bufs_tmp, concurrency * _files_slot_buf_size());
+
+	for (i = 0; i < concurrency; ++i) {
+		files->slots[i].buf = bufs + i * _files_slot_buf_size();
+		files->free_slots[i] = concurrency - 1 - i;
+	}
+
+	rb_ensure(_files_uring_body, (VALUE)files, _files_uring_ensure, (VALUE)files);
+	ALLOCV_END(slots_tmp);
+	ALLOCV_END(bufs_tmp);
+	return 0;
+}
+#endif
+
+/*
+ * Hashes the +count+ files at files->paths into +digests+ with +engine+.
+ * files->errors needs room for +count+ values.  Returns 0, -1 if the engine
+ * is unavailable, or an errno value, with *failed_p set to the index of the
+ * file it's for, or to +count+ if it isn't for a single file.
+ */
+static int _run_files(struct _files *files, size_t count, unsigned char *digests, int concurrency,
+		int engine, size_t *failed_p)
+{
+	VALUE work_tmp = 0;
+	int hashed = 0, error = 0;
+	size_t i;
+	#ifndef HAVE_PREAD
+	VALUE data;
+	#endif
+
+	memset(files->errors, 0, count * sizeof(int));
+	_init_tree(&files->tree, NULL, 0, 0, count, concurrency);
+	files->tree.leaves = digests;
+	_set_tree_work(&files->tree, ALLOCV(work_tmp, _tree_work_size(&files->tree)));
+
+	#ifdef HAVE_IO_URING
+	if (engine != _FILES_ENGINE_THREADS)
+		hashed = _files_hash_with_uring(files, files->tree.threads) == 0;
+	#endif
+
+	if (! hashed && engine == _FILES_ENGINE_IO_URING) {
+		error = -1;
+	} else if (! hashed) {
+		#ifdef HAVE_PREAD
+		files->tree.chunk_func = _files_hash_file;
+		files->tree.buf_size = _files_slot_buf_size();
+		files->tree.dynamic = 1;
+		_run_tree(&files->tree, 1);
+		#else
+		for (i = 0; i < count; ++i) {
+			data = rb_funcall(rb_cFile, _id_binread, 1, rb_str_new_cstr(files->paths[i]));
+			XXH128_canonicalFromHash((XXH128_canonical_t *)(digests + i * 16),
+					XXH3_128bits(RSTRING_PTR(data), RSTRING_LEN(data)));
+		}
+		#endif
+	}
+
+	*failed_p = count;
+
+	if (error == 0 && (error = files->tree.error) == 0) {
+		for (i = 0; i < count && files->errors[i] == 0; ++i);
+
+		if (i < count) {
+			error = files->errors[i];
+			*failed_p = i;
+		}
+	}
+
+	ALLOCV_END(work_tmp);
+	return error;
+}
+
+/*
+ * Returns the XXH3_128bits digests of the files at +paths+ in an array.
+ */
+static VALUE _hash_files(VALUE paths, int concurrency, int engine)
+{
+	VALUE holder, path, result, paths_tmp = 0, names_tmp = 0, errors_tmp = 0, digests_tmp = 0;
+	struct _files files;
+	long i, count = RARRAY_LEN(paths);
+	size_t names_len = 0, failed;
+	unsigned char *digests;
+	int error;
+	char *names;
+
+	/* Path conversions can run Ruby code, so work on a private copy. */
+	paths = rb_ary_subseq(paths, 0, count);
+	holder = rb_ary_new_capa(count);
+
+	for (i = 0; i < count; ++i) {
+		path = rb_get_path(RARRAY_AREF(paths, i));
+		rb_ary_push(holder, path);
+		names_len += RSTRING_LEN(path) + 1;
+	}
+
+	if (count == 0)
+		return rb_ary_new();
+
+	files.paths = ALLOCV_N(const char *, paths_tmp, count);
+	names = ALLOCV(names_tmp, names_len);
+
+	for (i = 0; i < count; ++i) {
+		path = RARRAY_AREF(holder, i);
+		memcpy(names, RSTRING_PTR(path), RSTRING_LEN(path));
+		names[RSTRING_LEN(path)] = '\0';
+		files.paths[i] = names;
+		names += RSTRING_LEN(path) + 1;
+	}
+
+	files.errors = ALLOCV_N(int, errors_tmp, count);
+	digests = ALLOCV_N(unsigned char, digests_tmp, count * 16);
+
+	if ((error = _run_files(&files, count, digests, concurrency, engine, &failed)) == 0) {
+		result = rb_ary_new_capa(count);
+
+		for (i = 0; i < count; ++i)
+			rb_ary_push(result, rb_usascii_str_new((const char *)digests + i * 16, 16));
+	}
+
+	ALLOCV_END(paths_tmp);
+	ALLOCV_END(names_tmp);
+	ALLOCV_END(errors_tmp);
+	ALLOCV_END(digests_tmp);
+
+	if (error < 0)
+		rb_raise(rb_eNotImpError, "io_uring is not available.");
+	else if (error > 0 && failed < (size_t)count)
+		rb_syserr_fail_str(error, RARRAY_AREF(holder, failed));
+	else if (error > 0)
+		rb_syserr_fail(error, NULL);
+
+	RB_GC_GUARD(holder);
+	return result;
+}
+
+/*
+ * Directory trees
+ *
+ * Used by XXH3_128bits.tree.  Directories are walked with a stack of pending
+ * ones instead of recursion, so only one is open at a time, and walking can
+ * stop and resume between directories when interrupted.  The thread is woken
+ * with a signal then, so that a system call stuck on a slow file system
+ * fails with EINTR, and a directory left partway is walked again from the
+ * start.  Each directory records its parent, so that loops through symbolic
+ * links can be told apart from links to directories found elsewhere in the
+ * tree.  Entry types come from readdir where the file system reports them,
+ * saving a stat for each file.  The files found are sorted, then hashed by the workers of
+ * XXH3_128bits.files, claiming files one at a time.
+ */
+
+#if defined(HAVE_FDOPENDIR) && defined(HAVE_FNMATCH)
+struct _scan_buf {
+	char *ptr;
+	size_t len;
+	size_t capa;
+};
+
+/*
+ * A directory to walk.  Its device and inode numbers are filled in when it's
+ * walked with symbolic links followed, to tell if it's one of its ancestors.
+ */
+struct _scan_dir_entry {
+	size_t path;
+	size_t parent;
+	dev_t dev;
+	ino_t ino;
+};
+
+struct _scan {
+	struct _scan_buf names;
+	struct _scan_buf offsets;
+	struct _scan_buf dirs;
+	struct _scan_buf dir_paths;
+	struct _scan_buf stack;
+	struct _scan_buf path;
+	struct _scan_buf error_path;
+	char **excludes;
+	long exclude_count;
+	size_t root_len;
+	int follow_symlinks;
+	int error;
+	volatile int interrupted;
+};
+
+static int _scan_buf_append(struct _scan_buf *buf, const void *data, size_t len)
+{
+	size_t capa;
+	char *ptr;
+
+	if (buf->len + len > buf->capa) {
+		for (capa = buf->capa == 0 ? 4096 : buf->capa; capa < buf->len + len; capa *= 2);
+
+		if ((ptr = realloc(buf->ptr, capa)) == NULL)
+			return ENOMEM;
+
+		buf->ptr = ptr;
+		buf->capa = capa;
+	}
+
+	memcpy(buf->ptr + buf->len, data, len);
+	buf->len += len;
+	return 0;
+}
+
+/*
+ * Records that the current directory failed with +error+, or that it was
+ * interrupted if +error+ is EINTR.
+ */
+static void _scan_fail(struct _scan *scan, int error)
+{
+	if (error == EINTR) {
+		scan->interrupted = 1;
+		return;
+	}
+
+	scan->error = error;
+	scan->error_path.len = 0;
+
+	if (_scan_buf_append(&scan->error_path, scan->path.ptr, strlen(scan->path.ptr) + 1) != 0)
+		scan->error = ENOMEM;
+}
+
+#define _SCAN_NO_PARENT ((size_t)-1)
+
+static struct _scan_dir_entry *_scan_get_dir(struct _scan *scan, size_t i)
+{
+	return (struct _scan_dir_entry *)scan->dirs.ptr + i;
+}
+
+/*
+ * Returns 1 if the directory at +i+ is the same as one of its ancestors,
+ * which happens when a symbolic link points back up the tree.
+ */
+static int _scan_is_loop(struct _scan *scan, size_t i)
+{
+	struct _scan_dir_entry *dir = _scan_get_dir(scan, i), *ancestor;
+	size_t j;
+
+	for (j = dir->parent; j != _SCAN_NO_PARENT; j = ancestor->parent) {
+		ancestor = _scan_get_dir(scan, j);
+
+		if (ancestor->dev == dir->dev && ancestor->ino == dir->ino)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Adds the file at scan->path to the ones to hash.  Returns 0, or ENOMEM.
+ */
+static int _scan_add_file(struct _scan *scan)
+{
+	size_t offset = scan->names.len;
+
+	if (_scan_buf_append(&scan->offsets, &offset, sizeof(offset)) != 0 ||
+			_scan_buf_append(&scan->names, scan->path.ptr, scan->path.len) != 0)
+		return ENOMEM;
+
+	return 0;
+}
+
+/*
+ * Queues the directory at scan->path, a child of the one at +parent+, to be
+ * walked.  Returns 0, or ENOMEM.
+ */
+static int _scan_push_dir(struct _scan *scan, size_t parent)
+{
+	struct _scan_dir_entry dir;
+	size_t i = scan->dirs.len / sizeof(dir);
+
+	memset(&dir, 0, sizeof(dir));
+	dir.path = scan->dir_paths.len;
+	dir.parent = parent;
+
+	if (_scan_buf_append(&scan->dirs, &dir, sizeof(dir)) != 0 ||
+			_scan_buf_append(&scan->dir_paths, scan->path.ptr, scan->path.len) != 0 ||
+			_scan_buf_append(&scan->stack, &i, sizeof(i)) != 0)
+		return ENOMEM;
+
+	return 0;
+}
+
+/*
+ * Patterns containing a slash are matched against the path relative to the
+ * root, and others against the base name.
+ */
+static int _scan_excluded(const struct _scan *scan, const char *name)
+{
+	const char *rel = scan->path.ptr + scan->root_len;
+	long i;
+
+	for (i = 0; i < scan->exclude_count; ++i) {
+		if (strchr(scan->excludes[i], '/') != NULL ?
+				fnmatch(scan->excludes[i], rel, FNM_PATHNAME) == 0 :
+				fnmatch(scan->excludes[i], name, 0) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int _scan_mode_type(mode_t mode)
+{
+	return S_ISREG(mode) ? S_IFREG : S_ISDIR(mode) ? S_IFDIR : 0;
+}
+
+/*
+ * Returns the type of the target of the symbolic link at scan->path if links
+ * are followed, or -1 if interrupted.  Dangling links are skipped.
+ */
+static int _scan_link_type(struct _scan *scan)
+{
+	struct stat st;
+
+	if (! scan->follow_symlinks)
+		return 0;
+
+	if (stat(scan->path.ptr, &st) < 0) {
+		if (errno != EINTR)
+			return 0;
+
+		scan->interrupted = 1;
+		return -1;
+	}
+
+	return _scan_mode_type(st.st_mode);
+}
+
+/*
+ * Returns S_IFREG or S_IFDIR for entries to hash or to walk into, 0 for
+ * others, or -1 after recording an error.  Entries removed since they were
+ * listed are skipped.
+ */
+static int _scan_entry_type(struct _scan *scan, DIR *dir, const struct dirent *ent)
+{
+	struct stat st;
+
+	#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+	switch (ent->d_type) {
+	case DT_REG:
+		return S_IFREG;
+	case DT_DIR:
+		return S_IFDIR;
+	case DT_LNK:
+		return _scan_link_type(scan);
+	case DT_UNKNOWN:
+		break;
+	default:
+		return 0;
+	}
+	#endif
+
+	if (fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+		if (errno == ENOENT)
+			return 0;
+
+		_scan_fail(scan, errno);
+		return -1;
+	}
+
+	return S_ISLNK(st.st_mode) ? _scan_link_type(scan) : _scan_mode_type(st.st_mode);
+}
+
+/*
+ * Adds the files in the directory at +i+ in scan->dirs to scan->names, and
+ * queues its subdirectories.
+ */
+static void _scan_dir(struct _scan *scan, size_t i)
+{
+	const char *dir_path = scan->dir_paths.ptr + _scan_get_dir(scan, i)->path;
+	struct dirent *ent;
+	struct stat st;
+	size_t dir_len, base_len;
+	DIR *dir;
+	int fd, type;
+
+	scan->path.len = 0;
+
+	if (_scan_buf_append(&scan->path, dir_path, strlen(dir_path) + 1) != 0) {
+		scan->error = ENOMEM;
+		return;
+	}
+
+	if ((fd = open(scan->path.ptr, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		_scan_fail(scan, errno);
+		return;
+	}
+
+	if (scan->follow_symlinks) {
+		if (fstat(fd, &st) < 0) {
+			_scan_fail(scan, errno);
+			close(fd);
+			return;
+		}
+
+		_scan_get_dir(scan, i)->dev = st.st_dev;
+		_scan_get_dir(scan, i)->ino = st.st_ino;
+
+		if (_scan_is_loop(scan, i)) {
+			close(fd);
+			return;
+		}
+	}
+
+	if ((dir = fdopendir(fd)) == NULL) {
+		_scan_fail(scan, errno);
+		close(fd);
+		return;
+	}
+
+	dir_len = base_len = scan->path.len - 1;
+
+	if (base_len > 0 && scan->path.ptr[base_len - 1] != '/')
+		scan->path.ptr[base_len++] = '/';
+
+	while ((errno = 0, ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] == '.' && (ent->d_name[1] == '\0' ||
+				(ent->d_name[1] == '.' && ent->d_name[2] == '\0')))
+			continue;
+
+		scan->path.len = base_len;
+
+		if (_scan_buf_append(&scan->path, ent->d_name, strlen(ent->d_name) + 1) != 0) {
+			scan->error = ENOMEM;
+			break;
+		}
+
+		if (_scan_excluded(scan, ent->d_name) || (type = _scan_entry_type(scan, dir, ent)) == 0)
+			continue;
+
+		if (type < 0)
+			break;
+
+		if ((type == S_IFREG ? _scan_add_file(scan) : _scan_push_dir(scan, i)) != 0) {
+			scan->error = ENOMEM;
+			break;
+		}
+	}
+
+	if (ent == NULL && errno != 0) {
+		scan->path.ptr[dir_len] = '\0';
+		_scan_fail(scan, errno);
+	}
+
+	closedir(dir);
+}
+
+/*
+ * Walks the queued directories until none are left, or a system call is
+ * interrupted by a signal.  What an interrupted directory added is taken
+ * back, and the directory queued again to be walked from the start.
+ */
+static void *_scan_func(void *ptr)
+{
+	struct _scan *scan = ptr;
+	size_t i, stack_len, names_len, offsets_len, dirs_len, dir_paths_len;
+
+	while (scan->stack.len > 0 && ! scan->interrupted && scan->error == 0) {
+		stack_len = scan->stack.len - sizeof(i);
+		memcpy(&i, scan->stack.ptr + stack_len, sizeof(i));
+		scan->stack.len = stack_len;
+		names_len = scan->names.len;
+		offsets_len = scan->offsets.len;
+		dirs_len = scan->dirs.len;
+		dir_paths_len = scan->dir_paths.len;
+		_scan_dir(scan, i);
+
+		if (scan->interrupted) {
+			scan->names.len = names_len;
+			scan->offsets.len = offsets_len;
+			scan->dirs.len = dirs_len;
+			scan->dir_paths.len = dir_paths_len;
+			/* The stack had room for it before it was taken off. */
+			memcpy(scan->stack.ptr + stack_len, &i, sizeof(i));
+			scan->stack.len = stack_len + sizeof(i);
+		}
+	}
+
+	return NULL;
+}
+
+static int _compare_paths(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+struct _dir_tree_args {
+	struct _scan scan;
+	const char **paths;
+	int *errors;
+	unsigned char *digests;
+	int threads;
+	int aggregate;
+};
+
+static VALUE _dir_tree_body(VALUE ptr)
+{
+	struct _dir_tree_args *args = (struct _dir_tree_args *)ptr;
+	struct _scan *scan = &args->scan;
+	VALUE result;
+	struct _files files;
+	XXH3_state_t state;
+	XXH128_canonical_t aggregate;
+	size_t i, count, offset, failed;
+	const char *rel;
+	int error;
+
+	while (scan->stack.len > 0 && scan->error == 0) {
+		scan->interrupted = 0;
+
+		#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+		rb_thread_call_without_gvl(_scan_func, scan, RUBY_UBF_IO, NULL);
+		#else
+		_scan_func(scan);
+		#endif
+	}
+
+	if (scan->error == ENOMEM)
+		rb_raise(rb_eNoMemError, "Failed to allocate memory for directory walk.");
+	else if (scan->error != 0)
+		rb_syserr_fail_str(scan->error, rb_str_new_cstr(scan->error_path.ptr));
+
+	count = scan->offsets.len / sizeof(size_t);
+
+	if (count > 0 && ((args->paths = malloc(count * sizeof(const char *))) == NULL ||
+			(args->errors = malloc(count * sizeof(int))) == NULL ||
+			(args->digests = malloc(count * 16)) == NULL))
+		rb_raise(rb_eNoMemError, "Failed to allocate memory for directory walk.");
+
+	files.paths = args->paths;
+	files.errors = args->errors;
+
+	for (i = 0; i < count; ++i) {
+		memcpy(&offset, scan->offsets.ptr + i * sizeof(size_t), sizeof(size_t));
+		files.paths[i] = scan->names.ptr + offset;
+	}
+
+	if (count > 0) {
+		qsort(files.paths, count, sizeof(const char *), _compare_paths);
+
+		if ((error = _run_files(&files, count, args->digests, args->threads, _FILES_ENGINE_THREADS,
+				&failed)) != 0) {
+			if (failed < count)
+				rb_syserr_fail_str(error, rb_str_new_cstr(files.paths[failed]));
+
+			rb_syserr_fail(error, NULL);
+		}
+	}
+
+	result = rb_hash_new();
+	XXH3_128bits_reset(&state);
+
+	for (i = 0; i < count; ++i) {
+		rel = files.paths[i] + scan->root_len;
+		/* Frozen keys are stored as they are instead of being interned. */
+		rb_hash_aset(result, rb_obj_freeze(rb_filesystem_str_new_cstr(rel)),
+				rb_usascii_str_new((const char *)args->digests + i * 16, 16));
+
+		if (args->aggregate) {
+			XXH3_128bits_update(&state, rel, strlen(rel) + 1);
+			XXH3_128bits_update(&state, args->digests + i * 16, 16);
+		}
+	}
+
+	if (args->aggregate) {
+		XXH128_canonicalFromHash(&aggregate, XXH3_128bits_digest(&state));
+		result = rb_assoc_new(result, rb_usascii_str_new((const char *)aggregate.digest, 16));
+	}
+
+	return result;
+}
+
+static VALUE _dir_tree_ensure(VALUE ptr)
+{
+	struct _dir_tree_args *args = (struct _dir_tree_args *)ptr;
+	struct _scan *scan = &args->scan;
+	long i;
+
+	free(scan->names.ptr);
+	free(scan->offsets.ptr);
+	free(scan->dirs.ptr);
+	free(scan->dir_paths.ptr);
+	free(scan->stack.ptr);
+	free(scan->path.ptr);
+	free(scan->error_path.ptr);
+	free(args->paths);
+	free(args->errors);
+	free(args->digests);
+
+	for (i = 0; i < scan->exclude_count; ++i)
+		free(scan->excludes[i]);
+
+	free(scan->excludes);
+	return Qnil;
+}
+
+/*
+ * Hashes the files under the directory at +root+.  +excludes+ is an array of
+ * strings without null bytes.
+ */
+static VALUE _hash_dir_tree(VALUE root, VALUE excludes, int threads, int follow_symlinks,
+		int aggregate)
+{
+	struct _dir_tree_args args;
+	struct _scan *scan = &args.scan;
+	long i;
+
+	memset(&args, 0, sizeof(args));
+	args.threads = threads;
+	args.aggregate = aggregate;
+	scan->follow_symlinks = follow_symlinks;
+	scan->root_len = RSTRING_LEN(root);
+
+	if (scan->root_len == 0 || RSTRING_PTR(root)[scan->root_len - 1] != '/')
+		++scan->root_len;
+
+	if ((scan->excludes = calloc(RARRAY_LEN(excludes) + 1, sizeof(char *))) == NULL)
+		rb_raise(rb_eNoMemError, "Failed to allocate memory for directory walk.");
+
+	scan->exclude_count = RARRAY_LEN(excludes);
+
+	for (i = 0; i < scan->exclude_count; ++i) {
+		if ((scan->excludes[i] = strdup(RSTRING_PTR(RARRAY_AREF(excludes, i)))) == NULL) {
+			scan->exclude_count = i;
+			_dir_tree_ensure((VALUE)&args);
+			rb_raise(rb_eNoMemError, "Failed to allocate memory for directory walk.");
+		}
+	}
+
+	if (_scan_buf_append(&scan->path, RSTRING_PTR(root), RSTRING_LEN(root)) != 0 ||
+			_scan_buf_append(&scan->path, "", 1) != 0 ||
+			_scan_push_dir(scan, _SCAN_NO_PARENT) != 0) {
+		_dir_tree_ensure((VALUE)&args);
+		rb_raise(rb_eNoMemError, "Failed to allocate memory for directory walk.");
+	}
+
+	return rb_ensure(_dir_tree_body, (VALUE)&args, _dir_tree_ensure, (VALUE)&args);
+}
+#endif
+
+/*
+ * Content-defined chunking
+ *
+ * Used by Digest::XXHash::Chunker.  Boundaries are found with FastCDC's gear
+ * hash and normalized chunking: after the minimum size, a boundary needs more
+ * bits of the fingerprint to be zero until the average size is reached, and
+ * fewer bits after it.
+ */
+
+static XXH64_hash_t _gear[256];
+
+struct _chunker {
+	size_t min;
+	size_t avg;
+	size_t max;
+	XXH64_hash_t mask_s;
+	XXH64_hash_t mask_l;
+};
+
+struct _chunk {
+	size_t offset;
+	size_t length;
+	unsigned char digest[16];
+};
+
+struct _chunks {
+	struct _chunker chunker;
+	struct _chunk *items;
+	size_t count;
+	size_t capa;
+	int no_memory;
+	volatile int interrupted;
+};
+
+/*
+ * The gear table consists of the XXH64 digests of the bytes 0 to 255.
+ */
+static void _init_gear(void)
+{
+	unsigned char b;
+	int i;
+
+	for (i = 0; i < 256; ++i) {
+		b = (unsigned char)i;
+		_gear[i] = XXH64(&b, 1, 0);
+	}
+}
+
+/*
+ * Returns the length of the chunk at the beginning of the +len+ bytes at +p+.
+ */
+static size_t _chunker_cut(const struct _chunker *chunker, const unsigned char *p, size_t len)
+{
+	XXH64_hash_t fp = 0;
+	size_t i, normal;
+
+	if (len <= chunker->min)
+		return len;
+
+	if (len > chunker->max)
+		len = chunker->max;
+
+	normal = len < chunker->avg ? len : chunker->avg;
+
+	for (i = chunker->min; i < normal; ++i) {
+		fp = (fp << 1) + _gear[p[i]];
+
+		if (! (fp & chunker->mask_s))
+			return i + 1;
+	}
+
+	for (; i < len; ++i) {
+		fp = (fp << 1) + _gear[p[i]];
+
+		if (! (fp & chunker->mask_l))
+			return i + 1;
+	}
+
+	return len;
+}
+
+/*
+ * Finds and hashes the chunks in +data+, and returns the number of bytes
+ * consumed.  Unless +final+ is set, a chunk is only cut if at least the
+ * maximum chunk size is available, since more data could move its boundary.
+ */
+static size_t _chunks_scan(struct _chunks *chunks, const unsigned char *data, size_t len,
+		size_t offset, int final)
+{
+	const struct _chunker *chunker = &chunks->chunker;
+	size_t done = 0, n;
+	struct _chunk *chunk;
+
+	while (done < len && (final || len - done >= chunker->max) && ! chunks->interrupted) {
+		if (chunks->count == chunks->capa) {
+			size_t capa = chunks->capa == 0 ? 256 : chunks->capa * 2;
+			struct _chunk *items;
+
+			if ((items = realloc(chunks->items, capa * sizeof(struct _chunk))) == NULL) {
+				chunks->no_memory = 1;
+				break;
+			}
+
+			chunks->items = items;
+			chunks->capa = capa;
+		}
+
+		n = _chunker_cut(chunker, data + done, len - done);
+		chunk = &chunks->items[chunks->count++];
+		chunk->offset = offset + done;
+		chunk->length = n;
+		XXH128_canonicalFromHash((XXH128_canonical_t *)chunk->digest, XXH3_128bits(data + done, n));
+		done += n;
+	}
+
+	return done;
+}
+
+struct _chunks_args {
+	struct _chunks chunks;
+	struct _input input;
+	const unsigned char *data;
+	size_t len;
+	size_t offset;
+	int final;
+	size_t done;
+	unsigned char *buf;
+	size_t buf_capa;
+};
+
+static void *_chunks_func(void *ptr)
+{
+	struct _chunks_args *args = ptr;
+	args->done += _chunks_scan(&args->chunks, args->data + args->done, args->len - args->done,
+			args->offset + args->done, args->final);
+	return NULL;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void _chunks_ubf(void *ptr)
+{
+	((struct _chunks_args *)ptr)->chunks.interrupted = 1;
+}
+#endif
+
+/*
+ * Scans +len+ bytes of +data+, yields the chunks found, and returns the
+ * number of bytes consumed.
+ */
+static size_t _chunks_process(struct _chunks_args *args, const unsigned char *data, size_t len,
+		size_t offset, int final, int nogvl)
+{
+	struct _chunk *chunk;
+	size_t i;
+
+	args->data = data;
+	args->len = len;
+	args->offset = offset;
+	args->final = final;
+	args->done = 0;
+
+	do {
+		args->chunks.interrupted = 0;
+
+		#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+		if (nogvl)
+			rb_thread_call_without_gvl(_chunks_func, args, _chunks_ubf, args);
+		else
+			_chunks_func(args);
+		#else
+		_chunks_func(args);
+		#endif
+
+		if (args->chunks.no_memory)
+			rb_raise(rb_eNoMemError, "Failed to allocate memory for chunks.");
+	} while (args->chunks.interrupted);
+
+	for (i = 0; i < args->chunks.count; ++i) {
+		chunk = &args->chunks.items[i];
+		rb_yield_values(3, SIZET2NUM(chunk->offset), SIZET2NUM(chunk->length),
+				rb_usascii_str_new((const char *)chunk->digest, 16));
+	}
+
+	args->chunks.count = 0;
+	return args->done;
+}
+
+static VALUE _chunks_str_body(VALUE ptr)
+{
+	struct _chunks_args *args = (struct _chunks_args *)ptr;
+	_chunks_process(args, args->input.ptr, args->input.len, 0, 1, args->input.nogvl);
+	return Qnil;
+}
+
+/*
+ * Reads +io+ in chunks into args->buf.  Data not yet cut into chunks is moved
+ * to the front of the buffer and completed with the following reads.
+ */
+static VALUE _chunks_io_body(VALUE ptr)
+{
+	struct _chunks_args *args = (struct _chunks_args *)ptr;
+	VALUE read_args[2];
+	size_t len = 0, offset = 0, done;
+
+	read_args[0] = INT2FIX(_READ_CHUNK_SIZE);
+	read_args[1] = rb_str_buf_new(_READ_CHUNK_SIZE);
+
+	while (_read_more(args->input.holder, read_args, &args->buf, &args->buf_capa, &len)) {
+		done = _chunks_process(args, args->buf, len, offset, 0, len >= _NOGVL_MIN_LENGTH);
+
+		if (done > 0) {
+			memmove(args->buf, args->buf + done, len - done);
+			len -= done;
+			offset += done;
+		}
+	}
+
+	if (len > 0)
+		_chunks_process(args, args->buf, len, offset, 1, len >= _NOGVL_MIN_LENGTH);
+
+	return Qnil;
+}
+
+static VALUE _chunks_ensure(VALUE ptr)
+{
+	struct _chunks_args *args = (struct _chunks_args *)ptr;
+
+	_release_input(&args->input);
+	free(args->chunks.items);
+	free(args->buf);
+	args->chunks.items = NULL;
+	args->buf = NULL;
+	return Qnil;
+}
+
+/*
+ * Rsync signatures and deltas
+ *
+ * A signature consists of a 32-byte header followed by a 12-byte entry for
+ * each block of the file.  The header consists of "XXHR", the version number
+ * as a byte, three zero bytes, and the block size, the file size and the
+ * number of blocks as 64-bit little-endian integers.  An entry consists of
+ * the block's weak checksum as a 32-bit little-endian integer, followed by
+ * its XXH3_64bits digest in canonical form, the one returned by
+ * XXH3_64bits.digest.  The last block may be shorter than the others.
+ *
+ * The weak checksum is rsync's: with a being the sum of the block's bytes,
+ * and b the sum of each byte multiplied by its distance from the end of the
+ * block, it's a + b * 2**16, with a and b taken modulo 2**16.  It can be
+ * updated in constant time as the block slides over the data.
+ */
+
+struct _signature {
+	const unsigned char *entries;
+	size_t block_size;
+	size_t file_size;
+	size_t count;
+};
+
+struct _signature_args {
+	struct _input input;
+	size_t block_size;
+	size_t file_size;
+	unsigned char *entries;
+	size_t count;
+	size_t capa;
+	const unsigned char *data;
+	size_t len;
+	int final;
+	size_t done;
+	unsigned char *buf;
+	size_t buf_capa;
+	VALUE result;
+	int no_memory;
+	volatile int interrupted;
+};
+
+struct _delta_op {
+	size_t offset;
+	size_t length;
+	int copy;
+};
+
+struct _delta_args {
+	struct _input input;
+	struct _signature signature;
+	size_t *table;
+	int table_bits;
+	unsigned char *filter;
+	int filter_bits;
+	size_t next_block;
+	struct _delta_op *ops;
+	size_t count;
+	size_t capa;
+	const unsigned char *data;
+	size_t len;
+	size_t pos;
+	size_t literal_start;
+	XXH32_hash_t a;
+	XXH32_hash_t b;
+	int rolling;
+	int final;
+	unsigned char *buf;
+	size_t buf_capa;
+	VALUE result;
+	VALUE literal;
+	size_t copy_offset;
+	size_t copy_length;
+	int no_memory;
+	volatile int interrupted;
+};
+
+static void _weak_sums(const unsigned char *p, size_t len, XXH32_hash_t *a_p, XXH32_hash_t *b_p)
+{
+	XXH32_hash_t a = 0, b = 0;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		a += p[i];
+		b += a;
+	}
+
+	*a_p = a;
+	*b_p = b;
+}
+
+static XXH32_hash_t _weak_checksum(XXH32_hash_t a, XXH32_hash_t b)
+{
+	return (a & 0xffff) | (b << 16);
+}
+
+static void _write_le32(unsigned char *p, XXH32_hash_t value)
+{
+	int i;
+
+	for (i = 0; i < 4; ++i)
+		p[i] = (unsigned char)(value >> (i * 8));
+}
+
+/*
+ * Adds the entries of the complete blocks in +data+, and of the remaining
+ * data as the last block if +final+ is set.  Returns the number of bytes
+ * consumed.
+ */
+static size_t _signature_scan(struct _signature_args *args, const unsigned char *data, size_t len,
+		int final)
+{
+	size_t done = 0, n;
+	XXH32_hash_t a, b;
+	unsigned char *entry;
+
+	while (done < len && (final || len - done >= args->block_size) && ! args->interrupted) {
+		if (args->count == args->capa) {
+			size_t capa = args->capa == 0 ? 1024 : args->capa * 2;
+			unsigned char *entries;
+
+			if ((entries = realloc(args->entries, capa * _RSYNC_ENTRY_SIZE)) == NULL) {
+				args->no_memory = 1;
+				break;
+			}
+
+			args->entries = entries;
+			args->capa = capa;
+		}
+
+		n = len - done < args->block_size ? len - done : args->block_size;
+		_weak_sums(data + done, n, &a, &b);
+		entry = args->entries + args->count++ * _RSYNC_ENTRY_SIZE;
+		_write_le32(entry, _weak_checksum(a, b));
+		XXH64_canonicalFromHash((XXH64_canonical_t *)(entry + 4), XXH3_64bits(data + done, n));
+		done += n;
+	}
+
+	return done;
+}
+
+static void *_signature_func(void *ptr)
+{
+	struct _signature_args *args = ptr;
+	args->done += _signature_scan(args, args->data + args->done, args->len - args->done, args->final);
+	return NULL;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void _signature_ubf(void *ptr)
+{
+	((struct _signature_args *)ptr)->interrupted = 1;
+}
+#endif
+
+static size_t _signature_process(struct _signature_args *args, const unsigned char *data,
+		size_t len, int final, int nogvl)
+{
+	args->data = data;
+	args->len = len;
+	args->final = final;
+	args->done = 0;
+
+	do {
+		args->interrupted = 0;
+
+		#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+		if (nogvl)
+			rb_thread_call_without_gvl(_signature_func, args, _signature_ubf, args);
+		else
+			_signature_func(args);
+		#else
+		_signature_func(args);
+		#endif
+
+		if (args->no_memory)
+			rb_raise(rb_eNoMemError, "Failed to allocate memory for the signature.");
+	} while (args->interrupted);
+
+	args->file_size += args->done;
+	return args->done;
+}
+
+static void _signature_set_result(struct _signature_args *args)
+{
+	unsigned char *p;
+
+	args->result = rb_str_new(0, _RSYNC_HEADER_SIZE + args->count * _RSYNC_ENTRY_SIZE);
+	p = _RSTRING_PTR_U(args->result);
+	memcpy(p, "XXHR", 4);
+	p[4] = _RSYNC_VERSION;
+	p[5] = p[6] = p[7] = 0;
+	XXH_writeLE64(p + 8, args->block_size);
+	XXH_writeLE64(p + 16, args->file_size);
+	XXH_writeLE64(p + 24, args->count);
+
+	if (args->count > 0)
+		memcpy(p + _RSYNC_HEADER_SIZE, args->entries, args->count * _RSYNC_ENTRY_SIZE);
+}
+
+static VALUE _signature_str_body(VALUE ptr)
+{
+	struct _signature_args *args = (struct _signature_args *)ptr;
+	_signature_process(args, args->input.ptr, args->input.len, 1, args->input.nogvl);
+	_signature_set_result(args);
+	return Qnil;
+}
+
+static VALUE _signature_io_body(VALUE ptr)
+{
+	struct _signature_args *args = (struct _signature_args *)ptr;
+	VALUE read_args[2];
+	size_t len = 0, done;
+
+	read_args[0] = INT2FIX(_READ_CHUNK_SIZE);
+	read_args[1] = rb_str_buf_new(_READ_CHUNK_SIZE);
+
+	while (_read_more(args->input.holder, read_args, &args->buf, &args->buf_capa, &len)) {
+		done = _signature_process(args, args->buf, len, 0, len >= _NOGVL_MIN_LENGTH);
+
+		if (done > 0) {
+			memmove(args->buf, args->buf + done, len - done);
+			len -= done;
+		}
+	}
+
+	if (len > 0)
+		_signature_process(args, args->buf, len, 1, len >= _NOGVL_MIN_LENGTH);
+
+	_signature_set_result(args);
+	return Qnil;
+}
+
+static VALUE _signature_ensure(VALUE ptr)
+{
+	struct _signature_args *args = (struct _signature_args *)ptr;
+
+	_release_input(&args->input);
+	free(args->entries);
+	free(args->buf);
+	args->entries = args->buf = NULL;
+	return Qnil;
+}
+
+static void _parse_signature(VALUE signature, struct _signature *sig)
+{
+	const unsigned char *p = _RSTRING_PTR_U(signature);
+	size_t len = RSTRING_LEN(signature);
+	unsigned long long block_size, file_size, count;
+
+	if (len < _RSYNC_HEADER_SIZE || memcmp(p, "XXHR", 4) != 0)
+		rb_raise(rb_eArgError, "Invalid signature.");
+
+	if (p[4] != _RSYNC_VERSION)
+		rb_raise(rb_eArgError, "Unsupported signature version.");
+
+	block_size = XXH_readLE64(p + 8);
+	file_size = XXH_readLE64(p + 16);
+	count = XXH_readLE64(p + 24);
+
+	if (block_size == 0 || block_size > LONG_MAX || count > len / _RSYNC_ENTRY_SIZE ||
+			count != file_size / block_size + (file_size % block_size != 0) ||
+			len != _RSYNC_HEADER_SIZE + count * _RSYNC_ENTRY_SIZE)
+		rb_raise(rb_eArgError, "Invalid signature.");
+
+	sig->entries = p + _RSYNC_HEADER_SIZE;
+	sig->block_size = block_size;
+	sig->file_size = file_size;
+	sig->count = count;
+}
+
+static size_t _signature_block_length(const struct _signature *sig, size_t i)
+{
+	return i + 1 < sig->count ? sig->block_size : sig->file_size - i * sig->block_size;
+}
+
+static size_t _delta_bucket(const struct _delta_args *args, XXH32_hash_t weak, int bits)
+{
+	return (size_t)(((XXH64_hash_t)weak * XXH_PRIME64_1) >> (64 - bits));
+}
+
+/*
+ * Finds the block matching the +len+ bytes at +p+, whose weak checksum is
+ * +weak+, and returns its index, or SIZE_MAX.  The block following the last
+ * matched one is preferred, so that copies can be merged.
+ */
+static size_t _delta_lookup(struct _delta_args *args, const unsigned char *p, size_t len,
+		XXH32_hash_t weak)
+{
+	size_t mask = ((size_t)1 << args->table_bits) - 1, i = _delta_bucket(args, weak, args->table_bits), index;
+	size_t found = SIZE_MAX;
+	const unsigned char *entry;
+	XXH64_hash_t strong = 0;
+	int hashed = 0;
+
+	for (; (index = args->table[i]) != 0; i = (i + 1) & mask) {
+		entry = args->signature.entries + --index * _RSYNC_ENTRY_SIZE;
+
+		if (XXH_readLE32(entry) != weak || _signature_block_length(&args->signature, index) != len)
+			continue;
+
+		if (! hashed) {
+			strong = XXH3_64bits(p, len);
+			hashed = 1;
+		}
+
+		if (XXH64_hashFromCanonical((const XXH64_canonical_t *)(entry + 4)) == strong) {
+			if (index == args->next_block)
+				return index;
+
+			if (found == SIZE_MAX)
+				found = index;
+		}
+	}
+
+	return found;
+}
+
+/*
+ * Adds the blocks of the signature to the table, skipping duplicates, and
+ * marks their weak checksums in the filter.
+ */
+static void _build_delta_table(struct _delta_args *args)
+{
+	const struct _signature *sig = &args->signature;
+	size_t mask = ((size_t)1 << args->table_bits) - 1, i, j;
+	const unsigned char *entry, *other;
+
+	for (i = 0; i < sig->count; ++i) {
+		entry = sig->entries + i * _RSYNC_ENTRY_SIZE;
+		j = _delta_bucket(args, XXH_readLE32(entry), args->filter_bits);
+		args->filter[j >> 3] |= 1 << (j & 7);
+
+		for (j = _delta_bucket(args, XXH_readLE32(entry), args->table_bits); args->table[j] != 0;
+				j = (j + 1) & mask) {
+			other = sig->entries + (args->table[j] - 1) * _RSYNC_ENTRY_SIZE;
+
+			if (memcmp(entry, other, _RSYNC_ENTRY_SIZE) == 0 && _signature_block_length(sig, i) ==
+					_signature_block_length(sig, args->table[j] - 1))
+				break;
+		}
+
+		if (args->table[j] == 0)
+			args->table[j] = i + 1;
+	}
+}
+
+static int _delta_add(struct _delta_args *args, size_t offset, size_t length, int copy)
+{
+	struct _delta_op *op;
+
+	if (args->count > 0) {
+		op = &args->ops[args->count - 1];
+
+		if (op->copy == copy && op->offset + op->length == offset) {
+			op->length += length;
+			return 1;
+		}
+	}
+
+	if (args->count == args->capa) {
+		size_t capa = args->capa == 0 ? 256 : args->capa * 2;
+		struct _delta_op *ops;
+
+		if ((ops = realloc(args->ops, capa * sizeof(struct _delta_op))) == NULL)
+			return 0;
+
+		args->ops = ops;
+		args->capa = capa;
+	}
+
+	op = &args->ops[args->count++];
+	op->offset = offset;
+	op->length = length;
+	op->copy = copy;
+	return 1;
+}
+
+/*
+ * Records a match of block +index+ at args->pos.  Literal operations refer
+ * to args->data.
+ */
+static int _delta_match(struct _delta_args *args, size_t index, size_t len)
+{
+	if (args->pos > args->literal_start && ! _delta_add(args, args->literal_start,
+			args->pos - args->literal_start, 0))
+		return 0;
+
+	if (! _delta_add(args, index * args->signature.block_size, len, 1))
+		return 0;
+
+	args->pos += len;
+	args->literal_start = args->pos;
+	args->next_block = index + 1;
+	args->rolling = 0;
+	return 1;
+}
+
+/*
+ * Slides the block from +pos+ until its weak checksum is marked in the filter
+ * or +end+ is reached, and returns the new position.  The filter is sparse,
+ * so most positions are rejected without a table lookup.
+ */
+static size_t _delta_roll(const struct _delta_args *args, size_t pos, size_t end,
+		XXH32_hash_t *a_p, XXH32_hash_t *b_p)
+{
+	const unsigned char *data = args->data, *filter = args->filter;
+	XXH32_hash_t a = *a_p, b = *b_p, block_size = (XXH32_hash_t)args->signature.block_size;
+	size_t bit;
+	unsigned char out;
+
+	for (; pos < end; ++pos) {
+		bit = _delta_bucket(args, _weak_checksum(a, b), args->filter_bits);
+
+		if (filter[bit >> 3] & (1 << (bit & 7)))
+			break;
+
+		out = data[pos];
+		a += data[pos + block_size] - out;
+		b += a - block_size * out;
+	}
+
+	*a_p = a;
+	*b_p = b;
+	return pos;
+}
+
+/*
+ * Slides the block over args->data from args->pos, until there's not enough
+ * data to move it further.  If args->final is set, the end of the data is
+ * also matched against the last block if it's shorter than the others.
+ */
+static void *_delta_func(void *ptr)
+{
+	struct _delta_args *args = ptr;
+	const struct _signature *sig = &args->signature;
+	const unsigned char *data = args->data;
+	size_t block_size = sig->block_size, index, last_len, end;
+	XXH32_hash_t a = args->a, b = args->b;
+	unsigned char out;
+
+	while (! args->interrupted && ! args->no_memory && sig->count > 0) {
+		if (args->pos + block_size > args->len) {
+			last_len = _signature_block_length(sig, sig->count - 1);
+
+			if (args->final && last_len < block_size && args->len - args->pos >= last_len) {
+				args->pos = args->len - last_len;
+				_weak_sums(data + args->pos, last_len, &a, &b);
+				index = _delta_lookup(args, data + args->pos, last_len, _weak_checksum(a, b));
+
+				if (index != SIZE_MAX && ! _delta_match(args, index, last_len))
+					args->no_memory = 1;
+			}
+
+			break;
+		}
+
+		if (! args->rolling) {
+			_weak_sums(data + args->pos, block_size, &a, &b);
+			args->rolling = 1;
+		}
+
+		end = args->len - block_size;
+
+		if (end - args->pos > _NOGVL_CHUNK_SIZE)
+			end = args->pos + _NOGVL_CHUNK_SIZE;
+
+		args->pos = _delta_roll(args, args->pos, end, &a, &b);
+		index = _delta_lookup(args, data + args->pos, block_size, _weak_checksum(a, b));
+
+		if (index != SIZE_MAX) {
+			if (! _delta_match(args, index, block_size))
+				args->no_memory = 1;
+
+			continue;
+		}
+
+		if (args->pos + block_size == args->len) {
+			if (! args->final)
+				break;
+
+			++args->pos;
+			args->rolling = 0;
+			continue;
+		}
+
+		out = data[args->pos];
+		a += data[args->pos + block_size] - out;
+		b += a - (XXH32_hash_t)block_size * out;
+		++args->pos;
+	}
+
+	args->a = a;
+	args->b = b;
+	return NULL;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void _delta_ubf(void *ptr)
+{
+	((struct _delta_args *)ptr)->interrupted = 1;
+}
+#endif
+
+static void _delta_push_pending(struct _delta_args *args)
+{
+	if (args->copy_length > 0) {
+		rb_ary_push(args->result, rb_range_new(SIZET2NUM(args->copy_offset),
+				SIZET2NUM(args->copy_offset + args->copy_length), 1));
+		args->copy_length = 0;
+	}
+
+	if (! NIL_P(args->literal)) {
+		rb_ary_push(args->result, args->literal);
+		args->literal = Qnil;
+	}
+}
+
+/*
+ * Moves the recorded operations to args->result.  The last copy or literal
+ * is kept pending so that it can be merged with the following operations.
+ */
+static void _delta_flush(struct _delta_args *args)
+{
+	struct _delta_op *op;
+	size_t i;
+
+	for (i = 0; i < args->count; ++i) {
+		op = &args->ops[i];
+
+		if (op->copy) {
+			if (args->copy_length > 0 && args->copy_offset + args->copy_length == op->offset) {
+				args->copy_length += op->length;
+				continue;
+			}
+
+			_delta_push_pending(args);
+			args->copy_offset = op->offset;
+			args->copy_length = op->length;
+		} else if (! NIL_P(args->literal)) {
+			rb_str_cat(args->literal, (const char *)args->data + op->offset, op->length);
+		} else {
+			_delta_push_pending(args);
+			args->literal = rb_str_new((const char *)args->data + op->offset, op->length);
+		}
+	}
+
+	args->count = 0;
+}
+
+/*
+ * Matches the data from args->pos, and records the literal data before the
+ * new position.  Returns the new position.
+ */
+static size_t _delta_process(struct _delta_args *args, const unsigned char *data, size_t len,
+		int final, int nogvl)
+{
+	args->data = data;
+	args->len = len;
+	args->final = final;
+
+	do {
+		args->interrupted = 0;
+
+		#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+		if (nogvl)
+			rb_thread_call_without_gvl(_delta_func, args, _delta_ubf, args);
+		else
+			_delta_func(args);
+		#else
+		_delta_func(args);
+		#endif
+
+		if (args->no_memory)
+			rb_raise(rb_eNoMemError, "Failed to allocate memory for the delta.");
+	} while (args->interrupted);
+
+	if (final)
+		args->pos = len;
+
+	if (args->pos > args->literal_start && ! _delta_add(args, args->literal_start,
+			args->pos - args->literal_start, 0))
+		rb_raise(rb_eNoMemError, "Failed to allocate memory for the delta.");
+
+	args->literal_start = args->pos;
+	_delta_flush(args);
+	return args->pos;
+}
+
+static VALUE _delta_str_body(VALUE ptr)
+{
+	struct _delta_args *args = (struct _delta_args *)ptr;
+	_delta_process(args, args->input.ptr, args->input.len, 1, args->input.nogvl);
+	_delta_push_pending(args);
+	return Qnil;
+}
+
+/*
+ * Reads +io+ in chunks into args->buf.  The data before the block's position
+ * is discarded after each chunk is processed.
+ */
+static VALUE _delta_io_body(VALUE ptr)
+{
+	struct _delta_args *args = (struct _delta_args *)ptr;
+	VALUE read_args[2];
+	size_t len = 0, done;
+
+	read_args[0] = INT2FIX(_READ_CHUNK_SIZE);
+	read_args[1] = rb_str_buf_new(_READ_CHUNK_SIZE);
+
+	while (_read_more(args->input.holder, read_args, &args->buf, &args->buf_capa, &len)) {
+		done = _delta_process(args, args->buf, len, 0, len >= _NOGVL_MIN_LENGTH);
+
+		if (done > 0) {
+			memmove(args->buf, args->buf + done, len - done);
+			len -= done;
+			args->pos = args->literal_start = 0;
+		}
+	}
+
+	_delta_process(args, args->buf, len, 1, len >= _NOGVL_MIN_LENGTH);
+	_delta_push_pending(args);
+	return Qnil;
+}
+
+static VALUE _delta_ensure(VALUE ptr)
+{
+	struct _delta_args *args = (struct _delta_args *)ptr;
+
+	_release_input(&args->input);
+	free(args->ops);
+	free(args->buf);
+	args->ops = NULL;
+	args->buf = NULL;
+	return Qnil;
+}
+
+/*
+ * State serialization
+ *
+ * Exported states begin with an 8-byte header: the magic "XXHS", the format
+ * version, the algorithm's ID, the kind of secret used (XXH3 only), and a
+ * reserved byte.  Numbers are stored in little endian form.
+ *
+ * XXH32:  total_len_32(4) large_len(4) acc(4 * 4) buffered_size(4) buffer
+ * XXH64:  total_len(8) acc(4 * 8) buffered_size(4) buffer
+ * XXH3:   total_len(8) stripes_so_far(8) acc(8 * 8) buffered_size(4) buffer
+ *         catch_up_bytes [seed(8) | secret_size(4) (secret | fingerprint(8))]
+ *
+ * Only the buffered part of the internal buffer is stored.  XXH3 also needs
+ * the bytes before the last stripe when the length has gone past
+ * XXH3_MIDSIZE_MAX and less than a stripe is buffered, so these are stored
+ * as well.
+ */
+
+#define _STATE_MAGIC "XXHS"
+#define _STATE_VERSION 1
+#define _STATE_HEADER_SIZE 8
+
+enum {
+	_STATE_ALGO_XXH32 = 1,
+	_STATE_ALGO_XXH64,
+	_STATE_ALGO_XXH3_64BITS,
+	_STATE_ALGO_XXH3_128BITS
+};
+
+enum {
+	_STATE_SECRET_DEFAULT = 0,
+	_STATE_SECRET_SEED,
+	_STATE_SECRET_EMBEDDED,
+	_STATE_SECRET_REFERENCED
+};
+
+struct _state_reader {
+	const unsigned char *ptr;
+	size_t left;
+};
+
+static void _put_le32(VALUE buf, XXH32_hash_t value)
+{
+	unsigned char bytes[4];
+	int i;
+
+	for (i = 0; i < 4; ++i)
+		bytes[i] = (unsigned char)(value >> (i * 8));
+
+	rb_str_buf_cat(buf, (const char *)bytes, 4);
+}
+
+static void _put_le64(VALUE buf, XXH64_hash_t value)
+{
+	unsigned char bytes[8];
+	XXH_writeLE64(bytes, value);
+	rb_str_buf_cat(buf, (const char *)bytes, 8);
+}
+
+static VALUE _new_state_buf(int algo_id, int secret_kind, size_t capa)
+{
+	VALUE buf = rb_str_buf_new(_STATE_HEADER_SIZE + capa);
+	unsigned char header[_STATE_HEADER_SIZE - 4] = { _STATE_VERSION, algo_id, secret_kind, 0 };
+
+	rb_str_buf_cat(buf, _STATE_MAGIC, 4);
+	rb_str_buf_cat(buf, (const char *)header, sizeof header);
+	return buf;
+}
+
+static void _invalid_state_data(void)
+{
+	rb_raise(rb_eArgError, "Invalid state data.");
+}
+
+static const unsigned char *_read_state_bytes(struct _state_reader *reader, size_t size)
+{
+	const unsigned char *ptr = reader->ptr;
+
+	if (reader->left < size)
+		_invalid_state_data();
+
+	reader->ptr += size;
+	reader->left -= size;
+	return ptr;
+}
+
+static XXH32_hash_t _read_state_le32(struct _state_reader *reader)
+{
+	return XXH_readLE32(_read_state_bytes(reader, 4));
+}
+
+static XXH64_hash_t _read_state_le64(struct _state_reader *reader)
+{
+	return XXH_readLE64(_read_state_bytes(reader, 8));
+}
+
+/*
+ * Checks the header of +data+ and returns the kind of secret specified in it.
+ */
+static int _open_state_data(struct _state_reader *reader, VALUE data, int algo_id)
+{
+	const unsigned char *header;
+
+	StringValue(data);
+	reader->ptr = _RSTRING_PTR_U(data);
+	reader->left = RSTRING_LEN(data);
+
+	if (reader->left < _STATE_HEADER_SIZE || memcmp(reader->ptr, _STATE_MAGIC, 4) != 0)
+		_invalid_state_data();
+
+	header = _read_state_bytes(reader, _STATE_HEADER_SIZE);
+
+	if (header[4] != _STATE_VERSION)
+		rb_raise(rb_eArgError, "Unsupported state data version: %d", header[4]);
+
+	if (header[5] != algo_id)
+		rb_raise(rb_eArgError, "State data is for a different algorithm.");
+
+	return header[6];
+}
+
+static void _close_state_data(struct _state_reader *reader)
+{
+	if (reader->left != 0)
+		_invalid_state_data();
+}
+
+static VALUE _export_xxh32_state(const XXH32_state_t *state_p)
+{
+	VALUE buf = _new_state_buf(_STATE_ALGO_XXH32, _STATE_SECRET_DEFAULT, 44);
+	int i;
+
+	_put_le32(buf, state_p->total_len_32);
+	_put_le32(buf, state_p->large_len);
+
+	for (i = 0; i < 4; ++i)
+		_put_le32(buf, state_p->acc[i]);
+
+	_put_le32(buf, state_p->bufferedSize);
+	rb_str_buf_cat(buf, (const char *)state_p->buffer, state_p->bufferedSize);
+	return buf;
+}
+
+static void _import_xxh32_state(XXH32_state_t *state_p, VALUE data)
+{
+	struct _state_reader reader;
+	XXH32_state_t state;
+	int i;
+
+	if (_open_state_data(&reader, data, _STATE_ALGO_XXH32) != _STATE_SECRET_DEFAULT)
+		_invalid_state_data();
+
+	memset(&state, 0, sizeof state);
+	state.total_len_32 = _read_state_le32(&reader);
+	state.large_len = _read_state_le32(&reader);
+
+	for (i = 0; i < 4; ++i)
+		state.acc[i] = _read_state_le32(&reader);
+
+	state.bufferedSize = _read_state_le32(&reader);
+
+	if (state.bufferedSize >= sizeof state.buffer || state.large_len > 1 ||
+			state.bufferedSize != state.total_len_32 % sizeof state.buffer ||
+			(! state.large_len && state.total_len_32 >= sizeof state.buffer))
+		_invalid_state_data();
+
+	memcpy(state.buffer, _read_state_bytes(&reader, state.bufferedSize), state.bufferedSize);
+	_close_state_data(&reader);
+	memcpy(state_p, &state, sizeof state);
+}
+
+static VALUE _export_xxh64_state(const XXH64_state_t *state_p)
+{
+	VALUE buf = _new_state_buf(_STATE_ALGO_XXH64, _STATE_SECRET_DEFAULT, 76);
+	int i;
+
+	_put_le64(buf, state_p->total_len);
+
+	for (i = 0; i < 4; ++i)
+		_put_le64(buf, state_p->acc[i]);
+
+	_put_le32(buf, state_p->bufferedSize);
+	rb_str_buf_cat(buf, (const char *)state_p->buffer, state_p->bufferedSize);
+	return buf;
+}
+
+static void _import_xxh64_state(XXH64_state_t *state_p, VALUE data)
+{
+	struct _state_reader reader;
+	XXH64_state_t state;
+	int i;
+
+	if (_open_state_data(&reader, data, _STATE_ALGO_XXH64) != _STATE_SECRET_DEFAULT)
+		_invalid_state_data();
+
+	memset(&state, 0, sizeof state);
+	state.total_len = _read_state_le64(&reader);
+
+	for (i = 0; i < 4; ++i)
+		state.acc[i] = _read_state_le64(&reader);
+
+	state.bufferedSize = _read_state_le32(&reader);
+
+	if (state.bufferedSize >= sizeof state.buffer || state.total_len < state.bufferedSize)
+		_invalid_state_data();
+
+	memcpy(state.buffer, _read_state_bytes(&reader, state.bufferedSize), state.bufferedSize);
+	_close_state_data(&reader);
+	memcpy(state_p, &state, sizeof state);
+}
+
+static size_t _xxh3_catch_up_size(const XXH3_state_t *state_p)
+{
+	if (state_p->totalLen > XXH3_MIDSIZE_MAX && state_p->bufferedSize < XXH_STRIPE_LEN)
+		return XXH_STRIPE_LEN - state_p->bufferedSize;
+
+	return 0;
+}
+
+static XXH64_hash_t _xxh3_secret_fingerprint(const void *secret, size_t size)
+{
+	return XXH3_64bits(secret, size);
+}
+
+/*
+ * Exports an XXH3 state.  If +embed_secret+ is false, a custom secret is only
+ * referenced by its size and its fingerprint.
+ */
+static VALUE _export_xxh3_state(int algo_id, const struct _xxh3_data *data_p, int embed_secret)
+{
+	const XXH3_state_t *state_p = data_p->state_p;
+	size_t catch_up_size = _xxh3_catch_up_size(state_p);
+	int secret_kind;
+	VALUE buf;
+	int i;
+
+	if (state_p->extSecret == NULL)
+		secret_kind = _STATE_SECRET_SEED;
+	else if (state_p->extSecret == XXH3_kSecret)
+		secret_kind = _STATE_SECRET_DEFAULT;
+	else
+		secret_kind = embed_secret ? _STATE_SECRET_EMBEDDED : _STATE_SECRET_REFERENCED;
+
+	buf = _new_state_buf(algo_id, secret_kind, 84 + state_p->bufferedSize + catch_up_size);
+	_put_le64(buf, state_p->totalLen);
+	_put_le64(buf, state_p->nbStripesSoFar);
+
+	for (i = 0; i < 8; ++i)
+		_put_le64(buf, state_p->acc[i]);
+
+	_put_le32(buf, state_p->bufferedSize);
+	rb_str_buf_cat(buf, (const char *)state_p->buffer, state_p->bufferedSize);
+	rb_str_buf_cat(buf, (const char *)state_p->buffer + sizeof state_p->buffer - catch_up_size,
+			catch_up_size);
+
+	switch (secret_kind) {
+	case _STATE_SECRET_SEED:
+		_put_le64(buf, state_p->seed);
+		break;
+	case _STATE_SECRET_EMBEDDED:
+		_put_le32(buf, data_p->secret_size);
+		rb_str_buf_cat(buf, (const char *)data_p->secret, data_p->secret_size);
+		break;
+	case _STATE_SECRET_REFERENCED:
+		_put_le32(buf, data_p->secret_size);
+		_put_le64(buf, _xxh3_secret_fingerprint(data_p->secret, data_p->secret_size));
+		break;
+	}
+
+	return buf;
+}
+
+/*
+ * Imports an XXH3 state.  +secret+ is needed if the state data only
+ * references its custom secret.
+ */
+static void _import_xxh3_state(int algo_id, struct _xxh3_data *data_p, VALUE data, VALUE secret)
+{
+	struct _state_reader reader;
+	union _any_state any_state;
+	XXH3_state_t *state_p = &any_state.xxh3;
+	XXH64_hash_t total_len, stripes_so_far, acc[8];
+	XXH32_hash_t buffered_size;
+	const unsigned char *buffer, *catch_up, *secret_ptr = NULL;
+	size_t catch_up_size, secret_size = 0;
+	int secret_kind, i;
+
+	secret_kind = _open_state_data(&reader, data, algo_id);
+	total_len = _read_state_le64(&reader);
+	stripes_so_far = _read_state_le64(&reader);
+
+	for (i = 0; i < 8; ++i)
+		acc[i] = _read_state_le64(&reader);
+
+	buffered_size = _read_state_le32(&reader);
+
+	if (buffered_size > XXH3_INTERNALBUFFER_SIZE || total_len < buffered_size)
+		_invalid_state_data();
+
+	buffer = _read_state_bytes(&reader, buffered_size);
+	catch_up_size = total_len > XXH3_MIDSIZE_MAX && buffered_size < XXH_STRIPE_LEN ?
+			XXH_STRIPE_LEN - buffered_size : 0;
+	catch_up = _read_state_bytes(&reader, catch_up_size);
+	memset(state_p, 0, sizeof *state_p);
+
+	switch (secret_kind) {
+	case _STATE_SECRET_DEFAULT:
+		XXH3_64bits_reset(state_p);
+		break;
+	case _STATE_SECRET_SEED:
+		XXH3_64bits_reset_withSeed(state_p, _read_state_le64(&reader));
+		break;
+	case _STATE_SECRET_EMBEDDED:
+		secret_size = _read_state_le32(&reader);
+		secret_ptr = _read_state_bytes(&reader, secret_size);
+		break;
+	case _STATE_SECRET_REFERENCED:
+		secret_size = _read_state_le32(&reader);
+
+		if (NIL_P(secret))
+			rb_raise(rb_eArgError, "State data references a custom secret; it needs to be "
+					"specified with 'secret'.");
+
+		StringValue(secret);
+
+		if ((size_t)RSTRING_LEN(secret) != secret_size || _read_state_le64(&reader) !=
+				_xxh3_secret_fingerprint(RSTRING_PTR(secret), secret_size))
+			rb_raise(rb_eArgError, "Secret doesn't match the one used by the state.");
+
+		secret_ptr = _RSTRING_PTR_U(secret);
+		break;
+	default:
+		_invalid_state_data();
+	}
+
+	_close_state_data(&reader);
+	_xxh3_check_idle(data_p);
+
+	if (secret_ptr != NULL) {
+		if (secret_size < XXH3_SECRET_SIZE_MIN)
+			_invalid_state_data();
+
+		XXH3_64bits_reset_withSecret(state_p, secret_ptr, secret_size);
+	}
+
+	if (stripes_so_far >= state_p->nbStripesPerBlock)
+		_invalid_state_data();
+
+	state_p->totalLen = total_len;
+	state_p->nbStripesSoFar = stripes_so_far;
+	memcpy(state_p->acc, acc, sizeof acc);
+	state_p->bufferedSize = buffered_size;
+	memcpy(state_p->buffer, buffer, buffered_size);
+	memcpy(state_p->buffer + sizeof state_p->buffer - catch_up_size, catch_up, catch_up_size);
+
+	if (secret_ptr != NULL)
+		state_p->extSecret = _xxh3_copy_secret_bytes(data_p, secret_ptr, secret_size);
+	else
+		_xxh3_free_secret(data_p);
+
+	memcpy(data_p->state_p, state_p, sizeof *state_p);
+}
+
+/*
+ * Gets the 'secret' option given to export_state and returns true if the
+ * secret is to be embedded.
+ */
+static int _get_embed_secret_opt(int argc, VALUE *argv)
+{
+	ID keywords[1];
+	VALUE opts, secret_opt = Qundef;
+
+	keywords[0] = _id_secret;
+	rb_scan_args(argc, argv, "0:", &opts);
+
+	if (! NIL_P(opts))
+		rb_get_kwargs(opts, keywords, 0, 1, &secret_opt);
+
+	if (secret_opt == Qundef || secret_opt == ID2SYM(_id_embed))
+		return 1;
+
+	if (secret_opt == ID2SYM(_id_reference))
+		return 0;
+
+	rb_raise(rb_eArgError, "Option 'secret' needs to be :embed or :reference.");
+}
+
+/*
+ * Gets the data argument and the 'secret' option given to import_state.
+ */
+static VALUE _get_import_args(int argc, VALUE *argv, VALUE *secret_p)
+{
+	ID keywords[1];
+	VALUE data, opts, secret = Qundef;
+
+	keywords[0] = _id_secret;
+	rb_scan_args(argc, argv, "1:", &data, &opts);
+
+	if (! NIL_P(opts))
+		rb_get_kwargs(opts, keywords, 0, 1, &secret);
+
+	*secret_p = secret == Qundef ? Qnil : secret;
+	return data;
+}
+
+/*
+ * Document-class: Digest::XXHash
+ *
+ * This is the base class of Digest::XXH32, Digest::XXH64,
+ * Digest::XXH3_64bits, and Digest::XXH3_128bits.
+ */
+
+static VALUE _Digest_XXHash_internal_allocate(VALUE klass)
+{
+	if (klass == _Digest_XXHash)
+		rb_raise(rb_eRuntimeError, "Digest::XXHash is an incomplete class and cannot be "
+				"instantiated.");
+
+	rb_raise(rb_eNotImpError, "Allocator function not implemented.");
+}
+
+/*
+ * call-seq:
+ *     new -> instance
+ *     new(seed) -> instance
+ *
+ * Returns a new hash instance.
+ *
+ * If seed is provided, the state is reset with its value, otherwise the default
+ * seed (0) is used.
+ *
+ * +seed+ can be in the form of a string, a hex string, or a number.
+ */
+static VALUE _Digest_XXHash_initialize(int argc, VALUE* argv, VALUE self)
+{
+	if (argc > 0)
+		rb_funcallv(self, _id_reset, argc, argv);
+
+	return self;
+}
+
+/* :nodoc: */
+static VALUE _Digest_XXHash_ifinish(VALUE self)
+{
+	rb_raise(rb_eNotImpError, "Method not implemented.");
+}
+
+static VALUE _do_digest(int argc, VALUE* argv, VALUE self, ID finish_method_id)
+{
+	VALUE str, seed, opts, result;
+	int argc2 = argc > 0 ? rb_scan_args(argc, argv, "02:", &str, &seed, &opts) : 0;
+
+	if (argc2 > 0) {
+		_check_input(str);
+
+		if (argc2 > 1)
+			rb_funcall(self, _id_reset, 1, seed);
+		else
+			rb_funcall(self, _id_reset, 0);
+
+		_funcall_with_opts(self, _id_update, 1, &str, opts);
+	} else if (argc > 0) {
+		rb_raise(rb_eArgError, "Options can only be specified along with a string or buffer.");
+	}
+
+	result = rb_funcall(self, finish_method_id, 0);
+
+	if (argc2 > 0)
+		rb_funcall(self, _id_reset, 0);
+
+	return result;
+}
+
+/*
+ * call-seq:
+ *     digest -> str
+ *     digest(str, seed = 0) -> str
+ *
+ * Returns digest value in string form.
+ *
+ * If no argument is provided, the current digest value is returned, and no
+ * reset happens.
+ *
+ * If a string argument is provided, the string's digest value is calculated
+ * with +seed+, and is used as the return value.  The instance's state is reset
+ * to default afterwards.
+ *
+ * An IO::Buffer or an object exporting a memory view can also be used in
+ * place of the string.  Options like +offset+, +length+, and +casefold+ are
+ * passed to #update.
+ *
+ * Providing an argument means that previous initializations done with custom
+ * seeds or secrets, and previous calculations done with #update would be
+ * discarded, so be careful with its use.
+ *
+ * +seed+ can be in the form of a string, a hex string, or a number.
+ */
+static VALUE _Digest_XXHash_digest(int argc, VALUE* argv, VALUE self)
+{
+	return _do_digest(argc, argv, self, _id_finish);
+}
+
+/*
+ * call-seq:
+ *     hexdigest -> hex_str
+ *     hexdigest(str) -> hex_str
+ *     hexdigest(str, seed) -> hex_str
+ *
+ * Same as #digest but returns the digest value in hex form.
+ */
+static VALUE _Digest_XXHash_hexdigest(int argc, VALUE* argv, VALUE self)
+{
+	return _hex_encode_str(_do_digest(argc, argv, self, _id_finish));
+}
+
+/*
+ * call-seq:
+ *     idigest -> num
+ *     idigest(str) -> num
+ *     idigest(str, seed) -> num
+ *
+ * Same as #digest but returns the digest value in numerical form.
+ */
+static VALUE _Digest_XXHash_idigest(int argc, VALUE* argv, VALUE self)
+{
+	return _do_digest(argc, argv, self, _id_ifinish);
+}
+
+/*
+ * call-seq: idigest!
+ *
+ * Returns current digest value and resets state to default form.
+ */
+static VALUE _Digest_XXHash_idigest_bang(VALUE self)
+{
+	VALUE result;
+	result = rb_funcall(self, _id_ifinish, 0);
+	rb_funcall(self, _id_reset, 0);
+	return result;
+}
+
+/*
+ * call-seq: initialize_copy(orig) -> self
+ *
+ * This method is called when instances are cloned.  It is responsible for
+ * replicating internal data.
+ */
+static VALUE _Digest_XXHash_initialize_copy(VALUE self, VALUE orig)
+{
+	rb_raise(rb_eNotImpError, "initialize_copy method not implemented.");
+}
+
+/*
+ * call-seq: inspect -> str
+ *
  * Returns a string in the form of <tt>#<class_name|hex_digest></tt>.
  */
-static VALUE _Digest_XXHash_inspect(VALUE self)
+static VALUE _Digest_XXHash_inspect(VALUE self)
+{
+	VALUE klass, klass_name, hexdigest, args[2];
+	klass = rb_obj_class(self);
+	klass_name = rb_class_name(klass);
+
+	if (klass_name == Qnil)
+		klass_name = rb_inspect(klass);
+
+	hexdigest = rb_funcall(self, _id_hexdigest, 0);
+
+	args[0] = klass_name;
+	args[1] = hexdigest;
+	return rb_str_format(sizeof(args), args, rb_str_new_literal("#<%s|%s>"));
+}
+
+static VALUE _instantiate_and_digest(int argc, VALUE* argv, VALUE klass, ID digest_method_id)
+{
+	VALUE str, seed, opts, instance;
+	int argc2;
+
+	argc2 = rb_scan_args(argc, argv, "11:", &str, &seed, &opts);
+	_check_input(str);
+	instance = rb_funcall(klass, _id_new, 0);
+	return _funcall_with_opts(instance, digest_method_id, argc2, argv, opts);
+}
+
+/*
+ * call-seq: Digest::XXHash::digest(str, seed = 0, **opts) -> str
+ *
+ * Returns the digest value of +str+ in string form with +seed+ as its seed.
+ *
+ * +str+ can also be an IO::Buffer or an object exporting a memory view.
+ * Options like +offset+, +length+, and +casefold+ are passed to #update.
+ *
+ * +seed+ can be in the form of a string, a hex string, or a number.
+ *
+ * If +seed+ is not provided, the default value would be 0.
+ */
+static VALUE _Digest_XXHash_singleton_digest(int argc, VALUE* argv, VALUE self)
+{
+	return _instantiate_and_digest(argc, argv, self, _id_digest);
+}
+
+/*
+ * call-seq: Digest::XXHash::hexdigest -> hex_str
+ *
+ * Same as ::digest but returns the digest value in hex form.
+ */
+static VALUE _Digest_XXHash_singleton_hexdigest(int argc, VALUE* argv, VALUE self)
+{
+	return _instantiate_and_digest(argc, argv, self, _id_hexdigest);
+}
+
+/*
+ * call-seq: Digest::XXHash::idigest -> num
+ *
+ * Same as ::digest but returns the digest value in numerical form.
+ */
+static VALUE _Digest_XXHash_singleton_idigest(int argc, VALUE* argv, VALUE self)
+{
+	return _instantiate_and_digest(argc, argv, self, _id_idigest);
+}
+
+/*
+ * call-seq: Digest::XXHash::simd_level -> sym
+ *
+ * Returns the vector instructions used by ::idigest_many of Digest::XXH32
+ * and Digest::XXH64 to hash several strings at once.  It can be +:avx512+,
+ * +:avx2+, or +:scalar+.
+ */
+static VALUE _Digest_XXHash_singleton_simd_level(VALUE self)
+{
+	switch (multibuf_level()) {
+	case MULTIBUF_AVX512:
+		return ID2SYM(_id_avx512);
+	case MULTIBUF_AVX2:
+		return ID2SYM(_id_avx2);
+	default:
+		return ID2SYM(_id_scalar);
+	}
+}
+
+/*
+ * call-seq: Digest::XXHash::simd_level=(sym)
+ *
+ * Limits the vector instructions used by ::idigest_many to +sym+, which can
+ * be +:avx512+, +:avx2+, or +:scalar+.  Instructions not supported by the
+ * processor are still never used.  This mainly exists for testing and
+ * benchmarking.
+ *
+ * The limit is shared by the whole process, so it can only be set from the
+ * main Ractor.
+ */
+static VALUE _Digest_XXHash_singleton_simd_level_set(VALUE self, VALUE level)
+{
+	#ifdef HAVE_RB_EXT_RACTOR_SAFE
+	VALUE ractor = rb_const_get(rb_cObject, _id_Ractor);
+
+	if (rb_funcall(ractor, _id_current, 0) != rb_funcall(ractor, _id_main, 0))
+		rb_raise(rb_eRuntimeError, "SIMD level can only be set from the main Ractor.");
+	#endif
+
+	if (level == ID2SYM(_id_avx512))
+		multibuf_set_level(MULTIBUF_AVX512);
+	else if (level == ID2SYM(_id_avx2))
+		multibuf_set_level(MULTIBUF_AVX2);
+	else if (level == ID2SYM(_id_scalar))
+		multibuf_set_level(MULTIBUF_SCALAR);
+	else
+		rb_raise(rb_eArgError, "Invalid SIMD level.");
+
+	return level;
+}
+
+/*
+ * Document-class: Digest::XXH32
+ *
+ * This class implements XXH32.
+ */
+
+static VALUE _Digest_XXH32_internal_allocate(VALUE klass)
+{
+	struct _xxh32_data *data_p = ALLOC(struct _xxh32_data);
+	data_p->busy = 0;
+
+	if ((data_p->state_p = XXH32_createState()) == NULL) {
+		xfree(data_p);
+		rb_raise(rb_eNoMemError, "Failed to allocate state.");
+	}
+
+	_xxh32_reset(data_p->state_p, 0);
+	return TypedData_Wrap_Struct(klass, &_xxh32_state_data_type, data_p);
+}
+
+/*
+ * call-seq:
+ *     update(str) -> self
+ *     update(str_or_buffer, offset: 0, length: nil) -> self
+ *     update(str_or_buffer, progress: callable, progress_interval: 64 MiB) -> self
+ *     update(str_or_buffer, casefold: true) -> self
+ *
+ * Updates current digest value with a string, an IO::Buffer, or any object
+ * exporting a contiguous memory view, like a Fiddle::Pointer or a numerical
+ * array from an extension supporting the MemoryView protocol.
+ *
+ * +offset+ and +length+ select a range of bytes to hash instead of the whole
+ * data.  The data is hashed in place, so no copy of it is made.
+ *
+ * Data at least 1 MiB in length is hashed with the GVL released, 1 MiB at a
+ * time, so interrupts like Thread#kill, Timeout, and signals are still handled
+ * while it's being processed.  If hashing gets interrupted by an exception,
+ * the state would only include part of the data.  Meanwhile, other threads
+ * and the progress callback get a RuntimeError from methods that would change
+ * the state, like #reset.
+ *
+ * If +progress+ is specified, it is called every +progress_interval+ bytes,
+ * and once after the last byte, with the number of bytes processed so far
+ * and the total number of bytes as arguments.  Empty data gets one call with
+ * 0 as both.  A string changed by the callback is still hashed as it was,
+ * and an IO::Buffer stays locked until the update ends.
+ *
+ * If +casefold+ is true, ASCII uppercase letters are hashed as lowercase,
+ * giving the same digest as hashing <tt>str.downcase(:ascii)</tt> without
+ * making a copy of the data.
+ */
+static VALUE _Digest_XXH32_update(int argc, VALUE* argv, VALUE self)
+{
+	struct _xxh32_data *data_p = _get_data_xxh32(self);
+	_busy_update(&data_p->busy, _update_state, argc, argv, data_p->state_p, _xxh32_update_func);
+	return self;
+}
+
+/*
+ * call-seq: file(path, read_ahead: 4, cache: nil) -> self
+ *
+ * Reads the file at +path+ and updates the state with its contents.
+ *
+ * A reader thread fills up to +read_ahead+ buffers of 1 MiB ahead while the
+ * calling thread hashes the filled ones with the GVL released, so waiting
+ * for the disk overlaps with hashing.
+ *
+ * Only regular files can be read.  Directories raise Errno::EISDIR, and
+ * other files, like FIFOs, raise Errno::EINVAL.
+ *
+ * If +cache+ is +:bypass+, the file is read without filling the page cache,
+ * so hashing large cold files doesn't evict the cached data of other
+ * processes.  It's read with O_DIRECT where the file system supports it, and
+ * otherwise each range is dropped from the cache once read.  Pages of the
+ * file that were already cached before they were read, like those of other
+ * processes reading it, are kept.
+ */
+static VALUE _Digest_XXH32_file(int argc, VALUE* argv, VALUE self)
+{
+	struct _xxh32_data *data_p = _get_data_xxh32(self);
+	_busy_update(&data_p->busy, _update_file, argc, argv, data_p->state_p, _xxh32_update_func);
+	return self;
+}
+
+/* :nodoc: */
+static VALUE _Digest_XXH32_finish(VALUE self)
+{
+	XXH64_hash_t hash = XXH32_digest(_get_state_xxh32(self));
+	VALUE str = rb_usascii_str_new(0, sizeof(XXH32_canonical_t));
+	XXH32_canonicalFromHash((XXH32_canonical_t *)RSTRING_PTR(str), hash);
+	return str;
+}
+
+/* :nodoc: */
+static VALUE _Digest_XXH32_ifinish(VALUE self)
+{
+	XXH32_hash_t hash = XXH32_digest(_get_state_xxh32(self));
+	return ULONG2NUM(hash);
+}
+
+/*
+ * call-seq: reset(seed = 0) -> self
+ *
+ * Resets state to initial form with seed.
+ *
+ * This discards previous calculations with #update.
+ *
+ * +seed+ can be in the form of a string, a hex string, or a number.
+ * Its virtual length should be 32-bits.
+ *
+ * If +seed+ is not provided, the default value would be 0.
+ */
+static VALUE _Digest_XXH32_reset(int argc, VALUE* argv, VALUE self)
+{
+	VALUE seed;
+
+	_check_idle(_get_data_xxh32(self)->busy);
+
+	if (argc > 0 && rb_scan_args(argc, argv, "01", &seed) > 0) {
+		switch (TYPE(seed)) {
+		case T_STRING:
+			{
+				int len = RSTRING_LEN(seed);
+				XXH32_hash_t decoded_seed;
+
+				if (len == _TWICE(sizeof(XXH32_hash_t))) {
+					unsigned char hex_decoded_seed[sizeof(XXH32_hash_t)];
+
+					if (! hex_decode_str_implied(_RSTRING_PTR_U(seed), len, hex_decoded_seed))
+						rb_raise(rb_eArgError, "Invalid hex string seed: %s\n",
+								StringValueCStr(seed));
+
+					decoded_seed = XXH_readBE32(hex_decoded_seed);
+				} else if (len == sizeof(XXH32_hash_t)) {
+					decoded_seed = XXH_readBE32(RSTRING_PTR(seed));
+				} else {
+					rb_raise(rb_eArgError, "Invalid seed length.  "
+							"Expecting an 8-character hex string or a 4-byte string.");
+				}
+
+				_xxh32_reset(_get_state_xxh32(self), decoded_seed);
+			}
+
+			break;
+		case T_FIXNUM:
+			_xxh32_reset(_get_state_xxh32(self), FIX2UINT(seed));
+			break;
+		case T_BIGNUM:
+			_xxh32_reset(_get_state_xxh32(self), NUM2UINT(seed));
+			break;
+		default:
+			rb_raise(rb_eArgError, "Invalid argument type for 'seed'.  "
+					"Expecting a string or a number.");
+		}
+	} else {
+		_xxh32_reset(_get_state_xxh32(self), _XXH32_DEFAULT_SEED);
+	}
+
+	return self;
+}
+
+/*
+ * call-seq: initialize_copy(orig) -> self
+ *
+ * This method is called when instances are cloned.  It is responsible for
+ * replicating internal data.
+ */
+static VALUE _Digest_XXH32_initialize_copy(VALUE self, VALUE orig)
+{
+	_check_idle(_get_data_xxh32(self)->busy);
+	XXH32_copyState(_get_state_xxh32(self), _get_state_xxh32(orig));
+	return self;
+}
+
+/*
+ * call-seq: freeze_prefix -> prefix
+ *
+ * Returns a Digest::XXHash::Prefix capturing the current state.  It can then
+ * be used to hash many messages that begin with the data hashed so far.
+ *
+ * The instance itself isn't changed.
+ */
+static VALUE _Digest_XXH32_freeze_prefix(VALUE self)
+{
+	return _new_prefix(&_xxh32_algo, _get_state_xxh32(self), NULL, 0);
+}
+
+/*
+ * call-seq: export_state -> str
+ *
+ * Returns the current state in a compact, versioned binary form.  It only
+ * holds the accumulators, the buffered data, and the length hashed so far.
+ *
+ * The state can be restored with #import_state, even on another host, and
+ * hashing can then continue where it left off.
+ */
+static VALUE _Digest_XXH32_export_state(VALUE self)
+{
+	return _export_xxh32_state(_get_state_xxh32(self));
+}
+
+/*
+ * call-seq: import_state(str) -> self
+ *
+ * Restores a state exported with #export_state.
+ *
+ * Raises ArgumentError if the data is invalid or was exported from a
+ * different algorithm.
+ */
+static VALUE _Digest_XXH32_import_state(VALUE self, VALUE data)
+{
+	_check_idle(_get_data_xxh32(self)->busy);
+	_import_xxh32_state(_get_state_xxh32(self), data);
+	return self;
+}
+
+/* :nodoc: */
+static VALUE _Digest_XXH32_marshal_dump(VALUE self)
+{
+	return _Digest_XXH32_export_state(self);
+}
+
+/* :nodoc: */
+static VALUE _Digest_XXH32_marshal_load(VALUE self, VALUE data)
+{
+	return _Digest_XXH32_import_state(self, data);
+}
+
+/*
+ * call-seq: digest_length -> int
+ *
+ * Returns 4
+ */
+static VALUE _Digest_XXH32_digest_length(VALUE self)
+{
+	return INT2FIX(_XXH32_DIGEST_SIZE);
+}
+
+/*
+ * call-seq: block_length  -> int
+ *
+ * Returns 4
+ */
+static VALUE _Digest_XXH32_block_length(VALUE self)
+{
+	return INT2FIX(_XXH32_BLOCK_SIZE);
+}
+
+/*
+ * call-seq: digest_length -> int
+ *
+ * Returns 4
+ */
+static VALUE _Digest_XXH32_singleton_digest_length(VALUE self)
+{
+	return INT2FIX(_XXH32_DIGEST_SIZE);
+}
+
+/*
+ * call-seq: block_length -> int
+ *
+ * Returns 4
+ */
+static VALUE _Digest_XXH32_singleton_block_length(VALUE self)
+{
+	return INT2FIX(_XXH32_BLOCK_SIZE);
+}
+
+/*
+ * call-seq:
+ *     idigest_seeds(str, seeds) -> array
+ *     idigest_seeds(str, seeds, packed: true) -> str
+ *
+ * Returns the digests of +str+ hashed with each seed in +seeds+, computed in
+ * a single call.  Seeds need to be numbers that fit in 32 bits.
+ *
+ * If +packed+ is true, the digests are returned packed into a single string
+ * instead, each in the same form as the one returned by ::digest.
+ */
+static VALUE _Digest_XXH32_singleton_idigest_seeds(int argc, VALUE* argv, VALUE self)
+{
+	return _idigest_seeds(argc, argv, &_xxh32_algo);
+}
+
+/*
+ * call-seq:
+ *     idigest_seeds_many(strings, seeds) -> array
+ *     idigest_seeds_many(strings, seeds, packed: true) -> str
+ *
+ * Same as ::idigest_seeds but hashes each string in +strings+.  Returns an
+ * array of arrays of digests, or all digests packed into a single string,
+ * grouped by string.
+ */
+static VALUE _Digest_XXH32_singleton_idigest_seeds_many(int argc, VALUE* argv, VALUE self)
+{
+	return _idigest_seeds_many(argc, argv, &_xxh32_algo);
+}
+
+/*
+ * call-seq:
+ *     idigest_many(strings, seed = 0) -> array
+ *     idigest_many(strings, seed = 0, packed: true) -> str
+ *
+ * Returns the digests of each string in +strings+, computed in a single
+ * call.  +seed+ needs to be a number that fits in 32 bits.
+ *
+ * If +packed+ is true, the digests are returned packed into a single string
+ * instead, each in the same form as the one returned by ::digest.
+ *
+ * With AVX2 or AVX-512, long strings are hashed 8 or 16 at a time, one
+ * string per vector lane.  See Digest::XXHash::simd_level.
+ */
+static VALUE _Digest_XXH32_singleton_idigest_many(int argc, VALUE* argv, VALUE self)
+{
+	return _idigest_many(argc, argv, &_xxh32_algo);
+}
+
+/*
+ * Document-class: Digest::XXH64
+ *
+ * This class implements XXH64.
+ */
+
+static VALUE _Digest_XXH64_internal_allocate(VALUE klass)
+{
+	struct _xxh64_data *data_p = ALLOC(struct _xxh64_data);
+	data_p->busy = 0;
+
+	if ((data_p->state_p = XXH64_createState()) == NULL) {
+		xfree(data_p);
+		rb_raise(rb_eNoMemError, "Failed to allocate state.");
+	}
+
+	_xxh64_reset(data_p->state_p, 0);
+	return TypedData_Wrap_Struct(klass, &_xxh64_state_data_type, data_p);
+}
+
+/*
+ * call-seq:
+ *     update(str) -> self
+ *     update(str_or_buffer, offset: 0, length: nil) -> self
+ *     update(str_or_buffer, progress: callable, progress_interval: 64 MiB) -> self
+ *     update(str_or_buffer, casefold: true) -> self
+ *
+ * Updates current digest value with a string, an IO::Buffer, or any object
+ * exporting a contiguous memory view, like a Fiddle::Pointer or a numerical
+ * array from an extension supporting the MemoryView protocol.
+ *
+ * +offset+ and +length+ select a range of bytes to hash instead of the whole
+ * data.  The data is hashed in place, so no copy of it is made.
+ *
+ * Data at least 1 MiB in length is hashed with the GVL released, 1 MiB at a
+ * time, so interrupts like Thread#kill, Timeout, and signals are still handled
+ * while it's being processed.  If hashing gets interrupted by an exception,
+ * the state would only include part of the data.  Meanwhile, other threads
+ * and the progress callback get a RuntimeError from methods that would change
+ * the state, like #reset.
+ *
+ * If +progress+ is specified, it is called every +progress_interval+ bytes,
+ * and once after the last byte, with the number of bytes processed so far
+ * and the total number of bytes as arguments.  Empty data gets one call with
+ * 0 as both.  A string changed by the callback is still hashed as it was,
+ * and an IO::Buffer stays locked until the update ends.
+ *
+ * If +casefold+ is true, ASCII uppercase letters are hashed as lowercase,
+ * giving the same digest as hashing <tt>str.downcase(:ascii)</tt> without
+ * making a copy of the data.
+ */
+static VALUE _Digest_XXH64_update(int argc, VALUE* argv, VALUE self)
+{
+	struct _xxh64_data *data_p = _get_data_xxh64(self);
+	_busy_update(&data_p->busy, _update_state, argc, argv, data_p->state_p, _xxh64_update_func);
+	return self;
+}
+
+/*
+ * call-seq: file(path, read_ahead: 4, cache: nil) -> self
+ *
+ * Reads the file at +path+ and updates the state with its contents.
+ *
+ * A reader thread fills up to +read_ahead+ buffers of 1 MiB ahead while the
+ * calling thread hashes the filled ones with the GVL released, so waiting
+ * for the disk overlaps with hashing.
+ *
+ * Only regular files can be read.  Directories raise Errno::EISDIR, and
+ * other files, like FIFOs, raise Errno::EINVAL.
+ *
+ * If +cache+ is +:bypass+, the file is read without filling the page cache,
+ * so hashing large cold files doesn't evict the cached data of other
+ * processes.  It's read with O_DIRECT where the file system supports it, and
+ * otherwise each range is dropped from the cache once read.  Pages of the
+ * file that were already cached before they were read, like those of other
+ * processes reading it, are kept.
+ */
+static VALUE _Digest_XXH64_file(int argc, VALUE* argv, VALUE self)
+{
+	struct _xxh64_data *data_p = _get_data_xxh64(self);
+	_busy_update(&data_p->busy, _update_file, argc, argv, data_p->state_p, _xxh64_update_func);
+	return self;
+}
+
+/* :nodoc: */
+static VALUE _Digest_XXH64_finish(VALUE self)
+{
+	XXH64_hash_t hash = XXH64_digest(_get_state_xxh64(self));
+	VALUE str = rb_usascii_str_new(0, sizeof(XXH64_canonical_t));
+	XXH64_canonicalFromHash((XXH64_canonical_t *)RSTRING_PTR(str), hash);
+	return str;
+}
+
+/* :nodoc: */
+static VALUE _Digest_XXH64_ifinish(VALUE self)
+{
+	XXH64_hash_t hash = XXH64_digest(_get_state_xxh64(self));
+	return ULL2NUM(hash);
+}
+
+/*
+ * call-seq: reset(seed = 0) -> self
+ *
+ * Resets state to initial form with seed.
+ *
+ * This discards previous calculations with #update.
+ *
+ * +seed+ can be in the form of a string, a hex string, or a number.
+ * Its virtual length should be 64-bits.
+ *
+ * If +seed+ is not provided, the default value would be 0.
+ */
+static VALUE _Digest_XXH64_reset(int argc, VALUE* argv, VALUE self)
+{
+	VALUE seed;
+
+	_check_idle(_get_data_xxh64(self)->busy);
+
+	if (rb_scan_args(argc, argv, "01", &seed) > 0) {
+		switch (TYPE(seed)) {
+		case T_STRING:
+			{
+				int len = RSTRING_LEN(seed);
+				XXH64_hash_t decoded_seed;
+
+				if (len == _TWICE(sizeof(XXH64_hash_t))) {
+					unsigned char hex_decoded_seed[sizeof(XXH64_hash_t)];
+
+					if (! hex_decode_str_implied(_RSTRING_PTR_U(seed), len, hex_decoded_seed))
+						rb_raise(rb_eArgError, "Invalid hex string seed: %s\n",
+								StringValueCStr(seed));
+
+					decoded_seed = XXH_readBE64(hex_decoded_seed);
+				} else if (len == sizeof(XXH64_hash_t)) {
+					decoded_seed = XXH_readBE64(RSTRING_PTR(seed));
+				} else {
+					rb_raise(rb_eArgError, "Invalid seed length.  "
+							"Expecting a 16-character hex string or an 8-byte string.");
+				}
+
+				_xxh64_reset(_get_state_xxh64(self), decoded_seed);
+			}
+
+			break;
+		case T_FIXNUM:
+		case T_BIGNUM:
+			_xxh64_reset(_get_state_xxh64(self), NUM2ULL(seed));
+			break;
+		default:
+			rb_raise(rb_eArgError, "Invalid argument type for 'seed'.  "
+					"Expecting a string or a number.");
+		}
+	} else {
+		_xxh64_reset(_get_state_xxh64(self), _XXH64_DEFAULT_SEED);
+	}
+
+	return self;
+}
+
+/*
+ * call-seq: initialize_copy(orig) -> self
+ *
+ * This method is called when instances are cloned.  It is responsible for
+ * replicating internal data.
+ */
+static VALUE _Digest_XXH64_initialize_copy(VALUE self, VALUE orig)
+{
+	_check_idle(_get_data_xxh64(self)->busy);
+	XXH64_copyState(_get_state_xxh64(self), _get_state_xxh64(orig));
+	return self;
+}
+
+/*
+ * call-seq: freeze_prefix -> prefix
+ *
+ * Returns a Digest::XXHash::Prefix capturing the current state.  It can then
+ * be used to hash many messages that begin with the data hashed so far.
+ *
+ * The instance itself isn't changed.
+ */
+static VALUE _Digest_XXH64_freeze_prefix(VALUE self)
+{
+	return _new_prefix(&_xxh64_algo, _get_state_xxh64(self), NULL, 0);
+}
+
+/*
+ * call-seq: export_state -> str
+ *
+ * Returns the current state in a compact, versioned binary form.  It only
+ * holds the accumulators, the buffered data, and the length hashed so far.
+ *
+ * The state can be restored with #import_state, even on another host, and
+ * hashing can then continue where it left off.
+ */
+static VALUE _Digest_XXH64_export_state(VALUE self)
+{
+	return _export_xxh64_state(_get_state_xxh64(self));
+}
+
+/*
+ * call-seq: import_state(str) -> self
+ *
+ * Restores a state exported with #export_state.
+ *
+ * Raises ArgumentError if the data is invalid or was exported from a
+ * different algorithm.
+ */
+static VALUE _Digest_XXH64_import_state(VALUE self, VALUE data)
+{
+	_check_idle(_get_data_xxh64(self)->busy);
+	_import_xxh64_state(_get_state_xxh64(self), data);
+	return self;
+}
+
+/* :nodoc: */
+static VALUE _Digest_XXH64_marshal_dump(VALUE self)
+{
+	return _Digest_XXH64_export_state(self);
+}
+
+/* :nodoc: */
+static VALUE _Digest_XXH64_marshal_load(VALUE self, VALUE data)
+{
+	return _Digest_XXH64_import_state(self, data);
+}
+
+/*
+ * call-seq: digest_length -> int
+ *
+ * Returns 8
+ */
+static VALUE _Digest_XXH64_digest_length(VALUE self)
+{
+	return INT2FIX(_XXH64_DIGEST_SIZE);
+}
+
+/*
+ * call-seq: block_length -> int
+ *
+ * Returns 8
+ */
+static VALUE _Digest_XXH64_block_length(VALUE self)
+{
+	return INT2FIX(_XXH64_BLOCK_SIZE);
+}
+
+/*
+ * call-seq: digest_length -> int
+ *
+ * Returns 8
+ */
+static VALUE _Digest_XXH64_singleton_digest_length(VALUE self)
+{
+	return INT2FIX(_XXH64_DIGEST_SIZE);
+}
+
+/*
+ * call-seq: block_length -> int
+ *
+ * Returns 8
+ */
+static VALUE _Digest_XXH64_singleton_block_length(VALUE self)
+{
+	return INT2FIX(_XXH64_BLOCK_SIZE);
+}
+
+/*
+ * call-seq:
+ *     idigest_seeds(str, seeds) -> array
+ *     idigest_seeds(str, seeds, packed: true) -> str
+ *
+ * Returns the digests of +str+ hashed with each seed in +seeds+, computed in
+ * a single call.  Seeds need to be numbers.
+ *
+ * If +packed+ is true, the digests are returned packed into a single string
+ * instead, each in the same form as the one returned by ::digest.
+ */
+static VALUE _Digest_XXH64_singleton_idigest_seeds(int argc, VALUE* argv, VALUE self)
+{
+	return _idigest_seeds(argc, argv, &_xxh64_algo);
+}
+
+/*
+ * call-seq:
+ *     idigest_seeds_many(strings, seeds) -> array
+ *     idigest_seeds_many(strings, seeds, packed: true) -> str
+ *
+ * Same as ::idigest_seeds but hashes each string in +strings+.  Returns an
+ * array of arrays of digests, or all digests packed into a single string,
+ * grouped by string.
+ */
+static VALUE _Digest_XXH64_singleton_idigest_seeds_many(int argc, VALUE* argv, VALUE self)
+{
+	return _idigest_seeds_many(argc, argv, &_xxh64_algo);
+}
+
+/*
+ * call-seq:
+ *     idigest_many(strings, seed = 0) -> array
+ *     idigest_many(strings, seed = 0, packed: true) -> str
+ *
+ * Returns the digests of each string in +strings+, computed in a single
+ * call.  +seed+ needs to be a number.
+ *
+ * If +packed+ is true, the digests are returned packed into a single string
+ * instead, each in the same form as the one returned by ::digest.
+ *
+ * With AVX-512, long strings are hashed 8 at a time, one string per vector
+ * lane.  See Digest::XXHash::simd_level.
+ */
+static VALUE _Digest_XXH64_singleton_idigest_many(int argc, VALUE* argv, VALUE self)
+{
+	return _idigest_many(argc, argv, &_xxh64_algo);
+}
+
+/*
+ * Document-class: Digest::XXH3_64bits
+ *
+ * This class implements XXH3_64bits.
+ */
+
+static VALUE _Digest_XXH3_64bits_internal_allocate(VALUE klass)
+{
+	struct _xxh3_data *data_p = _xxh3_create_data();
+	XXH3_64bits_reset(data_p->state_p);
+	return TypedData_Wrap_Struct(klass, &_xxh3_64bits_state_data_type, data_p);
+}
+
+/*
+ * call-seq:
+ *     update(str) -> self
+ *     update(str_or_buffer, offset: 0, length: nil) -> self
+ *     update(str_or_buffer, progress: callable, progress_interval: 64 MiB) -> self
+ *     update(str_or_buffer, casefold: true) -> self
+ *
+ * Updates current digest value with a string, an IO::Buffer, or any object
+ * exporting a contiguous memory view, like a Fiddle::Pointer or a numerical
+ * array from an extension supporting the MemoryView protocol.
+ *
+ * +offset+ and +length+ select a range of bytes to hash instead of the whole
+ * data.  The data is hashed in place, so no copy of it is made.
+ *
+ * Data at least 1 MiB in length is hashed with the GVL released, 1 MiB at a
+ * time, so interrupts like Thread#kill, Timeout, and signals are still handled
+ * while it's being processed.  If hashing gets interrupted by an exception,
+ * the state would only include part of the data.  Meanwhile, other threads
+ * and the progress callback get a RuntimeError from methods that would change
+ * the state, like #reset.
+ *
+ * If +progress+ is specified, it is called every +progress_interval+ bytes,
+ * and once after the last byte, with the number of bytes processed so far
+ * and the total number of bytes as arguments.  Empty data gets one call with
+ * 0 as both.  A string changed by the callback is still hashed as it was,
+ * and an IO::Buffer stays locked until the update ends.
+ *
+ * If +casefold+ is true, ASCII uppercase letters are hashed as lowercase,
+ * giving the same digest as hashing <tt>str.downcase(:ascii)</tt> without
+ * making a copy of the data.
+ */
+static VALUE _Digest_XXH3_64bits_update(int argc, VALUE* argv, VALUE self)
+{
+	_xxh3_update(_get_data_xxh3_64bits(self), _update_state, argc, argv, _xxh3_64bits_update_func);
+	return self;
+}
+
+/*
+ * call-seq: file(path, read_ahead: 4, cache: nil) -> self
+ *
+ * Reads the file at +path+ and updates the state with its contents.
+ *
+ * A reader thread fills up to +read_ahead+ buffers of 1 MiB ahead while the
+ * calling thread hashes the filled ones with the GVL released, so waiting
+ * for the disk overlaps with hashing.
+ *
+ * Only regular files can be read.  Directories raise Errno::EISDIR, and
+ * other files, like FIFOs, raise Errno::EINVAL.
+ *
+ * If +cache+ is +:bypass+, the file is read without filling the page cache,
+ * so hashing large cold files doesn't evict the cached data of other
+ * processes.  It's read with O_DIRECT where the file system supports it, and
+ * otherwise each range is dropped from the cache once read.  Pages of the
+ * file that were already cached before they were read, like those of other
+ * processes reading it, are kept.
+ */
+static VALUE _Digest_XXH3_64bits_file(int argc, VALUE* argv, VALUE self)
+{
+	_xxh3_update(_get_data_xxh3_64bits(self), _update_file, argc, argv, _xxh3_64bits_update_func);
+	return self;
+}
+
+/* :nodoc: */
+static VALUE _Digest_XXH3_64bits_finish(VALUE self)
+{
+	XXH64_hash_t hash = XXH3_64bits_digest(_get_state_xxh3_64bits(self));
+	VALUE str = rb_usascii_str_new(0, sizeof(XXH64_canonical_t));
+	XXH64_canonicalFromHash((XXH64_canonical_t *)RSTRING_PTR(str), hash);
+	return str;
+}
+
+/* :nodoc: */
+static VALUE _Digest_XXH3_64bits_ifinish(VALUE self)
+{
+	XXH64_hash_t hash = XXH3_64bits_digest(_get_state_xxh3_64bits(self));
+	return ULL2NUM(hash);
+}
+
+/*
+ * call-seq: reset(seed = 0) -> self
+ *
+ * Resets state to initial form with seed.
+ *
+ * This discards previous calculations with #update.
+ *
+ * +seed+ can be in the form of a string, a hex string, or a number.
+ * Its virtual length should be 64-bits.
+ *
+ * If +seed+ is not provided, the default value would be 0.
+ */
+static VALUE _Digest_XXH3_64bits_reset(int argc, VALUE* argv, VALUE self)
+{
+	VALUE seed;
+
+	if (rb_scan_args(argc, argv, "01", &seed) > 0) {
+		switch (TYPE(seed)) {
+		case T_STRING:
+			{
+				int len = RSTRING_LEN(seed);
+				XXH64_hash_t decoded_seed;
+
+				if (len == _TWICE(sizeof(XXH64_hash_t))) {
+					unsigned char hex_decoded_seed[sizeof(XXH64_hash_t)];
+
+					if (! hex_decode_str_implied(_RSTRING_PTR_U(seed), len, hex_decoded_seed))
+						rb_raise(rb_eArgError, "Invalid hex string seed: %s\n",
+								StringValueCStr(seed));
+
+					decoded_seed = XXH_readBE64(hex_decoded_seed);
+				} else if (len == sizeof(XXH64_hash_t)) {
+					decoded_seed = XXH_readBE64(RSTRING_PTR(seed));
+				} else {
+					rb_raise(rb_eArgError, "Invalid seed length.  "
+							"Expecting a 16-character hex string or an 8-byte string.");
+				}
+
+				_xxh3_64bits_reset(_get_data_xxh3_64bits(self), decoded_seed);
+			}
+
+			break;
+		case T_FIXNUM:
+		case T_BIGNUM:
+			_xxh3_64bits_reset(_get_data_xxh3_64bits(self), NUM2ULL(seed));
+			break;
+		default:
+			rb_raise(rb_eArgError, "Invalid argument type for 'seed'.  "
+					"Expecting a string or a number.");
+		}
+	} else {
+		_xxh3_64bits_reset(_get_data_xxh3_64bits(self), _XXH3_64BITS_DEFAULT_SEED);
+	}
+
+	return self;
+}
+
+/*
+ * call-seq: reset_with_secret(secret) -> self
+ *
+ * Resets state to initial form using a secret.
+ *
+ * This discards previous calculations with #update.
+ *
+ * Secret should be a string and have a minimum length of XXH3_SECRET_SIZE_MIN.
+ *
+ * A copy of the secret is kept with the state, so the string can be modified
+ * or discarded afterwards.
+ */
+static VALUE _Digest_XXH3_64bits_reset_with_secret(VALUE self, VALUE secret)
 {
-	VALUE klass, klass_name, hexdigest, args[2];
-	klass = rb_obj_class(self);
-	klass_name = rb_class_name(klass);
+	struct _xxh3_data *data_p;
 
-	if (klass_name == Qnil)
-		klass_name = rb_inspect(klass);
+	if (TYPE(secret) != T_STRING)
+		rb_raise(rb_eArgError, "Argument 'secret' needs to be a string.");
 
-	hexdigest = rb_funcall(self, _id_hexdigest, 0);
+	if (RSTRING_LEN(secret) < XXH3_SECRET_SIZE_MIN)
+		rb_raise(rb_eRuntimeError, "Secret needs to be at least %d bytes in length.",
+				XXH3_SECRET_SIZE_MIN);
 
-	args[0] = klass_name;
-	args[1] = hexdigest;
-	return rb_str_format(sizeof(args), args, rb_str_new_literal("#<%s|%s>"));
+	data_p = _get_data_xxh3_64bits(self);
+	_xxh3_check_idle(data_p);
+
+	if (XXH3_64bits_reset_withSecret(data_p->state_p, _xxh3_copy_secret(data_p, secret),
+			RSTRING_LEN(secret)) != XXH_OK)
+		rb_raise(rb_eRuntimeError, "Failed to reset state with secret.");
+
+	return self;
 }
 
-static VALUE _instantiate_and_digest(int argc, VALUE* argv, VALUE klass, ID digest_method_id)
+/*
+ * call-seq: initialize_copy(orig) -> self
+ *
+ * This method is called when instances are cloned.  It is responsible for
+ * replicating internal data.
+ */
+static VALUE _Digest_XXH3_64bits_initialize_copy(VALUE self, VALUE orig)
 {
-	VALUE str, seed, instance;
-	int argc2;
+	_xxh3_copy_data(_get_data_xxh3_64bits(self), _get_data_xxh3_64bits(orig));
+	return self;
+}
 
-	argc2 = rb_scan_args(argc, argv, "11", &str, &seed);
+/*
+ * call-seq: freeze_prefix -> prefix
+ *
+ * Returns a Digest::XXHash::Prefix capturing the current state.  It can then
+ * be used to hash many messages that begin with the data hashed so far.
+ *
+ * The instance itself isn't changed.
+ */
+static VALUE _Digest_XXH3_64bits_freeze_prefix(VALUE self)
+{
+	struct _xxh3_data *data_p = _get_data_xxh3_64bits(self);
+	return _new_prefix(&_xxh3_64bits_algo, data_p->state_p, data_p->secret, data_p->secret_size);
+}
 
-	if (TYPE(str) != T_STRING)
-		rb_raise(rb_eTypeError, "Argument type not string.");
+/*
+ * call-seq:
+ *     export_state -> str
+ *     export_state(secret: :embed) -> str
+ *     export_state(secret: :reference) -> str
+ *
+ * Returns the current state in a compact, versioned binary form.  It only
+ * holds the accumulators, the buffered data, the length hashed so far, and
+ * the seed or the custom secret.
+ *
+ * The state can be restored with #import_state, even on another host, and
+ * hashing can then continue where it left off.
+ *
+ * A custom secret set with #reset_with_secret is embedded by default.  With
+ * <tt>secret: :reference</tt>, only its size and a fingerprint of it are
+ * stored, and the secret has to be passed to #import_state.
+ */
+static VALUE _Digest_XXH3_64bits_export_state(int argc, VALUE* argv, VALUE self)
+{
+	int embed_secret = _get_embed_secret_opt(argc, argv);
+	return _export_xxh3_state(_STATE_ALGO_XXH3_64BITS, _get_data_xxh3_64bits(self), embed_secret);
+}
 
-	instance = rb_funcall(klass, _id_new, 0);
+/*
+ * call-seq:
+ *     import_state(str) -> self
+ *     import_state(str, secret: secret) -> self
+ *
+ * Restores a state exported with #export_state.
+ *
+ * +secret+ is required if the state only references its custom secret.  It
+ * is checked against the fingerprint stored in the state.
+ *
+ * Raises ArgumentError if the data is invalid, was exported from a different
+ * algorithm, or if the secret doesn't match.
+ */
+static VALUE _Digest_XXH3_64bits_import_state(int argc, VALUE* argv, VALUE self)
+{
+	VALUE secret, data = _get_import_args(argc, argv, &secret);
+	_import_xxh3_state(_STATE_ALGO_XXH3_64BITS, _get_data_xxh3_64bits(self), data, secret);
+	return self;
+}
 
-	if (argc2 > 1)
-		return rb_funcall(instance, digest_method_id, 2, str, seed);
-	else
-		return rb_funcall(instance, digest_method_id, 1, str);
+/* :nodoc: */
+static VALUE _Digest_XXH3_64bits_marshal_dump(VALUE self)
+{
+	return _export_xxh3_state(_STATE_ALGO_XXH3_64BITS, _get_data_xxh3_64bits(self), 1);
+}
+
+/* :nodoc: */
+static VALUE _Digest_XXH3_64bits_marshal_load(VALUE self, VALUE data)
+{
+	_import_xxh3_state(_STATE_ALGO_XXH3_64BITS, _get_data_xxh3_64bits(self), data, Qnil);
+	return self;
 }
 
 /*
- * call-seq: Digest::XXHash::digest(str, seed = 0) -> str
+ * call-seq: hibernate -> self
  *
- * Returns the digest value of +str+ in string form with +seed+ as its seed.
+ * Packs the state into a minimal form and frees the full state, which is
+ * several times larger.  This is meant for instances that stay idle for a
+ * long time, like one per open connection.
  *
- * +seed+ can be in the form of a string, a hex string, or a number.
+ * The state is re-expanded transparently the next time the instance is used.
  *
- * If +seed+ is not provided, the default value would be 0.
+ * Raises RuntimeError if called while an update of the instance is in
+ * progress, like from its +progress+ callback.
  */
-static VALUE _Digest_XXHash_singleton_digest(int argc, VALUE* argv, VALUE self)
+static VALUE _Digest_XXH3_64bits_hibernate(VALUE self)
 {
-	return _instantiate_and_digest(argc, argv, self, _id_digest);
+	_xxh3_hibernate(_get_raw_data_xxh3_64bits(self));
+	return self;
 }
 
 /*
- * call-seq: Digest::XXHash::hexdigest -> hex_str
+ * call-seq: hibernated? -> true or false
  *
- * Same as ::digest but returns the digest value in hex form.
+ * Returns true if the state is currently packed.
  */
-static VALUE _Digest_XXHash_singleton_hexdigest(int argc, VALUE* argv, VALUE self)
+static VALUE _Digest_XXH3_64bits_hibernated_p(VALUE self)
 {
-	return _instantiate_and_digest(argc, argv, self, _id_hexdigest);
+	return _get_raw_data_xxh3_64bits(self)->packed != NULL ? Qtrue : Qfalse;
 }
 
 /*
- * call-seq: Digest::XXHash::idigest -> num
+ * call-seq: auto_hibernate = true or false
  *
- * Same as ::digest but returns the digest value in numerical form.
+ * If enabled, the state is hibernated automatically after every #update.
  */
-static VALUE _Digest_XXHash_singleton_idigest(int argc, VALUE* argv, VALUE self)
+static VALUE _Digest_XXH3_64bits_set_auto_hibernate(VALUE self, VALUE value)
 {
-	return _instantiate_and_digest(argc, argv, self, _id_idigest);
+	struct _xxh3_data *data_p = _get_raw_data_xxh3_64bits(self);
+
+	if ((data_p->auto_hibernate = RTEST(value)))
+		_xxh3_hibernate(data_p);
+
+	return value;
 }
 
 /*
- * Document-class: Digest::XXH32
+ * call-seq: auto_hibernate -> true or false
  *
- * This class implements XXH32.
+ * Returns true if the state is hibernated automatically after every #update.
  */
+static VALUE _Digest_XXH3_64bits_auto_hibernate(VALUE self)
+{
+	return _get_raw_data_xxh3_64bits(self)->auto_hibernate ? Qtrue : Qfalse;
+}
 
-static VALUE _Digest_XXH32_internal_allocate(VALUE klass)
+/*
+ * call-seq: digest_length -> int
+ *
+ * Returns 8
+ */
+static VALUE _Digest_XXH3_64bits_digest_length(VALUE self)
 {
-	XXH32_state_t *state_p = XXH32_createState();
-	_xxh32_reset(state_p, 0);
-	return TypedData_Wrap_Struct(klass, &_xxh32_state_data_type, state_p);
+	return INT2FIX(_XXH3_64BITS_DIGEST_SIZE);
 }
 
 /*
- * call-seq: update(str) -> self
+ * call-seq: block_length -> int
  *
- * Updates current digest value with string.
+ * Returns 8
  */
-static VALUE _Digest_XXH32_update(VALUE self, VALUE str)
+static VALUE _Digest_XXH3_64bits_block_length(VALUE self)
 {
-	if (XXH32_update(_get_state_xxh32(self), RSTRING_PTR(str), RSTRING_LEN(str)) != XXH_OK)
-		rb_raise(rb_eRuntimeError, "Failed to update state.");
+	return INT2FIX(_XXH3_64BITS_BLOCK_SIZE);
+}
 
-	return self;
+/*
+ * call-seq: digest_length -> int
+ *
+ * Returns 8
+ */
+static VALUE _Digest_XXH3_64bits_singleton_digest_length(VALUE self)
+{
+	return INT2FIX(_XXH3_64BITS_DIGEST_SIZE);
 }
 
-/* :nodoc: */
-static VALUE _Digest_XXH32_finish(VALUE self)
+/*
+ * call-seq: block_length -> int
+ *
+ * Returns 8
+ */
+static VALUE _Digest_XXH3_64bits_singleton_block_length(VALUE self)
 {
-	XXH64_hash_t hash = XXH32_digest(_get_state_xxh32(self));
-	VALUE str = rb_usascii_str_new(0, sizeof(XXH32_canonical_t));
-	XXH32_canonicalFromHash((XXH32_canonical_t *)RSTRING_PTR(str), hash);
-	return str;
+	return INT2FIX(_XXH3_64BITS_BLOCK_SIZE);
 }
 
-/* :nodoc: */
-static VALUE _Digest_XXH32_ifinish(VALUE self)
+/*
+ * call-seq:
+ *     idigest_seeds(str, seeds) -> array
+ *     idigest_seeds(str, seeds, packed: true) -> str
+ *
+ * Returns the digests of +str+ hashed with each seed in +seeds+, computed in
+ * a single call.  Seeds need to be numbers.
+ *
+ * If +packed+ is true, the digests are returned packed into a single string
+ * instead, each in the same form as the one returned by ::digest.
+ */
+static VALUE _Digest_XXH3_64bits_singleton_idigest_seeds(int argc, VALUE* argv, VALUE self)
 {
-	XXH32_hash_t hash = XXH32_digest(_get_state_xxh32(self));
-	return ULONG2NUM(hash);
+	return _idigest_seeds(argc, argv, &_xxh3_64bits_algo);
 }
 
 /*
- * call-seq: reset(seed = 0) -> self
+ * call-seq:
+ *     idigest_seeds_many(strings, seeds) -> array
+ *     idigest_seeds_many(strings, seeds, packed: true) -> str
  *
- * Resets state to initial form with seed.
+ * Same as ::idigest_seeds but hashes each string in +strings+.  Returns an
+ * array of arrays of digests, or all digests packed into a single string,
+ * grouped by string.
+ */
+static VALUE _Digest_XXH3_64bits_singleton_idigest_seeds_many(int argc, VALUE* argv, VALUE self)
+{
+	return _idigest_seeds_many(argc, argv, &_xxh3_64bits_algo);
+}
+
+/*
+ * call-seq:
+ *     idigest_many(strings, seed = 0) -> array
+ *     idigest_many(strings, seed = 0, packed: true) -> str
  *
- * This discards previous calculations with #update.
+ * Returns the digests of each string in +strings+, computed in a single
+ * call.  +seed+ needs to be a number.
  *
- * +seed+ can be in the form of a string, a hex string, or a number.
- * Its virtual length should be 32-bits.
+ * If +packed+ is true, the digests are returned packed into a single string
+ * instead, each in the same form as the one returned by ::digest.
+ */
+static VALUE _Digest_XXH3_64bits_singleton_idigest_many(int argc, VALUE* argv, VALUE self)
+{
+	return _idigest_many(argc, argv, &_xxh3_64bits_algo);
+}
+
+/*
+ * call-seq:
+ *     hash_strided(buffer, width:, stride: width, offset: 0, seed: 0) -> str
  *
- * If +seed+ is not provided, the default value would be 0.
+ * Hashes fixed-width records packed in +buffer+ and returns their digests
+ * packed into a single string, each in the same form as the one returned by
+ * ::digest.  It's the same as hashing each record with ::digest and joining
+ * the results, but without creating a string for every record.
+ *
+ * Records are +width+ bytes long and begin every +stride+ bytes, starting at
+ * +offset+.  Trailing bytes not long enough to form a record are ignored.
+ *
+ * +buffer+ can be a string, an IO::Buffer, or an object exporting a memory
+ * view.  Like #update, buffers at least 1 MiB in length are hashed with the
+ * GVL released.  +seed+ needs to be a number.
  */
-static VALUE _Digest_XXH32_reset(int argc, VALUE* argv, VALUE self)
+static VALUE _Digest_XXH3_64bits_singleton_hash_strided(int argc, VALUE* argv, VALUE self)
 {
-	VALUE seed;
+	ID keywords[4];
+	VALUE buffer, opts, values[4];
+	struct _strided_body_args args;
+	XXH64_hash_t seed;
+	long width, stride;
+
+	keywords[0] = _id_width;
+	keywords[1] = _id_stride;
+	keywords[2] = _id_offset;
+	keywords[3] = _id_seed;
+
+	rb_scan_args(argc, argv, "1:", &buffer, &opts);
+	rb_get_kwargs(opts, keywords, 1, 3, values);
+	width = NUM2LONG(values[0]);
+	stride = values[1] == Qundef || NIL_P(values[1]) ? width : NUM2LONG(values[1]);
+
+	if (width <= 0 || stride <= 0)
+		rb_raise(rb_eArgError, "Width and stride need to be greater than 0.");
+
+	/* Converted before the input is taken since this can run Ruby code */
+	seed = values[3] == Qundef || NIL_P(values[3]) ? 0 : NUM2ULL(values[3]);
+	_acquire_input(&args.input, buffer, values[2], Qundef);
+	args.strided.base = args.input.ptr;
+	args.strided.width = width;
+	args.strided.stride = stride;
+	args.strided.count = args.input.len < (size_t)width ? 0 :
+			(args.input.len - width) / stride + 1;
+	args.strided.done = 0;
+	args.strided.seed = seed;
+	args.strided.interrupted = 0;
+	args.result = Qnil;
+
+	if (_input_needs_release(&args.input))
+		rb_ensure(_strided_body, (VALUE)&args, _strided_ensure, (VALUE)&args);
+	else
+		_strided_body((VALUE)&args);
 
-	if (argc > 0 && rb_scan_args(argc, argv, "01", &seed) > 0) {
-		switch (TYPE(seed)) {
-		case T_STRING:
-			{
-				int len = RSTRING_LEN(seed);
-				XXH32_hash_t decoded_seed;
+	RB_GC_GUARD(args.input.holder);
+	return args.result;
+}
 
-				if (len == _TWICE(sizeof(XXH32_hash_t))) {
-					unsigned char hex_decoded_seed[sizeof(XXH32_hash_t)];
+/*
+ * call-seq: hash_int(int, seed = 0) -> num
+ *
+ * Returns the digest of +int+ in numerical form.  The 8 bytes of +int+ in
+ * little-endian order are hashed, so the result is the same as
+ * <tt>idigest([int].pack("Q<"), seed)</tt>.
+ *
+ * +int+ can be from <tt>-2**63</tt> to <tt>2**64 - 1</tt>.  Negative values
+ * are hashed in two's complement form.  +seed+ needs to be a number.
+ */
+static VALUE _Digest_XXH3_64bits_singleton_hash_int(int argc, VALUE* argv, VALUE self)
+{
+	VALUE num, seed;
 
-					if (! hex_decode_str_implied(_RSTRING_PTR_U(seed), len, hex_decoded_seed))
-						rb_raise(rb_eArgError, "Invalid hex string seed: %s\n",
-								StringValueCStr(seed));
+	rb_scan_args(argc, argv, "11", &num, &seed);
+	return ULL2NUM(_xxh3_64bits_hash_u64(_int_to_u64(num), NIL_P(seed) ? 0 : NUM2ULL(seed)));
+}
 
-					decoded_seed = XXH_readBE32(hex_decoded_seed);
-				} else if (len == sizeof(XXH32_hash_t)) {
-					decoded_seed = XXH_readBE32(RSTRING_PTR(seed));
-				} else {
-					rb_raise(rb_eArgError, "Invalid seed length.  "
-							"Expecting an 8-character hex string or a 4-byte string.");
-				}
+/*
+ * call-seq:
+ *     hash_ints(ints, seed = 0) -> array
+ *     hash_ints(ints, seed = 0, packed: true) -> str
+ *
+ * Same as ::hash_int but hashes each integer in +ints+.
+ *
+ * If +packed+ is true, the digests are returned packed into a single string
+ * instead, each in the same form as the one returned by ::digest.
+ */
+static VALUE _Digest_XXH3_64bits_singleton_hash_ints(int argc, VALUE* argv, VALUE self)
+{
+	VALUE ints, seed_arg, opts, result;
+	XXH64_hash_t seed;
+	unsigned char *out;
+	long i, n;
+
+	rb_scan_args(argc, argv, "11:", &ints, &seed_arg, &opts);
+	Check_Type(ints, T_ARRAY);
+	seed = NIL_P(seed_arg) ? 0 : NUM2ULL(seed_arg);
+	n = RARRAY_LEN(ints);
+	result = rb_usascii_str_new(0, n * 8);
+	out = _RSTRING_PTR_U(result);
+
+	for (i = 0; i < n; ++i)
+		XXH64_canonicalFromHash((XXH64_canonical_t *)(out + i * 8),
+				_xxh3_64bits_hash_u64(_int_to_u64(RARRAY_AREF(ints, i)), seed));
+
+	return _hashes_to_result(result, n, opts);
+}
 
-				_xxh32_reset(_get_state_xxh32(self), decoded_seed);
-			}
+/*
+ * call-seq:
+ *     hash_range(range, seed = 0) -> array
+ *     hash_range(range, seed = 0, packed: true) -> str
+ *
+ * Same as ::hash_ints but hashes each integer in +range+, without creating
+ * them as objects.  Both ends of +range+ need to be integers from
+ * <tt>-2**63</tt> to <tt>2**63 - 1</tt>.
+ */
+static VALUE _Digest_XXH3_64bits_singleton_hash_range(int argc, VALUE* argv, VALUE self)
+{
+	VALUE range, seed_arg, opts, beg, end, result;
+	XXH64_hash_t seed, value;
+	unsigned char *out;
+	LONG_LONG first, last;
+	long i, n;
+	int excl;
+
+	rb_scan_args(argc, argv, "11:", &range, &seed_arg, &opts);
+
+	if (! rb_range_values(range, &beg, &end, &excl) || ! RB_INTEGER_TYPE_P(beg) ||
+			! RB_INTEGER_TYPE_P(end))
+		rb_raise(rb_eTypeError, "Range needs to have integer ends.");
+
+	seed = NIL_P(seed_arg) ? 0 : NUM2ULL(seed_arg);
+	first = NUM2LL(beg);
+	last = NUM2LL(end);
+
+	if (last < first || (excl && last == first))
+		n = 0;
+	else if ((unsigned LONG_LONG)last - (unsigned LONG_LONG)first >= LONG_MAX / 8)
+		rb_raise(rb_eRangeError, "Range is too large.");
+	else
+		n = (long)((unsigned LONG_LONG)last - (unsigned LONG_LONG)first) + ! excl;
 
-			break;
-		case T_FIXNUM:
-			_xxh32_reset(_get_state_xxh32(self), FIX2UINT(seed));
-			break;
-		case T_BIGNUM:
-			_xxh32_reset(_get_state_xxh32(self), NUM2UINT(seed));
-			break;
-		default:
-			rb_raise(rb_eArgError, "Invalid argument type for 'seed'.  "
-					"Expecting a string or a number.");
-		}
+	result = rb_usascii_str_new(0, n * 8);
+	out = _RSTRING_PTR_U(result);
+	value = (XXH64_hash_t)first;
+
+	for (i = 0; i < n; ++i, ++value)
+		XXH64_canonicalFromHash((XXH64_canonical_t *)(out + i * 8),
+				_xxh3_64bits_hash_u64(value, seed));
+
+	return _hashes_to_result(result, n, opts);
+}
+
+/*
+ * call-seq:
+ *     line_digests(str_or_io, separator: "\n", chomp: true) -> str
+ *     line_digests(str_or_io, separator: "\n", chomp: true, offsets: true) -> [str, offsets_str]
+ *
+ * Hashes each line of +str_or_io+ and returns the digests packed into a
+ * single string, each in the same form as the one returned by ::digest.
+ * Lines are split like String#each_line with +separator+ and +chomp+ does,
+ * so the digests are the same as the ones of the lines it yields, but no
+ * string is created for each line.
+ *
+ * +str_or_io+ can be a string, an IO::Buffer, an object exporting a memory
+ * view, or an object responding to +read+ like an IO, which is read until
+ * its end.  Scanning is done with the GVL released when at least 1 MiB of
+ * data is scanned at once.
+ *
+ * If +offsets+ is true, the byte offsets where each line begins are also
+ * returned, packed as 64-bit little-endian integers.  They can be read with
+ * <tt>unpack("Q<*")</tt>.
+ */
+static VALUE _Digest_XXH3_64bits_singleton_line_digests(int argc, VALUE* argv, VALUE self)
+{
+	ID keywords[3];
+	VALUE data, opts, values[3], sep;
+	struct _lines_args args;
+
+	keywords[0] = _id_separator;
+	keywords[1] = _id_chomp;
+	keywords[2] = _id_offsets;
+
+	rb_scan_args(argc, argv, "1:", &data, &opts);
+	values[0] = values[1] = values[2] = Qundef;
+
+	if (! NIL_P(opts))
+		rb_get_kwargs(opts, keywords, 0, 3, values);
+
+	sep = values[0] == Qundef ? rb_usascii_str_new_cstr("\n") : values[0];
+	StringValue(sep);
+
+	if (RSTRING_LEN(sep) == 0)
+		rb_raise(rb_eArgError, "Separator can't be empty.");
+
+	sep = rb_str_new_frozen(sep);
+	memset(&args, 0, sizeof args);
+	args.lines.sep = _RSTRING_PTR_U(sep);
+	args.lines.sep_len = RSTRING_LEN(sep);
+	args.lines.chomp = values[1] == Qundef || RTEST(values[1]);
+	args.lines.want_offsets = values[2] != Qundef && RTEST(values[2]);
+	args.result = Qnil;
+
+	if (! _is_input(data) && rb_respond_to(data, _id_read)) {
+		args.input.holder = data;
+		rb_ensure(_lines_io_body, (VALUE)&args, _lines_ensure, (VALUE)&args);
 	} else {
-		_xxh32_reset(_get_state_xxh32(self), _XXH32_DEFAULT_SEED);
+		_acquire_input(&args.input, data, Qundef, Qundef);
+		rb_ensure(_lines_str_body, (VALUE)&args, _lines_ensure, (VALUE)&args);
 	}
 
-	return self;
+	RB_GC_GUARD(sep);
+	RB_GC_GUARD(args.input.holder);
+	return args.result;
 }
 
 /*
- * call-seq: initialize_copy(orig) -> self
+ * call-seq: chunk_digests(path, chunk_size: 1 MiB, threads: nil) -> str
  *
- * This method is called when instances are cloned.  It is responsible for
- * replicating internal data.
- */
-static VALUE _Digest_XXH32_initialize_copy(VALUE self, VALUE orig)
-{
-	XXH32_copyState(_get_state_xxh32(self), _get_state_xxh32(orig));
-	return self;
-}
-
-/*
- * call-seq: digest_length -> int
+ * Returns a manifest of the file at +path+ as a binary string.  It holds the
+ * chunk size and the file size, followed by the XXH3_64bits digests of the
+ * chunks of +chunk_size+ bytes in the same form as the ones returned by
+ * ::digest.  The last chunk may be shorter, and an empty file has no chunks.
  *
- * Returns 4
+ * The chunks are read with pread and hashed by +threads+ threads, which
+ * defaults to the number of online processors, with the GVL released.  The
+ * manifest can be stored and checked later with ::verify_chunks.
  */
-static VALUE _Digest_XXH32_digest_length(VALUE self)
+static VALUE _Digest_XXH3_64bits_singleton_chunk_digests(int argc, VALUE* argv, VALUE self)
 {
-	return INT2FIX(_XXH32_DIGEST_SIZE);
+	VALUE path, opts;
+	long chunk_size;
+	int threads;
+
+	rb_scan_args(argc, argv, "1:", &path, &opts);
+	_get_file_chunks_opts(opts, &chunk_size, &threads);
+	FilePathValue(path);
+	return _file_chunk_digests(path, chunk_size, threads);
 }
 
 /*
- * call-seq: block_length  -> int
+ * call-seq: verify_chunks(path, manifest, threads: nil) -> array
  *
- * Returns 4
+ * Hashes the file at +path+ like ::chunk_digests, with the chunk size stored
+ * in +manifest+, and returns the indices of the chunks whose digests differ
+ * from the ones in +manifest+, in order.  Chunks missing from either the file
+ * or +manifest+ are reported as well.  An empty array means the file is
+ * intact.
+ *
+ * Raises ArgumentError if +manifest+ is invalid.
  */
-static VALUE _Digest_XXH32_block_length(VALUE self)
+static VALUE _Digest_XXH3_64bits_singleton_verify_chunks(int argc, VALUE* argv, VALUE self)
 {
-	return INT2FIX(_XXH32_BLOCK_SIZE);
+	ID keywords[1];
+	VALUE path, manifest, opts, threads_opt = Qundef, digests, result;
+	long chunk_size;
+	size_t i, offset, count, expected_count;
+	int threads;
+
+	keywords[0] = _id_threads;
+	rb_scan_args(argc, argv, "2:", &path, &manifest, &opts);
+
+	if (! NIL_P(opts))
+		rb_get_kwargs(opts, keywords, 0, 1, &threads_opt);
+
+	threads = _get_threads_opt(threads_opt);
+	FilePathValue(path);
+	manifest = rb_str_new_frozen(StringValue(manifest));
+	_parse_chunk_manifest(manifest, &chunk_size, &expected_count);
+	digests = _file_chunk_digests(path, chunk_size, threads);
+	count = (RSTRING_LEN(digests) - _CHUNK_MANIFEST_HEADER_SIZE) / 8;
+	result = rb_ary_new();
+
+	for (i = 0; i < count || i < expected_count; ++i) {
+		offset = _CHUNK_MANIFEST_HEADER_SIZE + i * 8;
+
+		if (i >= count || i >= expected_count ||
+				memcmp(RSTRING_PTR(digests) + offset, RSTRING_PTR(manifest) + offset, 8) != 0)
+			rb_ary_push(result, SIZET2NUM(i));
+	}
+
+	RB_GC_GUARD(manifest);
+	return result;
 }
 
 /*
- * call-seq: digest_length -> int
+ * call-seq: generate_secret(seed, size = 192) -> str
  *
- * Returns 4
+ * Generates a custom secret from +seed+, which can be a string of any length.
+ * The result can be used with #reset_with_secret.
+ *
+ * The returned string is frozen, so it can be shared between Ractors.
  */
-static VALUE _Digest_XXH32_singleton_digest_length(VALUE self)
+static VALUE _Digest_XXH3_64bits_singleton_generate_secret(int argc, VALUE* argv, VALUE self)
 {
-	return INT2FIX(_XXH32_DIGEST_SIZE);
+	return _generate_secret(argc, argv);
 }
 
 /*
- * call-seq: block_length -> int
+ * Document-class: Digest::XXH3_128bits
  *
- * Returns 4
+ * This class implements XXH3_128bits.
  */
-static VALUE _Digest_XXH32_singleton_block_length(VALUE self)
+
+static VALUE _Digest_XXH3_128bits_internal_allocate(VALUE klass)
 {
-	return INT2FIX(_XXH32_BLOCK_SIZE);
+	struct _xxh3_data *data_p = _xxh3_create_data();
+	XXH3_128bits_reset(data_p->state_p);
+	return TypedData_Wrap_Struct(klass, &_xxh3_128bits_state_data_type, data_p);
 }
 
 /*
- * Document-class: Digest::XXH64
+ * call-seq:
+ *     update(str) -> self
+ *     update(str_or_buffer, offset: 0, length: nil) -> self
+ *     update(str_or_buffer, progress: callable, progress_interval: 64 MiB) -> self
+ *     update(str_or_buffer, casefold: true) -> self
  *
- * This class implements XXH64.
+ * Updates current digest value with a string, an IO::Buffer, or any object
+ * exporting a contiguous memory view, like a Fiddle::Pointer or a numerical
+ * array from an extension supporting the MemoryView protocol.
+ *
+ * +offset+ and +length+ select a range of bytes to hash instead of the whole
+ * data.  The data is hashed in place, so no copy of it is made.
+ *
+ * Data at least 1 MiB in length is hashed with the GVL released, 1 MiB at a
+ * time, so interrupts like Thread#kill, Timeout, and signals are still handled
+ * while it's being processed.  If hashing gets interrupted by an exception,
+ * the state would only include part of the data.  Meanwhile, other threads
+ * and the progress callback get a RuntimeError from methods that would change
+ * the state, like #reset.
+ *
+ * If +progress+ is specified, it is called every +progress_interval+ bytes,
+ * and once after the last byte, with the number of bytes processed so far
+ * and the total number of bytes as arguments.  Empty data gets one call with
+ * 0 as both.  A string changed by the callback is still hashed as it was,
+ * and an IO::Buffer stays locked until the update ends.
+ *
+ * If +casefold+ is true, ASCII uppercase letters are hashed as lowercase,
+ * giving the same digest as hashing <tt>str.downcase(:ascii)</tt> without
+ * making a copy of the data.
  */
-
-static VALUE _Digest_XXH64_internal_allocate(VALUE klass)
+static VALUE _Digest_XXH3_128bits_update(int argc, VALUE* argv, VALUE self)
 {
-	XXH64_state_t *state_p = XXH64_createState();
-	_xxh64_reset(state_p, 0);
-	return TypedData_Wrap_Struct(klass, &_xxh64_state_data_type, state_p);
+	_xxh3_update(_get_data_xxh3_128bits(self), _update_state, argc, argv, _xxh3_128bits_update_func);
+	return self;
 }
 
 /*
- * call-seq: update(str) -> self
+ * call-seq: file(path, read_ahead: 4, cache: nil) -> self
+ *
+ * Reads the file at +path+ and updates the state with its contents.
+ *
+ * A reader thread fills up to +read_ahead+ buffers of 1 MiB ahead while the
+ * calling thread hashes the filled ones with the GVL released, so waiting
+ * for the disk overlaps with hashing.
+ *
+ * Only regular files can be read.  Directories raise Errno::EISDIR, and
+ * other files, like FIFOs, raise Errno::EINVAL.
  *
- * Updates current digest value with string.
+ * If +cache+ is +:bypass+, the file is read without filling the page cache,
+ * so hashing large cold files doesn't evict the cached data of other
+ * processes.  It's read with O_DIRECT where the file system supports it, and
+ * otherwise each range is dropped from the cache once read.  Pages of the
+ * file that were already cached before they were read, like those of other
+ * processes reading it, are kept.
  */
-static VALUE _Digest_XXH64_update(VALUE self, VALUE str)
+static VALUE _Digest_XXH3_128bits_file(int argc, VALUE* argv, VALUE self)
 {
-	if (XXH64_update(_get_state_xxh64(self), RSTRING_PTR(str), RSTRING_LEN(str)) != XXH_OK)
-		rb_raise(rb_eRuntimeError, "Failed to update state.");
-
+	_xxh3_update(_get_data_xxh3_128bits(self), _update_file, argc, argv, _xxh3_128bits_update_func);
 	return self;
 }
 
 /* :nodoc: */
-static VALUE _Digest_XXH64_finish(VALUE self)
+static VALUE _Digest_XXH3_128bits_finish(VALUE self)
 {
-	XXH64_hash_t hash = XXH64_digest(_get_state_xxh64(self));
-	VALUE str = rb_usascii_str_new(0, sizeof(XXH64_canonical_t));
-	XXH64_canonicalFromHash((XXH64_canonical_t *)RSTRING_PTR(str), hash);
+	XXH128_hash_t hash = XXH3_128bits_digest(_get_state_xxh3_128bits(self));
+	VALUE str = rb_usascii_str_new(0, sizeof(XXH128_canonical_t));
+	XXH128_canonicalFromHash((XXH128_canonical_t *)RSTRING_PTR(str), hash);
 	return str;
 }
 
 /* :nodoc: */
-static VALUE _Digest_XXH64_ifinish(VALUE self)
+static VALUE _Digest_XXH3_128bits_ifinish(VALUE self)
 {
-	XXH64_hash_t hash = XXH64_digest(_get_state_xxh64(self));
-	return ULL2NUM(hash);
+	return _xxh128_hash_to_num(XXH3_128bits_digest(_get_state_xxh3_128bits(self)));
 }
 
 /*
@@ -607,11 +8596,11 @@ static VALUE _Digest_XXH64_ifinish(VALUE self)
  * This discards previous calculations with #update.
  *
  * +seed+ can be in the form of a string, a hex string, or a number.
- * Its virtual length should be 64-bits.
+ * Its virtual length should be 64-bits and not 128-bits.
  *
  * If +seed+ is not provided, the default value would be 0.
  */
-static VALUE _Digest_XXH64_reset(int argc, VALUE* argv, VALUE self)
+static VALUE _Digest_XXH3_128bits_reset(int argc, VALUE* argv, VALUE self)
 {
 	VALUE seed;
 
@@ -633,440 +8622,900 @@ static VALUE _Digest_XXH64_reset(int argc, VALUE* argv, VALUE self)
 				} else if (len == sizeof(XXH64_hash_t)) {
 					decoded_seed = XXH_readBE64(RSTRING_PTR(seed));
 				} else {
-					rb_raise(rb_eArgError, "Invalid seed length.  "
-							"Expecting a 16-character hex string or an 8-byte string.");
+					rb_raise(rb_eArgError, "Invalid seed length.  Expecting a 16-character hex "
+							"string or an 8-byte string.");
 				}
 
-				_xxh64_reset(_get_state_xxh64(self), decoded_seed);
+				_xxh3_128bits_reset(_get_data_xxh3_128bits(self), decoded_seed);
 			}
 
 			break;
 		case T_FIXNUM:
 		case T_BIGNUM:
-			_xxh64_reset(_get_state_xxh64(self), NUM2ULL(seed));
+			_xxh3_128bits_reset(_get_data_xxh3_128bits(self), NUM2ULL(seed));
 			break;
 		default:
 			rb_raise(rb_eArgError, "Invalid argument type for 'seed'.  "
 					"Expecting a string or a number.");
 		}
 	} else {
-		_xxh64_reset(_get_state_xxh64(self), _XXH64_DEFAULT_SEED);
+		_xxh3_128bits_reset(_get_data_xxh3_128bits(self), _XXH3_128BITS_DEFAULT_SEED);
 	}
 
 	return self;
 }
 
+/*
+ * call-seq: reset_with_secret(secret) -> self
+ *
+ * Resets state to initial form using a secret.
+ *
+ * This discards previous calculations with #update.
+ *
+ * Secret should be a string having a minimum length of XXH3_SECRET_SIZE_MIN.
+ *
+ * A copy of the secret is kept with the state, so the string can be modified
+ * or discarded afterwards.
+ */
+static VALUE _Digest_XXH3_128bits_reset_with_secret(VALUE self, VALUE secret)
+{
+	struct _xxh3_data *data_p;
+
+	if (TYPE(secret) != T_STRING)
+		rb_raise(rb_eArgError, "Argument 'secret' needs to be a string.");
+
+	if (RSTRING_LEN(secret) < XXH3_SECRET_SIZE_MIN)
+		rb_raise(rb_eRuntimeError, "Secret needs to be at least %d bytes in length.",
+				XXH3_SECRET_SIZE_MIN);
+
+	data_p = _get_data_xxh3_128bits(self);
+	_xxh3_check_idle(data_p);
+
+	if (XXH3_128bits_reset_withSecret(data_p->state_p, _xxh3_copy_secret(data_p, secret),
+			RSTRING_LEN(secret)) != XXH_OK)
+		rb_raise(rb_eRuntimeError, "Failed to reset state with secret.");
+
+	return self;
+}
+
 /*
  * call-seq: initialize_copy(orig) -> self
  *
  * This method is called when instances are cloned.  It is responsible for
  * replicating internal data.
  */
-static VALUE _Digest_XXH64_initialize_copy(VALUE self, VALUE orig)
+static VALUE _Digest_XXH3_128bits_initialize_copy(VALUE self, VALUE orig)
 {
-	XXH64_copyState(_get_state_xxh64(self), _get_state_xxh64(orig));
+	_xxh3_copy_data(_get_data_xxh3_128bits(self), _get_data_xxh3_128bits(orig));
 	return self;
 }
 
 /*
- * call-seq: digest_length -> int
+ * call-seq: freeze_prefix -> prefix
  *
- * Returns 8
+ * Returns a Digest::XXHash::Prefix capturing the current state.  It can then
+ * be used to hash many messages that begin with the data hashed so far.
+ *
+ * The instance itself isn't changed.
  */
-static VALUE _Digest_XXH64_digest_length(VALUE self)
+static VALUE _Digest_XXH3_128bits_freeze_prefix(VALUE self)
 {
-	return INT2FIX(_XXH64_DIGEST_SIZE);
+	struct _xxh3_data *data_p = _get_data_xxh3_128bits(self);
+	return _new_prefix(&_xxh3_128bits_algo, data_p->state_p, data_p->secret, data_p->secret_size);
 }
 
 /*
- * call-seq: block_length -> int
+ * call-seq:
+ *     export_state -> str
+ *     export_state(secret: :embed) -> str
+ *     export_state(secret: :reference) -> str
  *
- * Returns 8
+ * Returns the current state in a compact, versioned binary form.  It only
+ * holds the accumulators, the buffered data, the length hashed so far, and
+ * the seed or the custom secret.
+ *
+ * The state can be restored with #import_state, even on another host, and
+ * hashing can then continue where it left off.
+ *
+ * A custom secret set with #reset_with_secret is embedded by default.  With
+ * <tt>secret: :reference</tt>, only its size and a fingerprint of it are
+ * stored, and the secret has to be passed to #import_state.
  */
-static VALUE _Digest_XXH64_block_length(VALUE self)
+static VALUE _Digest_XXH3_128bits_export_state(int argc, VALUE* argv, VALUE self)
 {
-	return INT2FIX(_XXH64_BLOCK_SIZE);
+	int embed_secret = _get_embed_secret_opt(argc, argv);
+	return _export_xxh3_state(_STATE_ALGO_XXH3_128BITS, _get_data_xxh3_128bits(self), embed_secret);
 }
 
 /*
- * call-seq: digest_length -> int
+ * call-seq:
+ *     import_state(str) -> self
+ *     import_state(str, secret: secret) -> self
  *
- * Returns 8
+ * Restores a state exported with #export_state.
+ *
+ * +secret+ is required if the state only references its custom secret.  It
+ * is checked against the fingerprint stored in the state.
+ *
+ * Raises ArgumentError if the data is invalid, was exported from a different
+ * algorithm, or if the secret doesn't match.
  */
-static VALUE _Digest_XXH64_singleton_digest_length(VALUE self)
+static VALUE _Digest_XXH3_128bits_import_state(int argc, VALUE* argv, VALUE self)
 {
-	return INT2FIX(_XXH64_DIGEST_SIZE);
+	VALUE secret, data = _get_import_args(argc, argv, &secret);
+	_import_xxh3_state(_STATE_ALGO_XXH3_128BITS, _get_data_xxh3_128bits(self), data, secret);
+	return self;
+}
+
+/* :nodoc: */
+static VALUE _Digest_XXH3_128bits_marshal_dump(VALUE self)
+{
+	return _export_xxh3_state(_STATE_ALGO_XXH3_128BITS, _get_data_xxh3_128bits(self), 1);
+}
+
+/* :nodoc: */
+static VALUE _Digest_XXH3_128bits_marshal_load(VALUE self, VALUE data)
+{
+	_import_xxh3_state(_STATE_ALGO_XXH3_128BITS, _get_data_xxh3_128bits(self), data, Qnil);
+	return self;
 }
 
 /*
- * call-seq: block_length -> int
+ * call-seq: hibernate -> self
  *
- * Returns 8
+ * Packs the state into a minimal form and frees the full state, which is
+ * several times larger.  This is meant for instances that stay idle for a
+ * long time, like one per open connection.
+ *
+ * The state is re-expanded transparently the next time the instance is used.
+ *
+ * Raises RuntimeError if called while an update of the instance is in
+ * progress, like from its +progress+ callback.
  */
-static VALUE _Digest_XXH64_singleton_block_length(VALUE self)
+static VALUE _Digest_XXH3_128bits_hibernate(VALUE self)
 {
-	return INT2FIX(_XXH64_BLOCK_SIZE);
+	_xxh3_hibernate(_get_raw_data_xxh3_128bits(self));
+	return self;
 }
 
 /*
- * Document-class: Digest::XXH3_64bits
+ * call-seq: hibernated? -> true or false
  *
- * This class implements XXH3_64bits.
+ * Returns true if the state is currently packed.
  */
-
-static VALUE _Digest_XXH3_64bits_internal_allocate(VALUE klass)
+static VALUE _Digest_XXH3_128bits_hibernated_p(VALUE self)
 {
-	XXH3_state_t *state_p = XXH3_createState();
-	XXH3_64bits_reset(state_p);
-	return TypedData_Wrap_Struct(klass, &_xxh3_64bits_state_data_type, state_p);
+	return _get_raw_data_xxh3_128bits(self)->packed != NULL ? Qtrue : Qfalse;
 }
 
 /*
- * call-seq: update(str) -> self
+ * call-seq: auto_hibernate = true or false
  *
- * Updates current digest value with string.
+ * If enabled, the state is hibernated automatically after every #update.
  */
-static VALUE _Digest_XXH3_64bits_update(VALUE self, VALUE str)
+static VALUE _Digest_XXH3_128bits_set_auto_hibernate(VALUE self, VALUE value)
 {
-	if (XXH3_64bits_update(_get_state_xxh3_64bits(self), RSTRING_PTR(str), RSTRING_LEN(str)) != XXH_OK)
-		rb_raise(rb_eRuntimeError, "Failed to update state.");
+	struct _xxh3_data *data_p = _get_raw_data_xxh3_128bits(self);
 
-	return self;
+	if ((data_p->auto_hibernate = RTEST(value)))
+		_xxh3_hibernate(data_p);
+
+	return value;
 }
 
-/* :nodoc: */
-static VALUE _Digest_XXH3_64bits_finish(VALUE self)
+/*
+ * call-seq: auto_hibernate -> true or false
+ *
+ * Returns true if the state is hibernated automatically after every #update.
+ */
+static VALUE _Digest_XXH3_128bits_auto_hibernate(VALUE self)
 {
-	XXH64_hash_t hash = XXH3_64bits_digest(_get_state_xxh3_64bits(self));
-	VALUE str = rb_usascii_str_new(0, sizeof(XXH64_canonical_t));
-	XXH64_canonicalFromHash((XXH64_canonical_t *)RSTRING_PTR(str), hash);
-	return str;
+	return _get_raw_data_xxh3_128bits(self)->auto_hibernate ? Qtrue : Qfalse;
 }
 
-/* :nodoc: */
-static VALUE _Digest_XXH3_64bits_ifinish(VALUE self)
+/*
+ * call-seq: digest_length -> int
+ *
+ * Returns 16
+ */
+static VALUE _Digest_XXH3_128bits_digest_length(VALUE self)
 {
-	XXH64_hash_t hash = XXH3_64bits_digest(_get_state_xxh3_64bits(self));
-	return ULL2NUM(hash);
+	return INT2FIX(_XXH3_128BITS_DIGEST_SIZE);
 }
 
 /*
- * call-seq: reset(seed = 0) -> self
- *
- * Resets state to initial form with seed.
- *
- * This discards previous calculations with #update.
- *
- * +seed+ can be in the form of a string, a hex string, or a number.
- * Its virtual length should be 64-bits.
+ * call-seq: block_length -> int
  *
- * If +seed+ is not provided, the default value would be 0.
+ * Returns 16
  */
-static VALUE _Digest_XXH3_64bits_reset(int argc, VALUE* argv, VALUE self)
+static VALUE _Digest_XXH3_128bits_block_length(VALUE self)
 {
-	VALUE seed;
-
-	if (rb_scan_args(argc, argv, "01", &seed) > 0) {
-		switch (TYPE(seed)) {
-		case T_STRING:
-			{
-				int len = RSTRING_LEN(seed);
-				XXH64_hash_t decoded_seed;
+	return INT2FIX(_XXH3_128BITS_BLOCK_SIZE);
+}
 
-				if (len == _TWICE(sizeof(XXH64_hash_t))) {
-					unsigned char hex_decoded_seed[sizeof(XXH64_hash_t)];
+/*
+ * call-seq: digest_length -> int
+ *
+ * Returns 16
+ */
+static VALUE _Digest_XXH3_128bits_singleton_digest_length(VALUE self)
+{
+	return INT2FIX(_XXH3_128BITS_DIGEST_SIZE);
+}
 
-					if (! hex_decode_str_implied(_RSTRING_PTR_U(seed), len, hex_decoded_seed))
-						rb_raise(rb_eArgError, "Invalid hex string seed: %s\n",
-								StringValueCStr(seed));
+/*
+ * call-seq: block_length -> int
+ *
+ * Returns 16
+ */
+static VALUE _Digest_XXH3_128bits_singleton_block_length(VALUE self)
+{
+	return INT2FIX(_XXH3_128BITS_BLOCK_SIZE);
+}
 
-					decoded_seed = XXH_readBE64(hex_decoded_seed);
-				} else if (len == sizeof(XXH64_hash_t)) {
-					decoded_seed = XXH_readBE64(RSTRING_PTR(seed));
-				} else {
-					rb_raise(rb_eArgError, "Invalid seed length.  "
-							"Expecting a 16-character hex string or an 8-byte string.");
-				}
+/*
+ * call-seq:
+ *     idigest_seeds(str, seeds) -> array
+ *     idigest_seeds(str, seeds, packed: true) -> str
+ *
+ * Returns the digests of +str+ hashed with each seed in +seeds+, computed in
+ * a single call.  Seeds need to be numbers.
+ *
+ * If +packed+ is true, the digests are returned packed into a single string
+ * instead, each in the same form as the one returned by ::digest.
+ */
+static VALUE _Digest_XXH3_128bits_singleton_idigest_seeds(int argc, VALUE* argv, VALUE self)
+{
+	return _idigest_seeds(argc, argv, &_xxh3_128bits_algo);
+}
 
-				_xxh3_64bits_reset(_get_state_xxh3_64bits(self), decoded_seed);
-			}
+/*
+ * call-seq:
+ *     idigest_seeds_many(strings, seeds) -> array
+ *     idigest_seeds_many(strings, seeds, packed: true) -> str
+ *
+ * Same as ::idigest_seeds but hashes each string in +strings+.  Returns an
+ * array of arrays of digests, or all digests packed into a single string,
+ * grouped by string.
+ */
+static VALUE _Digest_XXH3_128bits_singleton_idigest_seeds_many(int argc, VALUE* argv, VALUE self)
+{
+	return _idigest_seeds_many(argc, argv, &_xxh3_128bits_algo);
+}
 
-			break;
-		case T_FIXNUM:
-		case T_BIGNUM:
-			_xxh3_64bits_reset(_get_state_xxh3_64bits(self), NUM2ULL(seed));
-			break;
-		default:
-			rb_raise(rb_eArgError, "Invalid argument type for 'seed'.  "
-					"Expecting a string or a number.");
-		}
-	} else {
-		_xxh3_64bits_reset(_get_state_xxh3_64bits(self), _XXH3_64BITS_DEFAULT_SEED);
-	}
+/*
+ * call-seq:
+ *     idigest_many(strings, seed = 0) -> array
+ *     idigest_many(strings, seed = 0, packed: true) -> str
+ *
+ * Returns the digests of each string in +strings+, computed in a single
+ * call.  +seed+ needs to be a number.
+ *
+ * If +packed+ is true, the digests are returned packed into a single string
+ * instead, each in the same form as the one returned by ::digest.
+ */
+static VALUE _Digest_XXH3_128bits_singleton_idigest_many(int argc, VALUE* argv, VALUE self)
+{
+	return _idigest_many(argc, argv, &_xxh3_128bits_algo);
+}
 
-	return self;
+/*
+ * call-seq:
+ *     tree_digest(buffer, chunk: 1 MiB, threads: nil) -> str
+ *
+ * Returns the tree digest of +buffer+, computed with +threads+ threads.
+ * It's a different value from the one returned by ::digest, but it's the
+ * same for any number of threads.  If +threads+ isn't specified, as many
+ * threads as online processors are used.  At most 64 threads are used.
+ *
+ * +buffer+ can be a string, an IO::Buffer, or an object exporting a memory
+ * view.  It's hashed with the GVL released if it's at least 1 MiB long.
+ *
+ * The tree mode is versioned by TREE_DIGEST_VERSION.  Version 1 is computed
+ * as follows:
+ *
+ * 1. +buffer+ is split into chunks of +chunk+ bytes.  The last chunk may be
+ *    shorter.  An empty buffer has no chunks.
+ * 2. Each chunk is hashed with XXH3_128bits and no seed, giving 16-byte
+ *    digests in the same form as the one returned by ::digest.
+ * 3. The result is the XXH3_128bits digest, with no seed, of a 24-byte header
+ *    followed by the chunk digests in order.  The header consists of "XXHT",
+ *    the version number as a byte, three zero bytes, and the chunk size and
+ *    the length of +buffer+ as 64-bit little-endian integers.
+ */
+static VALUE _Digest_XXH3_128bits_singleton_tree_digest(int argc, VALUE* argv, VALUE self)
+{
+	ID keywords[2];
+	VALUE buffer, opts, values[2], result;
+	struct _tree_body_args args;
+	long chunk_size = _TREE_DEFAULT_CHUNK_SIZE;
+	int threads;
+
+	keywords[0] = _id_chunk;
+	keywords[1] = _id_threads;
+
+	rb_scan_args(argc, argv, "1:", &buffer, &opts);
+	values[0] = values[1] = Qundef;
+
+	if (! NIL_P(opts))
+		rb_get_kwargs(opts, keywords, 0, 2, values);
+
+	if (values[0] != Qundef && ! NIL_P(values[0]) && (chunk_size = NUM2LONG(values[0])) <= 0)
+		rb_raise(rb_eArgError, "Chunk size needs to be greater than 0.");
+
+	threads = _get_threads_opt(values[1]);
+	_check_input(buffer);
+	result = rb_usascii_str_new(0, 16);
+	args.digest = _RSTRING_PTR_U(result);
+	_acquire_input(&args.input, buffer, Qundef, Qundef);
+	_init_tree(&args.tree, args.input.ptr, args.input.len, chunk_size,
+			args.input.len / chunk_size + (args.input.len % chunk_size != 0), threads);
+
+	if (_input_needs_release(&args.input))
+		rb_ensure(_tree_body, (VALUE)&args, _tree_ensure, (VALUE)&args);
+	else
+		_tree_body((VALUE)&args);
+
+	RB_GC_GUARD(args.input.holder);
+	return result;
 }
 
 /*
- * call-seq: reset_with_secret(secret) -> self
+ * call-seq: files(paths, concurrency: 64, engine: nil) -> array
  *
- * Resets state to initial form using a secret.
+ * Returns the digests of the files at +paths+ in an array, in the same order
+ * and form as the ones returned by ::digest.  It's meant for hashing many
+ * small files, where opening and reading them costs more than hashing them.
  *
- * This discards previous calculations with #update.
+ * On Linux, the files are opened, read and closed through io_uring, with up
+ * to +concurrency+ files in flight, and hashed as their reads complete.
+ * Elsewhere, or if io_uring is unavailable, they're read by +concurrency+
+ * threads instead.  Either way, the GVL is released.  +engine+ can be
+ * +:io_uring+ or +:threads+ to choose one; +:io_uring+ raises
+ * NotImplementedError if it's unavailable.
  *
- * Secret should be a string and have a minimum length of XXH3_SECRET_SIZE_MIN.
+ * A SystemCallError is raised for the first file in +paths+ that can't be
+ * read, including Errno::EISDIR for a directory and Errno::EINVAL for
+ * anything else that isn't a regular file, like a FIFO.
  */
-static VALUE _Digest_XXH3_64bits_reset_with_secret(VALUE self, VALUE secret)
+static VALUE _Digest_XXH3_128bits_singleton_files(int argc, VALUE* argv, VALUE self)
 {
-	if (TYPE(secret) != T_STRING)
-		rb_raise(rb_eArgError, "Argument 'secret' needs to be a string.");
+	ID keywords[2];
+	VALUE paths, opts, values[2];
+	int concurrency = _FILES_DEFAULT_CONCURRENCY, engine = _FILES_ENGINE_AUTO;
 
-	if (RSTRING_LEN(secret) < XXH3_SECRET_SIZE_MIN)
-		rb_raise(rb_eRuntimeError, "Secret needs to be at least %d bytes in length.",
-				XXH3_SECRET_SIZE_MIN);
+	keywords[0] = _id_concurrency;
+	keywords[1] = _id_engine;
 
-	if (XXH3_64bits_reset_withSecret(_get_state_xxh3_64bits(self), RSTRING_PTR(secret),
-			RSTRING_LEN(secret)) != XXH_OK)
-		rb_raise(rb_eRuntimeError, "Failed to reset state with secret.");
+	rb_scan_args(argc, argv, "1:", &paths, &opts);
+	values[0] = values[1] = Qundef;
 
-	return self;
+	if (! NIL_P(opts))
+		rb_get_kwargs(opts, keywords, 0, 2, values);
+
+	if (values[0] != Qundef && ! NIL_P(values[0]) && (concurrency = NUM2INT(values[0])) <= 0)
+		rb_raise(rb_eArgError, "Concurrency needs to be greater than 0.");
+
+	if (values[1] == ID2SYM(_id_io_uring))
+		engine = _FILES_ENGINE_IO_URING;
+	else if (values[1] == ID2SYM(_id_threads))
+		engine = _FILES_ENGINE_THREADS;
+	else if (values[1] != Qundef && ! NIL_P(values[1]))
+		rb_raise(rb_eArgError, "Invalid engine.");
+
+	return _hash_files(rb_convert_type(paths, T_ARRAY, "Array", "to_ary"), concurrency, engine);
 }
 
 /*
- * call-seq: initialize_copy(orig) -> self
+ * call-seq:
+ *     tree(path, threads: nil, follow_symlinks: false, exclude: nil) -> hash
+ *     tree(path, aggregate: true, ...) -> [hash, str]
  *
- * This method is called when instances are cloned.  It is responsible for
- * replicating internal data.
+ * Returns the digests of the regular files under the directory at +path+ in a
+ * hash, keyed with their paths relative to it, in bytewise order of the
+ * paths.  The directories are walked natively with the GVL released, and
+ * the files are then hashed like ::files by +threads+ threads, each taking
+ * the next file when done with one.  +threads+ defaults to the number of
+ * online processors.
+ *
+ * Symbolic links are skipped unless +follow_symlinks+ is true, in which case
+ * links to regular files and directories are followed, except links to a
+ * directory containing them.  Other kinds of files are always skipped.
+ *
+ * +exclude+ is a glob pattern or an array of them, matched with fnmatch(3).
+ * Patterns containing a slash are matched against relative paths, and others
+ * against base names.  Excluded directories aren't walked into.
+ *
+ * If +aggregate+ is true, an array of the hash and a digest of the whole tree
+ * is returned instead.  That digest is the XXH3_128bits digest, with no seed,
+ * of each relative path followed by a zero byte and the file's digest, in
+ * the order of the hash.
+ *
+ * A SystemCallError is raised for a directory or file that can't be read.
  */
-static VALUE _Digest_XXH3_64bits_initialize_copy(VALUE self, VALUE orig)
+static VALUE _Digest_XXH3_128bits_singleton_tree(int argc, VALUE* argv, VALUE self)
 {
-	XXH3_copyState(_get_state_xxh3_64bits(self), _get_state_xxh3_64bits(orig));
-	return self;
+	#if defined(HAVE_FDOPENDIR) && defined(HAVE_FNMATCH)
+	ID keywords[4];
+	VALUE path, opts, values[4], excludes, patterns, pattern;
+	long i;
+
+	keywords[0] = _id_threads;
+	keywords[1] = _id_follow_symlinks;
+	keywords[2] = _id_exclude;
+	keywords[3] = _id_aggregate;
+
+	rb_scan_args(argc, argv, "1:", &path, &opts);
+	values[0] = values[1] = values[2] = values[3] = Qundef;
+
+	if (! NIL_P(opts))
+		rb_get_kwargs(opts, keywords, 0, 4, values);
+
+	FilePathValue(path);
+	excludes = rb_ary_new();
+
+	if (values[2] != Qundef && ! NIL_P(values[2])) {
+		if (NIL_P(patterns = rb_check_array_type(values[2])))
+			patterns = rb_ary_new_from_values(1, &values[2]);
+
+		for (i = 0; i < RARRAY_LEN(patterns); ++i) {
+			pattern = RARRAY_AREF(patterns, i);
+			StringValueCStr(pattern);
+			rb_ary_push(excludes, pattern);
+		}
+	}
+
+	return _hash_dir_tree(path, excludes, _get_threads_opt(values[0]),
+			values[1] != Qundef && RTEST(values[1]), values[3] != Qundef && RTEST(values[3]));
+	#else
+	rb_notimplement();
+	UNREACHABLE_RETURN(Qnil);
+	#endif
 }
 
 /*
- * call-seq: digest_length -> int
+ * call-seq: generate_secret(seed, size = 192) -> str
  *
- * Returns 8
+ * Generates a custom secret from +seed+, which can be a string of any length.
+ * The result can be used with #reset_with_secret.
+ *
+ * The returned string is frozen, so it can be shared between Ractors.
  */
-static VALUE _Digest_XXH3_64bits_digest_length(VALUE self)
+static VALUE _Digest_XXH3_128bits_singleton_generate_secret(int argc, VALUE* argv, VALUE self)
 {
-	return INT2FIX(_XXH3_64BITS_DIGEST_SIZE);
+	return _generate_secret(argc, argv);
 }
 
 /*
- * call-seq: block_length -> int
+ * Document-module: Digest::XXHash::Merkle
  *
- * Returns 8
+ * Builds manifests of files as Merkle trees of XXH3_128bits chunk digests,
+ * so that ranges of a file can be verified without hashing the whole file.
+ *
+ *     manifest = Digest::XXHash::Merkle.build("image.iso")
+ *     Digest::XXHash::Merkle.verify_range("image.iso", 4096, 65536, manifest)
+ *     # => true
+ *
+ * Like the rest of XXHash, the trees detect accidental corruption and can't
+ * protect against deliberate tampering.
  */
-static VALUE _Digest_XXH3_64bits_block_length(VALUE self)
-{
-	return INT2FIX(_XXH3_64BITS_BLOCK_SIZE);
-}
 
 /*
- * call-seq: digest_length -> int
+ * call-seq:
+ *     Digest::XXHash::Merkle.build(path, chunk_size: 1 MiB, threads: nil) -> str
  *
- * Returns 8
+ * Returns the manifest of the file at +path+ as a binary string.  The file is
+ * mapped to memory and its chunks are hashed with +threads+ threads, which
+ * defaults to the number of online processors.  The result doesn't depend on
+ * the number of threads.
  */
-static VALUE _Digest_XXH3_64bits_singleton_digest_length(VALUE self)
+static VALUE _Digest_XXHash_Merkle_singleton_build(int argc, VALUE* argv, VALUE self)
 {
-	return INT2FIX(_XXH3_64BITS_DIGEST_SIZE);
+	ID keywords[2];
+	VALUE path, opts, values[2];
+	struct _merkle_build_args args;
+
+	keywords[0] = _id_chunk_size;
+	keywords[1] = _id_threads;
+
+	rb_scan_args(argc, argv, "1:", &path, &opts);
+	values[0] = values[1] = Qundef;
+
+	if (! NIL_P(opts))
+		rb_get_kwargs(opts, keywords, 0, 2, values);
+
+	args.chunk_size = _MERKLE_DEFAULT_CHUNK_SIZE;
+
+	if (values[0] != Qundef && ! NIL_P(values[0]) && (args.chunk_size = NUM2LONG(values[0])) <= 0)
+		rb_raise(rb_eArgError, "Chunk size needs to be greater than 0.");
+
+	args.threads = _get_threads_opt(values[1]);
+	FilePathValue(path);
+	_map_file(&args.merkle.file, path);
+	return _with_mapped_file(&args.merkle, _merkle_build_body);
 }
 
 /*
- * call-seq: block_length -> int
+ * call-seq: Digest::XXHash::Merkle.root(manifest) -> str
  *
- * Returns 8
+ * Returns the root node of +manifest+.  Comparing it with a trusted root
+ * verifies the manifest itself.
  */
-static VALUE _Digest_XXH3_64bits_singleton_block_length(VALUE self)
+static VALUE _Digest_XXHash_Merkle_singleton_root(VALUE self, VALUE manifest)
 {
-	return INT2FIX(_XXH3_64BITS_BLOCK_SIZE);
+	struct _merkle_manifest m;
+
+	StringValue(manifest);
+	_parse_merkle_manifest(manifest, &m);
+	return rb_usascii_str_new((const char *)m.nodes + (_merkle_node_count(m.count) - 1) * 16, 16);
 }
 
 /*
- * Document-class: Digest::XXH3_128bits
+ * call-seq:
+ *     Digest::XXHash::Merkle.verify_range(path, offset, length, manifest, root: nil, threads: nil) -> true or false
  *
- * This class implements XXH3_128bits.
+ * Verifies +length+ bytes at +offset+ in the file at +path+ against
+ * +manifest+.  Only the chunks touched by the range are read and hashed.
+ * Their nodes and the nodes on their paths to the root are then checked with
+ * the sibling nodes in +manifest+.  If +root+ is specified, the root of
+ * +manifest+ has to be equal to it.
+ *
+ * Returns false if verification fails or if the file is too short to contain
+ * the touched chunks, as with a partial download.  Raises ArgumentError if the
+ * range is outside the file described by +manifest+.
  */
-
-static VALUE _Digest_XXH3_128bits_internal_allocate(VALUE klass)
+static VALUE _Digest_XXHash_Merkle_singleton_verify_range(int argc, VALUE* argv, VALUE self)
 {
-	XXH3_state_t *state_p = XXH3_createState();
-	XXH3_128bits_reset(state_p);
-	return TypedData_Wrap_Struct(klass, &_xxh3_128bits_state_data_type, state_p);
+	ID keywords[2];
+	VALUE path, offset_arg, length_arg, manifest, opts, values[2];
+	struct _merkle_manifest m;
+	struct _merkle_verify_args args;
+	const unsigned char *level;
+	unsigned char node[16];
+	long offset, length;
+	size_t first, last, start, end, n, i;
+	int threads, ok;
+
+	keywords[0] = _id_root;
+	keywords[1] = _id_threads;
+
+	rb_scan_args(argc, argv, "4:", &path, &offset_arg, &length_arg, &manifest, &opts);
+	values[0] = values[1] = Qundef;
+
+	if (! NIL_P(opts))
+		rb_get_kwargs(opts, keywords, 0, 2, values);
+
+	FilePathValue(path);
+	offset = _get_range_arg(offset_arg);
+	length = _get_range_arg(length_arg);
+	manifest = rb_str_new_frozen(StringValue(manifest));
+	_parse_merkle_manifest(manifest, &m);
+	threads = _get_threads_opt(values[1]);
+
+	if ((size_t)offset > m.file_size || (size_t)length > m.file_size - offset)
+		rb_raise(rb_eArgError, "Range is outside the file described by the manifest.");
+
+	if (values[0] != Qundef && ! NIL_P(values[0])) {
+		StringValue(values[0]);
+
+		if (RSTRING_LEN(values[0]) != 16 || memcmp(RSTRING_PTR(values[0]),
+				m.nodes + (_merkle_node_count(m.count) - 1) * 16, 16) != 0)
+			return Qfalse;
+	}
+
+	if (length == 0)
+		return Qtrue;
+
+	first = offset / m.chunk_size;
+	last = (offset + length - 1) / m.chunk_size;
+	start = first * m.chunk_size;
+	end = last * m.chunk_size + (m.file_size - last * m.chunk_size < m.chunk_size ?
+			m.file_size - last * m.chunk_size : m.chunk_size);
+
+	args.m = &m;
+	args.first = first;
+	args.last = last;
+	args.start = start;
+	args.end = end;
+	args.threads = threads;
+	_map_file(&args.merkle.file, path);
+	ok = RTEST(_with_mapped_file(&args.merkle, _merkle_verify_body));
+
+	for (level = m.nodes, n = m.count; ok && n > 1; level += n * 16, n = (n + 1) / 2) {
+		first /= 2;
+		last /= 2;
+
+		for (i = first; ok && i <= last; ++i) {
+			_merkle_parent(level, n, i, node);
+			ok = memcmp(node, level + (n + i) * 16, 16) == 0;
+		}
+	}
+
+	RB_GC_GUARD(manifest);
+	return ok ? Qtrue : Qfalse;
 }
 
 /*
- * call-seq: update(str) -> self
+ * Document-class: Digest::XXHash::Chunker
+ *
+ * Splits data into content-defined chunks and computes their XXH3_128bits
+ * digests in one pass, for deduplication.  Boundaries depend on the data
+ * around them, so inserting or removing data only changes the chunks near
+ * the change.
+ *
+ *     chunker = Digest::XXHash::Chunker.new(min: 2048, avg: 8192, max: 65536)
  *
- * Updates current digest value with string.
+ *     File.open("backup.tar", "rb") do |io|
+ *       chunker.each_chunk(io) do |offset, length, digest|
+ *         store(digest, offset, length) unless stored?(digest)
+ *       end
+ *     end
+ *
+ * Boundaries are found with FastCDC's gear hash and normalized chunking.
+ * The gear table consists of the XXH64 digests, with no seed, of the bytes
+ * 0 to 255.  If +avg+ is between 2**n and 2**(n+1), a boundary is placed
+ * after a byte when the n + 2 highest bits of the fingerprint are zero
+ * before +avg+ bytes are reached, or when the n - 2 highest bits are zero
+ * after that.  A chunk is cut at +max+ bytes if no boundary was found.
  */
-static VALUE _Digest_XXH3_128bits_update(VALUE self, VALUE str)
+
+static struct _chunker *_get_chunker(VALUE self)
 {
-	if (XXH3_128bits_update(_get_state_xxh3_128bits(self), RSTRING_PTR(str), RSTRING_LEN(str)) != XXH_OK)
-		rb_raise(rb_eRuntimeError, "Failed to update state.");
+	struct _chunker *chunker_p;
+	TypedData_Get_Struct(self, struct _chunker, &_chunker_data_type, chunker_p);
 
-	return self;
-}
+	if (chunker_p->max == 0)
+		rb_raise(rb_eRuntimeError, "Chunker object is not initialized.");
 
-/* :nodoc: */
-static VALUE _Digest_XXH3_128bits_finish(VALUE self)
-{
-	XXH128_hash_t hash = XXH3_128bits_digest(_get_state_xxh3_128bits(self));
-	VALUE str = rb_usascii_str_new(0, sizeof(XXH128_canonical_t));
-	XXH128_canonicalFromHash((XXH128_canonical_t *)RSTRING_PTR(str), hash);
-	return str;
+	return chunker_p;
 }
 
-/* :nodoc: */
-static VALUE _Digest_XXH3_128bits_ifinish(VALUE self)
+static VALUE _Digest_XXHash_Chunker_internal_allocate(VALUE klass)
 {
-	XXH128_hash_t hash = XXH3_128bits_digest(_get_state_xxh3_128bits(self));
-
-	if (! XXH_CPU_LITTLE_ENDIAN) {
-		#define _SWAP_WORDS(x) ((x << 32) & 0xffffffff00000000ULL) | \
-			((x >> 32) & 0x000000000ffffffffULL)
-		hash.low64 = _SWAP_WORDS(hash.low64);
-		hash.high64 = _SWAP_WORDS(hash.high64);
-	}
-
-	return rb_integer_unpack(&hash, 4, sizeof(XXH32_hash_t), 0, INTEGER_PACK_LSWORD_FIRST|
-			INTEGER_PACK_NATIVE_BYTE_ORDER);
+	struct _chunker *chunker_p;
+	return TypedData_Make_Struct(klass, struct _chunker, &_chunker_data_type, chunker_p);
 }
 
 /*
- * call-seq: reset(seed = 0) -> self
- *
- * Resets state to initial form with seed.
+ * call-seq: new(min: 2 KiB, avg: 8 KiB, max: 64 KiB) -> chunker
  *
- * This discards previous calculations with #update.
- *
- * +seed+ can be in the form of a string, a hex string, or a number.
- * Its virtual length should be 64-bits and not 128-bits.
- *
- * If +seed+ is not provided, the default value would be 0.
+ * Returns a new chunker producing chunks of +min+ to +max+ bytes, and of
+ * about +avg+ bytes on average.  +avg+ needs to be at least 64, and between
+ * +min+ and +max+.  The returned object is frozen.
  */
-static VALUE _Digest_XXH3_128bits_reset(int argc, VALUE* argv, VALUE self)
+static VALUE _Digest_XXHash_Chunker_initialize(int argc, VALUE* argv, VALUE self)
 {
-	VALUE seed;
+	ID keywords[3];
+	VALUE opts, values[3];
+	struct _chunker *chunker_p;
+	long min = _CHUNKER_DEFAULT_MIN, avg = _CHUNKER_DEFAULT_AVG, max = _CHUNKER_DEFAULT_MAX;
+	int bits;
 
-	if (rb_scan_args(argc, argv, "01", &seed) > 0) {
-		switch (TYPE(seed)) {
-		case T_STRING:
-			{
-				int len = RSTRING_LEN(seed);
-				XXH64_hash_t decoded_seed;
+	keywords[0] = _id_min;
+	keywords[1] = _id_avg;
+	keywords[2] = _id_max;
 
-				if (len == _TWICE(sizeof(XXH64_hash_t))) {
-					unsigned char hex_decoded_seed[sizeof(XXH64_hash_t)];
+	rb_scan_args(argc, argv, "0:", &opts);
+	values[0] = values[1] = values[2] = Qundef;
 
-					if (! hex_decode_str_implied(_RSTRING_PTR_U(seed), len, hex_decoded_seed))
-						rb_raise(rb_eArgError, "Invalid hex string seed: %s\n",
-								StringValueCStr(seed));
+	if (! NIL_P(opts))
+		rb_get_kwargs(opts, keywords, 0, 3, values);
 
-					decoded_seed = XXH_readBE64(hex_decoded_seed);
-				} else if (len == sizeof(XXH64_hash_t)) {
-					decoded_seed = XXH_readBE64(RSTRING_PTR(seed));
-				} else {
-					rb_raise(rb_eArgError, "Invalid seed length.  Expecting a 16-character hex "
-							"string or an 8-byte string.");
-				}
+	if (values[0] != Qundef)
+		min = NUM2LONG(values[0]);
 
-				_xxh3_128bits_reset(_get_state_xxh3_128bits(self), decoded_seed);
-			}
+	if (values[1] != Qundef)
+		avg = NUM2LONG(values[1]);
 
-			break;
-		case T_FIXNUM:
-		case T_BIGNUM:
-			_xxh3_128bits_reset(_get_state_xxh3_128bits(self), NUM2ULL(seed));
-			break;
-		default:
-			rb_raise(rb_eArgError, "Invalid argument type for 'seed'.  "
-					"Expecting a string or a number.");
-		}
-	} else {
-		_xxh3_128bits_reset(_get_state_xxh3_128bits(self), _XXH3_128BITS_DEFAULT_SEED);
-	}
+	if (values[2] != Qundef)
+		max = NUM2LONG(values[2]);
 
-	return self;
+	if (min <= 0 || avg < 64 || min > avg || avg > max)
+		rb_raise(rb_eArgError, "Chunk sizes need to satisfy 0 < min <= avg <= max and avg >= 64.");
+
+	TypedData_Get_Struct(self, struct _chunker, &_chunker_data_type, chunker_p);
+
+	if (chunker_p->max != 0)
+		rb_raise(rb_eRuntimeError, "Chunker object is already initialized.");
+
+	for (bits = 0; (avg >> (bits + 1)) != 0; ++bits);
+
+	chunker_p->min = min;
+	chunker_p->avg = avg;
+	chunker_p->max = max;
+	chunker_p->mask_s = ~(XXH64_hash_t)0 << (64 - (bits + 2));
+	chunker_p->mask_l = ~(XXH64_hash_t)0 << (64 - (bits - 2));
+	return rb_obj_freeze(self);
 }
 
 /*
- * call-seq: reset_with_secret(secret) -> self
- *
- * Resets state to initial form using a secret.
+ * call-seq:
+ *     each_chunk(str_or_io) { |offset, length, digest| ... } -> self
+ *     each_chunk(str_or_io) -> enumerator
  *
- * This discards previous calculations with #update.
+ * Splits the data in +str_or_io+ into chunks and yields the offset, the
+ * length, and the XXH3_128bits digest of each one.  The digests are in the
+ * same form as the ones returned by Digest::XXH3_128bits.digest.
  *
- * Secret should be a string having a minimum length of XXH3_SECRET_SIZE_MIN.
+ * +str_or_io+ can be a string, an IO::Buffer, an object exporting a memory
+ * view, or an object responding to +read+ like an IO, which is read in 1 MiB
+ * pieces.  Chunks are found and hashed with the GVL released when at least
+ * 1 MiB of data is available, and no string is allocated for their data.
  */
-static VALUE _Digest_XXH3_128bits_reset_with_secret(VALUE self, VALUE secret)
+static VALUE _Digest_XXHash_Chunker_each_chunk(VALUE self, VALUE data)
 {
-	if (TYPE(secret) != T_STRING)
-		rb_raise(rb_eArgError, "Argument 'secret' needs to be a string.");
+	struct _chunks_args args;
 
-	if (RSTRING_LEN(secret) < XXH3_SECRET_SIZE_MIN)
-		rb_raise(rb_eRuntimeError, "Secret needs to be at least %d bytes in length.",
-				XXH3_SECRET_SIZE_MIN);
+	RETURN_ENUMERATOR(self, 1, &data);
 
-	if (XXH3_128bits_reset_withSecret(_get_state_xxh3_128bits(self), RSTRING_PTR(secret),
-			RSTRING_LEN(secret)) != XXH_OK)
-		rb_raise(rb_eRuntimeError, "Failed to reset state with secret.");
+	memset(&args, 0, sizeof args);
+	args.chunks.chunker = *_get_chunker(self);
 
+	if (! _is_input(data) && rb_respond_to(data, _id_read)) {
+		args.input.holder = data;
+		rb_ensure(_chunks_io_body, (VALUE)&args, _chunks_ensure, (VALUE)&args);
+	} else {
+		_acquire_input(&args.input, data, Qundef, Qundef);
+		rb_ensure(_chunks_str_body, (VALUE)&args, _chunks_ensure, (VALUE)&args);
+	}
+
+	RB_GC_GUARD(args.input.holder);
 	return self;
 }
 
 /*
- * call-seq: initialize_copy(orig) -> self
+ * call-seq: min -> int
  *
- * This method is called when instances are cloned.  It is responsible for
- * replicating internal data.
+ * Returns the minimum chunk size.
  */
-static VALUE _Digest_XXH3_128bits_initialize_copy(VALUE self, VALUE orig)
+static VALUE _Digest_XXHash_Chunker_min(VALUE self)
 {
-	XXH3_copyState(_get_state_xxh3_128bits(self), _get_state_xxh3_128bits(orig));
-	return self;
+	return SIZET2NUM(_get_chunker(self)->min);
 }
 
 /*
- * call-seq: digest_length -> int
+ * call-seq: avg -> int
  *
- * Returns 16
+ * Returns the average chunk size the chunker aims for.
  */
-static VALUE _Digest_XXH3_128bits_digest_length(VALUE self)
+static VALUE _Digest_XXHash_Chunker_avg(VALUE self)
 {
-	return INT2FIX(_XXH3_128BITS_DIGEST_SIZE);
+	return SIZET2NUM(_get_chunker(self)->avg);
 }
 
 /*
- * call-seq: block_length -> int
+ * call-seq: max -> int
  *
- * Returns 16
+ * Returns the maximum chunk size.
  */
-static VALUE _Digest_XXH3_128bits_block_length(VALUE self)
+static VALUE _Digest_XXHash_Chunker_max(VALUE self)
 {
-	return INT2FIX(_XXH3_128BITS_BLOCK_SIZE);
+	return SIZET2NUM(_get_chunker(self)->max);
 }
 
 /*
- * call-seq: digest_length -> int
+ * Document-module: Digest::XXHash::Rsync
  *
- * Returns 16
+ * Computes rsync-style block signatures of files, and deltas of new versions
+ * of the files against them.
+ *
+ *     signature = File.open("old.img", "rb") { |io| Digest::XXHash::Rsync.signature(io) }
+ *     delta = File.open("new.img", "rb") { |io| Digest::XXHash::Rsync.delta(io, signature) }
+ *
+ *     File.open("old.img", "rb") do |old|
+ *       File.open("new.img.tmp", "wb") do |out|
+ *         delta.each do |op|
+ *           out.write(op.is_a?(Range) ? old.pread(op.size, op.begin) : op)
+ *         end
+ *       end
+ *     end
+ *
+ * Blocks are matched with rsync's rolling weak checksum and confirmed with
+ * XXH3_64bits.  Like the rest of XXHash, this detects accidental differences
+ * and can't protect against deliberately crafted collisions.
  */
-static VALUE _Digest_XXH3_128bits_singleton_digest_length(VALUE self)
+
+/*
+ * call-seq: Digest::XXHash::Rsync.signature(str_or_io, block: 2048) -> str
+ *
+ * Returns the signature of the data in +str_or_io+ as a binary string.  It
+ * consists of the weak checksum and the XXH3_64bits digest of each block of
+ * +block+ bytes.
+ *
+ * +str_or_io+ can be a string, an IO::Buffer, an object exporting a memory
+ * view, or an object responding to +read+ like an IO, which is read in 1 MiB
+ * pieces.  Blocks are hashed with the GVL released when at least 1 MiB of
+ * data is available.
+ */
+static VALUE _Digest_XXHash_Rsync_singleton_signature(int argc, VALUE* argv, VALUE self)
 {
-	return INT2FIX(_XXH3_128BITS_DIGEST_SIZE);
+	ID keywords[1];
+	VALUE data, opts, block_arg = Qundef;
+	struct _signature_args args;
+	long block_size = _RSYNC_DEFAULT_BLOCK_SIZE;
+
+	keywords[0] = _id_block;
+	rb_scan_args(argc, argv, "1:", &data, &opts);
+
+	if (! NIL_P(opts))
+		rb_get_kwargs(opts, keywords, 0, 1, &block_arg);
+
+	if (block_arg != Qundef && (block_size = NUM2LONG(block_arg)) <= 0)
+		rb_raise(rb_eArgError, "Block size needs to be greater than 0.");
+
+	memset(&args, 0, sizeof args);
+	args.block_size = block_size;
+
+	if (! _is_input(data) && rb_respond_to(data, _id_read)) {
+		args.input.holder = data;
+		rb_ensure(_signature_io_body, (VALUE)&args, _signature_ensure, (VALUE)&args);
+	} else {
+		_acquire_input(&args.input, data, Qundef, Qundef);
+		rb_ensure(_signature_str_body, (VALUE)&args, _signature_ensure, (VALUE)&args);
+	}
+
+	RB_GC_GUARD(args.input.holder);
+	return args.result;
 }
 
 /*
- * call-seq: block_length -> int
+ * call-seq: Digest::XXHash::Rsync.delta(str_or_io, signature) -> array
  *
- * Returns 16
+ * Returns the operations that rebuild the data in +str_or_io+ from the file
+ * +signature+ was computed from.  Each operation is either a range of
+ * offsets in that file whose data is to be copied, or a string of literal
+ * data.  Adjacent copies and literal data are merged.
+ *
+ * The block slides over the data one byte at a time, and its weak checksum
+ * is looked up in a hash table built from +signature+, behind a bit filter
+ * that rejects most positions early.  Hits are confirmed with XXH3_64bits.
+ *
+ * +str_or_io+ is read the same way as in ::signature, and matching is done
+ * with the GVL released when at least 1 MiB of data is available.
  */
-static VALUE _Digest_XXH3_128bits_singleton_block_length(VALUE self)
+static VALUE _Digest_XXHash_Rsync_singleton_delta(VALUE self, VALUE data, VALUE signature)
 {
-	return INT2FIX(_XXH3_128BITS_BLOCK_SIZE);
+	struct _delta_args args;
+	VALUE tmp = 0;
+	size_t table_size, filter_size;
+	unsigned char *entries;
+
+	memset(&args, 0, sizeof args);
+	StringValue(signature);
+	_parse_signature(signature, &args.signature);
+
+	for (args.table_bits = 1; ((size_t)1 << args.table_bits) < args.signature.count * 2;
+			++args.table_bits);
+
+	for (args.filter_bits = 16; ((size_t)1 << args.filter_bits) < args.signature.count * 16;
+			++args.filter_bits);
+
+	/* The signature's entries are copied since the string can't be pinned. */
+	table_size = ((size_t)1 << args.table_bits) * sizeof(size_t);
+	filter_size = (size_t)1 << (args.filter_bits - 3);
+	args.table = ALLOCV(tmp, table_size + filter_size + args.signature.count * _RSYNC_ENTRY_SIZE);
+	args.filter = (unsigned char *)args.table + table_size;
+	entries = args.filter + filter_size;
+	memset(args.table, 0, table_size + filter_size);
+	memcpy(entries, args.signature.entries, args.signature.count * _RSYNC_ENTRY_SIZE);
+	args.signature.entries = entries;
+	_build_delta_table(&args);
+
+	args.next_block = SIZE_MAX;
+	args.result = rb_ary_new();
+	args.literal = Qnil;
+
+	if (! _is_input(data) && rb_respond_to(data, _id_read)) {
+		args.input.holder = data;
+		rb_ensure(_delta_io_body, (VALUE)&args, _delta_ensure, (VALUE)&args);
+	} else {
+		_acquire_input(&args.input, data, Qundef, Qundef);
+		rb_ensure(_delta_str_body, (VALUE)&args, _delta_ensure, (VALUE)&args);
+	}
+
+	ALLOCV_END(tmp);
+	RB_GC_GUARD(args.input.holder);
+	return args.result;
 }
 
 /*
@@ -1075,17 +9524,64 @@ static VALUE _Digest_XXH3_128bits_singleton_block_length(VALUE self)
 
 void Init_xxhash(void)
 {
+	#ifdef HAVE_RB_EXT_RACTOR_SAFE
+	rb_ext_ractor_safe(true);
+	#endif
+
 	#define DEFINE_ID(x) _id_##x = rb_intern_const(#x);
 
+	DEFINE_ID(Ractor)
+	DEFINE_ID(aggregate)
+	DEFINE_ID(avg)
+	DEFINE_ID(avx2)
+	DEFINE_ID(avx512)
+	DEFINE_ID(binread)
+	DEFINE_ID(block)
+	DEFINE_ID(bypass)
+	DEFINE_ID(cache)
+	DEFINE_ID(call)
+	DEFINE_ID(casefold)
+	DEFINE_ID(chomp)
+	DEFINE_ID(chunk)
+	DEFINE_ID(chunk_size)
+	DEFINE_ID(close)
+	DEFINE_ID(concurrency)
+	DEFINE_ID(current)
 	DEFINE_ID(digest)
+	DEFINE_ID(embed)
+	DEFINE_ID(engine)
+	DEFINE_ID(exclude)
 	DEFINE_ID(finish)
+	DEFINE_ID(follow_symlinks)
 	DEFINE_ID(hexdigest)
 	DEFINE_ID(idigest)
 	DEFINE_ID(ifinish)
+	DEFINE_ID(io_uring)
+	DEFINE_ID(length)
+	DEFINE_ID(main)
+	DEFINE_ID(max)
+	DEFINE_ID(min)
 	DEFINE_ID(new)
+	DEFINE_ID(offset)
+	DEFINE_ID(offsets)
+	DEFINE_ID(packed)
+	DEFINE_ID(progress)
+	DEFINE_ID(progress_interval)
+	DEFINE_ID(read)
+	DEFINE_ID(read_ahead)
+	DEFINE_ID(reference)
 	DEFINE_ID(reset)
+	DEFINE_ID(root)
+	DEFINE_ID(scalar)
+	DEFINE_ID(secret)
+	DEFINE_ID(seed)
+	DEFINE_ID(separator)
+	DEFINE_ID(stride)
+	DEFINE_ID(threads)
 	DEFINE_ID(update)
+	DEFINE_ID(width)
 
+	_init_gear();
 	rb_require("digest");
 	_Digest = rb_path2class("Digest");
 	_Digest_Class = rb_path2class("Digest::Class");
@@ -1113,6 +9609,8 @@ void Init_xxhash(void)
 	rb_define_singleton_method(_Digest_XXHash, "digest", _Digest_XXHash_singleton_digest, -1);
 	rb_define_singleton_method(_Digest_XXHash, "hexdigest", _Digest_XXHash_singleton_hexdigest, -1);
 	rb_define_singleton_method(_Digest_XXHash, "idigest", _Digest_XXHash_singleton_idigest, -1);
+	rb_define_singleton_method(_Digest_XXHash, "simd_level", _Digest_XXHash_singleton_simd_level, 0);
+	rb_define_singleton_method(_Digest_XXHash, "simd_level=", _Digest_XXHash_singleton_simd_level_set, 1);
 
 	/*
 	 * Document-class: Digest::XXH32
@@ -1122,13 +9620,22 @@ void Init_xxhash(void)
 	rb_define_alloc_func(_Digest_XXH32, _Digest_XXH32_internal_allocate);
 	rb_define_private_method(_Digest_XXH32, "finish", _Digest_XXH32_finish, 0);
 	rb_define_private_method(_Digest_XXH32, "ifinish", _Digest_XXH32_ifinish, 0);
-	rb_define_method(_Digest_XXH32, "update", _Digest_XXH32_update, 1);
+	rb_define_method(_Digest_XXH32, "update", _Digest_XXH32_update, -1);
+	rb_define_method(_Digest_XXH32, "file", _Digest_XXH32_file, -1);
 	rb_define_method(_Digest_XXH32, "reset", _Digest_XXH32_reset, -1);
 	rb_define_method(_Digest_XXH32, "digest_length", _Digest_XXH32_digest_length, 0);
 	rb_define_method(_Digest_XXH32, "block_length", _Digest_XXH32_block_length, 0);
 	rb_define_method(_Digest_XXH32, "initialize_copy", _Digest_XXH32_initialize_copy, 1);
+	rb_define_method(_Digest_XXH32, "freeze_prefix", _Digest_XXH32_freeze_prefix, 0);
+	rb_define_method(_Digest_XXH32, "export_state", _Digest_XXH32_export_state, 0);
+	rb_define_method(_Digest_XXH32, "import_state", _Digest_XXH32_import_state, 1);
+	rb_define_method(_Digest_XXH32, "marshal_dump", _Digest_XXH32_marshal_dump, 0);
+	rb_define_method(_Digest_XXH32, "marshal_load", _Digest_XXH32_marshal_load, 1);
 	rb_define_singleton_method(_Digest_XXH32, "digest_length", _Digest_XXH32_singleton_digest_length, 0);
 	rb_define_singleton_method(_Digest_XXH32, "block_length", _Digest_XXH32_singleton_block_length, 0);
+	rb_define_singleton_method(_Digest_XXH32, "idigest_seeds", _Digest_XXH32_singleton_idigest_seeds, -1);
+	rb_define_singleton_method(_Digest_XXH32, "idigest_seeds_many", _Digest_XXH32_singleton_idigest_seeds_many, -1);
+	rb_define_singleton_method(_Digest_XXH32, "idigest_many", _Digest_XXH32_singleton_idigest_many, -1);
 
 	/*
 	 * Document-class: Digest::XXH64
@@ -1138,13 +9645,22 @@ void Init_xxhash(void)
 	rb_define_alloc_func(_Digest_XXH64, _Digest_XXH64_internal_allocate);
 	rb_define_private_method(_Digest_XXH64, "finish", _Digest_XXH64_finish, 0);
 	rb_define_private_method(_Digest_XXH64, "ifinish", _Digest_XXH64_ifinish, 0);
-	rb_define_method(_Digest_XXH64, "update", _Digest_XXH64_update, 1);
+	rb_define_method(_Digest_XXH64, "update", _Digest_XXH64_update, -1);
+	rb_define_method(_Digest_XXH64, "file", _Digest_XXH64_file, -1);
 	rb_define_method(_Digest_XXH64, "reset", _Digest_XXH64_reset, -1);
 	rb_define_method(_Digest_XXH64, "digest_length", _Digest_XXH64_digest_length, 0);
 	rb_define_method(_Digest_XXH64, "block_length", _Digest_XXH64_block_length, 0);
 	rb_define_method(_Digest_XXH64, "initialize_copy", _Digest_XXH64_initialize_copy, 1);
+	rb_define_method(_Digest_XXH64, "freeze_prefix", _Digest_XXH64_freeze_prefix, 0);
+	rb_define_method(_Digest_XXH64, "export_state", _Digest_XXH64_export_state, 0);
+	rb_define_method(_Digest_XXH64, "import_state", _Digest_XXH64_import_state, 1);
+	rb_define_method(_Digest_XXH64, "marshal_dump", _Digest_XXH64_marshal_dump, 0);
+	rb_define_method(_Digest_XXH64, "marshal_load", _Digest_XXH64_marshal_load, 1);
 	rb_define_singleton_method(_Digest_XXH64, "digest_length", _Digest_XXH64_singleton_digest_length, 0);
 	rb_define_singleton_method(_Digest_XXH64, "block_length", _Digest_XXH64_singleton_block_length, 0);
+	rb_define_singleton_method(_Digest_XXH64, "idigest_seeds", _Digest_XXH64_singleton_idigest_seeds, -1);
+	rb_define_singleton_method(_Digest_XXH64, "idigest_seeds_many", _Digest_XXH64_singleton_idigest_seeds_many, -1);
+	rb_define_singleton_method(_Digest_XXH64, "idigest_many", _Digest_XXH64_singleton_idigest_many, -1);
 
 	/*
 	 * Document-class: Digest::XXH3_64bits
@@ -1154,14 +9670,35 @@ void Init_xxhash(void)
 	rb_define_alloc_func(_Digest_XXH3_64bits, _Digest_XXH3_64bits_internal_allocate);
 	rb_define_private_method(_Digest_XXH3_64bits, "finish", _Digest_XXH3_64bits_finish, 0);
 	rb_define_private_method(_Digest_XXH3_64bits, "ifinish", _Digest_XXH3_64bits_ifinish, 0);
-	rb_define_method(_Digest_XXH3_64bits, "update", _Digest_XXH3_64bits_update, 1);
+	rb_define_method(_Digest_XXH3_64bits, "update", _Digest_XXH3_64bits_update, -1);
+	rb_define_method(_Digest_XXH3_64bits, "file", _Digest_XXH3_64bits_file, -1);
 	rb_define_method(_Digest_XXH3_64bits, "reset", _Digest_XXH3_64bits_reset, -1);
 	rb_define_method(_Digest_XXH3_64bits, "reset_with_secret", _Digest_XXH3_64bits_reset_with_secret, 1);
 	rb_define_method(_Digest_XXH3_64bits, "digest_length", _Digest_XXH3_64bits_digest_length, 0);
 	rb_define_method(_Digest_XXH3_64bits, "block_length", _Digest_XXH3_64bits_block_length, 0);
 	rb_define_method(_Digest_XXH3_64bits, "initialize_copy", _Digest_XXH3_64bits_initialize_copy, 1);
+	rb_define_method(_Digest_XXH3_64bits, "freeze_prefix", _Digest_XXH3_64bits_freeze_prefix, 0);
+	rb_define_method(_Digest_XXH3_64bits, "export_state", _Digest_XXH3_64bits_export_state, -1);
+	rb_define_method(_Digest_XXH3_64bits, "import_state", _Digest_XXH3_64bits_import_state, -1);
+	rb_define_method(_Digest_XXH3_64bits, "marshal_dump", _Digest_XXH3_64bits_marshal_dump, 0);
+	rb_define_method(_Digest_XXH3_64bits, "marshal_load", _Digest_XXH3_64bits_marshal_load, 1);
+	rb_define_method(_Digest_XXH3_64bits, "hibernate", _Digest_XXH3_64bits_hibernate, 0);
+	rb_define_method(_Digest_XXH3_64bits, "hibernated?", _Digest_XXH3_64bits_hibernated_p, 0);
+	rb_define_method(_Digest_XXH3_64bits, "auto_hibernate", _Digest_XXH3_64bits_auto_hibernate, 0);
+	rb_define_method(_Digest_XXH3_64bits, "auto_hibernate=", _Digest_XXH3_64bits_set_auto_hibernate, 1);
 	rb_define_singleton_method(_Digest_XXH3_64bits, "digest_length", _Digest_XXH3_64bits_singleton_digest_length, 0);
 	rb_define_singleton_method(_Digest_XXH3_64bits, "block_length", _Digest_XXH3_64bits_singleton_block_length, 0);
+	rb_define_singleton_method(_Digest_XXH3_64bits, "idigest_seeds", _Digest_XXH3_64bits_singleton_idigest_seeds, -1);
+	rb_define_singleton_method(_Digest_XXH3_64bits, "idigest_seeds_many", _Digest_XXH3_64bits_singleton_idigest_seeds_many, -1);
+	rb_define_singleton_method(_Digest_XXH3_64bits, "idigest_many", _Digest_XXH3_64bits_singleton_idigest_many, -1);
+	rb_define_singleton_method(_Digest_XXH3_64bits, "hash_strided", _Digest_XXH3_64bits_singleton_hash_strided, -1);
+	rb_define_singleton_method(_Digest_XXH3_64bits, "hash_int", _Digest_XXH3_64bits_singleton_hash_int, -1);
+	rb_define_singleton_method(_Digest_XXH3_64bits, "hash_ints", _Digest_XXH3_64bits_singleton_hash_ints, -1);
+	rb_define_singleton_method(_Digest_XXH3_64bits, "hash_range", _Digest_XXH3_64bits_singleton_hash_range, -1);
+	rb_define_singleton_method(_Digest_XXH3_64bits, "line_digests", _Digest_XXH3_64bits_singleton_line_digests, -1);
+	rb_define_singleton_method(_Digest_XXH3_64bits, "chunk_digests", _Digest_XXH3_64bits_singleton_chunk_digests, -1);
+	rb_define_singleton_method(_Digest_XXH3_64bits, "verify_chunks", _Digest_XXH3_64bits_singleton_verify_chunks, -1);
+	rb_define_singleton_method(_Digest_XXH3_64bits, "generate_secret", _Digest_XXH3_64bits_singleton_generate_secret, -1);
 
 	/*
 	 * Document-class: Digest::XXH3_128bits
@@ -1171,14 +9708,31 @@ void Init_xxhash(void)
 	rb_define_alloc_func(_Digest_XXH3_128bits, _Digest_XXH3_128bits_internal_allocate);
 	rb_define_private_method(_Digest_XXH3_128bits, "finish", _Digest_XXH3_128bits_finish, 0);
 	rb_define_private_method(_Digest_XXH3_128bits, "ifinish", _Digest_XXH3_128bits_ifinish, 0);
-	rb_define_method(_Digest_XXH3_128bits, "update", _Digest_XXH3_128bits_update, 1);
+	rb_define_method(_Digest_XXH3_128bits, "update", _Digest_XXH3_128bits_update, -1);
+	rb_define_method(_Digest_XXH3_128bits, "file", _Digest_XXH3_128bits_file, -1);
 	rb_define_method(_Digest_XXH3_128bits, "reset", _Digest_XXH3_128bits_reset, -1);
 	rb_define_method(_Digest_XXH3_128bits, "reset_with_secret", _Digest_XXH3_128bits_reset_with_secret, 1);
 	rb_define_method(_Digest_XXH3_128bits, "digest_length", _Digest_XXH3_128bits_digest_length, 0);
 	rb_define_method(_Digest_XXH3_128bits, "block_length", _Digest_XXH3_128bits_block_length, 0);
 	rb_define_method(_Digest_XXH3_128bits, "initialize_copy", _Digest_XXH3_128bits_initialize_copy, 1);
+	rb_define_method(_Digest_XXH3_128bits, "freeze_prefix", _Digest_XXH3_128bits_freeze_prefix, 0);
+	rb_define_method(_Digest_XXH3_128bits, "export_state", _Digest_XXH3_128bits_export_state, -1);
+	rb_define_method(_Digest_XXH3_128bits, "import_state", _Digest_XXH3_128bits_import_state, -1);
+	rb_define_method(_Digest_XXH3_128bits, "marshal_dump", _Digest_XXH3_128bits_marshal_dump, 0);
+	rb_define_method(_Digest_XXH3_128bits, "marshal_load", _Digest_XXH3_128bits_marshal_load, 1);
+	rb_define_method(_Digest_XXH3_128bits, "hibernate", _Digest_XXH3_128bits_hibernate, 0);
+	rb_define_method(_Digest_XXH3_128bits, "hibernated?", _Digest_XXH3_128bits_hibernated_p, 0);
+	rb_define_method(_Digest_XXH3_128bits, "auto_hibernate", _Digest_XXH3_128bits_auto_hibernate, 0);
+	rb_define_method(_Digest_XXH3_128bits, "auto_hibernate=", _Digest_XXH3_128bits_set_auto_hibernate, 1);
 	rb_define_singleton_method(_Digest_XXH3_128bits, "digest_length", _Digest_XXH3_128bits_singleton_digest_length, 0);
 	rb_define_singleton_method(_Digest_XXH3_128bits, "block_length", _Digest_XXH3_128bits_singleton_block_length, 0);
+	rb_define_singleton_method(_Digest_XXH3_128bits, "idigest_seeds", _Digest_XXH3_128bits_singleton_idigest_seeds, -1);
+	rb_define_singleton_method(_Digest_XXH3_128bits, "idigest_seeds_many", _Digest_XXH3_128bits_singleton_idigest_seeds_many, -1);
+	rb_define_singleton_method(_Digest_XXH3_128bits, "idigest_many", _Digest_XXH3_128bits_singleton_idigest_many, -1);
+	rb_define_singleton_method(_Digest_XXH3_128bits, "tree_digest", _Digest_XXH3_128bits_singleton_tree_digest, -1);
+	rb_define_singleton_method(_Digest_XXH3_128bits, "files", _Digest_XXH3_128bits_singleton_files, -1);
+	rb_define_singleton_method(_Digest_XXH3_128bits, "tree", _Digest_XXH3_128bits_singleton_tree, -1);
+	rb_define_singleton_method(_Digest_XXH3_128bits, "generate_secret", _Digest_XXH3_128bits_singleton_generate_secret, -1);
 
 	/*
 	 * Document-const: Digest::XXHash::XXH3_SECRET_SIZE_MIN
@@ -1192,5 +9746,107 @@ void Init_xxhash(void)
 
 	rb_define_const(_Digest_XXHash, "XXH3_SECRET_SIZE_MIN", INT2FIX(XXH3_SECRET_SIZE_MIN));
 
+	/*
+	 * Document-const: Digest::XXH3_128bits::TREE_DIGEST_VERSION
+	 *
+	 * Version of the tree mode used by XXH3_128bits.tree_digest.  It would
+	 * only change if the way the tree digest is computed changes.
+	 */
+
+	rb_define_const(_Digest_XXH3_128bits, "TREE_DIGEST_VERSION", INT2FIX(_TREE_VERSION));
+
+	/*
+	 * Document-class: Digest::XXHash::Prefix
+	 */
+
+	_Digest_XXHash_Prefix = rb_define_class_under(_Digest_XXHash, "Prefix", rb_cObject);
+	rb_undef_alloc_func(_Digest_XXHash_Prefix);
+	rb_define_method(_Digest_XXHash_Prefix, "digest_suffix", _Digest_XXHash_Prefix_digest_suffix, 1);
+	rb_define_method(_Digest_XXHash_Prefix, "hexdigest_suffix", _Digest_XXHash_Prefix_hexdigest_suffix, 1);
+	rb_define_method(_Digest_XXHash_Prefix, "idigest_suffix", _Digest_XXHash_Prefix_idigest_suffix, 1);
+	rb_define_method(_Digest_XXHash_Prefix, "digest_suffixes", _Digest_XXHash_Prefix_digest_suffixes, 1);
+	rb_define_method(_Digest_XXHash_Prefix, "idigest_suffixes", _Digest_XXHash_Prefix_idigest_suffixes, 1);
+	rb_define_method(_Digest_XXHash_Prefix, "digest_length", _Digest_XXHash_Prefix_digest_length, 0);
+
+	/*
+	 * Document-class: Digest::XXHash::Streams
+	 */
+
+	_Digest_XXHash_Streams = rb_define_class_under(_Digest_XXHash, "Streams", rb_cObject);
+	rb_define_alloc_func(_Digest_XXHash_Streams, _Digest_XXHash_Streams_internal_allocate);
+	rb_define_method(_Digest_XXHash_Streams, "initialize", _Digest_XXHash_Streams_initialize, -1);
+	rb_define_method(_Digest_XXHash_Streams, "update", _Digest_XXHash_Streams_update, -1);
+	rb_define_method(_Digest_XXHash_Streams, "update_batch", _Digest_XXHash_Streams_update_batch, 2);
+	rb_define_method(_Digest_XXHash_Streams, "reset", _Digest_XXHash_Streams_reset, -1);
+	rb_define_method(_Digest_XXHash_Streams, "digest", _Digest_XXHash_Streams_digest, 1);
+	rb_define_method(_Digest_XXHash_Streams, "hexdigest", _Digest_XXHash_Streams_hexdigest, 1);
+	rb_define_method(_Digest_XXHash_Streams, "idigest", _Digest_XXHash_Streams_idigest, 1);
+	rb_define_method(_Digest_XXHash_Streams, "digests", _Digest_XXHash_Streams_digests, 0);
+	rb_define_method(_Digest_XXHash_Streams, "idigests", _Digest_XXHash_Streams_idigests, 0);
+	rb_define_method(_Digest_XXHash_Streams, "size", _Digest_XXHash_Streams_size, 0);
+	rb_define_method(_Digest_XXHash_Streams, "digest_length", _Digest_XXHash_Streams_digest_length, 0);
+	rb_undef_method(_Digest_XXHash_Streams, "initialize_copy");
+
+	/*
+	 * Document-class: Digest::XXHash::Multi
+	 */
+
+	_Digest_XXHash_Multi = rb_define_class_under(_Digest_XXHash, "Multi", rb_cObject);
+	rb_define_alloc_func(_Digest_XXHash_Multi, _Digest_XXHash_Multi_internal_allocate);
+	rb_define_method(_Digest_XXHash_Multi, "initialize", _Digest_XXHash_Multi_initialize, -1);
+	rb_define_method(_Digest_XXHash_Multi, "update", _Digest_XXHash_Multi_update, -1);
+	rb_define_method(_Digest_XXHash_Multi, "update_io", _Digest_XXHash_Multi_update_io, 1);
+	rb_define_method(_Digest_XXHash_Multi, "file", _Digest_XXHash_Multi_file, -1);
+	rb_define_method(_Digest_XXHash_Multi, "reset", _Digest_XXHash_Multi_reset, 0);
+	rb_define_method(_Digest_XXHash_Multi, "digests", _Digest_XXHash_Multi_digests, 0);
+	rb_define_method(_Digest_XXHash_Multi, "hexdigests", _Digest_XXHash_Multi_hexdigests, 0);
+	rb_define_method(_Digest_XXHash_Multi, "idigests", _Digest_XXHash_Multi_idigests, 0);
+	rb_undef_method(_Digest_XXHash_Multi, "initialize_copy");
+
+	/*
+	 * Document-module: Digest::XXHash::Merkle
+	 */
+
+	_Digest_XXHash_Merkle = rb_define_module_under(_Digest_XXHash, "Merkle");
+	rb_define_singleton_method(_Digest_XXHash_Merkle, "build", _Digest_XXHash_Merkle_singleton_build, -1);
+	rb_define_singleton_method(_Digest_XXHash_Merkle, "root", _Digest_XXHash_Merkle_singleton_root, 1);
+	rb_define_singleton_method(_Digest_XXHash_Merkle, "verify_range",
+			_Digest_XXHash_Merkle_singleton_verify_range, -1);
+
+	/*
+	 * Document-class: Digest::XXHash::Chunker
+	 */
+
+	_Digest_XXHash_Chunker = rb_define_class_under(_Digest_XXHash, "Chunker", rb_cObject);
+	rb_define_alloc_func(_Digest_XXHash_Chunker, _Digest_XXHash_Chunker_internal_allocate);
+	rb_define_method(_Digest_XXHash_Chunker, "initialize", _Digest_XXHash_Chunker_initialize, -1);
+	rb_define_method(_Digest_XXHash_Chunker, "each_chunk", _Digest_XXHash_Chunker_each_chunk, 1);
+	rb_define_method(_Digest_XXHash_Chunker, "min", _Digest_XXHash_Chunker_min, 0);
+	rb_define_method(_Digest_XXHash_Chunker, "avg", _Digest_XXHash_Chunker_avg, 0);
+	rb_define_method(_Digest_XXHash_Chunker, "max", _Digest_XXHash_Chunker_max, 0);
+	rb_undef_method(_Digest_XXHash_Chunker, "initialize_copy");
+
+	/*
+	 * Document-module: Digest::XXHash::Rsync
+	 */
+
+	_Digest_XXHash_Rsync = rb_define_module_under(_Digest_XXHash, "Rsync");
+	rb_define_singleton_method(_Digest_XXHash_Rsync, "signature", _Digest_XXHash_Rsync_singleton_signature, -1);
+	rb_define_singleton_method(_Digest_XXHash_Rsync, "delta", _Digest_XXHash_Rsync_singleton_delta, 2);
+
+	_Digest_XXH32_Streams = rb_define_class_under(_Digest_XXH32, "Streams", _Digest_XXHash_Streams);
+	rb_define_alloc_func(_Digest_XXH32_Streams, _Digest_XXH32_Streams_internal_allocate);
+
+	_Digest_XXH64_Streams = rb_define_class_under(_Digest_XXH64, "Streams", _Digest_XXHash_Streams);
+	rb_define_alloc_func(_Digest_XXH64_Streams, _Digest_XXH64_Streams_internal_allocate);
+
+	_Digest_XXH3_64bits_Streams = rb_define_class_under(_Digest_XXH3_64bits, "Streams",
+			_Digest_XXHash_Streams);
+	rb_define_alloc_func(_Digest_XXH3_64bits_Streams, _Digest_XXH3_64bits_Streams_internal_allocate);
+
+	_Digest_XXH3_128bits_Streams = rb_define_class_under(_Digest_XXH3_128bits, "Streams",
+			_Digest_XXHash_Streams);
+	rb_define_alloc_func(_Digest_XXH3_128bits_Streams, _Digest_XXH3_128bits_Streams_internal_allocate);
+
 	rb_require("digest/xxhash/version");
 }
@@ -4,6 +4,52 @@ $defs.push('-Wall') if enable_config('all-warnings')
 $defs.push('-ggdb3') if enable_config('gdb-info')
 $CFLAGS << ' -O0' if enable_config('no-opt')
 
+have_func('rb_ext_ractor_safe', 'ruby.h')
+have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+have_library('pthread', 'pthread_create', 'pthread.h')
+have_func('pthread_create', 'pthread.h')
+
+if have_header('ruby/io/buffer.h')
+  have_func('rb_io_buffer_get_bytes', 'ruby/io/buffer.h')
+  have_func('rb_io_buffer_get_immutable', 'ruby/io/buffer.h')
+end
+
+have_func('rb_memory_view_get', 'ruby/memory_view.h')
+have_func('mmap', 'sys/mman.h')
+have_func('pread', 'unistd.h')
+have_func('posix_fadvise', 'fcntl.h')
+have_func('mincore', 'sys/mman.h')
+have_func('fdopendir', 'dirent.h')
+have_func('fnmatch', 'fnmatch.h')
+have_struct_member('struct dirent', 'd_type', 'dirent.h')
+
+# The multi-buffer engine in multibuf.h is compiled with per-function target
+# attributes and selected at runtime, so it doesn't need -mavx2 or similar.
+multibuf_src = <<-SRC
+#include <immintrin.h>
+__attribute__((target("avx2"))) static __m256i f(__m256i a) { return _mm256_mullo_epi32(a, a); }
+__attribute__((target("avx512f,avx512dq"))) static __m512i g(__m512i a) { return _mm512_mullo_epi64(a, a); }
+int main(void) { __builtin_cpu_init(); return __builtin_cpu_supports("avx2") && (void *)f != (void *)g; }
+SRC
+
+if enable_config('multibuf', true) && checking_for('x86 multi-buffer hashing') { try_compile(multibuf_src) }
+  $defs.push('-DHAVE_X86_MULTIBUF')
+end
+
+# XXH3_128bits.files drives io_uring with raw system calls, so it doesn't need
+# liburing.  Support is still checked at runtime.
+io_uring_src = <<-SRC
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+int main(void) { return (int)syscall(__NR_io_uring_enter, -1, 0, 0, IORING_ENTER_GETEVENTS, 0, 0) + eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK) + IORING_OP_OPENAT + IORING_OP_READ + IORING_OP_CLOSE + IORING_OP_POLL_ADD + IORING_SETUP_CLAMP; }
+SRC
+
+if enable_config('io-uring', true) && checking_for('io_uring') { try_link(io_uring_src) }
+  $defs.push('-DHAVE_IO_URING')
+end
+
 create_makefile('digest/xxhash')
 
 if enable_config('verbose-mode')
@@ -0,0 +1,702 @@
+/*
+ * Copyright (c) 2024 konsolebox
+ *
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Multi-buffer XXH32 and XXH64
+ *
+ * Hashes several messages at once, one message per vector lane.  Each step
+ * loads one stripe from every message, transposes the stripes so that each
+ * vector holds the same accumulator of every message, and runs the round on
+ * all of them.  Lanes of messages that have run out of stripes are masked.
+ * The remaining input and the final avalanche are also done in the vector
+ * lanes, and the digests are stored from them.
+ *
+ * Messages are grouped by length so that messages processed together have
+ * about the same number of stripes.
+ *
+ * XXH32 uses 8 lanes with AVX2 or 16 lanes with AVX-512.  XXH64 uses 8 lanes
+ * with AVX-512DQ.  XXH64 has no AVX2 code since AVX2 has no 64-bit multiply,
+ * and putting one together from three 32-bit multiplies per lane makes a
+ * round slower than the scalar one.  The code is selected at runtime, and
+ * the scalar functions are used if neither is available.
+ *
+ * This needs to be included after xxhash.h with XXH_INLINE_ALL defined.
+ */
+
+#ifndef MULTIBUF_H
+#define MULTIBUF_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_X86_MULTIBUF
+#	include <immintrin.h>
+#	define MULTIBUF_TARGET(x) __attribute__((target(x)))
+#endif
+
+enum {
+	MULTIBUF_SCALAR,
+	MULTIBUF_AVX2,
+	MULTIBUF_AVX512
+};
+
+/*
+ * Shorter messages are hashed faster one at a time, since the per-message
+ * work of gathering stripes and remaining input outweighs the gain.
+ */
+#define MULTIBUF_XXH32_MIN_LEN 256
+#define MULTIBUF_XXH64_MIN_LEN 512
+
+struct multibuf_item {
+	size_t len;
+	size_t index;
+};
+
+/*
+ * Limit set with multibuf_set_level().
+ */
+static int multibuf_level_limit = MULTIBUF_AVX512;
+
+static int multibuf_supported_level(void)
+{
+#ifdef HAVE_X86_MULTIBUF
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq"))
+		return MULTIBUF_AVX512;
+
+	if (__builtin_cpu_supports("avx2"))
+		return MULTIBUF_AVX2;
+#endif
+
+	return MULTIBUF_SCALAR;
+}
+
+/*
+ * Returns the level of SIMD instructions used, limited by
+ * multibuf_set_level().
+ */
+static int multibuf_level(void)
+{
+	int level = multibuf_supported_level();
+	return level < multibuf_level_limit ? level : multibuf_level_limit;
+}
+
+static void multibuf_set_level(int level)
+{
+	multibuf_level_limit = level;
+}
+
+/*
+ * Number of length classes used by multibuf_sort()
+ */
+#define MULTIBUF_CLASSES 64
+
+static int multibuf_class(size_t len, size_t min_len)
+{
+	size_t units = len / min_len;
+	int c = 0;
+
+	while (units >>= 1)
+		++c;
+
+	return c;
+}
+
+/*
+ * Returns the indices of the messages at least +min_len+ bytes long, ordered
+ * by length class.  Messages in the same class differ in length by less than
+ * twice, which is close enough to keep most lanes busy, and a counting sort
+ * is a lot cheaper than a full sort.  Returns NULL if there are fewer than
+ * +lanes+ such messages or if memory can't be allocated.
+ */
+static struct multibuf_item *multibuf_sort(const size_t *lens, size_t count, size_t min_len,
+		size_t lanes, size_t *sorted_count_p)
+{
+	struct multibuf_item *items;
+	size_t starts[MULTIBUF_CLASSES] = { 0 };
+	size_t i, n = 0, total = 0;
+
+	for (i = 0; i < count; ++i) {
+		if (lens[i] >= min_len) {
+			++starts[multibuf_class(lens[i], min_len)];
+			++n;
+		}
+	}
+
+	if (n < lanes || (items = malloc(n * sizeof *items)) == NULL)
+		return NULL;
+
+	for (i = 0; i < MULTIBUF_CLASSES; ++i) {
+		size_t k = starts[i];
+		starts[i] = total;
+		total += k;
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (lens[i] >= min_len) {
+			struct multibuf_item *item = &items[starts[multibuf_class(lens[i], min_len)]++];
+			item->len = lens[i];
+			item->index = i;
+		}
+	}
+
+	*sorted_count_p = n;
+	return items;
+}
+
+#ifdef HAVE_X86_MULTIBUF
+
+static const unsigned char multibuf_zeros[32];
+
+/*
+ * Returns the address of stripe +s+ of a message, or a block of zeros if
+ * the message has no such stripe.  The result isn't used for such lanes.
+ */
+#define MULTIBUF_STRIPE(ptr, len, s, size) \
+	((s) < (len) / (size) ? (ptr) + (s) * (size) : multibuf_zeros)
+
+/*
+ * Gets the number of stripes of each message, and the smallest and largest of
+ * them.  Counts are kept as size_t since they don't fit in vector lanes for
+ * messages of 64 GiB or more.
+ */
+static void multibuf_count_stripes(const size_t *lens, int lanes, size_t size, size_t *counts,
+		size_t *min_p, size_t *max_p)
+{
+	size_t min = SIZE_MAX, max = 0;
+	int l;
+
+	for (l = 0; l < lanes; ++l) {
+		counts[l] = lens[l] / size;
+
+		if (counts[l] < min)
+			min = counts[l];
+
+		if (counts[l] > max)
+			max = counts[l];
+	}
+
+	*min_p = min;
+	*max_p = max;
+}
+
+/*
+ * Returns a bit mask of the lanes that have stripe +s+.
+ */
+static unsigned multibuf_active_lanes(const size_t *counts, int lanes, size_t s)
+{
+	unsigned mask = 0;
+	int l;
+
+	for (l = 0; l < lanes; ++l) {
+		if (s < counts[l])
+			mask |= 1u << l;
+	}
+
+	return mask;
+}
+
+/*
+ * Remaining input of the messages in a group after their last full stripe,
+ * laid out per lane so that it can be loaded into vectors.  Each step of
+ * XXH32_finalize() and XXH64_finalize() then runs on all lanes at once, with
+ * the lanes not having enough remaining input masked.
+ */
+struct multibuf_xxh32_tails {
+	XXH32_hash_t words[3][16];
+	XXH32_hash_t bytes[3][16];
+	XXH32_hash_t sizes[16];
+	XXH32_hash_t lens[16];
+};
+
+struct multibuf_xxh64_tails {
+	XXH64_hash_t quads[3][8];
+	XXH64_hash_t halves[8];
+	XXH64_hash_t bytes[3][8];
+	XXH64_hash_t sizes[8];
+	XXH64_hash_t lens[8];
+};
+
+/*
+ * Copies the last 16 bytes of each message so that the remaining input begins
+ * at offset 16 of a buffer.  Messages are at least 16 bytes long, so this
+ * never reads outside of them, and never needs to branch on sizes.  Bytes
+ * past the remaining input are left from the previous lane but are masked.
+ */
+static void multibuf_xxh32_get_tails(const unsigned char *const *ptrs, const size_t *lens,
+		int lanes, struct multibuf_xxh32_tails *tails)
+{
+	unsigned char buf[32];
+	int l, k;
+
+	memset(buf, 0, sizeof buf);
+
+	for (l = 0; l < lanes; ++l) {
+		size_t size = lens[l] & 15;
+		memcpy(buf + size, ptrs[l] + lens[l] - 16, 16);
+
+		for (k = 0; k < 3; ++k) {
+			tails->words[k][l] = XXH_readLE32(buf + 16 + k * 4);
+			tails->bytes[k][l] = buf[16 + (size & 12) + k];
+		}
+
+		tails->sizes[l] = (XXH32_hash_t)size;
+		tails->lens[l] = (XXH32_hash_t)lens[l];
+	}
+}
+
+MULTIBUF_TARGET("avx2")
+static inline __m256i multibuf_rotl32_avx2(__m256i x, int r)
+{
+	return _mm256_or_si256(_mm256_slli_epi32(x, r), _mm256_srli_epi32(x, 32 - r));
+}
+
+/*
+ * Hashes 8 messages of at least 16 bytes with XXH32.
+ */
+MULTIBUF_TARGET("avx2")
+static void multibuf_xxh32_avx2(const unsigned char *const *ptrs, const size_t *lens,
+		XXH32_hash_t seed, XXH32_hash_t *hashes)
+{
+	__m256i prime1 = _mm256_set1_epi32((int)XXH_PRIME32_1);
+	__m256i prime2 = _mm256_set1_epi32((int)XXH_PRIME32_2);
+	__m256i prime3 = _mm256_set1_epi32((int)XXH_PRIME32_3);
+	__m256i prime4 = _mm256_set1_epi32((int)XXH_PRIME32_4);
+	__m256i prime5 = _mm256_set1_epi32((int)XXH_PRIME32_5);
+	__m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+	__m256i active = _mm256_set1_epi32(-1);
+	__m256i acc[4], data[4], h, sizes, x;
+	struct multibuf_xxh32_tails tails;
+	size_t counts[8], s, min, max;
+	int l, i;
+
+	acc[0] = _mm256_set1_epi32((int)(seed + XXH_PRIME32_1 + XXH_PRIME32_2));
+	acc[1] = _mm256_set1_epi32((int)(seed + XXH_PRIME32_2));
+	acc[2] = _mm256_set1_epi32((int)seed);
+	acc[3] = _mm256_set1_epi32((int)(seed - XXH_PRIME32_1));
+	multibuf_count_stripes(lens, 8, 16, counts, &min, &max);
+
+	for (s = 0; s < max; ++s) {
+		__m128i rows[8];
+		__m256i a, b, c, d, t0, t1, t2, t3;
+
+		if (s >= min) {
+			active = _mm256_set1_epi32((int)multibuf_active_lanes(counts, 8, s));
+			active = _mm256_cmpeq_epi32(_mm256_and_si256(active, bits), bits);
+		}
+
+		for (l = 0; l < 8; ++l)
+			rows[l] = _mm_loadu_si128((const __m128i *)MULTIBUF_STRIPE(ptrs[l], lens[l], s, 16));
+
+		a = _mm256_inserti128_si256(_mm256_castsi128_si256(rows[0]), rows[4], 1);
+		b = _mm256_inserti128_si256(_mm256_castsi128_si256(rows[1]), rows[5], 1);
+		c = _mm256_inserti128_si256(_mm256_castsi128_si256(rows[2]), rows[6], 1);
+		d = _mm256_inserti128_si256(_mm256_castsi128_si256(rows[3]), rows[7], 1);
+		t0 = _mm256_unpacklo_epi32(a, b);
+		t1 = _mm256_unpackhi_epi32(a, b);
+		t2 = _mm256_unpacklo_epi32(c, d);
+		t3 = _mm256_unpackhi_epi32(c, d);
+		data[0] = _mm256_unpacklo_epi64(t0, t2);
+		data[1] = _mm256_unpackhi_epi64(t0, t2);
+		data[2] = _mm256_unpacklo_epi64(t1, t3);
+		data[3] = _mm256_unpackhi_epi64(t1, t3);
+
+		for (i = 0; i < 4; ++i) {
+			x = _mm256_add_epi32(acc[i], _mm256_mullo_epi32(data[i], prime2));
+			x = _mm256_mullo_epi32(multibuf_rotl32_avx2(x, 13), prime1);
+			acc[i] = _mm256_blendv_epi8(acc[i], x, active);
+		}
+	}
+
+	multibuf_xxh32_get_tails(ptrs, lens, 8, &tails);
+	sizes = _mm256_loadu_si256((const __m256i *)tails.sizes);
+	h = _mm256_add_epi32(
+			_mm256_add_epi32(multibuf_rotl32_avx2(acc[0], 1), multibuf_rotl32_avx2(acc[1], 7)),
+			_mm256_add_epi32(multibuf_rotl32_avx2(acc[2], 12), multibuf_rotl32_avx2(acc[3], 18)));
+	h = _mm256_add_epi32(h, _mm256_loadu_si256((const __m256i *)tails.lens));
+
+	for (i = 0; i < 3; ++i) {
+		__m256i active = _mm256_cmpgt_epi32(_mm256_srli_epi32(sizes, 2), _mm256_set1_epi32(i));
+		x = _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i *)tails.words[i]), prime3);
+		x = _mm256_mullo_epi32(multibuf_rotl32_avx2(_mm256_add_epi32(h, x), 17), prime4);
+		h = _mm256_blendv_epi8(h, x, active);
+	}
+
+	for (i = 0; i < 3; ++i) {
+		__m256i active = _mm256_cmpgt_epi32(_mm256_and_si256(sizes, _mm256_set1_epi32(3)),
+				_mm256_set1_epi32(i));
+		x = _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i *)tails.bytes[i]), prime5);
+		x = _mm256_mullo_epi32(multibuf_rotl32_avx2(_mm256_add_epi32(h, x), 11), prime1);
+		h = _mm256_blendv_epi8(h, x, active);
+	}
+
+	h = _mm256_mullo_epi32(_mm256_xor_si256(h, _mm256_srli_epi32(h, 15)), prime2);
+	h = _mm256_mullo_epi32(_mm256_xor_si256(h, _mm256_srli_epi32(h, 13)), prime3);
+	h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+	_mm256_storeu_si256((__m256i *)hashes, h);
+}
+
+/*
+ * Hashes 16 messages of at least 16 bytes with XXH32.
+ */
+MULTIBUF_TARGET("avx512f")
+static void multibuf_xxh32_avx512(const unsigned char *const *ptrs, const size_t *lens,
+		XXH32_hash_t seed, XXH32_hash_t *hashes)
+{
+	__m512i prime1 = _mm512_set1_epi32((int)XXH_PRIME32_1);
+	__m512i prime2 = _mm512_set1_epi32((int)XXH_PRIME32_2);
+	__m512i prime3 = _mm512_set1_epi32((int)XXH_PRIME32_3);
+	__m512i prime4 = _mm512_set1_epi32((int)XXH_PRIME32_4);
+	__m512i prime5 = _mm512_set1_epi32((int)XXH_PRIME32_5);
+	__m512i acc[4], data[4], h, sizes, x;
+	struct multibuf_xxh32_tails tails;
+	__mmask16 active = 0xffff;
+	size_t counts[16], s, min, max;
+	int l, i;
+
+	acc[0] = _mm512_set1_epi32((int)(seed + XXH_PRIME32_1 + XXH_PRIME32_2));
+	acc[1] = _mm512_set1_epi32((int)(seed + XXH_PRIME32_2));
+	acc[2] = _mm512_set1_epi32((int)seed);
+	acc[3] = _mm512_set1_epi32((int)(seed - XXH_PRIME32_1));
+	multibuf_count_stripes(lens, 16, 16, counts, &min, &max);
+
+	for (s = 0; s < max; ++s) {
+		__m128i rows[16];
+		__m512i a, b, c, d, t0, t1, t2, t3;
+
+		if (s >= min)
+			active = (__mmask16)multibuf_active_lanes(counts, 16, s);
+
+		for (l = 0; l < 16; ++l)
+			rows[l] = _mm_loadu_si128((const __m128i *)MULTIBUF_STRIPE(ptrs[l], lens[l], s, 16));
+
+		/* Block k of a, b, c, and d holds messages 4k, 4k + 1, 4k + 2, and 4k + 3. */
+		a = _mm512_inserti32x4(_mm512_castsi128_si512(rows[0]), rows[4], 1);
+		b = _mm512_inserti32x4(_mm512_castsi128_si512(rows[1]), rows[5], 1);
+		c = _mm512_inserti32x4(_mm512_castsi128_si512(rows[2]), rows[6], 1);
+		d = _mm512_inserti32x4(_mm512_castsi128_si512(rows[3]), rows[7], 1);
+		a = _mm512_inserti32x4(_mm512_inserti32x4(a, rows[8], 2), rows[12], 3);
+		b = _mm512_inserti32x4(_mm512_inserti32x4(b, rows[9], 2), rows[13], 3);
+		c = _mm512_inserti32x4(_mm512_inserti32x4(c, rows[10], 2), rows[14], 3);
+		d = _mm512_inserti32x4(_mm512_inserti32x4(d, rows[11], 2), rows[15], 3);
+		t0 = _mm512_unpacklo_epi32(a, b);
+		t1 = _mm512_unpackhi_epi32(a, b);
+		t2 = _mm512_unpacklo_epi32(c, d);
+		t3 = _mm512_unpackhi_epi32(c, d);
+		data[0] = _mm512_unpacklo_epi64(t0, t2);
+		data[1] = _mm512_unpackhi_epi64(t0, t2);
+		data[2] = _mm512_unpacklo_epi64(t1, t3);
+		data[3] = _mm512_unpackhi_epi64(t1, t3);
+
+		for (i = 0; i < 4; ++i) {
+			x = _mm512_add_epi32(acc[i], _mm512_mullo_epi32(data[i], prime2));
+			x = _mm512_mullo_epi32(_mm512_rol_epi32(x, 13), prime1);
+			acc[i] = _mm512_mask_mov_epi32(acc[i], active, x);
+		}
+	}
+
+	multibuf_xxh32_get_tails(ptrs, lens, 16, &tails);
+	sizes = _mm512_loadu_si512(tails.sizes);
+	h = _mm512_add_epi32(_mm512_add_epi32(_mm512_rol_epi32(acc[0], 1), _mm512_rol_epi32(acc[1], 7)),
+			_mm512_add_epi32(_mm512_rol_epi32(acc[2], 12), _mm512_rol_epi32(acc[3], 18)));
+	h = _mm512_add_epi32(h, _mm512_loadu_si512(tails.lens));
+
+	for (i = 0; i < 3; ++i) {
+		__mmask16 active = _mm512_cmpgt_epu32_mask(_mm512_srli_epi32(sizes, 2), _mm512_set1_epi32(i));
+		x = _mm512_mullo_epi32(_mm512_loadu_si512(tails.words[i]), prime3);
+		x = _mm512_mullo_epi32(_mm512_rol_epi32(_mm512_add_epi32(h, x), 17), prime4);
+		h = _mm512_mask_mov_epi32(h, active, x);
+	}
+
+	for (i = 0; i < 3; ++i) {
+		__mmask16 active = _mm512_cmpgt_epu32_mask(_mm512_and_si512(sizes, _mm512_set1_epi32(3)),
+				_mm512_set1_epi32(i));
+		x = _mm512_mullo_epi32(_mm512_loadu_si512(tails.bytes[i]), prime5);
+		x = _mm512_mullo_epi32(_mm512_rol_epi32(_mm512_add_epi32(h, x), 11), prime1);
+		h = _mm512_mask_mov_epi32(h, active, x);
+	}
+
+	h = _mm512_mullo_epi32(_mm512_xor_si512(h, _mm512_srli_epi32(h, 15)), prime2);
+	h = _mm512_mullo_epi32(_mm512_xor_si512(h, _mm512_srli_epi32(h, 13)), prime3);
+	h = _mm512_xor_si512(h, _mm512_srli_epi32(h, 16));
+	_mm512_storeu_si512(hashes, h);
+}
+
+/*
+ * Same as multibuf_xxh32_get_tails() but for XXH64, which works on 32-byte
+ * stripes.  Lanes are given in the order used by multibuf_xxh64_avx512().
+ */
+static void multibuf_xxh64_get_tails(const unsigned char *const *ptrs, const size_t *lens,
+		const int *order, struct multibuf_xxh64_tails *tails)
+{
+	unsigned char buf[64];
+	int l, k;
+
+	memset(buf, 0, sizeof buf);
+
+	for (l = 0; l < 8; ++l) {
+		const unsigned char *ptr = ptrs[order[l]];
+		size_t len = lens[order[l]], size = len & 31;
+		memcpy(buf + size, ptr + len - 32, 32);
+
+		for (k = 0; k < 3; ++k) {
+			tails->quads[k][l] = XXH_readLE64(buf + 32 + k * 8);
+			tails->bytes[k][l] = buf[32 + (size & 28) + k];
+		}
+
+		tails->halves[l] = XXH_readLE32(buf + 32 + (size & 24));
+		tails->sizes[l] = size;
+		tails->lens[l] = len;
+	}
+}
+
+MULTIBUF_TARGET("avx512f,avx512dq")
+static inline __m512i multibuf_xxh64_round_avx512(__m512i acc, __m512i input)
+{
+	acc = _mm512_add_epi64(acc, _mm512_mullo_epi64(input, _mm512_set1_epi64((long long)XXH_PRIME64_2)));
+	return _mm512_mullo_epi64(_mm512_rol_epi64(acc, 31), _mm512_set1_epi64((long long)XXH_PRIME64_1));
+}
+
+/*
+ * Hashes 8 messages of at least 32 bytes with XXH64.
+ */
+MULTIBUF_TARGET("avx512f,avx512dq")
+static void multibuf_xxh64_avx512(const unsigned char *const *ptrs, const size_t *lens,
+		XXH64_hash_t seed, XXH64_hash_t *hashes)
+{
+	/* Lane order after the transposition below */
+	static const int order[8] = { 0, 1, 4, 5, 2, 3, 6, 7 };
+	__m512i prime1 = _mm512_set1_epi64((long long)XXH_PRIME64_1);
+	__m512i prime2 = _mm512_set1_epi64((long long)XXH_PRIME64_2);
+	__m512i prime3 = _mm512_set1_epi64((long long)XXH_PRIME64_3);
+	__m512i prime4 = _mm512_set1_epi64((long long)XXH_PRIME64_4);
+	__m512i prime5 = _mm512_set1_epi64((long long)XXH_PRIME64_5);
+	__m512i zero = _mm512_setzero_si512();
+	__m512i acc[4], stripes, data[4], h, sizes, x;
+	struct multibuf_xxh64_tails tails;
+	XXH64_hash_t stripe_counts[8], lanes[8];
+	__mmask8 active;
+	size_t s, max = 0;
+	int l, i;
+
+	acc[0] = _mm512_set1_epi64((long long)(seed + XXH_PRIME64_1 + XXH_PRIME64_2));
+	acc[1] = _mm512_set1_epi64((long long)(seed + XXH_PRIME64_2));
+	acc[2] = _mm512_set1_epi64((long long)seed);
+	acc[3] = _mm512_set1_epi64((long long)(seed - XXH_PRIME64_1));
+
+	for (l = 0; l < 8; ++l) {
+		stripe_counts[l] = lens[order[l]] / 32;
+
+		if (lens[l] / 32 > max)
+			max = lens[l] / 32;
+	}
+
+	stripes = _mm512_loadu_si512(stripe_counts);
+
+	for (s = 0; s < max; ++s) {
+		__m256i rows[8];
+		__m512i a, b, c, d, t0, t1, t2, t3;
+
+		active = _mm512_cmpgt_epu64_mask(stripes, _mm512_set1_epi64((long long)s));
+
+		for (l = 0; l < 8; ++l)
+			rows[l] = _mm256_loadu_si256((const __m256i *)MULTIBUF_STRIPE(ptrs[l], lens[l], s, 32));
+
+		a = _mm512_inserti64x4(_mm512_castsi256_si512(rows[0]), rows[4], 1);
+		b = _mm512_inserti64x4(_mm512_castsi256_si512(rows[1]), rows[5], 1);
+		c = _mm512_inserti64x4(_mm512_castsi256_si512(rows[2]), rows[6], 1);
+		d = _mm512_inserti64x4(_mm512_castsi256_si512(rows[3]), rows[7], 1);
+		t0 = _mm512_unpacklo_epi64(a, b);
+		t1 = _mm512_unpackhi_epi64(a, b);
+		t2 = _mm512_unpacklo_epi64(c, d);
+		t3 = _mm512_unpackhi_epi64(c, d);
+		data[0] = _mm512_shuffle_i64x2(t0, t2, 0x88);
+		data[1] = _mm512_shuffle_i64x2(t1, t3, 0x88);
+		data[2] = _mm512_shuffle_i64x2(t0, t2, 0xdd);
+		data[3] = _mm512_shuffle_i64x2(t1, t3, 0xdd);
+
+		for (i = 0; i < 4; ++i)
+			acc[i] = _mm512_mask_mov_epi64(acc[i], active, multibuf_xxh64_round_avx512(acc[i], data[i]));
+	}
+
+	multibuf_xxh64_get_tails(ptrs, lens, order, &tails);
+	sizes = _mm512_loadu_si512(tails.sizes);
+	h = _mm512_add_epi64(_mm512_add_epi64(_mm512_rol_epi64(acc[0], 1), _mm512_rol_epi64(acc[1], 7)),
+			_mm512_add_epi64(_mm512_rol_epi64(acc[2], 12), _mm512_rol_epi64(acc[3], 18)));
+
+	for (i = 0; i < 4; ++i) {
+		h = _mm512_xor_si512(h, multibuf_xxh64_round_avx512(zero, acc[i]));
+		h = _mm512_add_epi64(_mm512_mullo_epi64(h, prime1), prime4);
+	}
+
+	h = _mm512_add_epi64(h, _mm512_loadu_si512(tails.lens));
+
+	for (i = 0; i < 3; ++i) {
+		active = _mm512_cmpgt_epu64_mask(_mm512_srli_epi64(sizes, 3), _mm512_set1_epi64(i));
+		x = _mm512_xor_si512(h, multibuf_xxh64_round_avx512(zero, _mm512_loadu_si512(tails.quads[i])));
+		x = _mm512_add_epi64(_mm512_mullo_epi64(_mm512_rol_epi64(x, 27), prime1), prime4);
+		h = _mm512_mask_mov_epi64(h, active, x);
+	}
+
+	active = _mm512_test_epi64_mask(sizes, _mm512_set1_epi64(4));
+	x = _mm512_xor_si512(h, _mm512_mullo_epi64(_mm512_loadu_si512(tails.halves), prime1));
+	x = _mm512_add_epi64(_mm512_mullo_epi64(_mm512_rol_epi64(x, 23), prime2), prime3);
+	h = _mm512_mask_mov_epi64(h, active, x);
+
+	for (i = 0; i < 3; ++i) {
+		active = _mm512_cmpgt_epu64_mask(_mm512_and_si512(sizes, _mm512_set1_epi64(3)),
+				_mm512_set1_epi64(i));
+		x = _mm512_xor_si512(h, _mm512_mullo_epi64(_mm512_loadu_si512(tails.bytes[i]), prime5));
+		x = _mm512_mullo_epi64(_mm512_rol_epi64(x, 11), prime1);
+		h = _mm512_mask_mov_epi64(h, active, x);
+	}
+
+	h = _mm512_mullo_epi64(_mm512_xor_si512(h, _mm512_srli_epi64(h, 33)), prime2);
+	h = _mm512_mullo_epi64(_mm512_xor_si512(h, _mm512_srli_epi64(h, 29)), prime3);
+	h = _mm512_xor_si512(h, _mm512_srli_epi64(h, 32));
+	_mm512_storeu_si512(lanes, h);
+
+	for (l = 0; l < 8; ++l)
+		hashes[order[l]] = lanes[l];
+}
+
+#endif /* HAVE_X86_MULTIBUF */
+
+/*
+ * Hashes each message with XXH32 and stores the canonical digests in +out+.
+ */
+static void multibuf_xxh32(const unsigned char *const *ptrs, const size_t *lens, size_t count,
+		XXH32_hash_t seed, unsigned char *out)
+{
+	int level = multibuf_level();
+	int lanes = level == MULTIBUF_AVX512 ? 16 : 8;
+	struct multibuf_item *items = NULL;
+	size_t i, sorted_count = 0;
+
+	if (level != MULTIBUF_SCALAR)
+		items = multibuf_sort(lens, count, MULTIBUF_XXH32_MIN_LEN, lanes, &sorted_count);
+
+	if (items == NULL) {
+		for (i = 0; i < count; ++i)
+			XXH32_canonicalFromHash((XXH32_canonical_t *)(out + i * 4), XXH32(ptrs[i], lens[i], seed));
+
+		return;
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (lens[i] < MULTIBUF_XXH32_MIN_LEN)
+			XXH32_canonicalFromHash((XXH32_canonical_t *)(out + i * 4), XXH32(ptrs[i], lens[i], seed));
+	}
+
+#ifdef HAVE_X86_MULTIBUF
+	for (i = 0; i + lanes <= sorted_count; i += lanes) {
+		const unsigned char *group_ptrs[16];
+		size_t group_lens[16];
+		XXH32_hash_t hashes[16];
+		int l;
+
+		for (l = 0; l < lanes; ++l) {
+			group_ptrs[l] = ptrs[items[i + l].index];
+			group_lens[l] = items[i + l].len;
+		}
+
+		if (level == MULTIBUF_AVX512)
+			multibuf_xxh32_avx512(group_ptrs, group_lens, seed, hashes);
+		else
+			multibuf_xxh32_avx2(group_ptrs, group_lens, seed, hashes);
+
+		for (l = 0; l < lanes; ++l)
+			XXH32_canonicalFromHash((XXH32_canonical_t *)(out + items[i + l].index * 4), hashes[l]);
+	}
+#else
+	i = 0;
+#endif
+
+	for (; i < sorted_count; ++i) {
+		size_t index = items[i].index;
+		XXH32_canonicalFromHash((XXH32_canonical_t *)(out + index * 4),
+				XXH32(ptrs[index], lens[index], seed));
+	}
+
+	free(items);
+}
+
+/*
+ * Hashes each message with XXH64 and stores the canonical digests in +out+.
+ */
+static void multibuf_xxh64(const unsigned char *const *ptrs, const size_t *lens, size_t count,
+		XXH64_hash_t seed, unsigned char *out)
+{
+	struct multibuf_item *items = NULL;
+	size_t i, sorted_count = 0;
+
+	if (multibuf_level() == MULTIBUF_AVX512)
+		items = multibuf_sort(lens, count, MULTIBUF_XXH64_MIN_LEN, 8, &sorted_count);
+
+	if (items == NULL) {
+		for (i = 0; i < count; ++i)
+			XXH64_canonicalFromHash((XXH64_canonical_t *)(out + i * 8), XXH64(ptrs[i], lens[i], seed));
+
+		return;
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (lens[i] < MULTIBUF_XXH64_MIN_LEN)
+			XXH64_canonicalFromHash((XXH64_canonical_t *)(out + i * 8), XXH64(ptrs[i], lens[i], seed));
+	}
+
+#ifdef HAVE_X86_MULTIBUF
+	for (i = 0; i + 8 <= sorted_count; i += 8) {
+		const unsigned char *group_ptrs[8];
+		size_t group_lens[8];
+		XXH64_hash_t hashes[8];
+		int l;
+
+		for (l = 0; l < 8; ++l) {
+			group_ptrs[l] = ptrs[items[i + l].index];
+			group_lens[l] = items[i + l].len;
+		}
+
+		multibuf_xxh64_avx512(group_ptrs, group_lens, seed, hashes);
+
+		for (l = 0; l < 8; ++l)
+			XXH64_canonicalFromHash((XXH64_canonical_t *)(out + items[i + l].index * 8), hashes[l]);
+	}
+#else
+	i = 0;
+#endif
+
+	for (; i < sorted_count; ++i) {
+		size_t index = items[i].index;
+		XXH64_canonicalFromHash((XXH64_canonical_t *)(out + index * 8),
+				XXH64(ptrs[index], lens[index], seed));
+	}
+
+	free(items);
+}
+
+#endif
@@ -1,6 +1,14 @@
 require 'csv'
+require 'fileutils'
+require 'stringio'
+require 'tmpdir'
 require 'minitest/autorun'
 
+begin
+  require 'fiddle'
+rescue LoadError
+end
+
 # To show more verbose messages, install minitest-reporters and uncomment the
 # following lines:
 #
@@ -17,6 +25,27 @@ def get_repeated_0x00_to_0xff(length)
   [str].cycle(cycles).to_a.join[0...length]
 end
 
+# Yields the path of a file named +name+ in a new temporary directory, which
+# is removed afterwards.
+def with_temp_path(name = "data.tmp")
+  Dir.mktmpdir("xxhash-test") do |dir|
+    yield File.join(dir, name)
+  end
+end
+
+# An IO-like reader returning new strings of at most +size+ bytes from #read
+# instead of filling the buffer argument.
+class PieceReader
+  def initialize(str, size)
+    @io = StringIO.new(str)
+    @size = size
+  end
+
+  def read(length, buf = nil)
+    @io.read([length, @size].min)
+  end
+end
+
 [Digest::XXH32, Digest::XXH64, Digest::XXH3_64bits, Digest::XXH3_128bits].each do |klass|
   describe klass do
     it "produces correct types of digest outputs" do
@@ -53,6 +82,318 @@ end
       idigest_hex = "%08x" % idigest
       _(hexdigest).must_equal idigest_hex
     end
+
+    it "hashes a range of a string with offset and length" do
+      _(klass.new.update("xxabcdyy", offset: 2, length: 4).digest).must_equal klass.digest("abcd")
+      _(klass.new.update("xxabcd", offset: 2).digest).must_equal klass.digest("abcd")
+      _(klass.digest("xxabcdyy", 0, offset: 2, length: 4)).must_equal klass.digest("abcd")
+      _(proc{ klass.new.update("abcd", offset: 5) }).must_raise ArgumentError
+      _(proc{ klass.new.update("abcd", offset: 1, length: 4) }).must_raise ArgumentError
+      _(proc{ klass.digest(1234) }).must_raise TypeError
+      _(proc{ klass.new.update(1234) }).must_raise TypeError
+    end
+
+    it "hashes ASCII case-insensitively with casefold" do
+      str = "Hello, WORLD! @[`{ \xC3\x80 ".b + get_repeated_0x00_to_0xff(10000)
+      _(klass.new.update(str, casefold: true).digest).must_equal klass.digest(str.downcase(:ascii))
+      _(klass.digest("ABCD", casefold: true)).must_equal klass.digest("abcd")
+      _(klass.hexdigest("ABCD", "00000000", casefold: true)).must_equal klass.hexdigest("abcd", "00000000")
+      _(klass.idigest("xxABCDyy", casefold: true, offset: 2, length: 4)).must_equal klass.idigest("abcd")
+      _(klass.new.update("ABCD", casefold: false).digest).must_equal klass.digest("ABCD")
+
+      large = get_repeated_0x00_to_0xff(2 * 1024 * 1024 + 9)
+      _(klass.new.update(large, casefold: true).digest).must_equal klass.digest(large.downcase(:ascii))
+    end
+
+    it "hashes large strings the same way with the GVL released" do
+      str = get_repeated_0x00_to_0xff(3 * 1024 * 1024 + 7)
+      _(klass.new.update(str).digest).must_equal klass.new.update(str[0, 4096]).update(str[4096..-1]).digest
+    end
+
+    it "reports progress while hashing" do
+      str = get_repeated_0x00_to_0xff(3 * 1024 * 1024 + 1)
+      calls = []
+      digest = klass.new.update(str, progress: proc{ |done, total| calls << [done, total] },
+          progress_interval: 1024 * 1024).digest
+      _(digest).must_equal klass.digest(str)
+      _(calls).must_equal [1, 2, 3].map{ |i| [i * 1024 * 1024, str.bytesize] } + [[str.bytesize, str.bytesize]]
+
+      calls = []
+      _(klass.digest("abcd", progress: proc{ |*args| calls << args })).must_equal klass.digest("abcd")
+      _(calls).must_equal [[4, 4]]
+
+      calls = []
+      _(klass.new.update("", progress: proc{ |*args| calls << args }).digest).must_equal klass.digest("")
+      _(calls).must_equal [[0, 0]]
+
+      short = get_repeated_0x00_to_0xff(4096)
+      original = short.dup
+      replace = proc{ short.replace("x" * 100_000) }
+      _(klass.new.update(short, progress: replace, progress_interval: 1000).digest).must_equal klass.digest(original)
+
+      _(proc{ klass.new.update(str, progress: proc{ raise IOError }) }).must_raise IOError
+      _(proc{ klass.new.update(str, progress: 1) }).must_raise TypeError
+      _(proc{ klass.new.update(str, progress: proc{}, progress_interval: 0) }).must_raise ArgumentError
+    end
+
+    it "can be interrupted while hashing large data" do
+      str = get_repeated_0x00_to_0xff(16 * 1024 * 1024)
+      started = Queue.new
+      thread = Thread.new do
+        started << true
+        loop { klass.new.update(str) }
+      end
+      started.pop
+      thread.kill
+      _(thread.join(10)).wont_be_nil
+    end
+
+    if defined?(IO::Buffer)
+      it "unlocks IO::Buffer objects when hashing gets interrupted" do
+        buffer = IO::Buffer.new(2 * 1024 * 1024)
+        _(proc{ klass.new.update(buffer, progress: proc{ raise IOError }) }).must_raise IOError
+        buffer.free
+
+        buffer = IO::Buffer.new(4096)
+        resize = proc{ buffer.resize(100_000) }
+        _(proc{ klass.new.update(buffer, progress: resize, progress_interval: 1000) }).must_raise IO::Buffer::LockedError
+        _(buffer).wont_be :locked?
+        buffer.free
+      end
+
+      it "hashes IO::Buffer objects in place" do
+        str = get_repeated_0x00_to_0xff(4096)
+        buffer = IO::Buffer.for(str)
+        _(klass.digest(buffer)).must_equal klass.digest(str)
+        _(klass.hexdigest(buffer, "00000000")).must_equal klass.hexdigest(str, "00000000")
+        _(klass.new.update(buffer, offset: 10, length: 100).digest).must_equal klass.digest(str[10, 100])
+        _(klass.digest(buffer, offset: 10, length: 100)).must_equal klass.digest(str[10, 100])
+      end
+
+      it "hashes large IO::Buffer objects and file mappings" do
+        str = get_repeated_0x00_to_0xff(2 * 1024 * 1024 + 3)
+        buffer = IO::Buffer.new(str.bytesize)
+        buffer.set_string(str)
+        _(klass.digest(buffer)).must_equal klass.digest(str)
+
+        with_temp_path do |path|
+          File.binwrite(path, str)
+          File.open(path, "rb") do |file|
+            mapped = IO::Buffer.map(file, nil, 0, IO::Buffer::READONLY)
+            _(klass.new.update(mapped).digest).must_equal klass.digest(str)
+            mapped.free
+          end
+        end
+      end
+    end
+
+    it "hashes suffixes from a frozen prefix" do
+      seed = "0123456789abcdef"[0, klass.digest_length == 4 ? 8 : 16]
+      instance = klass.new.reset(seed).update("namespace:")
+      prefix = instance.freeze_prefix
+      suffixes = ["", "a", "key-1234", get_repeated_0x00_to_0xff(1000)]
+      expected = suffixes.map{ |suffix| klass.digest("namespace:" + suffix, seed) }
+      _(prefix).must_be :frozen?
+      _(prefix.digest_length).must_equal klass.digest_length
+      _(suffixes.map{ |suffix| prefix.digest_suffix(suffix) }).must_equal expected
+      _(prefix.hexdigest_suffix("a")).must_equal klass.hexdigest("namespace:a", seed)
+      _(prefix.idigest_suffix("a")).must_equal klass.idigest("namespace:a", seed)
+      _(prefix.digest_suffixes(suffixes)).must_equal expected.join
+      _(prefix.idigest_suffixes(suffixes)).must_equal suffixes.map{ |suffix| klass.idigest("namespace:" + suffix, seed) }
+      _(instance.update("x").digest).must_equal klass.digest("namespace:x", seed)
+      _(prefix.digest_suffix("x")).must_equal klass.digest("namespace:x", seed)
+      _(proc{ prefix.digest_suffixes(["a", 1]) }).must_raise TypeError
+      _(proc{ Digest::XXHash::Prefix.new }).must_raise TypeError
+    end
+
+    it "exports and imports states for resumable hashing" do
+      seed = "0123456789abcdef"[0, klass.digest_length == 4 ? 8 : 16]
+      str = get_repeated_0x00_to_0xff(5000)
+
+      [0, 1, 15, 31, 100, 239, 240, 241, 255, 256, 257, 1024, 1087, 1100, 4999].each do |split|
+        instance = klass.new(seed).update(str[0, split])
+        state = instance.export_state
+        _(state.bytesize).must_be :<, 400
+        _(klass.new.import_state(state).update(str[split..-1]).digest).must_equal klass.digest(str, seed)
+        _(Marshal.load(Marshal.dump(instance)).update(str[split..-1]).digest).must_equal klass.digest(str, seed)
+      end
+
+      _(proc{ klass.new.import_state("XXHS") }).must_raise ArgumentError
+      _(proc{ klass.new.import_state(klass.new.export_state + "x") }).must_raise ArgumentError
+      _(proc{ klass.new.import_state(klass.new.export_state[0..-2]) }).must_raise ArgumentError
+      other = klass == Digest::XXH32 ? Digest::XXH64 : Digest::XXH32
+      _(proc{ klass.new.import_state(other.new.export_state) }).must_raise ArgumentError
+
+      if klass == Digest::XXH32
+        state = klass.new.update("abc").export_state
+        state.setbyte(8, 4)
+        _(proc{ klass.new.import_state(state) }).must_raise ArgumentError
+        state.setbyte(8, 19)
+        _(proc{ klass.new.import_state(state) }).must_raise ArgumentError
+      end
+    end
+
+    it "computes digests with many seeds in one call" do
+      seeds = [0, 1, 0xdeadbeef, 0x7fffffff, 0xffffffff, (klass == Digest::XXH32 ? 12 : 2**64 - 1)]
+      str = get_repeated_0x00_to_0xff(300)
+      lengths = (0..20).to_a + [100, 240, 241, 300]
+
+      lengths.each do |length|
+        expected = seeds.map{ |seed| klass.idigest(str[0, length], seed) }
+        _(klass.idigest_seeds(str[0, length], seeds)).must_equal expected
+        _(klass.idigest_seeds(str[0, length], seeds, packed: true)).must_equal seeds.map{ |seed| klass.digest(str[0, length], seed) }.join
+      end
+
+      strings = lengths.map{ |length| str[0, length] }
+      _(klass.idigest_seeds_many(strings, seeds)).must_equal strings.map{ |s| klass.idigest_seeds(s, seeds) }
+      _(klass.idigest_seeds_many(strings, seeds, packed: true)).must_equal strings.map{ |s| klass.idigest_seeds(s, seeds, packed: true) }.join
+      _(klass.idigest_seeds("abcd", [])).must_equal []
+      _(proc{ klass.idigest_seeds_many(["a", 1], seeds) }).must_raise TypeError
+      _(proc{ klass.idigest_seeds("a", ["x"]) }).must_raise TypeError
+
+      growing = [1, 2]
+      seed = Object.new
+      seed.define_singleton_method(:to_int){ growing.concat([3] * 1000); GC.start; 5 }
+      growing << seed
+      _(klass.idigest_seeds("abcd", growing)).must_equal [1, 2, 5].map{ |i| klass.idigest("abcd", i) }
+
+      batch = ["abcd", "efgh"]
+      seed = Object.new
+      seed.define_singleton_method(:to_int){ batch[0] = nil; batch.replace([]); GC.start; 7 }
+      _(klass.idigest_seeds_many(batch, [seed])).must_equal [[klass.idigest("abcd", 7)], [klass.idigest("efgh", 7)]]
+
+      if klass == Digest::XXH32
+        _(proc{ klass.idigest_seeds("a", [2**32]) }).must_raise RangeError
+        _(proc{ klass.idigest_seeds_many(["a"], [2**32]) }).must_raise RangeError
+      end
+    end
+
+    it "hashes batches of strings in one call" do
+      str = get_repeated_0x00_to_0xff(300)
+      lengths = (0..70).to_a + [9, 16, 17, 32, 33, 64] * 4 + [100, 128, 129, 240, 241, 300] + (9..16).to_a + (17..24).to_a
+      strings = lengths.map{ |length| str[length % 7, length] }
+      _(klass.idigest_many(strings)).must_equal strings.map{ |s| klass.idigest(s) }
+      _(klass.idigest_many(strings, 1234)).must_equal strings.map{ |s| klass.idigest(s, 1234) }
+      _(klass.idigest_many(strings, 1234, packed: true)).must_equal strings.map{ |s| klass.digest(s, 1234) }.join
+      _(klass.idigest_many([])).must_equal []
+      _(proc{ klass.idigest_many(["a", nil]) }).must_raise TypeError
+
+      mutated = strings.dup
+      seed = Object.new
+      seed.define_singleton_method(:to_int){ mutated.replace(["abcd"]); GC.start; 1234 }
+      _(klass.idigest_many(mutated, seed)).must_equal [klass.idigest("abcd", 1234)]
+
+      if klass == Digest::XXH32
+        _(proc{ klass.idigest_many(["a"], 2**32) }).must_raise RangeError
+        _(klass.idigest_many(["a"], 2**32 - 1)).must_equal [klass.idigest("a", 2**32 - 1)]
+      end
+    end
+
+    it "hashes batches of long strings with every SIMD level" do
+      str = get_repeated_0x00_to_0xff(2200)
+      lengths = (0...48).map{ |i| 250 + i * 37 } + [0, 15, 16, 31, 32, 255, 256, 511, 512, 1024, 2047]
+      strings = lengths.map{ |length| str[length % 13, length] }
+      expected = strings.map{ |s| klass.idigest(s, 1234) }
+      saved = Digest::XXHash.simd_level
+
+      begin
+        [:scalar, :avx2, :avx512].each do |level|
+          Digest::XXHash.simd_level = level
+          _(klass.idigest_many(strings, 1234)).must_equal expected
+          _(klass.idigest_many(strings.reverse, 1234)).must_equal expected.reverse
+        end
+      ensure
+        Digest::XXHash.simd_level = saved
+      end
+    end
+
+    it "keeps independent streams in one object" do
+      streams = klass::Streams.new(5, seed: 1234)
+      _(streams).must_be_kind_of Digest::XXHash::Streams
+      _(streams.size).must_equal 5
+      _(streams.digest_length).must_equal klass.digest_length
+      streams.update(0, "ab").update(2, "xxabcd", offset: 2).update(-1, "1234")
+      streams.update_batch([0, 1, 4], ["cd", "abcd", "5678"])
+      expected = ["abcd", "abcd", "abcd", "", "12345678"].map{ |str| klass.digest(str, 1234) }
+      _(streams.digests).must_equal expected.join
+      _((0...5).map{ |i| streams.digest(i) }).must_equal expected
+      _(streams.idigests).must_equal ["abcd", "abcd", "abcd", "", "12345678"].map{ |str| klass.idigest(str, 1234) }
+      _(streams.hexdigest(1)).must_equal klass.hexdigest("abcd", 1234)
+      _(streams.reset(0).digest(0)).must_equal klass.digest("", 1234)
+      _(streams.reset.digests).must_equal klass.digest("", 1234) * 5
+      _(proc{ streams.update(5, "a") }).must_raise IndexError
+      _(proc{ streams.update_batch([0, 1], ["a"]) }).must_raise ArgumentError
+      _(proc{ streams.update_batch([0], [1]) }).must_raise TypeError
+      _(proc{ streams.update_batch([0, 5], ["a", "b"]) }).must_raise IndexError
+      _(proc{ streams.update_batch([0, 1], ["a", 2]) }).must_raise TypeError
+      _(streams.digests).must_equal klass.digest("", 1234) * 5
+      _(proc{ klass::Streams.new(0) }).must_raise ArgumentError
+      _(proc{ Digest::XXHash::Streams.new(1) }).must_raise RuntimeError
+
+      if klass == Digest::XXH32
+        _(proc{ klass::Streams.new(1, seed: 2**32) }).must_raise RangeError
+        _(klass::Streams.new(1, seed: 2**32 - 1).digest(0)).must_equal klass.digest("", 2**32 - 1)
+      end
+    end
+
+    it "refuses to reset the state while an update is using it" do
+      str = get_repeated_0x00_to_0xff(2 * 1024 * 1024)
+      instance = klass.new
+      errors = 0
+      instance.update(str, progress: proc{
+        begin
+          instance.reset
+        rescue RuntimeError
+          errors += 1
+        end
+      }, progress_interval: 1024 * 1024)
+      _(errors).must_equal 2
+      _(instance.digest).must_equal klass.digest(str)
+
+      streams = klass::Streams.new(2)
+      _(proc{ streams.update(0, str, progress: proc{ streams.reset(1) }) }).must_raise RuntimeError
+      _(streams.update(1, "abc").digest(1)).must_equal klass.digest("abc")
+    end
+
+    it "hashes files through the read-ahead pipeline" do
+      str = Random.new(11).bytes(3 * 1024 * 1024 + 5)
+
+      with_temp_path do |path|
+        [0, 1, 1024 * 1024, str.bytesize].each do |length|
+          File.binwrite(path, str.byteslice(0, length))
+
+          [1, 2, 4].each do |read_ahead|
+            _(klass.new.file(path, read_ahead: read_ahead).digest).must_equal klass.digest(str.byteslice(0, length))
+            _(klass.new.file(path, read_ahead: read_ahead, cache: :bypass).digest).must_equal klass.digest(str.byteslice(0, length))
+          end
+        end
+
+        _(klass.file(path, 1234).digest).must_equal klass.digest(str, 1234)
+        _(klass.new.update("ab").file(path).digest).must_equal klass.digest("ab" + str)
+        _(proc{ klass.new.file(path, read_ahead: 0) }).must_raise ArgumentError
+        _(proc{ klass.new.file(path, cache: :none) }).must_raise ArgumentError
+        _(proc{ klass.new.file(File.dirname(path)) }).must_raise Errno::EISDIR
+
+        if File.respond_to?(:mkfifo)
+          File.unlink(path)
+          File.mkfifo(path)
+          _(proc{ klass.new.file(path) }).must_raise Errno::EINVAL
+        end
+
+        File.unlink(path)
+        _(proc{ klass.new.file(path) }).must_raise Errno::ENOENT
+      end
+    end
+
+    if defined?(Fiddle::MemoryView)
+      it "hashes objects exporting a memory view in place" do
+        str = get_repeated_0x00_to_0xff(2 * 1024 * 1024 + 5)
+        pointer = Fiddle::Pointer[str]
+        _(klass.digest(pointer)).must_equal klass.digest(str)
+        _(klass.new.update(pointer, offset: 3, length: 1000).digest).must_equal klass.digest(str[3, 1000])
+        _(proc{ klass.new.update(pointer, offset: str.bytesize + 1) }).must_raise ArgumentError
+      end
+    end
   end
 end
 
@@ -110,6 +451,673 @@ CSV.foreach(File.join(TEST_DIR, 'test.vectors'), col_sep: '|').with_index(1) do
   end
 end
 
+[Digest::XXH3_64bits, Digest::XXH3_128bits].each do |klass|
+  describe klass do
+    it "keeps its own copy of the secret" do
+      secret = "abcd" * 34
+      expected = klass.new.reset_with_secret(secret).update("1234").hexdigest
+      instance = klass.new.reset_with_secret(secret)
+      secret.replace("x" * 136)
+      copy = instance.update("12").dup
+      instance = nil
+      GC.start
+      _(copy.update("34").hexdigest).must_equal expected
+    end
+
+    it "keeps the secret in frozen prefixes" do
+      secret = "abcd" * 34
+      instance = klass.new.reset_with_secret(secret).update("12")
+      prefix = instance.freeze_prefix
+      expected = klass.new.reset_with_secret(secret).update("1234").digest
+      instance = nil
+      GC.start
+      _(prefix.digest_suffix("34")).must_equal expected
+    end
+
+    it "exports states with embedded or referenced secrets" do
+      secret = klass.generate_secret("resumable")
+      str = get_repeated_0x00_to_0xff(3000)
+      expected = klass.new.reset_with_secret(secret).update(str).digest
+
+      [10, 300, 2000].each do |split|
+        instance = klass.new.reset_with_secret(secret).update(str[0, split])
+        embedded = instance.export_state
+        _(klass.new.import_state(embedded).update(str[split..-1]).digest).must_equal expected
+        _(Marshal.load(Marshal.dump(instance)).update(str[split..-1]).digest).must_equal expected
+
+        referenced = instance.export_state(secret: :reference)
+        _(referenced.bytesize).must_be :<, embedded.bytesize
+        _(klass.new.import_state(referenced, secret: secret.dup).update(str[split..-1]).digest).must_equal expected
+        _(proc{ klass.new.import_state(referenced) }).must_raise ArgumentError
+        _(proc{ klass.new.import_state(referenced, secret: "x" * secret.bytesize) }).must_raise ArgumentError
+      end
+
+      other = klass == Digest::XXH3_64bits ? Digest::XXH3_128bits : Digest::XXH3_64bits
+      _(proc{ klass.new.import_state(other.new.export_state) }).must_raise ArgumentError
+      _(proc{ klass.new.export_state(secret: :other) }).must_raise ArgumentError
+    end
+
+    it "hibernates idle states and re-expands them transparently" do
+      require 'objspace'
+      secret = klass.generate_secret("hibernate")
+      str = get_repeated_0x00_to_0xff(3000)
+
+      [[nil], ["0123456789abcdef"], [:secret]].each do |seed,|
+        [0, 10, 200, 250, 1100, 1090, 2999].each do |split|
+          instance = seed == :secret ? klass.new.reset_with_secret(secret) : klass.new(*seed)
+          expected = instance.dup.update(str).digest
+          instance.update(str[0, split])
+          size = ObjectSpace.memsize_of(instance)
+          _(instance.hibernate).must_be_same_as instance
+          _(instance).must_be :hibernated?
+          _(ObjectSpace.memsize_of(instance)).must_be :<, size - (split == 0 ? 400 : 200)
+          _(instance.update(str[split..-1]).digest).must_equal expected
+          _(instance).wont_be :hibernated?
+        end
+      end
+
+      instance = klass.new
+      instance.auto_hibernate = true
+      _(instance).must_be :auto_hibernate
+      _(instance).must_be :hibernated?
+      _(instance.update("12").update("34")).must_be :hibernated?
+      _(instance.hexdigest).must_equal klass.hexdigest("1234")
+    end
+
+    it "refuses to replace the state while an update is using it" do
+      str = get_repeated_0x00_to_0xff(8 * 1024 * 1024)
+      secret = klass.generate_secret("busy")
+      state = klass.new.export_state
+
+      [proc{ |h| h.hibernate }, proc{ |h| h.reset_with_secret(secret) }, proc{ |h| h.import_state(state) },
+          proc{ |h| h.reset }, proc{ |h| h.update("x") }].each do |action|
+        instance = klass.new
+        errors = []
+        instance.update(str, progress: proc{ |done, total|
+          begin
+            action.call(instance)
+          rescue RuntimeError => e
+            errors << e
+          end
+        }, progress_interval: 1024 * 1024)
+        _(errors.size).must_equal 8
+        _(instance.digest).must_equal klass.digest(str)
+      end
+
+      with_temp_path do |path|
+        File.binwrite(path, str * 4)
+        instance = klass.new
+        thread = Thread.new { instance.file(path) }
+        errors = 0
+
+        until thread.join(0)
+          begin
+            instance.hibernate
+          rescue RuntimeError
+            errors += 1
+          end
+        end
+
+        _(errors).must_be :>, 0
+        _(instance.digest).must_equal klass.digest(str * 4)
+      end
+
+      instance = klass.new
+      instance.auto_hibernate = true
+      _(proc{ instance.update(str, progress: proc{ raise IOError }) }).must_raise IOError
+      _(instance.hibernate.update("abcd")).must_be :hibernated?
+    end
+
+    it "generates frozen custom secrets" do
+      secret = klass.generate_secret("seed material")
+      _(secret.bytesize).must_equal 192
+      _(secret).must_be :frozen?
+      _(klass.generate_secret("seed material")).must_equal secret
+      _(klass.generate_secret("seed material", 200).bytesize).must_equal 200
+      _(klass.new.reset_with_secret(secret).update("1234").hexdigest).wont_equal klass.hexdigest("1234")
+      _(proc{ klass.generate_secret("seed", 135) }).must_raise ArgumentError
+    end
+  end
+end
+
+if defined?(Ractor)
+  describe "Digest::XXHash in Ractors" do
+    it "can be used from non-main Ractors" do
+      Warning[:experimental] = false
+      secret = Digest::XXH3_64bits.generate_secret("ractor")
+      expected = [Digest::XXH32, Digest::XXH64, Digest::XXH3_64bits, Digest::XXH3_128bits].map do |klass|
+        klass.hexdigest("abcd", "0123456789abcdef"[0, klass.digest_length == 4 ? 8 : 16])
+      end + [Digest::XXH3_64bits.new.reset_with_secret(secret).update("abcd").hexdigest]
+
+      prefix = Digest::XXH3_64bits.new.update("ab").freeze_prefix
+      _(Ractor.new(prefix){ |prefix| prefix.hexdigest_suffix("cd") }.take).must_equal Digest::XXH3_64bits.hexdigest("abcd")
+
+      ractor = Ractor.new(secret) do |secret|
+        [Digest::XXH32, Digest::XXH64, Digest::XXH3_64bits, Digest::XXH3_128bits].map do |klass|
+          klass.hexdigest("abcd", "0123456789abcdef"[0, klass.digest_length == 4 ? 8 : 16])
+        end + [Digest::XXH3_64bits.new.reset_with_secret(secret).update("abcd").hexdigest]
+      end
+
+      _(ractor.take).must_equal expected
+    end
+
+    it "only lets the main Ractor set the SIMD level" do
+      Warning[:experimental] = false
+      ractor = Ractor.new do
+        begin
+          Digest::XXHash.simd_level = :scalar
+        rescue RuntimeError
+          :refused
+        end
+      end
+      _(ractor.take).must_equal :refused
+    end
+  end
+end
+
+describe Digest::XXH3_64bits do
+  it "hashes strided records" do
+    str = get_repeated_0x00_to_0xff(3000)
+
+    [1, 4, 8, 9, 16, 17, 128, 129, 241].each do |width|
+      [width, width + 3].each do |stride|
+        expected = (5..str.bytesize - width).step(stride).map{ |i| Digest::XXH3_64bits.digest(str[i, width], 1234) }.join
+        _(Digest::XXH3_64bits.hash_strided(str, width: width, stride: stride, offset: 5, seed: 1234)).must_equal expected
+      end
+    end
+
+    records = ["a" * 16, "b" * 16, "c" * 16]
+    _(Digest::XXH3_64bits.hash_strided(records.join + "d" * 15, width: 16)).must_equal records.map{ |s| Digest::XXH3_64bits.digest(s) }.join
+    _(Digest::XXH3_64bits.hash_strided("abc", width: 8)).must_equal ""
+    _(proc{ Digest::XXH3_64bits.hash_strided("abc") }).must_raise ArgumentError
+    _(proc{ Digest::XXH3_64bits.hash_strided("abc", width: 0) }).must_raise ArgumentError
+    _(proc{ Digest::XXH3_64bits.hash_strided("abc", width: 1, offset: 4) }).must_raise ArgumentError
+  end
+
+  it "converts the seed before taking the records" do
+    str = "a" * 16
+    seed = Object.new
+    seed.define_singleton_method(:to_int){ str.replace("b"); 1234 }
+    _(Digest::XXH3_64bits.hash_strided(str, width: 16, seed: seed)).must_equal ""
+
+    if defined?(IO::Buffer)
+      buffer = IO::Buffer.new(4096)
+      seed.define_singleton_method(:to_int){ raise "seed" }
+      _(proc{ Digest::XXH3_64bits.hash_strided(buffer, width: 16, seed: seed) }).must_raise RuntimeError
+      _(buffer.locked?).must_equal false
+    end
+  end
+
+  it "hashes integers in their little-endian form" do
+    ints = [0, 1, -1, 255, 2**32, 2**63 - 1, -2**63, 2**64 - 1]
+    expected = ints.map{ |i| Digest::XXH3_64bits.idigest([i].pack("Q<"), 1234) }
+    _(ints.map{ |i| Digest::XXH3_64bits.hash_int(i, 1234) }).must_equal expected
+    _(Digest::XXH3_64bits.hash_ints(ints, 1234)).must_equal expected
+    _(Digest::XXH3_64bits.hash_ints(ints, 1234, packed: true)).must_equal ints.map{ |i| Digest::XXH3_64bits.digest([i].pack("Q<"), 1234) }.join
+    _(proc{ Digest::XXH3_64bits.hash_int(2**64) }).must_raise RangeError
+    _(proc{ Digest::XXH3_64bits.hash_ints([1, 2.0]) }).must_raise TypeError
+  end
+
+  it "hashes ranges of integers" do
+    _(Digest::XXH3_64bits.hash_range(-3..3, 1234)).must_equal (-3..3).map{ |i| Digest::XXH3_64bits.hash_int(i, 1234) }
+    _(Digest::XXH3_64bits.hash_range(1...4, packed: true)).must_equal Digest::XXH3_64bits.hash_ints([1, 2, 3], packed: true)
+    _(Digest::XXH3_64bits.hash_range(1...1)).must_equal []
+    _(Digest::XXH3_64bits.hash_range(3..1)).must_equal []
+    _(proc{ Digest::XXH3_64bits.hash_range(-2**63..2**63 - 1) }).must_raise RangeError
+    _(proc{ Digest::XXH3_64bits.hash_range("a".."b") }).must_raise TypeError
+  end
+
+  it "hashes each line of strings and IOs" do
+    str = "ab\r\n\ncd--\r\nef--gh\n\rij"
+
+    ["\n", "\r\n", "--"].each do |separator|
+      [true, false].each do |chomp|
+        expected = str.each_line(separator, chomp: chomp).map{ |line| Digest::XXH3_64bits.digest(line) }.join
+        offsets = str.each_line(separator).inject([0]){ |a, line| a << a.last + line.bytesize }[0...-1]
+        _(Digest::XXH3_64bits.line_digests(str, separator: separator, chomp: chomp)).must_equal expected
+        _(Digest::XXH3_64bits.line_digests(StringIO.new(str), separator: separator, chomp: chomp)).must_equal expected
+        _(Digest::XXH3_64bits.line_digests(PieceReader.new(str, 3), separator: separator, chomp: chomp)).must_equal expected
+        digests, packed_offsets = Digest::XXH3_64bits.line_digests(PieceReader.new(str, 3), separator: separator, chomp: chomp, offsets: true)
+        _(digests).must_equal expected
+        _(packed_offsets.unpack("Q<*")).must_equal offsets
+      end
+    end
+
+    _(Digest::XXH3_64bits.line_digests("")).must_equal ""
+    _(proc{ Digest::XXH3_64bits.line_digests("a", separator: "") }).must_raise ArgumentError
+    _(proc{ Digest::XXH3_64bits.line_digests(1) }).must_raise TypeError
+  end
+
+  def chunk_manifest(data, chunk_size)
+    digests = (0...data.bytesize).step(chunk_size).map{ |i| Digest::XXH3_64bits.digest(data.byteslice(i, chunk_size)) }
+    ["XXHC", 1, chunk_size, data.bytesize, digests.size].pack("a4Cx3Q<Q<Q<") + digests.join.b
+  end
+
+  it "computes and verifies chunk digests of files" do
+    data = Random.new(9).bytes(10_000)
+
+    with_temp_path do |path|
+      [0, 1, 1000, 4321, 10_000].each do |length|
+        buffer = data.byteslice(0, length)
+        File.binwrite(path, buffer)
+        expected = chunk_manifest(buffer, 1000)
+
+        [1, 3, 16].each do |threads|
+          _(Digest::XXH3_64bits.chunk_digests(path, chunk_size: 1000, threads: threads)).must_equal expected
+        end
+      end
+
+      manifest = Digest::XXH3_64bits.chunk_digests(path, chunk_size: 1000)
+      _(Digest::XXH3_64bits.chunk_digests(path)).must_equal chunk_manifest(data, 1024 * 1024)
+      _(Digest::XXH3_64bits.verify_chunks(path, manifest)).must_equal []
+
+      File.open(path, "r+b") do |f|
+        [2500, 2999, 7000].each do |offset|
+          f.seek(offset)
+          f.write("x")
+        end
+      end
+
+      _(Digest::XXH3_64bits.verify_chunks(path, manifest, threads: 2)).must_equal [2, 7]
+      File.binwrite(path, data.byteslice(0, 8500))
+      _(Digest::XXH3_64bits.verify_chunks(path, manifest)).must_equal [8, 9]
+      _(Digest::XXH3_64bits.verify_chunks(path, chunk_manifest(data.byteslice(0, 2000), 1000))).must_equal (2..8).to_a
+      _(proc{ Digest::XXH3_64bits.verify_chunks(path, manifest[0, 31]) }).must_raise ArgumentError
+      _(proc{ Digest::XXH3_64bits.verify_chunks(path, manifest[0...-1]) }).must_raise ArgumentError
+      _(proc{ Digest::XXH3_64bits.verify_chunks(path, "XXHR" + manifest[4..-1]) }).must_raise ArgumentError
+      _(proc{ Digest::XXH3_64bits.verify_chunks(path, manifest, chunk_size: 1000) }).must_raise ArgumentError
+      _(proc{ Digest::XXH3_64bits.chunk_digests(path, chunk_size: 0) }).must_raise ArgumentError
+      _(proc{ Digest::XXH3_64bits.chunk_digests(File.dirname(path)) }).must_raise ArgumentError
+      _(proc{ Digest::XXH3_64bits.chunk_digests(path + ".missing") }).must_raise Errno::ENOENT
+
+      File.binwrite(path, "abcdef")
+      _(Digest::XXH3_64bits.chunk_digests(path, chunk_size: 2**45)).must_equal chunk_manifest("abcdef", 2**45)
+    end
+  end
+end
+
+describe Digest::XXH3_128bits do
+  def tree_digest(data, chunk)
+    leaves = (0...data.bytesize).step(chunk).map{ |i| Digest::XXH3_128bits.digest(data.byteslice(i, chunk)) }
+    header = ["XXHT", Digest::XXH3_128bits::TREE_DIGEST_VERSION, chunk, data.bytesize].pack("a4Cx3Q<Q<")
+    Digest::XXH3_128bits.digest(header + leaves.join)
+  end
+
+  it "computes tree digests" do
+    data = Random.new(0).bytes(10_000)
+
+    [0, 1, 4096, 8192, 10_000].each do |length|
+      buffer = data.byteslice(0, length)
+      expected = tree_digest(buffer, 1024)
+
+      [1, 2, 3, 4, 16].each do |threads|
+        _(Digest::XXH3_128bits.tree_digest(buffer, chunk: 1024, threads: threads)).must_equal expected
+      end
+    end
+
+    _(Digest::XXH3_128bits.tree_digest(data)).must_equal tree_digest(data, 1024 * 1024)
+    _(Digest::XXH3_128bits.tree_digest(data, chunk: 64, threads: 2**20)).must_equal tree_digest(data, 64)
+    _(proc{ Digest::XXH3_128bits.tree_digest(data, chunk: 0) }).must_raise ArgumentError
+    _(proc{ Digest::XXH3_128bits.tree_digest(data, threads: 0) }).must_raise ArgumentError
+  end
+
+  it "computes tree digests of large buffers without the GVL" do
+    data = Random.new(1).bytes(3 * 1024 * 1024 + 5)
+    expected = tree_digest(data, 256 * 1024)
+    _(Digest::XXH3_128bits.tree_digest(data, chunk: 256 * 1024, threads: 1)).must_equal expected
+    _(Digest::XXH3_128bits.tree_digest(data, chunk: 256 * 1024, threads: 4)).must_equal expected
+  end
+
+  if defined?(IO::Buffer)
+    it "unlocks IO::Buffer objects when the leaves can't be allocated" do
+      Dir.mktmpdir("xxhash-test") do |dir|
+        path = File.join(dir, "sparse.tmp")
+        File.open(path, "w"){ |file| file.truncate(2**40) }
+
+        File.open(path) do |file|
+          buffer = IO::Buffer.map(file, nil, 0, IO::Buffer::READONLY)
+          _(proc{ Digest::XXH3_128bits.tree_digest(buffer, chunk: 1) }).must_raise NoMemoryError
+          _(buffer.locked?).must_equal false
+          buffer.free
+        end
+      end
+    end
+  end
+
+  it "hashes batches of files" do
+    random = Random.new(10)
+    lengths = [0, 1, 100, 65_535, 65_536, 65_537, 200_000] + Array.new(40) { random.rand(0..5000) }
+    data = lengths.map{ |length| random.bytes(length) }
+
+    Dir.mktmpdir("xxhash-test") do |dir|
+      paths = lengths.each_index.map{ |i| File.join(dir, "files-#{i}.tmp") }
+      paths.zip(data) { |path, buffer| File.binwrite(path, buffer) }
+      expected = data.map{ |buffer| Digest::XXH3_128bits.digest(buffer) }
+      engines = [nil, :threads]
+
+      begin
+        Digest::XXH3_128bits.files([], engine: :io_uring)
+        engines << :io_uring
+      rescue NotImplementedError
+      end
+
+      if File.respond_to?(:mkfifo)
+        fifo = File.join(dir, "fifo")
+        File.mkfifo(fifo)
+      end
+
+      short_reads = "/proc/kallsyms" if File.readable?("/proc/kallsyms")
+
+      engines.each do |engine|
+        [1, 3, 64].each do |concurrency|
+          _(Digest::XXH3_128bits.files(paths, concurrency: concurrency, engine: engine)).must_equal expected
+        end
+
+        missing = paths[0, 5] + [File.join(dir, "missing.tmp")] + paths[5, 5]
+        _(proc{ Digest::XXH3_128bits.files(missing, engine: engine) }).must_raise Errno::ENOENT
+        _(proc{ Digest::XXH3_128bits.files([dir], engine: engine) }).must_raise Errno::EISDIR
+        _(proc{ Digest::XXH3_128bits.files([fifo], engine: engine) }).must_raise Errno::EINVAL if fifo
+
+        if short_reads
+          expected_short = Digest::XXH3_128bits.digest(File.binread(short_reads))
+          _(Digest::XXH3_128bits.files([short_reads], engine: engine)).must_equal [expected_short]
+        end
+      end
+
+      _(Digest::XXH3_128bits.files([])).must_equal []
+      _(proc{ Digest::XXH3_128bits.files(paths, concurrency: 0) }).must_raise ArgumentError
+      _(proc{ Digest::XXH3_128bits.files(paths, engine: :aio) }).must_raise ArgumentError
+
+      changing = paths[0, 3]
+      path = Object.new
+      path.define_singleton_method(:to_path){ changing.replace(paths[5, 2]); paths[0] }
+      changing[0] = path
+      _(Digest::XXH3_128bits.files(changing)).must_equal expected[0, 3]
+    end
+  end
+
+  it "hashes directory trees" do
+    random = Random.new(12)
+    files = { "a/b/c.txt" => 100, "a/d.bin" => 70_000, "e" => 0, "f.log" => 10, "node_modules/g/h" => 5 }
+
+    Dir.mktmpdir("xxhash-test") do |root|
+      files.each do |path, length|
+        FileUtils.mkdir_p(File.dirname(File.join(root, path)))
+        File.binwrite(File.join(root, path), random.bytes(length))
+      end
+
+      File.symlink("a", File.join(root, "link"))
+      File.symlink("..", File.join(root, "a", "up"))
+      File.symlink("missing", File.join(root, "dangling"))
+      File.mkfifo(File.join(root, "fifo")) if File.respond_to?(:mkfifo)
+      expected = files.keys.sort.map{ |path| [path, Digest::XXH3_128bits.digest(File.binread(File.join(root, path)))] }
+
+      [1, 2, 16].each do |threads|
+        _(Digest::XXH3_128bits.tree(root, threads: threads).to_a).must_equal expected
+      end
+
+      _(Digest::XXH3_128bits.tree(root + "/").keys).must_equal files.keys.sort
+      _(Digest::XXH3_128bits.tree(root, exclude: ["node_modules", "*.log"]).keys).must_equal ["a/b/c.txt", "a/d.bin", "e"]
+      _(Digest::XXH3_128bits.tree(root, exclude: "a/b").keys).must_equal ["a/d.bin", "e", "f.log", "node_modules/g/h"]
+      _(Digest::XXH3_128bits.tree(root, follow_symlinks: true, exclude: "node_modules").keys).must_equal [
+        "a/b/c.txt", "a/d.bin", "e", "f.log", "link/b/c.txt", "link/d.bin"
+      ]
+
+      tree, digest = Digest::XXH3_128bits.tree(root, aggregate: true)
+      _(tree.to_a).must_equal expected
+      _(digest).must_equal Digest::XXH3_128bits.digest(expected.map{ |path, d| path.b + "\0" + d }.join)
+      _(proc{ Digest::XXH3_128bits.tree(File.join(root, "e")) }).must_raise Errno::ENOTDIR
+      _(proc{ Digest::XXH3_128bits.tree(File.join(root, "missing")) }).must_raise Errno::ENOENT
+      _(Digest::XXH3_128bits.tree(File.join(root, "a", "b")).keys).must_equal ["c.txt"]
+      _(Digest::XXH3_128bits.tree(root, exclude: "*", aggregate: true)).must_equal [{}, Digest::XXH3_128bits.digest("")]
+    end
+  end
+end
+
+describe Digest::XXHash::Multi do
+  it "hashes data with several algorithms in one pass" do
+    str = get_repeated_0x00_to_0xff(100 * 1024 + 3)
+    multi = Digest::XXHash::Multi.new(:xxh32, :xxh64, :xxh3_64bits, :xxh3_128, seed: 1234)
+    expected = {
+      xxh32: Digest::XXH32.digest(str, 1234), xxh64: Digest::XXH64.digest(str, 1234),
+      xxh3_64bits: Digest::XXH3_64bits.digest(str, 1234), xxh3_128: Digest::XXH3_128bits.digest(str, 1234)
+    }
+    _(multi.update(str[0, 5]).update(str[5..-1]).digests).must_equal expected
+    _(multi.hexdigests).must_equal expected.transform_values{ |digest| digest.unpack('H*').pop }
+    _(multi.idigests[:xxh64]).must_equal Digest::XXH64.idigest(str, 1234)
+    _(multi.reset.update(str, offset: 7).digests[:xxh32]).must_equal Digest::XXH32.digest(str[7..-1], 1234)
+
+    multi = Digest::XXHash::Multi.new(:xxh64, :xxh3_128bits)
+    _(multi.update_io(StringIO.new(str)).hexdigests).must_equal({
+      xxh64: Digest::XXH64.hexdigest(str), xxh3_128bits: Digest::XXH3_128bits.hexdigest(str)
+    })
+    _(multi.reset.update_io(PieceReader.new(str, 7)).hexdigests).must_equal({
+      xxh64: Digest::XXH64.hexdigest(str), xxh3_128bits: Digest::XXH3_128bits.hexdigest(str)
+    })
+
+    with_temp_path do |path|
+      File.binwrite(path, str * 12)
+      multi = Digest::XXHash::Multi.new(:xxh32, :xxh3_64)
+      _(multi.file(path).digests).must_equal({
+        xxh32: Digest::XXH32.digest(str * 12), xxh3_64: Digest::XXH3_64bits.digest(str * 12)
+      })
+    end
+
+    _(proc{ Digest::XXHash::Multi.new(:xxh64, :xxh32, seed: 2**32) }).must_raise RangeError
+    _(Digest::XXHash::Multi.new(:xxh64, seed: 2**32).update("a").digests[:xxh64]).must_equal Digest::XXH64.digest("a", 2**32)
+
+    multi = Digest::XXHash::Multi.new(:xxh64)
+    _(proc{ multi.update(str, progress: proc{ multi.reset }) }).must_raise RuntimeError
+    _(proc{ multi.update(str, progress: proc{ multi.update_io(StringIO.new("a")) }) }).must_raise RuntimeError
+    _(multi.reset.update(str).digests[:xxh64]).must_equal Digest::XXH64.digest(str)
+  end
+
+  it "validates algorithm names" do
+    _(proc{ Digest::XXHash::Multi.new }).must_raise ArgumentError
+    _(proc{ Digest::XXHash::Multi.new(:md5) }).must_raise ArgumentError
+    _(proc{ Digest::XXHash::Multi.new(:xxh3_64, :xxh3_64bits) }).must_raise ArgumentError
+    _(proc{ Digest::XXHash::Multi.new("xxh32") }).must_raise TypeError
+  end
+end
+
+describe Digest::XXHash::Merkle do
+  def merkle_manifest(data, chunk_size)
+    level = (data.empty? ? [""] : (0...data.bytesize).step(chunk_size).map{ |i| data.byteslice(i, chunk_size) })
+        .map{ |chunk| Digest::XXH3_128bits.digest(chunk) }
+    count = level.size
+    nodes = level.dup
+
+    while level.size > 1
+      level = level.each_slice(2).map{ |pair| pair.size == 1 ? pair[0] : Digest::XXH3_128bits.digest("\x01".b + pair.join.b) }
+      nodes.concat(level)
+    end
+
+    ["XXHM", 1, chunk_size, data.bytesize, count].pack("a4Cx3Q<Q<Q<") + nodes.join.b
+  end
+
+  it "builds manifests and verifies ranges" do
+    data = Random.new(2).bytes(10_000)
+
+    with_temp_path do |path|
+      [0, 1, 1024, 5000, 10_000].each do |length|
+        File.binwrite(path, data.byteslice(0, length))
+        expected = merkle_manifest(data.byteslice(0, length), 1024)
+
+        [1, 3].each do |threads|
+          _(Digest::XXHash::Merkle.build(path, chunk_size: 1024, threads: threads)).must_equal expected
+        end
+      end
+
+      manifest = Digest::XXHash::Merkle.build(path, chunk_size: 1000)
+      root = Digest::XXHash::Merkle.root(manifest)
+      _(Digest::XXHash::Merkle.build(path)).must_equal merkle_manifest(data, 1024 * 1024)
+      _(root).must_equal manifest.byteslice(-16, 16)
+      _(Digest::XXHash::Merkle.verify_range(path, 0, 10_000, manifest)).must_equal true
+      _(Digest::XXHash::Merkle.verify_range(path, 2500, 3000, manifest, root: root)).must_equal true
+      _(Digest::XXHash::Merkle.verify_range(path, 9999, 1, manifest, threads: 2)).must_equal true
+      _(Digest::XXHash::Merkle.verify_range(path, 0, 1, manifest, root: "\0" * 16)).must_equal false
+      _(proc{ Digest::XXHash::Merkle.verify_range(path, 9000, 1001, manifest) }).must_raise ArgumentError
+      _(proc{ Digest::XXHash::Merkle.verify_range(path, 0, 1, manifest[0, 40]) }).must_raise ArgumentError
+
+      File.open(path, "r+b") do |f|
+        f.seek(6000)
+        f.write("x")
+      end
+
+      _(Digest::XXHash::Merkle.verify_range(path, 0, 6000, manifest)).must_equal true
+      _(Digest::XXHash::Merkle.verify_range(path, 5500, 600, manifest)).must_equal false
+
+      File.binwrite(path, data.byteslice(0, 4500))
+      _(Digest::XXHash::Merkle.verify_range(path, 1000, 3000, manifest)).must_equal true
+      _(Digest::XXHash::Merkle.verify_range(path, 4000, 100, manifest)).must_equal false
+
+      tampered = manifest.dup
+      tampered.setbyte(32 + 16 * 10 + 5, tampered.getbyte(32 + 16 * 10 + 5) ^ 1)
+      _(Digest::XXHash::Merkle.verify_range(path, 0, 100, tampered)).must_equal false
+    end
+  end
+end
+
+describe Digest::XXHash::Chunker do
+  let(:gear){ (0..255).map{ |b| Digest::XXH64.idigest(b.chr) } }
+
+  def cdc_chunks(data, min, avg, max)
+    bits = avg.bit_length - 1
+    mask_s = ((1 << (bits + 2)) - 1) << (64 - (bits + 2))
+    mask_l = ((1 << (bits - 2)) - 1) << (64 - (bits - 2))
+    chunks = []
+    offset = 0
+
+    while offset < data.bytesize
+      len = [data.bytesize - offset, max].min
+      cut = len
+
+      if len > min
+        fp = 0
+
+        (min...len).each do |i|
+          fp = ((fp << 1) + gear[data.getbyte(offset + i)]) & 0xffffffffffffffff
+
+          if fp & (i < avg ? mask_s : mask_l) == 0
+            cut = i + 1
+            break
+          end
+        end
+      end
+
+      chunks << [offset, cut, Digest::XXH3_128bits.digest(data.byteslice(offset, cut))]
+      offset += cut
+    end
+
+    chunks
+  end
+
+  it "splits data into content-defined chunks" do
+    data = Random.new(3).bytes(100_000)
+    chunker = Digest::XXHash::Chunker.new(min: 256, avg: 1024, max: 4096)
+    expected = cdc_chunks(data, 256, 1024, 4096)
+
+    _(expected.size).must_be :>, 50
+    _(expected[0...-1].map{ |chunk| chunk[1] }.all?{ |len| len.between?(256, 4096) }).must_equal true
+    _(chunker.each_chunk(data).to_a).must_equal expected
+    _(chunker.each_chunk(StringIO.new(data)).to_a).must_equal expected
+    _(chunker.each_chunk(PieceReader.new(data, 1000)).to_a).must_equal expected
+    _(chunker.each_chunk("").to_a).must_equal []
+    _(chunker.each_chunk(data){}).must_be_same_as chunker
+
+    digests = expected.map{ |chunk| chunk[2] }
+    shifted = chunker.each_chunk("inserted" + data).map{ |offset, length, digest| digest }
+    _(shifted.count{ |digest| digests.include?(digest) }).must_be :>=, expected.size - 3
+  end
+
+  it "chunks large inputs consistently" do
+    data = Random.new(4).bytes(3 * 1024 * 1024 + 17)
+    chunker = Digest::XXHash::Chunker.new
+    chunks = chunker.each_chunk(data).to_a
+    offset, length, digest = chunks[chunks.size / 2]
+    _(chunks.inject(0){ |sum, chunk| sum + chunk[1] }).must_equal data.bytesize
+    _(chunks.each_cons(2).all?{ |a, b| a[0] + a[1] == b[0] }).must_equal true
+    _(chunker.each_chunk(StringIO.new(data)).to_a).must_equal chunks
+    _(Digest::XXH3_128bits.digest(data.byteslice(offset, length))).must_equal digest
+  end
+
+  it "validates chunk sizes" do
+    chunker = Digest::XXHash::Chunker.new
+    _([chunker.min, chunker.avg, chunker.max]).must_equal [2048, 8192, 65536]
+    _(chunker.frozen?).must_equal true
+    _(proc{ Digest::XXHash::Chunker.new(min: 0) }).must_raise ArgumentError
+    _(proc{ Digest::XXHash::Chunker.new(min: 4096, avg: 1024) }).must_raise ArgumentError
+    _(proc{ Digest::XXHash::Chunker.new(avg: 32, min: 16) }).must_raise ArgumentError
+    _(proc{ Digest::XXHash::Chunker.new(max: 4096) }).must_raise ArgumentError
+    _(proc{ chunker.each_chunk(1){} }).must_raise TypeError
+  end
+end
+
+describe Digest::XXHash::Rsync do
+  def rsync_signature(data, block)
+    entries = (0...data.bytesize).step(block).map do |i|
+      bytes = data.byteslice(i, block).bytes
+      a = bytes.inject(0, :+)
+      b = bytes.each_with_index.inject(0){ |sum, (byte, j)| sum + byte * (bytes.size - j) }
+      [(a & 0xffff) | ((b & 0xffff) << 16), Digest::XXH3_64bits.digest(data.byteslice(i, block))].pack("L<a8")
+    end
+
+    ["XXHR", 1, block, data.bytesize, entries.size].pack("a4Cx3Q<Q<Q<") + entries.join
+  end
+
+  def apply_delta(old, delta)
+    delta.map{ |op| op.is_a?(Range) ? old.byteslice(op.begin, op.size) : op }.join.b
+  end
+
+  it "computes signatures" do
+    data = Random.new(6).bytes(10_000)
+
+    [0, 1, 1000, 4096, 10_000].each do |length|
+      expected = rsync_signature(data.byteslice(0, length), 1000)
+      _(Digest::XXHash::Rsync.signature(data.byteslice(0, length), block: 1000)).must_equal expected
+      _(Digest::XXHash::Rsync.signature(StringIO.new(data.byteslice(0, length)), block: 1000)).must_equal expected
+      _(Digest::XXHash::Rsync.signature(PieceReader.new(data.byteslice(0, length), 333), block: 1000)).must_equal expected
+    end
+
+    _(Digest::XXHash::Rsync.signature(data)).must_equal rsync_signature(data, 2048)
+    _(proc{ Digest::XXHash::Rsync.signature(data, block: 0) }).must_raise ArgumentError
+  end
+
+  it "computes deltas" do
+    random = Random.new(7)
+    old = random.bytes(50_005)
+    signature = Digest::XXHash::Rsync.signature(old, block: 1000)
+
+    _(Digest::XXHash::Rsync.delta(old, signature)).must_equal [0...50_005]
+    _(Digest::XXHash::Rsync.delta("", signature)).must_equal []
+    _(Digest::XXHash::Rsync.delta(old, Digest::XXHash::Rsync.signature(""))).must_equal [old]
+
+    new = old.byteslice(0, 10_000) + random.bytes(123) + old.byteslice(10_000, 20_000) + old.byteslice(35_000..-1) + "tail"
+    delta = Digest::XXHash::Rsync.delta(new, signature)
+    _(apply_delta(old, delta)).must_equal new
+    _(delta.grep(String).inject(0){ |sum, str| sum + str.bytesize }).must_be :<, 3000
+    _(Digest::XXHash::Rsync.delta(StringIO.new(new), signature)).must_equal delta
+    _(Digest::XXHash::Rsync.delta(PieceReader.new(new, 777), signature)).must_equal delta
+
+    _(proc{ Digest::XXHash::Rsync.delta(new, "XXHR") }).must_raise ArgumentError
+    _(proc{ Digest::XXHash::Rsync.delta(new, signature[0...-1]) }).must_raise ArgumentError
+  end
+
+  it "computes deltas of large inputs" do
+    random = Random.new(8)
+    old = random.bytes(3 * 1024 * 1024)
+    new = old.dup
+    [100, 1_500_000, 2_900_000].each{ |i| new[i, 10] = random.bytes(20) }
+    signature = Digest::XXHash::Rsync.signature(StringIO.new(old))
+    _(signature).must_equal Digest::XXHash::Rsync.signature(old)
+
+    delta = Digest::XXHash::Rsync.delta(new, signature)
+    _(apply_delta(old, delta)).must_equal new
+    _(delta.size).must_equal 6
+    _(Digest::XXHash::Rsync.delta(StringIO.new(new), signature)).must_equal delta
+  end
+end
+
 describe Digest::XXHash::XXH3_SECRET_SIZE_MIN do
   it "should be 136" do
     # Documentation should be updated to reflect the new value if this fails.
@@ -121,4 +1129,19 @@ describe Digest::XXHash do
   it "must have VERSION constant" do
     _(Digest::XXHash.constants).must_include :VERSION
   end
+
+  it "reports and limits the SIMD level" do
+    level = Digest::XXHash.simd_level
+    _([:scalar, :avx2, :avx512]).must_include level
+
+    begin
+      Digest::XXHash.simd_level = :scalar
+      _(Digest::XXHash.simd_level).must_equal :scalar
+      _(proc{ Digest::XXHash.simd_level = :sse9 }).must_raise ArgumentError
+    ensure
+      Digest::XXHash.simd_level = level
+    end
+
+    _(Digest::XXHash.simd_level).must_equal level
+  end
 end